@@ -30,7 +30,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#define STORAGE_FILE "test-storage.variant"
+#define STORAGE_FILE "test-storage.prints"
 
 static char *
 get_print_data_descriptor (FpPrint *print, FpDevice *dev, FpFinger finger)
@@ -55,51 +55,21 @@ get_print_data_descriptor (FpPrint *print, FpDevice *dev, FpFinger finger)
                           finger);
 }
 
-static GVariantDict *
-load_data (void)
+static FpPrintStore *
+get_store (void)
 {
-  GVariantDict *res;
-  GVariant *var;
-  gchar *contents = NULL;
-  gsize length = 0;
+  static FpPrintStore *store = NULL;
 
-  if (!g_file_get_contents (STORAGE_FILE, &contents, &length, NULL))
+  if (!store)
     {
-      g_warning ("Error loading storage, assuming it is empty");
-      return g_variant_dict_new (NULL);
-    }
-
-  var = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
-                                 contents,
-                                 length,
-                                 FALSE,
-                                 g_free,
-                                 contents);
-
-  res = g_variant_dict_new (var);
-  g_variant_unref (var);
-  return res;
-}
-
-static int
-save_data (GVariant *data)
-{
-  const gchar *contents = NULL;
-  gsize length;
-
-  length = g_variant_get_size (data);
-  contents = (gchar *) g_variant_get_data (data);
+      g_autoptr(GError) error = NULL;
 
-  if (!g_file_set_contents (STORAGE_FILE, contents, length, NULL))
-    {
-      g_warning ("Error saving storage,!");
-      return -1;
+      store = fp_print_store_new (STORAGE_FILE, &error);
+      if (!store)
+        g_warning ("Error opening storage: %s", error->message);
     }
 
-  g_variant_ref_sink (data);
-  g_variant_unref (data);
-
-  return 0;
+  return store;
 }
 
 int
@@ -108,26 +78,21 @@ print_data_save (FpPrint *print, FpFinger finger)
   g_autofree gchar *descr = get_print_data_descriptor (print, NULL, finger);
 
   g_autoptr(GError) error = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
-  g_autofree guchar *data = NULL;
-  GVariant *val;
-  gsize size;
-  int res;
+  FpPrintStore *store;
 
-  dict = load_data ();
+  store = get_store ();
+  if (!store)
+    return -1;
 
-  fp_print_serialize (print, &data, &size, &error);
-  if (error)
+  /* Make sure the print is on disk before reporting success */
+  if (!fp_print_store_save (store, descr, print, &error) ||
+      !fp_print_store_flush (store, &error))
     {
-      g_warning ("Error serializing data: %s", error->message);
+      g_warning ("Error saving print: %s", error->message);
       return -1;
     }
-  val = g_variant_new_fixed_array (G_VARIANT_TYPE ("y"), data, size, 1);
-  g_variant_dict_insert_value (dict, descr, val);
-
-  res = save_data (g_variant_dict_end (dict));
 
-  return res;
+  return 0;
 }
 
 FpPrint *
@@ -135,68 +100,54 @@ print_data_load (FpDevice *dev, FpFinger finger)
 {
   g_autofree gchar *descr = get_print_data_descriptor (NULL, dev, finger);
 
-  g_autoptr(GVariant) val = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
-  const guchar *stored_data = NULL;
-  gsize stored_len;
-
-  dict = load_data ();
-  val = g_variant_dict_lookup_value (dict, descr, G_VARIANT_TYPE ("ay"));
-
-  if (val)
-    {
-      FpPrint *print;
-      g_autoptr(GError) error = NULL;
-
-      stored_data = (const guchar *) g_variant_get_fixed_array (val, &stored_len, 1);
-      print = fp_print_deserialize (stored_data, stored_len, &error);
+  g_autoptr(GError) error = NULL;
+  FpPrintStore *store;
+  FpPrint *print;
 
-      if (error)
-        g_warning ("Error deserializing data: %s", error->message);
+  store = get_store ();
+  if (!store)
+    return NULL;
 
-      return print;
-    }
+  print = fp_print_store_load (store, descr, &error);
+  if (!print && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_warning ("Error loading print: %s", error->message);
 
-  return NULL;
+  return print;
 }
 
 GPtrArray *
 gallery_data_load (FpDevice *dev)
 {
-  g_autoptr(GVariantDict) dict = NULL;
-  g_autoptr(GVariant) dict_variant = NULL;
   g_autofree char *dev_prefix = NULL;
+  g_auto(GStrv) keys = NULL;
+  FpPrintStore *store;
   GPtrArray *gallery;
   const char *driver;
   const char *dev_id;
-  GVariantIter iter;
-  GVariant *value;
-  gchar *key;
+  gint i;
 
   gallery = g_ptr_array_new_with_free_func (g_object_unref);
-  dict = load_data ();
-  dict_variant = g_variant_dict_end (dict);
+  store = get_store ();
+  if (!store)
+    return gallery;
+
   driver = fp_device_get_driver (dev);
   dev_id = fp_device_get_device_id (dev);
   dev_prefix = g_strdup_printf ("%s/%s/", driver, dev_id);
 
-  g_variant_iter_init (&iter, dict_variant);
-  while (g_variant_iter_loop (&iter, "{sv}", &key, &value))
+  keys = fp_print_store_get_keys (store);
+  for (i = 0; keys[i]; i++)
     {
-      FpPrint *print;
-      const guchar *stored_data;
       g_autoptr(GError) error = NULL;
-      gsize stored_len;
+      FpPrint *print;
 
-      if (!g_str_has_prefix (key, dev_prefix))
+      if (!g_str_has_prefix (keys[i], dev_prefix))
         continue;
 
-      stored_data = (const guchar *) g_variant_get_fixed_array (value, &stored_len, 1);
-      print = fp_print_deserialize (stored_data, stored_len, &error);
-
-      if (error)
+      print = fp_print_store_load (store, keys[i], &error);
+      if (!print)
         {
-          g_warning ("Error deserializing data: %s", error->message);
+          g_warning ("Error loading print: %s", error->message);
           continue;
         }
 
@@ -30,8 +30,6 @@
 
 static void start_capture (FpImageDevice *dev);
 static void complete_deactivation (FpImageDevice *dev);
-static int adjust_gain (unsigned char *buffer,
-                        int            status);
 
 #define FIRST_AES1610_REG 0x1B
 #define LAST_AES1610_REG 0xFF
@@ -39,6 +37,9 @@ static int adjust_gain (unsigned char *buffer,
 #define GAIN_STATUS_FIRST 1
 #define GAIN_STATUS_NORMAL 2
 
+/* Seconds the last gain adjustment is reused as starting point */
+#define GAIN_LIFETIME (30 * 60)
+
 /* FIXME these need checking */
 #define EP_IN (1 | FPI_USB_ENDPOINT_IN)
 #define EP_OUT (2 | FPI_USB_ENDPOINT_OUT)
@@ -79,6 +80,12 @@ struct _FpiDeviceAes1610
   gsize         strips_len;
   gboolean      deactivating;
   guint8        blanks_count;
+  /* The position in the array of possible values for 0xBE and 0xBD registers */
+  gint          pos_list_BE;
+  gint          pos_list_BD;
+  /* Copies of the register tables, the gain is written into them */
+  struct aes_regwrite *capture_reqs;
+  struct aes_regwrite *strip_scan_reqs;
 };
 G_DECLARE_FINAL_TYPE (FpiDeviceAes1610, fpi_device_aes1610, FPI, DEVICE_AES1610,
                       FpImageDevice);
@@ -172,6 +179,9 @@ static const struct aes_regwrite finger_det_reqs[] = {
 };
 
 static void start_finger_detection (FpImageDevice *dev);
+static int adjust_gain (FpiDeviceAes1610 *self,
+                        unsigned char    *buffer,
+                        int               status);
 
 static void
 finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
@@ -194,7 +204,7 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
   if (sum > 20)
     {
       /* reset default gain */
-      adjust_gain (data, GAIN_STATUS_FIRST);
+      adjust_gain (FPI_DEVICE_AES1610 (dev), data, GAIN_STATUS_FIRST);
       /* finger present, start capturing */
       fpi_image_device_report_finger_status (dev, TRUE);
       start_capture (dev);
@@ -242,7 +252,7 @@ start_finger_detection (FpImageDevice *dev)
 
 /****** CAPTURE ******/
 
-static struct aes_regwrite capture_reqs[] = {
+static const struct aes_regwrite capture_reqs[] = {
   { 0x80, 0x01 },
   { 0x80, 0x12 },
   { 0x84, 0x01 },
@@ -368,7 +378,7 @@ static struct aes_regwrite capture_reqs[] = {
   { 0x81, 0x01 }
 };
 
-static struct aes_regwrite strip_scan_reqs[] = {
+static const struct aes_regwrite strip_scan_reqs[] = {
   { 0xBE, 0x23 },
   { 0x29, 0x04 },
   { 0x2A, 0xFF },
@@ -398,11 +408,10 @@ static unsigned char list_BD_values[10] = {
  * Returns 0 if no problem occurred
  * TODO: This is a basic support for gain. It needs testing/tweaking.  */
 static int
-adjust_gain (unsigned char *buffer, int status)
+adjust_gain (FpiDeviceAes1610 *self, unsigned char *buffer, int status)
 {
-  // The position in the array of possible values for 0xBE and 0xBD registers
-  static int pos_list_BE = 0;
-  static int pos_list_BD = 0;
+  gint pos_list_BE = self->pos_list_BE;
+  gint pos_list_BD = self->pos_list_BD;
 
   // This is the first adjustment (we begin acquisition)
   // We adjust strip_scan_reqs for future strips and capture_reqs that is sent just after this step
@@ -410,40 +419,40 @@ adjust_gain (unsigned char *buffer, int status)
     {
       if (buffer[1] > 0x78)             // maximum gain needed
         {
-          strip_scan_reqs[0].value = 0x6B;
-          strip_scan_reqs[1].value = 0x06;
-          strip_scan_reqs[2].value = 0x35;
-          strip_scan_reqs[3].value = 0x4B;
+          self->strip_scan_reqs[0].value = 0x6B;
+          self->strip_scan_reqs[1].value = 0x06;
+          self->strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[3].value = 0x4B;
         }
       else if (buffer[1] > 0x55)
         {
-          strip_scan_reqs[0].value = 0x63;
-          strip_scan_reqs[1].value = 0x15;
-          strip_scan_reqs[2].value = 0x35;
-          strip_scan_reqs[3].value = 0x3b;
+          self->strip_scan_reqs[0].value = 0x63;
+          self->strip_scan_reqs[1].value = 0x15;
+          self->strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[3].value = 0x3b;
         }
       else if (buffer[1] > 0x40 || buffer[16] > 0x19)
         {
-          strip_scan_reqs[0].value = 0x43;
-          strip_scan_reqs[1].value = 0x13;
-          strip_scan_reqs[2].value = 0x35;
-          strip_scan_reqs[3].value = 0x30;
+          self->strip_scan_reqs[0].value = 0x43;
+          self->strip_scan_reqs[1].value = 0x13;
+          self->strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[3].value = 0x30;
         }
       else             // minimum gain needed
         {
-          strip_scan_reqs[0].value = 0x23;
-          strip_scan_reqs[1].value = 0x07;
-          strip_scan_reqs[2].value = 0x35;
-          strip_scan_reqs[3].value = 0x28;
+          self->strip_scan_reqs[0].value = 0x23;
+          self->strip_scan_reqs[1].value = 0x07;
+          self->strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[3].value = 0x28;
         }
 
       // Now copy this values in capture_reqs
-      capture_reqs[8].value = strip_scan_reqs[0].value;
-      capture_reqs[9].value = strip_scan_reqs[1].value;
-      capture_reqs[10].value = strip_scan_reqs[2].value;
-      capture_reqs[21].value = strip_scan_reqs[3].value;
+      self->capture_reqs[8].value = self->strip_scan_reqs[0].value;
+      self->capture_reqs[9].value = self->strip_scan_reqs[1].value;
+      self->capture_reqs[10].value = self->strip_scan_reqs[2].value;
+      self->capture_reqs[21].value = self->strip_scan_reqs[3].value;
 
-      fp_dbg ("first gain: %x %x %x %x %x %x %x %x", strip_scan_reqs[0].reg, strip_scan_reqs[0].value, strip_scan_reqs[1].reg, strip_scan_reqs[1].value, strip_scan_reqs[2].reg, strip_scan_reqs[2].value, strip_scan_reqs[3].reg, strip_scan_reqs[3].value);
+      fp_dbg ("first gain: %x %x %x %x %x %x %x %x", self->strip_scan_reqs[0].reg, self->strip_scan_reqs[0].value, self->strip_scan_reqs[1].reg, self->strip_scan_reqs[1].value, self->strip_scan_reqs[2].reg, self->strip_scan_reqs[2].value, self->strip_scan_reqs[3].reg, self->strip_scan_reqs[3].value);
     }
   // Every 2/3 strips
   // We try to soften big changes of the gain (at least for 0xBE and 0xBD
@@ -458,8 +467,8 @@ adjust_gain (unsigned char *buffer, int status)
           if (pos_list_BD < 6)
             pos_list_BD++;
 
-          strip_scan_reqs[1].value = 0x04;
-          strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[1].value = 0x04;
+          self->strip_scan_reqs[2].value = 0x35;
         }
       else if (buffer[514] > 0x55)
         {
@@ -473,8 +482,8 @@ adjust_gain (unsigned char *buffer, int status)
           else if (pos_list_BD > 2)
             pos_list_BD--;
 
-          strip_scan_reqs[1].value = 0x15;
-          strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[1].value = 0x15;
+          self->strip_scan_reqs[2].value = 0x35;
         }
       else if (buffer[514] > 0x40 || buffer[529] > 0x19)
         {
@@ -488,8 +497,8 @@ adjust_gain (unsigned char *buffer, int status)
           else if (pos_list_BD > 1)
             pos_list_BD--;
 
-          strip_scan_reqs[1].value = 0x13;
-          strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[1].value = 0x13;
+          self->strip_scan_reqs[2].value = 0x35;
         }
       else             // minimum gain needed
         {
@@ -499,14 +508,17 @@ adjust_gain (unsigned char *buffer, int status)
           if (pos_list_BD > 0)
             pos_list_BD--;
 
-          strip_scan_reqs[1].value = 0x07;
-          strip_scan_reqs[2].value = 0x35;
+          self->strip_scan_reqs[1].value = 0x07;
+          self->strip_scan_reqs[2].value = 0x35;
         }
 
-      strip_scan_reqs[0].value = list_BE_values[pos_list_BE];
-      strip_scan_reqs[3].value = list_BD_values[pos_list_BD];
+      self->strip_scan_reqs[0].value = list_BE_values[pos_list_BE];
+      self->strip_scan_reqs[3].value = list_BD_values[pos_list_BD];
+
+      fp_dbg ("gain: %x %x %x %x %x %x %x %x", self->strip_scan_reqs[0].reg, self->strip_scan_reqs[0].value, self->strip_scan_reqs[1].reg, self->strip_scan_reqs[1].value, self->strip_scan_reqs[2].reg, self->strip_scan_reqs[2].value, self->strip_scan_reqs[3].reg, self->strip_scan_reqs[3].value);
 
-      fp_dbg ("gain: %x %x %x %x %x %x %x %x", strip_scan_reqs[0].reg, strip_scan_reqs[0].value, strip_scan_reqs[1].reg, strip_scan_reqs[1].value, strip_scan_reqs[2].reg, strip_scan_reqs[2].value, strip_scan_reqs[3].reg, strip_scan_reqs[3].value);
+      self->pos_list_BE = pos_list_BE;
+      self->pos_list_BD = pos_list_BD;
     }
   // Unknown status
   else
@@ -521,17 +533,17 @@ adjust_gain (unsigned char *buffer, int status)
 /*
  * Restore the default gain values */
 static void
-restore_gain (void)
+restore_gain (FpiDeviceAes1610 *self)
 {
-  strip_scan_reqs[0].value = list_BE_values[0];
-  strip_scan_reqs[1].value = 0x04;
-  strip_scan_reqs[2].value = 0xFF;
-  strip_scan_reqs[3].value = list_BD_values[0];
-
-  capture_reqs[8].value = list_BE_values[0];
-  capture_reqs[9].value = 0x04;
-  capture_reqs[10].value = 0xFF;
-  capture_reqs[21].value = list_BD_values[0];
+  self->strip_scan_reqs[0].value = list_BE_values[0];
+  self->strip_scan_reqs[1].value = 0x04;
+  self->strip_scan_reqs[2].value = 0xFF;
+  self->strip_scan_reqs[3].value = list_BD_values[0];
+
+  self->capture_reqs[8].value = list_BE_values[0];
+  self->capture_reqs[9].value = 0x04;
+  self->capture_reqs[10].value = 0xFF;
+  self->capture_reqs[21].value = list_BD_values[0];
 }
 
 
@@ -598,7 +610,7 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
 
 
   /* use histogram data above for gain calibration (0xbd, 0xbe, 0x29 and 0x2A ) */
-  adjust_gain (data, GAIN_STATUS_NORMAL);
+  adjust_gain (self, data, GAIN_STATUS_NORMAL);
 
   /* stop capturing if MAX_FRAMES is reached */
   if (self->blanks_count > 10 || g_slist_length (self->strips) >= MAX_FRAMES)
@@ -622,8 +634,13 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
       fpi_image_device_report_finger_status (dev, FALSE);
       /* marking machine complete will re-trigger finger detection loop */
       fpi_ssm_mark_completed (transfer->ssm);
-      /* Acquisition finished: restore default gain values */
-      restore_gain ();
+      /* Acquisition finished: restore default gain values, but keep
+       * the adjusted gain as starting point for later captures */
+      restore_gain (self);
+      fpi_device_set_calibration (device,
+                                  g_variant_new ("(ii)", self->pos_list_BE,
+                                                 self->pos_list_BD),
+                                  GAIN_LIFETIME);
     }
   else
     {
@@ -642,7 +659,7 @@ capture_run_state (FpiSsm *ssm, FpDevice *_dev)
     {
     case CAPTURE_WRITE_REQS:
       fp_dbg ("write reqs");
-      aes_write_regv (dev, capture_reqs, G_N_ELEMENTS (capture_reqs),
+      aes_write_regv (dev, self->capture_reqs, G_N_ELEMENTS (capture_reqs),
                       generic_write_regv_cb, ssm);
       break;
 
@@ -656,7 +673,7 @@ capture_run_state (FpiSsm *ssm, FpDevice *_dev)
       if (self->deactivating)
         fpi_ssm_mark_completed (ssm);
       else
-        aes_write_regv (dev, strip_scan_reqs, G_N_ELEMENTS (strip_scan_reqs),
+        aes_write_regv (dev, self->strip_scan_reqs, G_N_ELEMENTS (strip_scan_reqs),
                         generic_write_regv_cb, ssm);
       break;
 
@@ -801,6 +818,8 @@ complete_deactivation (FpImageDevice *dev)
 static void
 dev_init (FpImageDevice *dev)
 {
+  FpiDeviceAes1610 *self = FPI_DEVICE_AES1610 (dev);
+  g_autoptr(GVariant) gain = NULL;
   GError *error = NULL;
 
   /* FIXME check endpoints */
@@ -811,14 +830,29 @@ dev_init (FpImageDevice *dev)
       return;
     }
 
+  gain = fpi_device_get_calibration (FP_DEVICE (dev), G_VARIANT_TYPE ("(ii)"));
+  if (gain)
+    {
+      g_variant_get (gain, "(ii)", &self->pos_list_BE, &self->pos_list_BD);
+      self->pos_list_BE = CLAMP (self->pos_list_BE, 0, 7);
+      self->pos_list_BD = CLAMP (self->pos_list_BD, 0, 6);
+    }
+
+  self->capture_reqs = g_memdup (capture_reqs, sizeof (capture_reqs));
+  self->strip_scan_reqs = g_memdup (strip_scan_reqs, sizeof (strip_scan_reqs));
+
   fpi_image_device_open_complete (dev, NULL);
 }
 
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpiDeviceAes1610 *self = FPI_DEVICE_AES1610 (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->capture_reqs, g_free);
+  g_clear_pointer (&self->strip_scan_reqs, g_free);
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
   fpi_image_device_close_complete (dev, error);
@@ -65,23 +65,42 @@ static void complete_deactivation (FpImageDevice *dev);
 
 struct _FpiDeviceAes2501
 {
-  FpImageDevice parent;
-
-  guint8        read_regs_retry_count;
-  GSList       *strips;
-  size_t        strips_len;
-  gboolean      deactivating;
-  int           no_finger_cnt;
+  FpImageDevice     parent;
+
+  guint8            read_regs_retry_count;
+  GSList           *strips;
+  size_t            strips_len;
+  struct fpi_frame *next_strip;
+  gboolean          deactivating;
+  int               no_finger_cnt;
 };
 G_DECLARE_FINAL_TYPE (FpiDeviceAes2501, fpi_device_aes2501, FPI, DEVICE_AES2501,
                       FpImageDevice);
 G_DEFINE_TYPE (FpiDeviceAes2501, fpi_device_aes2501, FP_TYPE_IMAGE_DEVICE);
 
+/* Strips are read straight into their frames, so the pixel data starts
+ * after the first byte of the capture response.
+ */
+static unsigned char
+aes2501_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
+                   struct fpi_frame           *frame,
+                   unsigned int                x,
+                   unsigned int                y)
+{
+  unsigned char ret;
+
+  ret = frame->data[1 + x * (ctx->frame_height >> 1) + (y >> 1)];
+  ret = y % 2 ? ret >> 4 : ret & 0xf;
+  ret *= 17;
+
+  return ret;
+}
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_width = FRAME_WIDTH,
   .frame_height = FRAME_HEIGHT,
   .image_width = IMAGE_WIDTH,
-  .get_pixel = aes_get_pixel,
+  .get_pixel = aes2501_get_pixel,
 };
 
 typedef void (*aes2501_read_regs_cb)(FpImageDevice *dev,
@@ -213,9 +232,8 @@ sum_histogram_values (unsigned char *data, guint8 threshold)
   if (threshold > 0x0f)
     return -1;
 
-  /* FIXME endianness */
   for (i = threshold; i < 16; i++)
-    r += histogram[i];
+    r += GUINT16_FROM_LE (histogram[i]);
 
   return r;
 }
@@ -399,7 +417,6 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
                        gpointer user_data, GError *error)
 {
   FpiSsm *ssm = transfer->ssm;
-  unsigned char *stripdata;
   FpImageDevice *dev = FP_IMAGE_DEVICE (_dev);
   FpiDeviceAes2501 *self = FPI_DEVICE_AES2501 (_dev);
   unsigned char *data = transfer->buffer;
@@ -474,13 +491,10 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
     }
   else
     {
-      /* obtain next strip */
-      /* FIXME: would preallocating strip buffers be a decent optimization? */
-      struct fpi_frame *stripe = g_malloc (FRAME_WIDTH * FRAME_HEIGHT / 2 + sizeof (struct fpi_frame));
+      /* keep the strip and obtain the next one */
+      struct fpi_frame *stripe = g_steal_pointer (&self->next_strip);
       stripe->delta_x = 0;
       stripe->delta_y = 0;
-      stripdata = stripe->data;
-      memcpy (stripdata, data + 1, 192 * 8);
       self->no_finger_cnt = 0;
       self->strips = g_slist_prepend (self->strips, stripe);
       self->strips_len++;
@@ -526,10 +540,16 @@ capture_run_state (FpiSsm *ssm, FpDevice *device)
     case CAPTURE_READ_STRIP: {
         FpiUsbTransfer *transfer;
 
+        /* Empty strips are dropped, so their frame is reused */
+        if (!self->next_strip)
+          self->next_strip = g_malloc (sizeof (struct fpi_frame) + STRIP_CAPTURE_LEN);
+
         transfer = fpi_usb_transfer_new (device);
         transfer->ssm = ssm;
         transfer->short_is_error = TRUE;
-        fpi_usb_transfer_fill_bulk (transfer, EP_IN, STRIP_CAPTURE_LEN);
+        fpi_usb_transfer_fill_bulk_full (transfer, EP_IN,
+                                         self->next_strip->data,
+                                         STRIP_CAPTURE_LEN, NULL);
         fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, NULL,
                                  capture_read_strip_cb, NULL);
         break;
@@ -823,7 +843,7 @@ complete_deactivation (FpImageDevice *dev)
    * maybe we can do this with a master reset, unconditionally? */
 
   self->deactivating = FALSE;
-  g_slist_free (self->strips);
+  g_slist_free_full (self->strips, g_free);
   self->strips = NULL;
   self->strips_len = 0;
   fpi_image_device_deactivate_complete (dev, NULL);
@@ -843,8 +863,11 @@ dev_init (FpImageDevice *dev)
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpiDeviceAes2501 *self = FPI_DEVICE_AES2501 (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->next_strip, g_free);
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
   fpi_image_device_close_complete (dev, error);
@@ -812,6 +812,36 @@ enum activate_states {
   ACTIVATE_NUM_STATES,
 };
 
+/* The firmware version and sensor dimensions do not change, so they
+ * are only queried once. */
+static gboolean
+elan_load_sensor_info (FpiDeviceElan *self)
+{
+  g_autoptr(GVariant) info = NULL;
+
+  info = fpi_device_get_calibration (FP_DEVICE (self), G_VARIANT_TYPE ("(qyyy)"));
+  if (!info)
+    return FALSE;
+
+  g_variant_get (info, "(qyyy)", &self->fw_ver, &self->frame_width,
+                 &self->frame_height, &self->raw_frame_height);
+  fp_dbg ("Using stored sensor info, FW ver 0x%04hx, WxH: %dx%d",
+          self->fw_ver, self->frame_width, self->raw_frame_height);
+
+  return TRUE;
+}
+
+static void
+elan_store_sensor_info (FpiDeviceElan *self)
+{
+  fpi_device_set_calibration (FP_DEVICE (self),
+                              g_variant_new ("(qyyy)", self->fw_ver,
+                                             self->frame_width,
+                                             self->frame_height,
+                                             self->raw_frame_height),
+                              0);
+}
+
 static void
 activate_run_state (FpiSsm *ssm, FpDevice *dev)
 {
@@ -822,7 +852,10 @@ activate_run_state (FpiSsm *ssm, FpDevice *dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case ACTIVATE_GET_FW_VER:
-      elan_run_cmd (ssm, dev, &get_fw_ver_cmd, ELAN_CMD_TIMEOUT);
+      if (elan_load_sensor_info (self))
+        fpi_ssm_jump_to_state (ssm, ACTIVATE_CMD_1);
+      else
+        elan_run_cmd (ssm, dev, &get_fw_ver_cmd, ELAN_CMD_TIMEOUT);
       break;
 
     case ACTIVATE_SET_FW_VER:
@@ -863,6 +896,7 @@ activate_run_state (FpiSsm *ssm, FpDevice *dev)
         self->frame_height = ELAN_MAX_FRAME_HEIGHT;
       fp_dbg ("sensor dimensions, WxH: %dx%d", self->frame_width,
               self->raw_frame_height);
+      elan_store_sensor_info (self);
       fpi_ssm_next_state (ssm);
       break;
 
@@ -491,14 +491,7 @@ msg_set_mode_control (FpiDeviceEtes603 *self, guint8 mode)
 static unsigned int
 process_get_brightness (guint8 *f, size_t s)
 {
-  unsigned int i, sum = 0;
-
-  for (i = 0; i < s; i++)
-    {
-      sum += f[i] >> 4;
-      sum += f[i] & 0x0F;
-    }
-  return sum;
+  return fpi_stats_sum_nibbles (f, s);
 }
 
 /*
@@ -507,21 +500,15 @@ process_get_brightness (guint8 *f, size_t s)
 static void
 process_hist (guint8 *f, size_t s, float stat[5])
 {
+  guint32 count[16];
   float hist[16];
   float black_mean, white_mean;
   int i;
 
-  /* Clean histogram */
-  for (i = 0; i < 16; i++)
-    hist[i] = 0.0;
-  for (i = 0; i < s; i++)
-    {
-      hist[f[i] >> 4]++;
-      hist[f[i] & 0x0F]++;
-    }
+  fpi_stats_histogram_nibbles (f, s, count);
   /* histogram average */
   for (i = 0; i < 16; i++)
-    hist[i] = hist[i] / (s * 2);
+    hist[i] = (float) count[i] / (s * 2);
   /* Average black/white pixels (full black and full white pixels
    * are excluded). */
   black_mean = white_mean = 0.0;
@@ -592,6 +579,29 @@ reset_param (FpiDeviceEtes603 *dev)
   dev->vrt = 0;
   dev->vrb = 0;
   dev->gain = 0;
+
+  fpi_device_clear_calibration (FP_DEVICE (dev));
+}
+
+/* Tuning takes many round trips, keep the result for later opens. */
+static void
+store_param (FpiDeviceEtes603 *dev)
+{
+  fpi_device_set_calibration (FP_DEVICE (dev),
+                              g_variant_new ("(yyyy)", dev->dcoffset, dev->vrt,
+                                             dev->vrb, dev->gain),
+                              0);
+}
+
+static void
+load_param (FpiDeviceEtes603 *dev)
+{
+  g_autoptr(GVariant) param = NULL;
+
+  param = fpi_device_get_calibration (FP_DEVICE (dev), G_VARIANT_TYPE ("(yyyy)"));
+  if (param)
+    g_variant_get (param, "(yyyy)", &dev->dcoffset, &dev->vrt, &dev->vrb,
+                   &dev->gain);
 }
 
 
@@ -1262,6 +1272,7 @@ m_tunevrb_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
   if (!error)
     {
       fp_dbg ("Tuning is done. Starting finger detection.");
+      store_param (self);
       m_start_fingerdetect (idev);
     }
 
@@ -1604,6 +1615,9 @@ dev_open (FpImageDevice *idev)
   self->ans = g_malloc (FE_SIZE);
   self->fp = g_malloc (FE_SIZE * 4);
 
+  if (self->dcoffset == 0)
+    load_param (self);
+
   fpi_image_device_open_complete (idev, NULL);
 }
 
@@ -73,13 +73,11 @@ struct _FpiDeviceUpeksonly
 
   FpiSsm       *loopsm;
 
-  /* Do we really need multiple concurrent transfers? */
-  GCancellable                    *img_cancellable;
-  GPtrArray                       *img_transfers;
-  int                              num_flying;
+  FpiUsbStream                    *img_stream;
 
   GSList                          *rows;
   size_t                           num_rows;
+  unsigned char                   *row_slab;
   unsigned char                   *rowbuf;
   int                              rowbuf_offset;
 
@@ -154,14 +152,14 @@ upeksonly_get_pixel (struct fpi_line_asmbl_ctx *ctx,
 static void
 free_img_transfers (FpiDeviceUpeksonly *sdev)
 {
-  g_cancellable_cancel (sdev->img_cancellable);
-  g_clear_object (&sdev->img_cancellable);
-  g_clear_pointer (&sdev->img_transfers, g_ptr_array_unref);
+  g_clear_pointer (&sdev->img_stream, fpi_usb_stream_free);
 }
 
 static void
-last_transfer_killed (FpImageDevice *dev)
+last_transfer_killed (FpiUsbStream *stream, FpDevice *device,
+                      gpointer user_data)
 {
+  FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
 
   switch (self->killing_transfers)
@@ -186,10 +184,7 @@ cancel_img_transfers (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
 
-  g_cancellable_cancel (self->img_cancellable);
-
-  if (self->num_flying == 0)
-    last_transfer_killed (dev);
+  fpi_usb_stream_stop (self->img_stream, last_transfer_killed, NULL);
 }
 
 static gboolean
@@ -217,7 +212,7 @@ handoff_img (FpImageDevice *dev)
   fp_dbg ("%lu rows", self->num_rows);
   img = fpi_assemble_lines (&self->assembling_ctx, self->rows, self->num_rows);
 
-  g_slist_free_full (self->rows, g_free);
+  g_slist_free (self->rows);
   self->rows = NULL;
 
   fpi_image_device_image_captured (dev, img);
@@ -352,8 +347,9 @@ static void
 start_new_row (FpiDeviceUpeksonly *self, unsigned char *data,
                int size)
 {
-  if (!self->rowbuf)
-    self->rowbuf = g_malloc (self->img_width);
+  /* Rows are stored in the slab in order, a row that is dropped is simply
+   * overwritten by the next one. */
+  self->rowbuf = self->row_slab + self->num_rows * self->img_width;
   memcpy (self->rowbuf, data, size);
   self->rowbuf_offset = size;
 }
@@ -497,25 +493,13 @@ handle_packet (FpImageDevice *dev, unsigned char *data)
 }
 
 static void
-img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
+img_data_cb (FpiUsbStream *stream, FpiUsbTransfer *transfer,
              gpointer user_data, GError *error)
 {
-  FpImageDevice *dev = FP_IMAGE_DEVICE (device);
+  FpImageDevice *dev = FP_IMAGE_DEVICE (transfer->device);
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   int i;
 
-  self->num_flying--;
-
-  if (self->killing_transfers)
-    {
-      if (self->num_flying == 0)
-        last_transfer_killed (dev);
-
-      /* don't care about error or success if we're terminating */
-      g_clear_error (&error);
-      return;
-    }
-
   /* NOTE: The old code assume 4096 bytes are received each time
    * but there is no reason we need to enforce that. However, we
    * always need full lines. */
@@ -550,16 +534,6 @@ img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
         return;
       handle_packet (dev, transfer->buffer + i);
     }
-
-  if (is_capturing (self))
-    {
-      fpi_usb_transfer_submit (fpi_usb_transfer_ref (transfer),
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               user_data);
-      self->num_flying++;
-    }
 }
 
 /***** STATE MACHINE HELPERS *****/
@@ -693,8 +667,6 @@ sm_read_reg_cb (FpiUsbTransfer *transfer, FpDevice *device,
       fp_dbg ("read reg result = %02x", self->read_reg_result);
       fpi_ssm_next_state (transfer->ssm);
     }
-
-  g_free (transfer->buffer);
 }
 
 static void
@@ -731,7 +703,6 @@ sm_await_intr_cb (FpiUsbTransfer *transfer, FpDevice *device,
 
   if (error)
     {
-      g_free (transfer->buffer);
       fpi_ssm_mark_failed (transfer->ssm, error);
       return;
     }
@@ -739,7 +710,6 @@ sm_await_intr_cb (FpiUsbTransfer *transfer, FpDevice *device,
   fp_dbg ("interrupt received: %02x %02x %02x %02x",
           transfer->buffer[0], transfer->buffer[1],
           transfer->buffer[2], transfer->buffer[3]);
-  g_free (transfer->buffer);
 
   self->finger_state = FINGER_DETECTED;
   fpi_image_device_report_finger_status (dev, TRUE);
@@ -895,21 +865,10 @@ capsm_fire_bulk (FpiSsm   *ssm,
                  FpDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
-  int i;
 
   g_assert (self->capturing == FALSE);
 
-  g_clear_object (&self->img_cancellable);
-  self->img_cancellable = g_cancellable_new ();
-  for (i = 0; i < self->img_transfers->len; i++)
-    {
-      fpi_usb_transfer_submit (fpi_usb_transfer_ref (g_ptr_array_index (self->img_transfers, i)),
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               NULL);
-      self->num_flying++;
-    }
+  fpi_usb_stream_start (self->img_stream, 0, NULL, img_data_cb, NULL);
   self->capturing = TRUE;
   fpi_ssm_next_state (ssm);
 }
@@ -1329,10 +1288,9 @@ deactivate_done (FpImageDevice *dev, GError *error)
 
   G_DEBUG_HERE ();
   free_img_transfers (self);
-  g_free (self->rowbuf);
   self->rowbuf = NULL;
 
-  g_slist_free_full (self->rows, g_free);
+  g_slist_free (self->rows);
   self->rows = NULL;
 
   fpi_image_device_deactivate_complete (dev, error);
@@ -1395,26 +1353,15 @@ dev_activate (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   FpiSsm *ssm = NULL;
-  int i;
 
   self->deactivating = FALSE;
   self->capturing = FALSE;
 
-  self->num_flying = 0;
-  self->img_transfers = g_ptr_array_new_with_free_func ((GFreeFunc) fpi_usb_transfer_unref);
-
   /* This might seem odd, but we do need multiple in-flight URBs so that
    * we never stop polling the device for more data.
    */
-  for (i = 0; i < NUM_BULK_TRANSFERS; i++)
-    {
-      FpiUsbTransfer *transfer;
-
-      transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
-      fpi_usb_transfer_fill_bulk (transfer, 0x81, 4096);
-
-      g_ptr_array_add (self->img_transfers, transfer);
-    }
+  self->img_stream = fpi_usb_stream_new (FP_DEVICE (dev), 0x81, 4096,
+                                         NUM_BULK_TRANSFERS);
 
   switch (self->dev_model)
     {
@@ -1444,8 +1391,11 @@ static void dev_init (FpImageDevice *dev);
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->row_slab, g_free);
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
   fpi_image_device_close_complete (dev, error);
@@ -1554,5 +1504,9 @@ dev_init (FpImageDevice *dev)
     default:
       g_assert_not_reached ();
     }
+
+  /* One more row as the next one may be started when hitting the limit */
+  self->row_slab = g_malloc ((MAX_ROWS + 1) * self->img_width);
+
   fpi_image_device_open_complete (dev, NULL);
 }
@@ -129,6 +129,7 @@ struct _FpiDeviceUru4000
   GCancellable                   *irq_cancellable;
   FpiUsbTransfer                 *img_transfer;
   void                           *img_data;
+  GDestroyNotify                  img_data_free;
   int                             img_data_actual_length;
   uint16_t                        img_lines_done, img_block;
   uint32_t                        img_enc_seed;
@@ -550,7 +551,11 @@ image_transfer_cb (FpiUsbTransfer *transfer, FpDevice *dev,
     }
   else
     {
-      self->img_data = g_memdup (transfer->buffer, sizeof (struct uru4k_image));
+      /* The frame is decoded in place, take it over rather than copying */
+      if (self->img_data)
+        self->img_data_free (self->img_data);
+      self->img_data = fpi_usb_transfer_steal_buffer (transfer,
+                                                      &self->img_data_free);
       self->img_data_actual_length = transfer->actual_length;
       fpi_ssm_next_state (ssm);
     }
@@ -610,7 +615,7 @@ static int
 calc_dev2 (struct uru4k_image *img)
 {
   uint8_t *b[2] = { NULL, NULL };
-  int res = 0, mean = 0, i, r, j, idx;
+  int i, r, j, idx;
 
   for (i = r = idx = 0; i < G_N_ELEMENTS (img->block_info) && idx < 2; i++)
     {
@@ -624,18 +629,8 @@ calc_dev2 (struct uru4k_image *img)
       fp_dbg ("NULL! %p %p", b[0], b[1]);
       return 0;
     }
-  for (i = 0; i < IMAGE_WIDTH; i++)
-    mean += (int) b[0][i] + (int) b[1][i];
 
-  mean /= IMAGE_WIDTH;
-
-  for (i = 0; i < IMAGE_WIDTH; i++)
-    {
-      int dev = (int) b[0][i] + (int) b[1][i] - mean;
-      res += dev * dev;
-    }
-
-  return res / IMAGE_WIDTH;
+  return fpi_stats_pair_sq_dev (b[0], b[1], IMAGE_WIDTH) / IMAGE_WIDTH;
 }
 
 static void
@@ -797,7 +792,8 @@ imaging_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
 
   g_clear_pointer (&self->img_transfer, fpi_usb_transfer_unref);
 
-  g_free (self->img_data);
+  if (self->img_data)
+    self->img_data_free (self->img_data);
   self->img_data = NULL;
   self->img_data_actual_length = 0;
 
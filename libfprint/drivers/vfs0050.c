@@ -182,15 +182,9 @@ vfs0050_get_difference (struct fpi_line_asmbl_ctx *ctx,
   struct vfs_line *line1 = line_list_1->data;
   struct vfs_line *line2 = line_list_2->data;
   const int shift = (VFS_IMAGE_WIDTH - VFS_NEXT_LINE_WIDTH) / 2 - 1;
-  int res = 0;
 
-  for (int i = 0; i < VFS_NEXT_LINE_WIDTH; ++i)
-    {
-      int x =
-        (int) line1->next_line_part[i] - (int) line2->data[shift + i];
-      res += x * x;
-    }
-  return res;
+  return fpi_stats_sq_diff (line1->next_line_part, line2->data + shift,
+                            VFS_NEXT_LINE_WIDTH);
 }
 
 #define VFS_NOISE_THRESHOLD 40
@@ -389,13 +383,11 @@ send_control_packet (FpiSsm   *ssm,
   fpi_ssm_start_subsm (ssm, subsm);
 }
 
-/* Clears all fprint data */
+/* Clears all fprint data, the buffer is kept for the next fprint */
 static void
 clear_data (FpDeviceVfs0050 *vdev)
 {
-  g_free (vdev->lines_buffer);
-  vdev->lines_buffer = NULL;
-  vdev->memory = vdev->bytes = 0;
+  vdev->bytes = 0;
 }
 
 /* After receiving interrupt from EP3 */
@@ -454,16 +446,30 @@ interrupt_callback (FpiUsbTransfer *transfer, FpDevice *device,
 }
 
 static void
-receive_callback (FpiUsbTransfer *transfer, FpDevice *device,
-                  gpointer user_data, GError *error)
+receive_stopped_callback (FpiUsbStream *stream, FpDevice *device,
+                          gpointer user_data)
 {
   FpDeviceVfs0050 *self = FPI_DEVICE_VFS0050 (device);
+  FpiSsm *ssm = user_data;
+
+  if (self->usb_error)
+    fpi_ssm_mark_failed (ssm, g_steal_pointer (&self->usb_error));
+  else
+    fpi_ssm_next_state (ssm);
+}
+
+static void
+receive_callback (FpiUsbStream *stream, FpiUsbTransfer *transfer,
+                  gpointer user_data, GError *error)
+{
+  FpDeviceVfs0050 *self = FPI_DEVICE_VFS0050 (transfer->device);
 
   if (error && !g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
     {
       fp_err ("USB read transfer: %s", error->message);
 
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      self->usb_error = error;
+      fpi_usb_stream_stop (stream, receive_stopped_callback, user_data);
       return;
     }
   if (error)
@@ -472,16 +478,22 @@ receive_callback (FpiUsbTransfer *transfer, FpDevice *device,
   /* Capture is done when there is no more data to transfer or device timed out */
   if (transfer->actual_length <= 0)
     {
-      fpi_ssm_next_state (transfer->ssm);
+      fpi_usb_stream_stop (stream, receive_stopped_callback, user_data);
+      return;
     }
-  else
-    {
-      self->bytes += transfer->actual_length;
 
-      /* Try reading more data */
-      fpi_ssm_jump_to_state (transfer->ssm,
-                             fpi_ssm_get_cur_state (transfer->ssm));
+  /* Increase buffer size while it's insufficient */
+  while (self->bytes + transfer->actual_length > self->memory)
+    {
+      self->memory <<= 1;
+      self->lines_buffer =
+        (struct vfs_line *) g_realloc (self->lines_buffer,
+                                       self->memory);
     }
+
+  memcpy ((guint8 *) self->lines_buffer + self->bytes,
+          transfer->buffer, transfer->actual_length);
+  self->bytes += transfer->actual_length;
 }
 
 /* Main SSM loop */
@@ -573,40 +585,25 @@ activate_ssm (FpiSsm *ssm, FpDevice *dev)
        *       cancellation. */
       break;
 
-    case SSM_RECEIVE_FINGER: {
-        FpiUsbTransfer *transfer;
-
-        if (self->memory == 0)
-          {
-            /* Initialize fingerprint buffer */
-            g_free (self->lines_buffer);
-            self->memory = VFS_USB_BUFFER_SIZE;
-            self->lines_buffer = g_malloc (self->memory);
-            self->bytes = 0;
-
-            /* Finger is on the scanner */
-            fpi_image_device_report_finger_status (idev, TRUE);
-          }
+    case SSM_RECEIVE_FINGER:
+      /* Initialize fingerprint buffer */
+      if (!self->lines_buffer)
+        {
+          self->memory = VFS_USB_BUFFER_SIZE;
+          self->lines_buffer = g_malloc (self->memory);
+        }
+      self->bytes = 0;
 
-        /* Increase buffer size while it's insufficient */
-        while (self->bytes + VFS_USB_BUFFER_SIZE > self->memory)
-          {
-            self->memory <<= 1;
-            self->lines_buffer =
-              (struct vfs_line *) g_realloc (self->lines_buffer,
-                                             self->memory);
-          }
+      /* Finger is on the scanner */
+      fpi_image_device_report_finger_status (idev, TRUE);
 
-        /* Receive chunk of data */
-        transfer = fpi_usb_transfer_new (dev);
-        fpi_usb_transfer_fill_bulk_full (transfer, 0x82,
-                                         (guint8 *) self->lines_buffer + self->bytes,
-                                         VFS_USB_BUFFER_SIZE, NULL);
-        transfer->ssm = ssm;
-        fpi_usb_transfer_submit (transfer, VFS_USB_TIMEOUT, NULL,
-                                 receive_callback, NULL);
-        break;
-      }
+      /* Receive chunks of data, every transfer is already queued while
+       * the one before it is being received, so double its timeout.
+       */
+      fpi_usb_stream_start (self->usb_stream,
+                            VFS_USB_TIMEOUT * VFS_USB_TRANSFERS,
+                            NULL, receive_callback, ssm);
+      break;
 
     case SSM_SUBMIT_IMAGE:
       submit_image (self);
@@ -705,6 +702,7 @@ dev_open_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
 static void
 dev_open (FpImageDevice *idev)
 {
+  FpDeviceVfs0050 *self = FPI_DEVICE_VFS0050 (idev);
   GError *error = NULL;
 
   /* Claim usb interface */
@@ -714,6 +712,10 @@ dev_open (FpImageDevice *idev)
       return;
     }
 
+  self->usb_stream = fpi_usb_stream_new (FP_DEVICE (idev), 0x82,
+                                         VFS_USB_BUFFER_SIZE,
+                                         VFS_USB_TRANSFERS);
+
   /* Clearing previous device state */
   FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (idev), activate_ssm, SSM_STATES);
 
@@ -727,7 +729,9 @@ dev_close (FpImageDevice *idev)
   GError *error = NULL;
   FpDeviceVfs0050 *self = FPI_DEVICE_VFS0050 (idev);
 
-  clear_data (self);
+  g_clear_pointer (&self->lines_buffer, g_free);
+  self->memory = self->bytes = 0;
+  g_clear_pointer (&self->usb_stream, fpi_usb_stream_free);
 
   /* Release usb interface */
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (idev)),
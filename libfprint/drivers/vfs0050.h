@@ -31,6 +31,8 @@
 #define VFS_SSM_ORANGE_TIMEOUT 400
 /* Buffer size for abort and fprint receiving */
 #define VFS_USB_BUFFER_SIZE 65536
+/* Number of transfers queued while receiving fprint */
+#define VFS_USB_TRANSFERS 2
 
 /* Line size from scanner including metainformation: line number, narrow stripe from the center, etc */
 #define VFS_LINE_SIZE 148
@@ -101,8 +103,9 @@ struct _FpDeviceVfs0050
   /* Current number of received bytes and current memory used by data */
   int bytes, memory;
 
-  /* USB buffer for fingerprint */
-  char *usb_buffer;
+  /* USB transfers for fingerprint and error that ended receiving */
+  FpiUsbStream *usb_stream;
+  GError       *usb_error;
 
   /* Received interrupt data */
   unsigned char interrupt[8];
@@ -58,6 +58,9 @@
 /* Best image contrast */
 #define VFS_IMG_BEST_CONTRAST 128
 
+/* Seconds the result of the contrast scan is reused */
+#define VFS_CONTRAST_LIFETIME (10 * 60)
+
 /* Device parameters address */
 #define VFS_PAR_000E 0x000e
 #define VFS_PAR_0011 0x0011
@@ -1172,10 +1175,24 @@ m_init_state (FpiSsm *ssm, FpDevice *_dev)
       break;
 
     case M_INIT_4_SET_EXPOSURE:
-      /* Set exposure level of reader */
-      vfs_poke (ssm, dev, VFS_REG_IMG_EXPOSURE, 0x4000, 0x02);
-      self->counter = 1;
-      break;
+      {
+        g_autoptr(GVariant) contrast = NULL;
+
+        /* Skip the contrast scan if it was done recently */
+        contrast = fpi_device_get_calibration (_dev, G_VARIANT_TYPE_INT32);
+        if (contrast)
+          {
+            self->contrast = g_variant_get_int32 (contrast);
+            fp_dbg ("use stored contrast value = %d", self->contrast);
+            fpi_ssm_jump_to_state (ssm, M_INIT_5_SET_EXPOSURE);
+            break;
+          }
+
+        /* Set exposure level of reader */
+        vfs_poke (ssm, dev, VFS_REG_IMG_EXPOSURE, 0x4000, 0x02);
+        self->counter = 1;
+        break;
+      }
 
     case M_INIT_4_SET_CONTRAST:
       /* Set contrast level of reader */
@@ -1202,6 +1219,8 @@ m_init_state (FpiSsm *ssm, FpDevice *_dev)
           self->contrast = self->best_contrast;
           self->counter = 0;
           fp_dbg ("use contrast value = %d", self->contrast);
+          fpi_device_set_calibration (_dev, g_variant_new_int32 (self->contrast),
+                                      VFS_CONTRAST_LIFETIME);
           fpi_ssm_next_state (ssm);
         }
       else
@@ -209,24 +209,12 @@ static int
 vfs5011_get_deviation2 (struct fpi_line_asmbl_ctx *ctx, GSList *row1, GSList *row2)
 {
   unsigned char *buf1, *buf2;
-  int res = 0, mean = 0, i;
   const int size = 64;
 
   buf1 = (unsigned char *) row1->data + 56;
   buf2 = (unsigned char *) row2->data + 168;
 
-  for (i = 0; i < size; i++)
-    mean += (int) buf1[i] + (int) buf2[i];
-
-  mean /= size;
-
-  for (i = 0; i < size; i++)
-    {
-      int dev = (int) buf1[i] + (int) buf2[i] - mean;
-      res += dev * dev;
-    }
-
-  return res / size;
+  return fpi_stats_pair_sq_dev (buf1, buf2, size) / size;
 }
 
 static unsigned char
@@ -243,6 +231,7 @@ vfs5011_get_pixel (struct fpi_line_asmbl_ctx *ctx,
 
 enum {
   CAPTURE_LINES = 256,
+  CAPTURE_TRANSFERS = 4,
   MAXLINES = 2000,
   MAX_CAPTURE_LINES = 100000,
 };
@@ -262,7 +251,8 @@ struct _FpDeviceVfs5011
   FpImageDevice           parent;
 
   unsigned char          *total_buffer;
-  unsigned char          *capture_buffer;
+  FpiUsbStream           *capture_stream;
+  GError                 *capture_error;
   unsigned char          *row_buffer;
   unsigned char          *lastline;
   GSList                 *rows;
@@ -309,7 +299,7 @@ capture_init (FpDeviceVfs5011 *self, int max_captured,
 }
 
 static int
-process_chunk (FpDeviceVfs5011 *self, int transferred)
+process_chunk (FpDeviceVfs5011 *self, unsigned char *buffer, int transferred)
 {
   enum {
     DEVIATION_THRESHOLD = 15 * 15,
@@ -323,8 +313,7 @@ process_chunk (FpDeviceVfs5011 *self, int transferred)
 
   for (i = 0; i < lines_captured; i++)
     {
-      unsigned char *linebuf = self->capture_buffer
-                               + i * VFS5011_LINE_SIZE;
+      unsigned char *linebuf = buffer + i * VFS5011_LINE_SIZE;
 
       if (fpi_std_sq_dev (linebuf + 8, VFS5011_IMAGE_WIDTH)
           < DEVIATION_THRESHOLD)
@@ -403,11 +392,25 @@ submit_image (FpiSsm          *ssm,
 }
 
 static void
-chunk_capture_callback (FpiUsbTransfer *transfer, FpDevice *device,
+capture_stopped_callback (FpiUsbStream *stream, FpDevice *device,
+                          gpointer user_data)
+{
+  FpDeviceVfs5011 *self = FPI_DEVICE_VFS5011 (device);
+  FpiSsm *ssm = user_data;
+
+  if (self->capture_error)
+    fpi_ssm_mark_failed (ssm, g_steal_pointer (&self->capture_error));
+  else
+    fpi_ssm_jump_to_state (ssm, DEV_ACTIVATE_DATA_COMPLETE);
+}
+
+static void
+chunk_capture_callback (FpiUsbStream *stream, FpiUsbTransfer *transfer,
                         gpointer user_data, GError *error)
 {
-  FpImageDevice *dev = FP_IMAGE_DEVICE (device);
+  FpImageDevice *dev = FP_IMAGE_DEVICE (transfer->device);
   FpDeviceVfs5011 *self;
+  FpiSsm *ssm = user_data;
 
   self = FPI_DEVICE_VFS5011 (dev);
 
@@ -420,53 +423,26 @@ chunk_capture_callback (FpiUsbTransfer *transfer, FpDevice *device,
       if (transfer->actual_length > 0)
         fpi_image_device_report_finger_status (dev, TRUE);
 
-      if (process_chunk (self, transfer->actual_length))
-        fpi_ssm_jump_to_state (transfer->ssm,
-                               DEV_ACTIVATE_DATA_COMPLETE);
-      else
-        fpi_ssm_jump_to_state (transfer->ssm,
-                               DEV_ACTIVATE_READ_DATA);
+      /* The main loop finishes the capture if we are deactivating */
+      if (process_chunk (self, transfer->buffer, transfer->actual_length) ||
+          self->deactivating)
+        fpi_usb_stream_stop (stream, capture_stopped_callback, ssm);
     }
   else
     {
       if (!self->deactivating)
         {
           fp_err ("Failed to capture data");
-          fpi_ssm_mark_failed (transfer->ssm, error);
+          self->capture_error = error;
         }
       else
         {
           g_error_free (error);
-          fpi_ssm_mark_completed (transfer->ssm);
         }
+      fpi_usb_stream_stop (stream, capture_stopped_callback, ssm);
     }
 }
 
-static void
-capture_chunk_async (FpDeviceVfs5011 *self,
-                     GUsbDevice *handle, int nline,
-                     int timeout, FpiSsm *ssm)
-{
-  FpiUsbTransfer *transfer;
-
-  fp_dbg ("capture_chunk_async: capture %d lines, already have %d",
-          nline, self->lines_recorded);
-  enum {
-    DEVIATION_THRESHOLD = 15 * 15,
-    DIFFERENCE_THRESHOLD = 600,
-    STOP_CHECK_LINES = 50
-  };
-
-  transfer = fpi_usb_transfer_new (FP_DEVICE (self));
-  fpi_usb_transfer_fill_bulk_full (transfer,
-                                   VFS5011_IN_ENDPOINT_DATA,
-                                   self->capture_buffer,
-                                   nline * VFS5011_LINE_SIZE, NULL);
-  transfer->ssm = ssm;
-  fpi_usb_transfer_submit (transfer, timeout, fpi_device_get_cancellable (FP_DEVICE (self)),
-                           chunk_capture_callback, NULL);
-}
-
 /*
  *  Device initialization. Windows driver only does it when the device is
  *  plugged in, but it doesn't harm to do this every time before scanning the
@@ -698,10 +674,11 @@ activate_loop (FpiSsm *ssm, FpDevice *_dev)
       break;
 
     case DEV_ACTIVATE_READ_DATA:
-      capture_chunk_async (self,
-                           fpi_device_get_usb_device (FP_DEVICE (dev)),
-                           CAPTURE_LINES,
-                           READ_TIMEOUT, ssm);
+      fp_dbg ("capturing %d lines per transfer, already have %d",
+              CAPTURE_LINES, self->lines_recorded);
+      fpi_usb_stream_start (self->capture_stream, READ_TIMEOUT,
+                            fpi_device_get_cancellable (FP_DEVICE (dev)),
+                            chunk_capture_callback, ssm);
       break;
 
     case DEV_ACTIVATE_DATA_COMPLETE:
@@ -797,7 +774,10 @@ dev_open (FpImageDevice *dev)
   FpDeviceVfs5011 *self;
 
   self = FPI_DEVICE_VFS5011 (dev);
-  self->capture_buffer = g_new0 (unsigned char, CAPTURE_LINES * VFS5011_LINE_SIZE);
+  self->capture_stream = fpi_usb_stream_new (FP_DEVICE (dev),
+                                             VFS5011_IN_ENDPOINT_DATA,
+                                             CAPTURE_LINES * VFS5011_LINE_SIZE,
+                                             CAPTURE_TRANSFERS);
 
   if (!g_usb_device_claim_interface (fpi_device_get_usb_device (FP_DEVICE (dev)), 0, 0, &error))
     {
@@ -818,7 +798,7 @@ dev_close (FpImageDevice *dev)
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
 
-  g_free (self->capture_buffer);
+  g_clear_pointer (&self->capture_stream, fpi_usb_stream_free);
   g_slist_free_full (g_steal_pointer (&self->rows), g_free);
 
   fpi_image_device_close_complete (dev, error);
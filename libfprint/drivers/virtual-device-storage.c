@@ -33,7 +33,30 @@
 
 G_DEFINE_TYPE (FpDeviceVirtualDeviceStorage, fpi_device_virtual_device_storage, fpi_device_virtual_device_get_type ())
 
-static GPtrArray * get_stored_prints (FpDeviceVirtualDevice * self);
+/* Returns the index of the first print in @prints equal to @print. The
+ * hashes are cached on the prints, so most of them are skipped without
+ * comparing their data. */
+static gboolean
+find_print (GPtrArray *prints,
+            FpPrint   *print,
+            guint     *idx)
+{
+  guint hash = fp_print_hash (print);
+  guint i;
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *candidate = g_ptr_array_index (prints, i);
+
+      if (fp_print_hash (candidate) == hash && fp_print_equal (candidate, print))
+        {
+          *idx = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
 
 static void
 dev_identify (FpDevice *dev)
@@ -48,7 +71,6 @@ dev_identify (FpDevice *dev)
 
   if (scan_id)
     {
-      g_autoptr(GPtrArray) stored = get_stored_prints (self);
       GPtrArray *prints;
       GVariant *data = NULL;
       FpPrint *new_scan;
@@ -64,15 +86,10 @@ dev_identify (FpDevice *dev)
       fpi_device_get_identify_data (dev, &prints);
       g_debug ("Trying to identify print '%s' against a gallery of %u prints", scan_id, prints->len);
 
-      if (!g_ptr_array_find_with_equal_func (stored,
-                                             new_scan,
-                                             (GEqualFunc) fp_print_equal,
-                                             NULL))
+      /* The stored prints are equal to a scan exactly if they share the ID */
+      if (!g_hash_table_contains (self->prints_storage, scan_id))
         error = fpi_device_error_new (FP_DEVICE_ERROR_DATA_NOT_FOUND);
-      else if (g_ptr_array_find_with_equal_func (prints,
-                                                 new_scan,
-                                                 (GEqualFunc) fp_print_equal,
-                                                 &idx))
+      else if (find_print (prints, new_scan, &idx))
         match = g_ptr_array_index (prints, idx);
 
       if (!self->match_reported)
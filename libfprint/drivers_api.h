@@ -30,3 +30,4 @@
 #include "fpi-print.h"
 #include "fpi-usb-transfer.h"
 #include "fpi-ssm.h"
+#include "fpi-stats.h"
@@ -22,6 +22,7 @@
 
 #include "fpi-context.h"
 #include "fpi-device.h"
+#include "fpi-worker-pool.h"
 #include <gusb.h>
 
 /**
@@ -34,6 +35,11 @@
  *
  * The <link linkend="device-added">device-added</link> and device-removed signals allow you to handle devices
  * that may be hotplugged at runtime.
+ *
+ * Image processing and matching happen in worker threads owned by
+ * libfprint. They are shared by all contexts of a process, so they are
+ * configured using process wide functions like
+ * fp_context_set_worker_threads() rather than per context.
  */
 
 typedef struct
@@ -44,10 +50,26 @@ typedef struct
   gint          pending_devices;
   gboolean      enumerated;
 
-  GArray       *drivers;
+  GStrv         drivers_whitelist;
   GPtrArray    *devices;
 } FpContextPrivate;
 
+typedef struct
+{
+  GType            driver;
+  const gchar     *driver_id;
+  const FpIdEntry *entry;
+} DriverIdEntry;
+
+/* Index of the id tables of all drivers, shared by all contexts */
+typedef struct
+{
+  GHashTable *usb;     /* USB_ID_KEY → GArray of DriverIdEntry */
+  GArray     *virtual; /* DriverIdEntry */
+} DriverIndex;
+
+#define USB_ID_KEY(vid, pid) GUINT_TO_POINTER (((guint) (vid) << 16) | (pid))
+
 G_DEFINE_TYPE_WITH_PRIVATE (FpContext, fp_context, G_TYPE_OBJECT)
 
 enum {
@@ -64,26 +86,76 @@ get_drivers_whitelist_env (void)
 }
 
 static gboolean
-is_driver_allowed (const gchar *driver)
+is_driver_allowed (FpContext *self, const gchar *driver)
 {
-  g_auto(GStrv) whitelisted_drivers = NULL;
-  const char *fp_drivers_whitelist_env;
-  int i;
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
 
   g_return_val_if_fail (driver, TRUE);
 
-  fp_drivers_whitelist_env = get_drivers_whitelist_env ();
-
-  if (!fp_drivers_whitelist_env)
+  if (!priv->drivers_whitelist)
     return TRUE;
 
-  whitelisted_drivers = g_strsplit (fp_drivers_whitelist_env, ":", -1);
+  return g_strv_contains ((const gchar * const *) priv->drivers_whitelist, driver);
+}
+
+static gpointer
+driver_index_build (gpointer data)
+{
+  g_autoptr(GArray) drivers = fpi_get_driver_types ();
+  DriverIndex *index;
+  guint i;
 
-  for (i = 0; whitelisted_drivers[i]; ++i)
-    if (g_strcmp0 (driver, whitelisted_drivers[i]) == 0)
-      return TRUE;
+  index = g_new0 (DriverIndex, 1);
+  index->usb = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                      (GDestroyNotify) g_array_unref);
+  index->virtual = g_array_new (FALSE, FALSE, sizeof (DriverIdEntry));
+
+  for (i = 0; i < drivers->len; i++)
+    {
+      GType driver = g_array_index (drivers, GType, i);
+      /* Driver types are static, so the class is never freed */
+      FpDeviceClass *cls = g_type_class_ref (driver);
+      const FpIdEntry *entry;
+
+      for (entry = cls->id_table; entry->pid; entry++)
+        {
+          DriverIdEntry id_entry = { driver, cls->id, entry };
+
+          if (cls->type == FP_DEVICE_TYPE_USB)
+            {
+              GArray *candidates;
+
+              candidates = g_hash_table_lookup (index->usb,
+                                                USB_ID_KEY (entry->vid, entry->pid));
+              if (!candidates)
+                {
+                  candidates = g_array_new (FALSE, FALSE, sizeof (DriverIdEntry));
+                  g_hash_table_insert (index->usb,
+                                       USB_ID_KEY (entry->vid, entry->pid),
+                                       candidates);
+                }
+
+              g_array_append_val (candidates, id_entry);
+            }
+          else if (cls->type == FP_DEVICE_TYPE_VIRTUAL)
+            {
+              g_array_append_val (index->virtual, id_entry);
+            }
+        }
+    }
+
+  return index;
+}
+
+/* Built on first use, which is the first device showing up or the first
+ * enumeration. The driver classes are only initialized at that point.
+ */
+static DriverIndex *
+driver_index_get (void)
+{
+  static GOnce index_once = G_ONCE_INIT;
 
-  return FALSE;
+  return g_once (&index_once, driver_index_build, NULL);
 }
 
 typedef struct
@@ -177,40 +249,36 @@ usb_device_added_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
   GType found_driver = G_TYPE_NONE;
   const FpIdEntry *found_entry = NULL;
   gint found_score = 0;
-  gint i;
+  GArray *candidates;
+  guint i;
   guint16 pid, vid;
 
   pid = g_usb_device_get_pid (device);
   vid = g_usb_device_get_vid (device);
 
+  candidates = g_hash_table_lookup (driver_index_get ()->usb, USB_ID_KEY (vid, pid));
+
   /* Find the best driver to handle this USB device. */
-  for (i = 0; i < priv->drivers->len; i++)
+  for (i = 0; candidates && i < candidates->len; i++)
     {
-      GType driver = g_array_index (priv->drivers, GType, i);
-      g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
-      const FpIdEntry *entry;
+      DriverIdEntry *candidate = &g_array_index (candidates, DriverIdEntry, i);
+      FpDeviceClass *cls;
+      gint driver_score = 50;
 
-      if (cls->type != FP_DEVICE_TYPE_USB)
+      if (!is_driver_allowed (self, candidate->driver_id))
         continue;
 
-      for (entry = cls->id_table; entry->pid; entry++)
-        {
-          gint driver_score = 50;
-
-          if (entry->pid != pid || entry->vid != vid)
-            continue;
-
-          if (cls->usb_discover)
-            driver_score = cls->usb_discover (device);
+      cls = g_type_class_peek (candidate->driver);
+      if (cls->usb_discover)
+        driver_score = cls->usb_discover (device);
 
-          /* Is this driver better than the one we had? */
-          if (driver_score <= found_score)
-            continue;
+      /* Is this driver better than the one we had? */
+      if (driver_score <= found_score)
+        continue;
 
-          found_score = driver_score;
-          found_driver = driver;
-          found_entry = entry;
-        }
+      found_score = driver_score;
+      found_driver = candidate->driver;
+      found_entry = candidate->entry;
     }
 
   if (found_driver == G_TYPE_NONE)
@@ -260,7 +328,7 @@ fp_context_finalize (GObject *object)
 
   g_cancellable_cancel (priv->cancellable);
   g_clear_object (&priv->cancellable);
-  g_clear_pointer (&priv->drivers, g_array_unref);
+  g_clear_pointer (&priv->drivers_whitelist, g_strfreev);
 
   if (priv->usb_ctx)
     g_object_run_dispose (G_OBJECT (priv->usb_ctx));
@@ -322,23 +390,9 @@ fp_context_init (FpContext *self)
 {
   g_autoptr(GError) error = NULL;
   FpContextPrivate *priv = fp_context_get_instance_private (self);
-  guint i;
-
-  priv->drivers = fpi_get_driver_types ();
 
   if (get_drivers_whitelist_env ())
-    {
-      for (i = 0; i < priv->drivers->len;)
-        {
-          GType driver = g_array_index (priv->drivers, GType, i);
-          g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
-
-          if (!is_driver_allowed (cls->id))
-            g_array_remove_index (priv->drivers, i);
-          else
-            ++i;
-        }
-    }
+    priv->drivers_whitelist = g_strsplit (get_drivers_whitelist_env (), ":", -1);
 
   priv->devices = g_ptr_array_new_with_free_func (g_object_unref);
 
@@ -389,7 +443,8 @@ void
 fp_context_enumerate (FpContext *context)
 {
   FpContextPrivate *priv = fp_context_get_instance_private (context);
-  gint i;
+  GArray *virtual_entries;
+  guint i;
 
   g_return_if_fail (FP_IS_CONTEXT (context));
 
@@ -403,35 +458,31 @@ fp_context_enumerate (FpContext *context)
     g_usb_context_enumerate (priv->usb_ctx);
 
   /* Handle Virtual devices based on environment variables */
-  for (i = 0; i < priv->drivers->len; i++)
+  virtual_entries = driver_index_get ()->virtual;
+  for (i = 0; i < virtual_entries->len; i++)
     {
-      GType driver = g_array_index (priv->drivers, GType, i);
-      g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
-      const FpIdEntry *entry;
+      DriverIdEntry *candidate = &g_array_index (virtual_entries, DriverIdEntry, i);
+      const FpIdEntry *entry = candidate->entry;
+      const gchar *val;
 
-      if (cls->type != FP_DEVICE_TYPE_VIRTUAL)
+      if (!is_driver_allowed (context, candidate->driver_id))
         continue;
 
-      for (entry = cls->id_table; entry->pid; entry++)
-        {
-          const gchar *val;
-
-          val = g_getenv (entry->virtual_envvar);
-          if (!val || val[0] == '\0')
-            continue;
-
-          g_debug ("Found virtual environment device: %s, %s", entry->virtual_envvar, val);
-          priv->pending_devices++;
-          g_async_initable_new_async (driver,
-                                      G_PRIORITY_LOW,
-                                      priv->cancellable,
-                                      async_device_init_done_cb,
-                                      context,
-                                      "fpi-environ", val,
-                                      "fpi-driver-data", entry->driver_data,
-                                      NULL);
-          g_debug ("created");
-        }
+      val = g_getenv (entry->virtual_envvar);
+      if (!val || val[0] == '\0')
+        continue;
+
+      g_debug ("Found virtual environment device: %s, %s", entry->virtual_envvar, val);
+      priv->pending_devices++;
+      g_async_initable_new_async (candidate->driver,
+                                  G_PRIORITY_LOW,
+                                  priv->cancellable,
+                                  async_device_init_done_cb,
+                                  context,
+                                  "fpi-environ", val,
+                                  "fpi-driver-data", entry->driver_data,
+                                  NULL);
+      g_debug ("created");
     }
 
   while (priv->pending_devices)
@@ -457,3 +508,367 @@ fp_context_get_devices (FpContext *context)
 
   return priv->devices;
 }
+
+typedef struct
+{
+  GPtrArray *devices;
+  guint      next;
+  guint      running;
+  guint      max_concurrent;
+} OpenDevicesData;
+
+static void
+open_devices_data_free (OpenDevicesData *data)
+{
+  g_ptr_array_unref (data->devices);
+  g_free (data);
+}
+
+static void open_devices_next (GTask *task);
+
+static void
+open_devices_device_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GError) error = NULL;
+  FpDevice *device = FP_DEVICE (source_object);
+  OpenDevicesData *data = g_task_get_task_data (task);
+
+  data->running--;
+
+  if (!fp_device_open_finish (device, res, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_message ("Could not open device %s: %s",
+               fp_device_get_device_id (device), error->message);
+
+  open_devices_next (task);
+}
+
+/* Opens devices until the limit is reached, returns once all are done */
+static void
+open_devices_next (GTask *task)
+{
+  OpenDevicesData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  g_autoptr(GPtrArray) opened = NULL;
+  guint i;
+
+  while (data->next < data->devices->len &&
+         (data->max_concurrent == 0 || data->running < data->max_concurrent) &&
+         !g_cancellable_is_cancelled (cancellable))
+    {
+      FpDevice *device = g_ptr_array_index (data->devices, data->next++);
+
+      if (fp_device_is_open (device))
+        continue;
+
+      data->running++;
+      fp_device_open (device, cancellable, open_devices_device_cb,
+                      g_object_ref (task));
+    }
+
+  if (data->running > 0)
+    return;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  opened = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < data->devices->len; i++)
+    {
+      FpDevice *device = g_ptr_array_index (data->devices, i);
+
+      if (fp_device_is_open (device))
+        g_ptr_array_add (opened, g_object_ref (device));
+    }
+
+  g_task_return_pointer (task, g_steal_pointer (&opened),
+                         (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * fp_context_open_devices:
+ * @context: a #FpContext
+ * @devices: (nullable) (element-type FpDevice): the devices to open, or
+ *   %NULL for all devices of @context
+ * @max_concurrent: the maximum number of devices to open at the same
+ *   time, or 0 for no limit
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to open several devices. The devices
+ * are opened independently of each other, at most @max_concurrent at a
+ * time, so a slow device only holds up one of the slots while the others
+ * continue. Devices that are already open are skipped.
+ *
+ * Devices that fail to open are left closed and are not part of the
+ * result, use fp_device_open() to retrieve the error for a single device.
+ * On cancellation no further devices are opened, devices that were
+ * opened already stay open.
+ */
+void
+fp_context_open_devices (FpContext          *context,
+                         GPtrArray          *devices,
+                         guint               max_concurrent,
+                         GCancellable       *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  OpenDevicesData *data;
+  guint i;
+
+  g_return_if_fail (FP_IS_CONTEXT (context));
+
+  if (!devices)
+    devices = fp_context_get_devices (context);
+
+  task = g_task_new (context, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_context_open_devices);
+
+  data = g_new0 (OpenDevicesData, 1);
+  data->devices = g_ptr_array_new_full (devices->len, g_object_unref);
+  data->max_concurrent = max_concurrent;
+  for (i = 0; i < devices->len; i++)
+    g_ptr_array_add (data->devices, g_object_ref (g_ptr_array_index (devices, i)));
+  g_task_set_task_data (task, data, (GDestroyNotify) open_devices_data_free);
+
+  open_devices_next (task);
+}
+
+/**
+ * fp_context_open_devices_finish:
+ * @context: a #FpContext
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to open several devices.
+ * See fp_context_open_devices().
+ *
+ * Returns: (element-type FpDevice) (transfer container): the devices
+ *   that are open, or %NULL on error
+ */
+GPtrArray *
+fp_context_open_devices_finish (FpContext    *context,
+                                GAsyncResult *result,
+                                GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, context), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+async_result_ready (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GTask **task = user_data;
+
+  *task = g_object_ref (G_TASK (res));
+}
+
+/**
+ * fp_context_open_devices_sync:
+ * @context: a #FpContext
+ * @devices: (nullable) (element-type FpDevice): the devices to open, or
+ *   %NULL for all devices of @context
+ * @max_concurrent: the maximum number of devices to open at the same
+ *   time, or 0 for no limit
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Open several devices synchronously. See fp_context_open_devices().
+ *
+ * Returns: (element-type FpDevice) (transfer container): the devices
+ *   that are open, or %NULL on error
+ */
+GPtrArray *
+fp_context_open_devices_sync (FpContext    *context,
+                              GPtrArray    *devices,
+                              guint         max_concurrent,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_CONTEXT (context), NULL);
+
+  fp_context_open_devices (context, devices, max_concurrent, cancellable,
+                           async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (NULL, TRUE);
+
+  return fp_context_open_devices_finish (context, task, error);
+}
+
+/**
+ * fp_context_get_worker_stats:
+ * @context: a #FpContext
+ * @queue_length: (out) (optional): Number of jobs waiting for a worker thread
+ * @n_jobs: (out) (optional): Number of jobs started so far
+ * @mean_wait_time: (out) (optional): Mean time jobs waited, in microseconds
+ * @max_wait_time: (out) (optional): Longest time a job waited, in microseconds
+ *
+ * Gets statistics about the worker threads that do image processing
+ * and matching. Long wait times mean that the threads cannot keep up,
+ * see fp_context_set_worker_threads().
+ */
+void
+fp_context_get_worker_stats (FpContext *context,
+                             guint     *queue_length,
+                             guint64   *n_jobs,
+                             gint64    *mean_wait_time,
+                             gint64    *max_wait_time)
+{
+  FpiWorkerPoolStats stats;
+
+  g_return_if_fail (FP_IS_CONTEXT (context));
+
+  fpi_worker_pool_get_stats (fpi_worker_pool_get_default (), &stats);
+
+  if (queue_length)
+    *queue_length = stats.queue_length;
+  if (n_jobs)
+    *n_jobs = stats.n_jobs;
+  if (mean_wait_time)
+    *mean_wait_time = stats.n_jobs ? stats.total_wait_time / (gint64) stats.n_jobs : 0;
+  if (max_wait_time)
+    *max_wait_time = stats.max_wait_time;
+}
+
+/**
+ * fp_context_set_worker_threads:
+ * @n_threads: Number of threads, or 0 for one per CPU
+ *
+ * Sets the number of threads used for image processing and matching.
+ * The default is one thread per CPU.
+ *
+ * The worker threads are shared by all contexts, so this applies to the
+ * whole process.
+ */
+void
+fp_context_set_worker_threads (guint n_threads)
+{
+  fpi_worker_pool_set_max_threads (fpi_worker_pool_get_default (), n_threads);
+}
+
+/**
+ * fp_context_get_worker_threads:
+ *
+ * Gets the number of threads used for image processing and matching,
+ * see fp_context_set_worker_threads().
+ *
+ * Returns: The number of worker threads
+ */
+guint
+fp_context_get_worker_threads (void)
+{
+  return fpi_worker_pool_get_max_threads (fpi_worker_pool_get_default ());
+}
+
+/**
+ * fp_context_set_worker_priority:
+ * @priority: Nice value of the worker threads, from -20 to 19
+ *
+ * Sets the nice value of the worker threads. Until it is set the threads
+ * inherit the priority of the process, use
+ * fp_context_reset_worker_priority() to return to that. Lowering the
+ * nice value below that of the process usually requires privileges.
+ *
+ * The worker threads are shared by all contexts, so this applies to the
+ * whole process.
+ */
+void
+fp_context_set_worker_priority (gint priority)
+{
+  g_return_if_fail (priority >= -20 && priority <= 19);
+
+  fpi_worker_pool_set_priority (fpi_worker_pool_get_default (), priority);
+}
+
+/**
+ * fp_context_reset_worker_priority:
+ *
+ * Undoes fp_context_set_worker_priority(), the worker threads use the
+ * nice value the process had when libfprint started them again.
+ */
+void
+fp_context_reset_worker_priority (void)
+{
+  fpi_worker_pool_reset_priority (fpi_worker_pool_get_default ());
+}
+
+/**
+ * fp_context_get_worker_priority:
+ *
+ * Gets the nice value of the worker threads, see
+ * fp_context_set_worker_priority().
+ *
+ * Returns: The nice value of the worker threads
+ */
+gint
+fp_context_get_worker_priority (void)
+{
+  return fpi_worker_pool_get_priority (fpi_worker_pool_get_default ());
+}
+
+/**
+ * fp_context_set_worker_cpu_mask:
+ * @cpu_mask: Bit mask of the first 64 CPUs, or 0 for all CPUs
+ *
+ * Restricts the worker threads to the CPUs in @cpu_mask, where bit 0 is
+ * the first CPU. By default all CPUs may be used.
+ *
+ * The worker threads are shared by all contexts, so this applies to the
+ * whole process.
+ */
+void
+fp_context_set_worker_cpu_mask (guint64 cpu_mask)
+{
+  fpi_worker_pool_set_cpu_mask (fpi_worker_pool_get_default (), cpu_mask);
+}
+
+/**
+ * fp_context_get_worker_cpu_mask:
+ *
+ * Gets the CPUs the worker threads may run on, see
+ * fp_context_set_worker_cpu_mask().
+ *
+ * Returns: The CPU mask, 0 means all CPUs
+ */
+guint64
+fp_context_get_worker_cpu_mask (void)
+{
+  return fpi_worker_pool_get_cpu_mask (fpi_worker_pool_get_default ());
+}
+
+/**
+ * fp_context_set_worker_queue_limit:
+ * @queue_limit: Maximum number of waiting jobs, or 0 for no limit
+ *
+ * Sets the maximum number of jobs waiting for a worker thread. When the
+ * queue is full, new scans fail with a retry error instead of piling up
+ * behind the ones that are waiting. There is no limit by default.
+ *
+ * The worker threads are shared by all contexts, so this applies to the
+ * whole process.
+ */
+void
+fp_context_set_worker_queue_limit (guint queue_limit)
+{
+  fpi_worker_pool_set_queue_limit (fpi_worker_pool_get_default (), queue_limit);
+}
+
+/**
+ * fp_context_get_worker_queue_limit:
+ *
+ * Gets the maximum number of jobs waiting for a worker thread, see
+ * fp_context_set_worker_queue_limit().
+ *
+ * Returns: The queue limit, 0 means no limit
+ */
+guint
+fp_context_get_worker_queue_limit (void)
+{
+  return fpi_worker_pool_get_queue_limit (fpi_worker_pool_get_default ());
+}
@@ -49,4 +49,35 @@ void fp_context_enumerate (FpContext *context);
 
 GPtrArray *fp_context_get_devices (FpContext *context);
 
+void       fp_context_open_devices (FpContext          *context,
+                                    GPtrArray          *devices,
+                                    guint               max_concurrent,
+                                    GCancellable       *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data);
+GPtrArray *fp_context_open_devices_finish (FpContext    *context,
+                                           GAsyncResult *result,
+                                           GError      **error);
+GPtrArray *fp_context_open_devices_sync (FpContext    *context,
+                                         GPtrArray    *devices,
+                                         guint         max_concurrent,
+                                         GCancellable *cancellable,
+                                         GError      **error);
+
+void fp_context_get_worker_stats (FpContext *context,
+                                  guint     *queue_length,
+                                  guint64   *n_jobs,
+                                  gint64    *mean_wait_time,
+                                  gint64    *max_wait_time);
+
+void    fp_context_set_worker_threads (guint n_threads);
+guint   fp_context_get_worker_threads (void);
+void    fp_context_set_worker_priority (gint priority);
+void    fp_context_reset_worker_priority (void);
+gint    fp_context_get_worker_priority (void);
+void    fp_context_set_worker_cpu_mask (guint64 cpu_mask);
+guint64 fp_context_get_worker_cpu_mask (void);
+void    fp_context_set_worker_queue_limit (guint queue_limit);
+guint   fp_context_get_worker_queue_limit (void);
+
 G_END_DECLS
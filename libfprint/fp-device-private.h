@@ -52,8 +52,19 @@ typedef struct
   /* State for tasks */
   gboolean            wait_for_finger;
   FpFingerStatusFlags finger_status;
+
+  /* Timing of the last or current action, see fp_device_get_trace() */
+  GArray             *trace;
 } FpDevicePrivate;
 
+#define FP_DEVICE_TRACE_MAX_POINTS 64
+
+typedef struct
+{
+  FpDeviceTracePoint point;
+  gint64             time;
+} FpDeviceTraceEntry;
+
 
 typedef struct
 {
@@ -70,6 +81,9 @@ typedef struct
 {
   FpPrint       *enrolled_print;   /* verify */
   GPtrArray     *gallery;   /* identify */
+  GListModel    *gallery_model; /* identify */
+  gboolean       continuous; /* identify */
+  gboolean       scan_reported; /* continuous identify, since the last restart */
 
   gboolean       result_reported;
   FpPrint       *match;
@@ -166,6 +166,7 @@ fp_device_finalize (GObject *object)
 
   g_clear_pointer (&priv->device_id, g_free);
   g_clear_pointer (&priv->device_name, g_free);
+  g_clear_pointer (&priv->trace, g_array_unref);
 
   g_clear_object (&priv->usb_device);
   g_clear_pointer (&priv->virtual_env, g_free);
@@ -284,6 +285,7 @@ fp_device_async_initable_init_async (GAsyncInitable     *initable,
 
   priv->current_action = FPI_DEVICE_ACTION_PROBE;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (self, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (self, cancellable);
 
   FP_DEVICE_GET_CLASS (self)->probe (self);
@@ -448,6 +450,9 @@ fp_device_class_init (FpDeviceClass *klass)
 static void
 fp_device_init (FpDevice *self)
 {
+  FpDevicePrivate *priv = fp_device_get_instance_private (self);
+
+  priv->trace = g_array_new (FALSE, FALSE, sizeof (FpDeviceTraceEntry));
 }
 
 /**
@@ -623,6 +628,43 @@ fp_device_has_storage (FpDevice *device)
   return cls->list != NULL;
 }
 
+/**
+ * fp_device_get_trace:
+ * @device: A #FpDevice
+ *
+ * Retrieves the timing trace of the last action on the device, or of the
+ * currently running one. The trace lists the #FpDeviceTracePoint values
+ * that the action passed through together with the monotonic time in
+ * microseconds (see g_get_monotonic_time()) at which each was reached.
+ *
+ * This allows applications to break down the latency of an operation,
+ * e.g. the time between %FP_DEVICE_TRACE_FINGER_PRESENT and
+ * %FP_DEVICE_TRACE_REPORT is the delay that the user perceives. Points
+ * may be passed more than once, e.g. for every enroll stage. Only the
+ * most recent points are kept for long running actions.
+ *
+ * Returns: (transfer full): A #GVariant of type `a(ix)`
+ */
+GVariant *
+fp_device_get_trace (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  GVariantBuilder builder;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ix)"));
+  for (i = 0; i < priv->trace->len; i++)
+    {
+      FpDeviceTraceEntry *entry = &g_array_index (priv->trace, FpDeviceTraceEntry, i);
+
+      g_variant_builder_add (&builder, "(ix)", entry->point, entry->time);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 /**
  * fp_device_open:
  * @device: a #FpDevice
@@ -683,6 +725,7 @@ fp_device_open (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_OPEN;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
 
@@ -748,6 +791,7 @@ fp_device_close (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_CLOSE;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   FP_DEVICE_GET_CLASS (device)->close (device);
@@ -846,6 +890,7 @@ fp_device_enroll (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_ENROLL;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   data = g_new0 (FpEnrollData, 1);
@@ -930,6 +975,7 @@ fp_device_verify (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_VERIFY;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   data = g_new0 (FpMatchData, 1);
@@ -990,30 +1036,17 @@ fp_device_verify_finish (FpDevice     *device,
   return res != FPI_MATCH_ERROR;
 }
 
-/**
- * fp_device_identify:
- * @device: a #FpDevice
- * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
- * @cancellable: (nullable): a #GCancellable, or %NULL
- * @match_cb: (nullable) (scope notified): match reporting callback
- * @match_data: (closure match_cb): user data for @match_cb
- * @match_destroy: (destroy match_data): Destroy notify for @match_data
- * @callback: the function to call on completion
- * @user_data: the data to pass to @callback
- *
- * Start an asynchronous operation to identify prints. The callback will
- * be called once the operation has finished. Retrieve the result with
- * fp_device_identify_finish().
- */
-void
-fp_device_identify (FpDevice           *device,
-                    GPtrArray          *prints,
-                    GCancellable       *cancellable,
-                    FpMatchCb           match_cb,
-                    gpointer            match_data,
-                    GDestroyNotify      match_destroy,
-                    GAsyncReadyCallback callback,
-                    gpointer            user_data)
+static void
+identify_start (FpDevice           *device,
+                GPtrArray          *prints,
+                GListModel         *gallery,
+                gboolean            continuous,
+                GCancellable       *cancellable,
+                FpMatchCb           match_cb,
+                gpointer            match_data,
+                GDestroyNotify      match_destroy,
+                GAsyncReadyCallback callback,
+                gpointer            user_data)
 {
   g_autoptr(GTask) task = NULL;
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
@@ -1040,6 +1073,7 @@ fp_device_identify (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_IDENTIFY;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   data = g_new0 (FpMatchData, 1);
@@ -1047,9 +1081,17 @@ fp_device_identify (FpDevice           *device,
    * a reference to each print. Also, the caller could in principle modify the
    * GPtrArray afterwards.
    */
-  data->gallery = g_ptr_array_new_full (prints->len, g_object_unref);
-  for (i = 0; i < prints->len; i++)
-    g_ptr_array_add (data->gallery, g_object_ref (g_ptr_array_index (prints, i)));
+  if (prints)
+    {
+      data->gallery = g_ptr_array_new_full (prints->len, g_object_unref);
+      for (i = 0; i < prints->len; i++)
+        g_ptr_array_add (data->gallery, g_object_ref (g_ptr_array_index (prints, i)));
+    }
+  else
+    {
+      data->gallery_model = g_object_ref (gallery);
+    }
+  data->continuous = continuous;
   data->match_cb = match_cb;
   data->match_data = match_data;
   data->match_destroy = match_destroy;
@@ -1060,6 +1102,114 @@ fp_device_identify (FpDevice           *device,
   FP_DEVICE_GET_CLASS (device)->identify (device);
 }
 
+/**
+ * fp_device_identify:
+ * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (nullable) (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to identify prints. The callback will
+ * be called once the operation has finished. Retrieve the result with
+ * fp_device_identify_finish().
+ */
+void
+fp_device_identify (FpDevice           *device,
+                    GPtrArray          *prints,
+                    GCancellable       *cancellable,
+                    FpMatchCb           match_cb,
+                    gpointer            match_data,
+                    GDestroyNotify      match_destroy,
+                    GAsyncReadyCallback callback,
+                    gpointer            user_data)
+{
+  identify_start (device, prints, NULL, FALSE, cancellable,
+                  match_cb, match_data, match_destroy,
+                  callback, user_data);
+}
+
+/**
+ * fp_device_identify_model:
+ * @device: a #FpDevice
+ * @gallery: a #GListModel of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (nullable) (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fp_device_identify() but the prints are taken from @gallery, e.g.
+ * a #FpGallery. Devices that match on the host fetch and match the prints
+ * in chunks, so only a few of them need to be loaded at a time and
+ * matching starts before the whole gallery is loaded. Other devices load
+ * all prints when the operation starts.
+ *
+ * The prints are fetched from the main context, @gallery must not change
+ * until the operation has finished. The reported match is the #FpPrint
+ * that was returned by @gallery.
+ *
+ * Retrieve the result with fp_device_identify_finish().
+ */
+void
+fp_device_identify_model (FpDevice           *device,
+                          GListModel         *gallery,
+                          GCancellable       *cancellable,
+                          FpMatchCb           match_cb,
+                          gpointer            match_data,
+                          GDestroyNotify      match_destroy,
+                          GAsyncReadyCallback callback,
+                          gpointer            user_data)
+{
+  g_return_if_fail (G_IS_LIST_MODEL (gallery));
+  g_return_if_fail (g_type_is_a (g_list_model_get_item_type (gallery), FP_TYPE_PRINT));
+
+  identify_start (device, NULL, gallery, FALSE, cancellable,
+                  match_cb, match_data, match_destroy,
+                  callback, user_data);
+}
+
+/**
+ * fp_device_identify_continuous:
+ * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an identify session that scans one finger after the other until
+ * @cancellable is cancelled. The result of every scan, including retry
+ * errors, is reported through @match_cb. The device stays ready between
+ * scans where the driver supports it, so the next finger can be placed
+ * right after the previous result.
+ *
+ * The callback will be called once the session has ended. Retrieve the
+ * result with fp_device_identify_continuous_finish().
+ */
+void
+fp_device_identify_continuous (FpDevice           *device,
+                               GPtrArray          *prints,
+                               GCancellable       *cancellable,
+                               FpMatchCb           match_cb,
+                               gpointer            match_data,
+                               GDestroyNotify      match_destroy,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  g_return_if_fail (match_cb != NULL);
+
+  identify_start (device, prints, NULL, TRUE, cancellable,
+                  match_cb, match_data, match_destroy,
+                  callback, user_data);
+}
+
 /**
  * fp_device_identify_finish:
  * @device: A #FpDevice
@@ -1106,6 +1256,28 @@ fp_device_identify_finish (FpDevice     *device,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * fp_device_identify_continuous_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish a continuous identify session. A session that was ended by
+ * cancelling it fails with %G_IO_ERROR_CANCELLED, any other error means
+ * that it was aborted due to a device failure.
+ *
+ * See fp_device_identify_continuous().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_identify_continuous_finish (FpDevice     *device,
+                                      GAsyncResult *result,
+                                      GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 /**
  * fp_device_capture:
  * @device: a #FpDevice
@@ -1148,6 +1320,7 @@ fp_device_capture (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_CAPTURE;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   priv->wait_for_finger = wait_for_finger;
@@ -1229,6 +1402,7 @@ fp_device_delete_print (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_DELETE;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   g_task_set_task_data (priv->current_task,
@@ -1307,6 +1481,7 @@ fp_device_list_prints (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_LIST;
   priv->current_task = g_steal_pointer (&task);
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_START);
   maybe_cancel_on_cancelled (device, cancellable);
 
   FP_DEVICE_GET_CLASS (device)->list (device);
@@ -113,6 +113,36 @@ typedef enum {
   FP_DEVICE_ERROR_UNTRUSTED,
 } FpDeviceError;
 
+/**
+ * FpDeviceTracePoint:
+ * @FP_DEVICE_TRACE_ACTION_START: The action was started
+ * @FP_DEVICE_TRACE_FINGER_NEEDED: The device started waiting for a finger
+ * @FP_DEVICE_TRACE_FINGER_PRESENT: A finger was detected on the sensor
+ * @FP_DEVICE_TRACE_CAPTURE_COMPLETE: An image was captured
+ * @FP_DEVICE_TRACE_MINUTIAE_START: Minutiae detection on an image started
+ * @FP_DEVICE_TRACE_MINUTIAE_END: Minutiae detection on an image finished
+ * @FP_DEVICE_TRACE_MATCH_START: Matching of a scan against the templates started
+ * @FP_DEVICE_TRACE_MATCH_END: Matching of a scan finished
+ * @FP_DEVICE_TRACE_REPORT: An enroll progress or match result was reported
+ * @FP_DEVICE_TRACE_ACTION_COMPLETE: The driver completed the action
+ *
+ * Points of an action that are recorded in the trace returned by
+ * fp_device_get_trace(). Not every device passes through every point,
+ * e.g. matching is only traced for devices that match on the host.
+ */
+typedef enum {
+  FP_DEVICE_TRACE_ACTION_START,
+  FP_DEVICE_TRACE_FINGER_NEEDED,
+  FP_DEVICE_TRACE_FINGER_PRESENT,
+  FP_DEVICE_TRACE_CAPTURE_COMPLETE,
+  FP_DEVICE_TRACE_MINUTIAE_START,
+  FP_DEVICE_TRACE_MINUTIAE_END,
+  FP_DEVICE_TRACE_MATCH_START,
+  FP_DEVICE_TRACE_MATCH_END,
+  FP_DEVICE_TRACE_REPORT,
+  FP_DEVICE_TRACE_ACTION_COMPLETE,
+} FpDeviceTracePoint;
+
 GQuark fp_device_retry_quark (void);
 GQuark fp_device_error_quark (void);
 
@@ -182,6 +212,8 @@ gboolean     fp_device_supports_identify (FpDevice *device);
 gboolean     fp_device_supports_capture (FpDevice *device);
 gboolean     fp_device_has_storage (FpDevice *device);
 
+GVariant    *fp_device_get_trace (FpDevice *device);
+
 /* Opening the device */
 void fp_device_open (FpDevice           *device,
                      GCancellable       *cancellable,
@@ -220,6 +252,24 @@ void fp_device_identify (FpDevice           *device,
                          GAsyncReadyCallback callback,
                          gpointer            user_data);
 
+void fp_device_identify_model (FpDevice           *device,
+                               GListModel         *gallery,
+                               GCancellable       *cancellable,
+                               FpMatchCb           match_cb,
+                               gpointer            match_data,
+                               GDestroyNotify      match_destroy,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data);
+
+void fp_device_identify_continuous (FpDevice           *device,
+                                    GPtrArray          *prints,
+                                    GCancellable       *cancellable,
+                                    FpMatchCb           match_cb,
+                                    gpointer            match_data,
+                                    GDestroyNotify      match_destroy,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data);
+
 void fp_device_capture (FpDevice           *device,
                         gboolean            wait_for_finger,
                         GCancellable       *cancellable,
@@ -256,6 +306,9 @@ gboolean fp_device_identify_finish (FpDevice     *device,
                                     FpPrint     **match,
                                     FpPrint     **print,
                                     GError      **error);
+gboolean fp_device_identify_continuous_finish (FpDevice     *device,
+                                               GAsyncResult *result,
+                                               GError      **error);
 FpImage * fp_device_capture_finish (FpDevice     *device,
                                     GAsyncResult *result,
                                     GError      **error);
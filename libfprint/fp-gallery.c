@@ -0,0 +1,536 @@
+/*
+ * FpGallery - Memory mappable collection of prints
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "gallery"
+
+#include "fp-gallery.h"
+#include "fp-print-private.h"
+#include "fpi-byte-reader.h"
+#include "fpi-byte-writer.h"
+#include "fpi-log.h"
+
+/**
+ * SECTION: fp-gallery
+ * @title: FpGallery
+ * @short_description: Memory mappable collection of prints
+ *
+ * An #FpGallery gives read-only access to a large number of prints that
+ * were stored in a single file using fp_gallery_write_file(). The file is
+ * mapped into memory and no #FpPrint is created until it is requested.
+ * The whole file is checked when it is opened, so every print of the
+ * gallery can be loaded later on.
+ *
+ * #FpGallery implements #GListModel with an item type of #FpPrint. Each
+ * call to g_list_model_get_item() creates a new #FpPrint from the mapped
+ * data, the object is not cached by the gallery. The prints are created
+ * using fp_print_deserialize_bytes(), so they reference the mapping and
+ * are only decoded when they are used.
+ *
+ * The file consists of a header, a fixed width index with one entry for
+ * each print and the print data. All integers are stored in little endian
+ * byte order.
+ *
+ * The header is 32 bytes long:
+ * - the magic "FPGALLRY" (8 bytes)
+ * - the format version (32 bit)
+ * - the number of prints (32 bit)
+ * - the offset of the index from the start of the file (64 bit)
+ * - reserved, set to zero (64 bit)
+ *
+ * Each index entry is 32 bytes long:
+ * - hash of the driver (32 bit)
+ * - hash of the device ID (32 bit)
+ * - hash of the username, zero if unset (32 bit)
+ * - the #FpFinger (8 bit)
+ * - the internal print type (8 bit)
+ * - reserved, set to zero (16 bit)
+ * - offset of the print data from the start of the file (64 bit)
+ * - length of the print data (32 bit)
+ * - checksum of the print data (32 bit)
+ *
+ * The print data of each entry is the result of fp_print_serialize_full()
+ * using %FP_PRINT_SERIALIZE_COMPACT. It is placed so that the data
+ * following its 3 byte header starts at an 8 byte aligned offset, which
+ * allows using it without copying. The hashes are the 32 bit FNV-1a hash
+ * of the UTF-8 string, they are only used to quickly skip entries in
+ * fp_gallery_find_prints(). The checksum is the 32 bit FNV-1a hash of the
+ * print data.
+ */
+
+#define FP_GALLERY_MAGIC "FPGALLRY"
+#define FP_GALLERY_VERSION 2
+#define FP_GALLERY_HEADER_SIZE 32
+#define FP_GALLERY_ENTRY_SIZE 32
+#define FP_GALLERY_ALIGNMENT 8
+
+#define GALLERY_ALIGN(offset) \
+  (((offset) + FP_GALLERY_ALIGNMENT - 1) & ~((guint64) FP_GALLERY_ALIGNMENT - 1))
+/* Skip the "FP3" header when aligning print data */
+#define GALLERY_RECORD_OFFSET(offset) (GALLERY_ALIGN ((offset) + 3) - 3)
+
+typedef struct
+{
+  guint32 driver_hash;
+  guint32 device_id_hash;
+  guint32 username_hash;
+  guint8  finger;
+  guint8  type;
+  guint64 offset;
+  guint32 length;
+  guint32 checksum;
+} FpGalleryEntry;
+
+struct _FpGallery
+{
+  GObject       parent_instance;
+
+  GMappedFile  *file;
+  GBytes       *bytes;
+
+  const guint8 *index;
+  guint         n_entries;
+};
+
+static void fp_gallery_list_model_init (GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (FpGallery, fp_gallery, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL,
+                                                fp_gallery_list_model_init))
+
+static guint32
+gallery_hash_string (const gchar *str)
+{
+  if (!str)
+    return 0;
+
+  return fpi_fnv1a_bytes (FPI_FNV1A_INIT, (const guint8 *) str, strlen (str));
+}
+
+static void
+gallery_read_entry (const guint8   *index,
+                    guint           position,
+                    FpGalleryEntry *entry)
+{
+  FpiByteReader reader;
+
+  /* The index size was checked when the file was opened */
+  fpi_byte_reader_init (&reader,
+                        index + (gsize) position * FP_GALLERY_ENTRY_SIZE,
+                        FP_GALLERY_ENTRY_SIZE);
+
+  entry->driver_hash = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  entry->device_id_hash = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  entry->username_hash = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  entry->finger = fpi_byte_reader_get_uint8_unchecked (&reader);
+  entry->type = fpi_byte_reader_get_uint8_unchecked (&reader);
+  fpi_byte_reader_skip_unchecked (&reader, 2);
+  entry->offset = fpi_byte_reader_get_uint64_le_unchecked (&reader);
+  entry->length = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  entry->checksum = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+}
+
+/* Every entry is checked when the gallery is opened, so that each of them
+ * can be loaded later on. */
+static gboolean
+gallery_check_entry (const guint8         *data,
+                     gsize                 size,
+                     const FpGalleryEntry *entry)
+{
+  if (entry->offset > size ||
+      entry->length > size - entry->offset ||
+      entry->length <= 3)
+    return FALSE;
+
+  if (memcmp (data + entry->offset, "FP3", 3) != 0)
+    return FALSE;
+
+  return fpi_fnv1a_bytes (FPI_FNV1A_INIT, data + entry->offset,
+                          entry->length) == entry->checksum;
+}
+
+static void
+fp_gallery_finalize (GObject *object)
+{
+  FpGallery *self = FP_GALLERY (object);
+
+  g_clear_pointer (&self->bytes, g_bytes_unref);
+  g_clear_pointer (&self->file, g_mapped_file_unref);
+
+  G_OBJECT_CLASS (fp_gallery_parent_class)->finalize (object);
+}
+
+static void
+fp_gallery_class_init (FpGalleryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = fp_gallery_finalize;
+}
+
+static void
+fp_gallery_init (FpGallery *self)
+{
+}
+
+static GType
+fp_gallery_get_item_type (GListModel *list)
+{
+  return FP_TYPE_PRINT;
+}
+
+static guint
+fp_gallery_get_n_items (GListModel *list)
+{
+  FpGallery *self = FP_GALLERY (list);
+
+  return self->n_entries;
+}
+
+static gpointer
+fp_gallery_get_item (GListModel *list,
+                     guint       position)
+{
+  FpGallery *self = FP_GALLERY (list);
+  g_autoptr(GError) error = NULL;
+  FpPrint *print;
+
+  if (position >= self->n_entries)
+    return NULL;
+
+  /* Cannot fail, the entries were validated when opening the gallery */
+  print = fp_gallery_get_print (self, position, &error);
+  if (!print)
+    g_critical ("Could not load print %u from gallery: %s", position, error->message);
+
+  return print;
+}
+
+static void
+fp_gallery_list_model_init (GListModelInterface *iface)
+{
+  iface->get_item_type = fp_gallery_get_item_type;
+  iface->get_n_items = fp_gallery_get_n_items;
+  iface->get_item = fp_gallery_get_item;
+}
+
+/**
+ * fp_gallery_new_from_file:
+ * @filename: (type filename): The gallery file to open
+ * @error: Return location for error
+ *
+ * Maps a gallery that was written using fp_gallery_write_file(). The
+ * header and every index entry are validated, including the checksum of
+ * the print data, which means the whole file is read once. The prints are
+ * only loaded on demand.
+ *
+ * If the file is not a valid gallery, then %FP_DEVICE_ERROR_DATA_INVALID
+ * is returned.
+ *
+ * Returns: (transfer full): A new #FpGallery, or %NULL on error
+ */
+FpGallery *
+fp_gallery_new_from_file (const gchar *filename,
+                          GError     **error)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  FpiByteReader reader;
+  FpGallery *self;
+  const guint8 *data;
+  gsize size;
+  guint32 version;
+  guint32 n_entries;
+  guint64 index_offset;
+  guint i;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  file = g_mapped_file_new (filename, FALSE, error);
+  if (!file)
+    return NULL;
+
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  size = g_mapped_file_get_length (file);
+
+  if (size < FP_GALLERY_HEADER_SIZE ||
+      memcmp (data, FP_GALLERY_MAGIC, strlen (FP_GALLERY_MAGIC)) != 0)
+    {
+      g_set_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
+                   "%s is not a gallery file", filename);
+      return NULL;
+    }
+
+  fpi_byte_reader_init (&reader, data, FP_GALLERY_HEADER_SIZE);
+  fpi_byte_reader_skip_unchecked (&reader, strlen (FP_GALLERY_MAGIC));
+  version = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  n_entries = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  index_offset = fpi_byte_reader_get_uint64_le_unchecked (&reader);
+
+  if (version != FP_GALLERY_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported gallery version %u", version);
+      return NULL;
+    }
+
+  if (index_offset > size ||
+      (size - index_offset) / FP_GALLERY_ENTRY_SIZE < n_entries)
+    {
+      g_set_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
+                   "Gallery index of %s is truncated", filename);
+      return NULL;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      FpGalleryEntry entry;
+
+      gallery_read_entry (data + index_offset, i, &entry);
+      if (!gallery_check_entry (data, size, &entry))
+        {
+          g_set_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
+                       "Gallery entry %u of %s is corrupt", i, filename);
+          return NULL;
+        }
+    }
+
+  self = g_object_new (FP_TYPE_GALLERY, NULL);
+  self->bytes = g_mapped_file_get_bytes (file);
+  self->file = g_steal_pointer (&file);
+  self->index = data + index_offset;
+  self->n_entries = n_entries;
+
+  fp_dbg ("Mapped gallery %s with %u prints", filename, n_entries);
+
+  return self;
+}
+
+/**
+ * fp_gallery_write_file:
+ * @filename: (type filename): The file to write
+ * @prints: (element-type FpPrint): The prints to store
+ * @error: Return location for error
+ *
+ * Writes @prints into a new gallery file which can be opened using
+ * fp_gallery_new_from_file(). An existing file is replaced atomically.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_gallery_write_file (const gchar *filename,
+                       GPtrArray   *prints,
+                       GError     **error)
+{
+  g_autoptr(GPtrArray) records = NULL;
+  g_autofree guint8 *contents = NULL;
+  FpiByteWriter writer;
+  guint64 offset;
+  gsize size;
+  guint i;
+
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (prints != NULL, FALSE);
+
+  records = g_ptr_array_new_full (prints->len, (GDestroyNotify) g_bytes_unref);
+  offset = FP_GALLERY_HEADER_SIZE + (guint64) prints->len * FP_GALLERY_ENTRY_SIZE;
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+      guchar *data;
+      gsize length;
+
+      g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+      if (!fp_print_serialize_full (print, FP_PRINT_SERIALIZE_COMPACT,
+                                    &data, &length, error))
+        return FALSE;
+
+      g_ptr_array_add (records, g_bytes_new_take (data, length));
+      offset = GALLERY_RECORD_OFFSET (offset) + length;
+    }
+
+  /* The writer is limited to 32 bit sizes */
+  if (offset > G_MAXUINT)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Gallery of %u prints is too large", prints->len);
+      return FALSE;
+    }
+
+  fpi_byte_writer_init_with_size (&writer, offset, FALSE);
+  fpi_byte_writer_put_data (&writer, (const guint8 *) FP_GALLERY_MAGIC,
+                            strlen (FP_GALLERY_MAGIC));
+  fpi_byte_writer_put_uint32_le (&writer, FP_GALLERY_VERSION);
+  fpi_byte_writer_put_uint32_le (&writer, prints->len);
+  fpi_byte_writer_put_uint64_le (&writer, FP_GALLERY_HEADER_SIZE);
+  fpi_byte_writer_put_uint64_le (&writer, 0);
+
+  offset = FP_GALLERY_HEADER_SIZE + (guint64) prints->len * FP_GALLERY_ENTRY_SIZE;
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+      GBytes *record = g_ptr_array_index (records, i);
+      gsize length = g_bytes_get_size (record);
+
+      offset = GALLERY_RECORD_OFFSET (offset);
+
+      fpi_byte_writer_put_uint32_le (&writer, gallery_hash_string (fp_print_get_driver (print)));
+      fpi_byte_writer_put_uint32_le (&writer, gallery_hash_string (fp_print_get_device_id (print)));
+      fpi_byte_writer_put_uint32_le (&writer, gallery_hash_string (fp_print_get_username (print)));
+      fpi_byte_writer_put_uint8 (&writer, fp_print_get_finger (print));
+      fpi_byte_writer_put_uint8 (&writer, print->type);
+      fpi_byte_writer_put_uint16_le (&writer, 0);
+      fpi_byte_writer_put_uint64_le (&writer, offset);
+      fpi_byte_writer_put_uint32_le (&writer, length);
+      fpi_byte_writer_put_uint32_le (&writer,
+                                     fpi_fnv1a_bytes (FPI_FNV1A_INIT,
+                                                      g_bytes_get_data (record, NULL),
+                                                      length));
+
+      offset += length;
+    }
+
+  for (i = 0; i < records->len; i++)
+    {
+      GBytes *record = g_ptr_array_index (records, i);
+      guint pos = fpi_byte_writer_get_pos (&writer);
+
+      fpi_byte_writer_fill (&writer, 0, GALLERY_RECORD_OFFSET (pos) - pos);
+      fpi_byte_writer_put_data (&writer,
+                                g_bytes_get_data (record, NULL),
+                                g_bytes_get_size (record));
+    }
+
+  size = fpi_byte_writer_get_pos (&writer);
+  contents = fpi_byte_writer_reset_and_get_data (&writer);
+
+  return g_file_set_contents (filename, (const gchar *) contents, size, error);
+}
+
+/**
+ * fp_gallery_get_n_prints:
+ * @gallery: A #FpGallery
+ *
+ * Returns the number of prints stored in the gallery.
+ *
+ * Returns: The number of prints
+ */
+guint
+fp_gallery_get_n_prints (FpGallery *gallery)
+{
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), 0);
+
+  return gallery->n_entries;
+}
+
+/**
+ * fp_gallery_get_print:
+ * @gallery: A #FpGallery
+ * @position: The index of the print
+ * @error: Return location for error
+ *
+ * Loads the print at @position from the gallery. A new #FpPrint is
+ * created for every call.
+ *
+ * Returns: (transfer full): The #FpPrint, or %NULL on error
+ */
+FpPrint *
+fp_gallery_get_print (FpGallery *gallery,
+                      guint      position,
+                      GError   **error)
+{
+  g_autoptr(GBytes) record = NULL;
+  FpGalleryEntry entry;
+
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), NULL);
+  g_return_val_if_fail (position < gallery->n_entries, NULL);
+
+  gallery_read_entry (gallery->index, position, &entry);
+
+  record = g_bytes_new_from_bytes (gallery->bytes, entry.offset, entry.length);
+
+  return fp_print_deserialize_bytes (record, error);
+}
+
+/**
+ * fp_gallery_find_prints:
+ * @gallery: A #FpGallery
+ * @driver: (nullable): The driver to match, or %NULL
+ * @device_id: (nullable): The device ID to match, or %NULL
+ * @finger: The finger to match, or %FP_FINGER_UNKNOWN
+ * @username: (nullable): The username to match, or %NULL
+ *
+ * Finds all prints in the gallery that match the given metadata. Passing
+ * %NULL or %FP_FINGER_UNKNOWN for a parameter matches any value.
+ *
+ * The search only uses the index of the gallery, prints are loaded only
+ * for entries that match it.
+ *
+ * Returns: (transfer container) (element-type FpPrint): The matching prints
+ */
+GPtrArray *
+fp_gallery_find_prints (FpGallery   *gallery,
+                        const gchar *driver,
+                        const gchar *device_id,
+                        FpFinger     finger,
+                        const gchar *username)
+{
+  g_autoptr(GPtrArray) result = NULL;
+  guint32 driver_hash = gallery_hash_string (driver);
+  guint32 device_id_hash = gallery_hash_string (device_id);
+  guint32 username_hash = gallery_hash_string (username);
+  guint i;
+
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), NULL);
+
+  result = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (i = 0; i < gallery->n_entries; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(FpPrint) print = NULL;
+      g_autoptr(GBytes) record = NULL;
+      FpGalleryEntry entry;
+
+      gallery_read_entry (gallery->index, i, &entry);
+
+      if ((driver && entry.driver_hash != driver_hash) ||
+          (device_id && entry.device_id_hash != device_id_hash) ||
+          (username && entry.username_hash != username_hash) ||
+          (finger != FP_FINGER_UNKNOWN && entry.finger != finger))
+        continue;
+
+      record = g_bytes_new_from_bytes (gallery->bytes, entry.offset, entry.length);
+      print = fp_print_deserialize_bytes (record, &error);
+      if (!print)
+        {
+          fp_warn ("Could not load print %u from gallery: %s", i, error->message);
+          continue;
+        }
+
+      /* Rule out hash collisions */
+      if ((driver && g_strcmp0 (fp_print_get_driver (print), driver) != 0) ||
+          (device_id && g_strcmp0 (fp_print_get_device_id (print), device_id) != 0) ||
+          (username && g_strcmp0 (fp_print_get_username (print), username) != 0))
+        continue;
+
+      g_ptr_array_add (result, g_steal_pointer (&print));
+    }
+
+  return g_steal_pointer (&result);
+}
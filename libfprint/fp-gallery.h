@@ -0,0 +1,47 @@
+/*
+ * FpGallery - Memory mappable collection of prints
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include "fp-print.h"
+
+G_BEGIN_DECLS
+
+#define FP_TYPE_GALLERY (fp_gallery_get_type ())
+G_DECLARE_FINAL_TYPE (FpGallery, fp_gallery, FP, GALLERY, GObject)
+
+FpGallery *fp_gallery_new_from_file (const gchar *filename,
+                                     GError     **error);
+
+gboolean   fp_gallery_write_file (const gchar *filename,
+                                  GPtrArray   *prints,
+                                  GError     **error);
+
+guint      fp_gallery_get_n_prints (FpGallery *gallery);
+FpPrint   *fp_gallery_get_print (FpGallery *gallery,
+                                 guint      position,
+                                 GError   **error);
+
+GPtrArray *fp_gallery_find_prints (FpGallery   *gallery,
+                                   const gchar *driver,
+                                   const gchar *device_id,
+                                   FpFinger     finger,
+                                   const gchar *username);
+
+G_END_DECLS
@@ -22,6 +22,8 @@
 #include "fpi-image-device.h"
 
 #define IMG_ENROLL_STAGES 5
+/* Number of prints fetched at a time when identifying against a model */
+#define IMG_IDENTIFY_CHUNK_SIZE 64
 
 typedef struct
 {
@@ -32,7 +34,10 @@ typedef struct
 
   gint                enroll_stage;
 
-  gboolean            minutiae_scan_active;
+  /* Scans that are being processed, results are reported in order */
+  GQueue              pending_scans;
+  guint               pipeline_depth;
+
   GError             *action_error;
   FpImage            *capture_image;
 
@@ -22,8 +22,6 @@
 
 #include "fp-image-device-private.h"
 
-#define BOZORTH3_DEFAULT_THRESHOLD 40
-
 /**
  * SECTION: fp-image-device
  * @title: FpImageDevice
@@ -37,6 +35,7 @@ G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (FpImageDevice, fp_image_device, FP_TYPE_DEV
 enum {
   PROP_0,
   PROP_FPI_STATE,
+  PROP_PIPELINE_DEPTH,
   N_PROPS
 };
 
@@ -130,7 +129,7 @@ fp_image_device_start_capture_action (FpDevice *device)
   priv->enroll_stage = 0;
   /* The internal state machine guarantees both of these. */
   g_assert (!priv->finger_present);
-  g_assert (!priv->minutiae_scan_active);
+  g_assert (g_queue_is_empty (&priv->pending_scans));
 
   /* And activate the device; we rely on fpi_image_device_activate_complete()
    * to be called when done (or immediately). */
@@ -147,6 +146,7 @@ fp_image_device_finalize (GObject *object)
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
 
   g_assert (priv->active == FALSE);
+  g_assert (g_queue_is_empty (&priv->pending_scans));
 
   G_OBJECT_CLASS (fp_image_device_parent_class)->finalize (object);
 }
@@ -178,6 +178,30 @@ fp_image_device_get_property (GObject    *object,
       g_value_set_enum (value, priv->state);
       break;
 
+    case PROP_PIPELINE_DEPTH:
+      g_value_set_uint (value, priv->pipeline_depth);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+fp_image_device_set_property (GObject      *object,
+                              guint         prop_id,
+                              const GValue *value,
+                              GParamSpec   *pspec)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (object);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_PIPELINE_DEPTH:
+      priv->pipeline_depth = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -208,6 +232,7 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
 
   object_class->finalize = fp_image_device_finalize;
   object_class->get_property = fp_image_device_get_property;
+  object_class->set_property = fp_image_device_set_property;
   object_class->constructed = fp_image_device_constructed;
 
   fp_device_class->open = fp_image_device_open;
@@ -238,6 +263,25 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
                        FPI_IMAGE_DEVICE_STATE_INACTIVE,
                        G_PARAM_STATIC_STRINGS | G_PARAM_READABLE);
 
+  /**
+   * FpImageDevice:pipeline-depth:
+   *
+   * The maximum number of scans that are processed at the same time.
+   * With the default of 1 the device waits for the image of a scan to
+   * be processed and matched before it detects the next finger.
+   *
+   * Higher values allow the next finger to be detected and captured
+   * while earlier scans are still being processed, which is useful for
+   * enrollment and continuous identification. Results are always
+   * reported in the order the scans were made.
+   */
+  properties[PROP_PIPELINE_DEPTH] =
+    g_param_spec_uint ("pipeline-depth",
+                       "Pipeline depth",
+                       "Maximum number of scans processed at the same time",
+                       1, 16, 1,
+                       G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+
   /**
    * FpImageDevice::fpi-image-device-state-changed: (skip)
    * @image_device: A #FpImageDevice
@@ -261,4 +305,7 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
 static void
 fp_image_device_init (FpImageDevice *self)
 {
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  g_queue_init (&priv->pending_scans);
 }
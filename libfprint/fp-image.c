@@ -22,6 +22,7 @@
 
 #include "fpi-image.h"
 #include "fpi-log.h"
+#include "fpi-worker-pool.h"
 
 #include <nbis.h>
 
@@ -163,6 +164,7 @@ typedef struct
   gint                width, height;
   gdouble             ppmm;
   FpiImageFlags       flags;
+  const guchar       *source;
   guchar             *image;
   guchar             *binarized;
 } DetectMinutiaeData;
@@ -185,15 +187,23 @@ fp_image_detect_minutiae_cb (GObject      *source_object,
   FpImage *image;
   DetectMinutiaeData *data = g_task_get_task_data (task);
 
+  image = FP_IMAGE (source_object);
+  image->detections_pending--;
+
   if (!g_task_had_error (task))
     {
       gint i;
-      image = FP_IMAGE (source_object);
 
-      image->flags = data->flags;
+      /* Another detection may still be reading the current data. The
+       * result is the same, so let the last one replace it.
+       */
+      if (image->detections_pending == 0)
+        {
+          image->flags = data->flags;
 
-      g_clear_pointer (&image->data, g_free);
-      image->data = g_steal_pointer (&data->image);
+          g_clear_pointer (&image->data, g_free);
+          image->data = g_steal_pointer (&data->image);
+        }
 
       g_clear_pointer (&image->binarized, g_free);
       image->binarized = g_steal_pointer (&data->binarized);
@@ -214,55 +224,55 @@ fp_image_detect_minutiae_cb (GObject      *source_object,
     data->user_cb (source_object, res, user_data);
 }
 
+/* Applies the normalization described by @flags to @in in a single pass.
+ * The result is stored in @out and, scaled to 6 bits as mindtct works on
+ * it, in @padded surrounded by @pad pixels of @pad_value on every side.
+ */
 static void
-vflip (guint8 *data, gint width, gint height)
+normalize_image (const guint8 *in,
+                 gint          width,
+                 gint          height,
+                 FpiImageFlags flags,
+                 guint8       *out,
+                 guint8       *padded,
+                 gint          pad,
+                 guint8        pad_value)
 {
-  int data_len = width * height;
-  unsigned char rowbuf[width];
-  int i;
-
-  for (i = 0; i < height / 2; i++)
-    {
-      int offset = i * width;
-      int swap_offset = data_len - (width * (i + 1));
-
-      /* copy top row into buffer */
-      memcpy (rowbuf, data + offset, width);
-
-      /* copy lower row over upper row */
-      memcpy (data + offset, data + swap_offset, width);
+  gint padded_width = width + 2 * pad;
+  guint8 invert = (flags & FPI_IMAGE_COLORS_INVERTED) ? 0xff : 0x00;
+  guint8 pad_6bit = pad_value >> 2;
+  gint x, y;
 
-      /* copy buffer over lower row */
-      memcpy (data + swap_offset, rowbuf, width);
-    }
-}
-
-static void
-hflip (guint8 *data, gint width, gint height)
-{
-  unsigned char rowbuf[width];
-  int i, j;
+  memset (padded, pad_6bit, pad * padded_width);
+  memset (padded + (pad + height) * padded_width, pad_6bit, pad * padded_width);
 
-  for (i = 0; i < height; i++)
+  for (y = 0; y < height; y++)
     {
-      int offset = i * width;
-
-      memcpy (rowbuf, data + offset, width);
-      for (j = 0; j < width; j++)
-        data[offset + j] = rowbuf[width - j - 1];
+      gint src_y = (flags & FPI_IMAGE_V_FLIPPED) ? height - y - 1 : y;
+      const guint8 *src = in + src_y * width;
+      guint8 *dst = out + y * width;
+      guint8 *pdst = padded + (pad + y) * padded_width;
+
+      memset (pdst, pad_6bit, pad);
+      memset (pdst + pad + width, pad_6bit, pad);
+      pdst += pad;
+
+      if (flags & FPI_IMAGE_H_FLIPPED)
+        {
+          for (x = 0; x < width; x++)
+            dst[x] = src[width - x - 1] ^ invert;
+        }
+      else
+        {
+          for (x = 0; x < width; x++)
+            dst[x] = src[x] ^ invert;
+        }
+
+      for (x = 0; x < width; x++)
+        pdst[x] = dst[x] >> 2;
     }
 }
 
-static void
-invert_colors (guint8 *data, gint width, gint height)
-{
-  int data_len = width * height;
-  int i;
-
-  for (i = 0; i < data_len; i++)
-    data[i] = 0xff - data[i];
-}
-
 static void
 fp_image_detect_minutiae_thread_func (GTask        *task,
                                       gpointer      source_object,
@@ -278,31 +288,34 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
   g_autofree gint *high_curve_map = NULL;
   g_autofree gint *quality_map = NULL;
   g_autofree guchar *bdata = NULL;
+  guchar *padded;
   gint map_w, map_h;
   gint bw, bh, bd;
+  gint pad;
   gint r;
   g_autofree LFSPARMS *lfsparms = NULL;
 
-  /* Normalize the image first */
-  if (data->flags & FPI_IMAGE_H_FLIPPED)
-    hflip (data->image, data->width, data->height);
-
-  if (data->flags & FPI_IMAGE_V_FLIPPED)
-    vflip (data->image, data->width, data->height);
+  lfsparms = g_memdup (&g_lfsparms_V2, sizeof (LFSPARMS));
+  lfsparms->remove_perimeter_pts = data->flags & FPI_IMAGE_PARTIAL ? TRUE : FALSE;
 
-  if (data->flags & FPI_IMAGE_COLORS_INVERTED)
-    invert_colors (data->image, data->width, data->height);
+  /* Normalize the image first, directly into the padded buffer that
+   * mindtct would otherwise create from it.
+   */
+  pad = get_max_padding_V2 (lfsparms->windowsize, lfsparms->windowoffset,
+                            lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
+  padded = g_malloc ((data->width + 2 * pad) * (data->height + 2 * pad));
+  data->image = g_malloc (data->width * data->height);
+  normalize_image (data->source, data->width, data->height, data->flags,
+                   data->image, padded, pad, lfsparms->pad_value);
 
   data->flags &= ~(FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED | FPI_IMAGE_COLORS_INVERTED);
 
-  lfsparms = g_memdup (&g_lfsparms_V2, sizeof (LFSPARMS));
-  lfsparms->remove_perimeter_pts = data->flags & FPI_IMAGE_PARTIAL ? TRUE : FALSE;
-
+  /* get_minutiae takes ownership of padded */
   timer = g_timer_new ();
   r = get_minutiae (&minutiae, &quality_map, &direction_map,
                     &low_contrast_map, &low_flow_map, &high_curve_map,
                     &map_w, &map_h, &bdata, &bw, &bh, &bd,
-                    data->image, data->width, data->height, 8,
+                    data->image, data->width, data->height, padded, 8,
                     data->ppmm, lfsparms);
   g_timer_stop (timer);
   fp_dbg ("Minutiae scan completed in %f secs", g_timer_elapsed (timer, NULL));
@@ -443,13 +456,16 @@ fp_image_detect_minutiae (FpImage            *self,
                           GAsyncReadyCallback callback,
                           gpointer            user_data)
 {
-  GTask *task;
+  g_autoptr(GTask) task = NULL;
   DetectMinutiaeData *data = g_new0 (DetectMinutiaeData, 1);
 
   task = g_task_new (self, cancellable, fp_image_detect_minutiae_cb, user_data);
 
-  data->image = g_malloc (self->width * self->height);
-  memcpy (data->image, self->data, self->width * self->height);
+  /* The task keeps the image alive, and its data is not replaced while
+   * a detection is pending, so the thread can read it without a copy.
+   */
+  data->source = self->data;
+  self->detections_pending++;
   data->flags = self->flags;
   data->width = self->width;
   data->height = self->height;
@@ -457,7 +473,8 @@ fp_image_detect_minutiae (FpImage            *self,
   data->user_cb = callback;
 
   g_task_set_task_data (task, data, (GDestroyNotify) fp_image_detect_minutiae_free);
-  g_task_run_in_thread (task, fp_image_detect_minutiae_thread_func);
+  fpi_worker_pool_run_task (fpi_worker_pool_get_default (), task,
+                            fp_image_detect_minutiae_thread_func);
 }
 
 /**
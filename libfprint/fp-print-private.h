@@ -43,4 +43,30 @@ struct _FpPrint
 
   GVariant  *data;
   GPtrArray *prints;
+
+  /* Serialized data that is only decoded on first access */
+  GMutex     decode_lock;
+  GVariant  *lazy_metadata;
+  GVariant  *lazy_prints;
+
+  /* Precomputed bozorth3 data, only accessed with the matcher locked */
+  GVariant  *bz3_data;
+  GPtrArray *bz3_tables;
+  GList     *bz3_cache_link;
+
+  /* Cached result of fp_print_hash(), zero if unknown */
+  guint      hash;
 };
+
+static inline void
+fpi_print_invalidate_hash (FpPrint *print)
+{
+  g_atomic_int_set (&print->hash, 0);
+}
+
+void     fpi_print_decode_metadata (FpPrint *print);
+gboolean fpi_print_decode_prints (FpPrint *print,
+                                  GError **error);
+
+GVariant *fpi_print_bz3_tables_serialize (FpPrint *print);
+void      fpi_print_bz3_tables_clear (FpPrint *print);
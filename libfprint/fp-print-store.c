@@ -0,0 +1,1063 @@
+/*
+ * FpPrintStore - Persistent log structured print storage
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "print-store"
+
+#include "fp-print-store.h"
+#include "fpi-byte-reader.h"
+#include "fpi-byte-writer.h"
+#include "fpi-log.h"
+#include "fpi-worker-pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * SECTION: fp-print-store
+ * @title: FpPrintStore
+ * @short_description: Persistent print storage
+ *
+ * An #FpPrintStore keeps serialized prints in a single file, each of them
+ * stored under a string key chosen by the application. It is meant as a
+ * ready to use replacement for storage code that rewrites a complete file
+ * whenever a print is added or removed.
+ *
+ * The file is an append only log. Saving a print appends a record with
+ * the serialized print, deleting a print appends a tombstone record. The
+ * location of the current record of every key is kept in memory, so the
+ * cost of a change does not depend on the number of stored prints. Every
+ * record carries a checksum, a record at the end of the file that was only
+ * partially written (e.g. because of a power loss) is discarded when the
+ * file is opened. A corrupted record anywhere else makes opening the file
+ * fail, the file is left untouched in that case.
+ *
+ * Writes are passed to the operating system immediately, but flushing
+ * them to the disk is batched. See fp_print_store_set_sync_interval() and
+ * fp_print_store_flush().
+ *
+ * Records that were replaced or deleted stay in the file until it is
+ * compacted. Compaction rewrites the file in a worker thread and happens
+ * automatically once the obsolete records take up more space than the
+ * current ones. It can also be started using fp_print_store_compact_async().
+ *
+ * An #FpPrintStore must only be used from the thread that created it and
+ * holds an exclusive lock on the file while it is open.
+ */
+
+#define FP_PRINT_STORE_MAGIC "FPPSTORE"
+#define FP_PRINT_STORE_VERSION 1
+#define FP_PRINT_STORE_HEADER_SIZE 16
+#define FP_PRINT_STORE_RECORD_HEADER_SIZE 12
+#define FP_PRINT_STORE_DEFAULT_SYNC_INTERVAL 100
+#define FP_PRINT_STORE_COMPACT_MIN_SIZE (1024 * 1024)
+/* Places print data after its 3 byte header at an 8 byte aligned address */
+#define FP_PRINT_STORE_LOAD_PADDING 5
+
+enum {
+  RECORD_PUT = 1,
+  RECORD_DELETE = 2,
+};
+
+typedef struct
+{
+  guint64 offset;
+  guint32 length;
+  guint32 record_size;
+} StoreEntry;
+
+struct _FpPrintStore
+{
+  GObject       parent_instance;
+
+  gchar        *filename;
+  gint          fd;
+  guint64       end;
+
+  GHashTable   *index;
+  guint64       live_size;
+
+  GMainContext *context;
+  GSource      *sync_source;
+  guint         sync_interval;
+
+  gboolean      compacting;
+};
+
+G_DEFINE_TYPE (FpPrintStore, fp_print_store, G_TYPE_OBJECT)
+
+static guint32 crc_table[256];
+
+static guint32
+store_crc32 (guint32 crc, const guint8 *data, gsize length)
+{
+  crc = ~crc;
+  while (length--)
+    crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+static void
+store_set_error_from_errno (GError     **error,
+                            gint         errsv,
+                            const gchar *action)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "Could not %s print store: %s", action, g_strerror (errsv));
+}
+
+static gboolean
+store_pwrite_all (gint          fd,
+                  const guint8 *data,
+                  gsize         size,
+                  guint64       offset,
+                  GError      **error)
+{
+  while (size > 0)
+    {
+      gssize res = pwrite (fd, data, size, offset);
+
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          store_set_error_from_errno (error, errno, "write");
+          return FALSE;
+        }
+
+      data += res;
+      size -= res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+store_pread_all (gint     fd,
+                 guint8  *data,
+                 gsize    size,
+                 guint64  offset,
+                 GError **error)
+{
+  while (size > 0)
+    {
+      gssize res = pread (fd, data, size, offset);
+
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          store_set_error_from_errno (error, errno, "read");
+          return FALSE;
+        }
+      else if (res == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Print store ended unexpectedly");
+          return FALSE;
+        }
+
+      data += res;
+      size -= res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+static void
+store_build_header (guint8 *header)
+{
+  FpiByteWriter writer;
+
+  fpi_byte_writer_init_with_data (&writer, header, FP_PRINT_STORE_HEADER_SIZE, FALSE);
+  fpi_byte_writer_put_data (&writer, (const guint8 *) FP_PRINT_STORE_MAGIC,
+                            strlen (FP_PRINT_STORE_MAGIC));
+  fpi_byte_writer_put_uint32_le (&writer, FP_PRINT_STORE_VERSION);
+  fpi_byte_writer_put_uint32_le (&writer, 0);
+}
+
+/* Record layout (little endian):
+ *  - length of the print data (32 bit)
+ *  - length of the key (16 bit)
+ *  - record type (8 bit)
+ *  - reserved (8 bit)
+ *  - CRC-32 of the record type, key and print data (32 bit)
+ *  - key (not NUL terminated)
+ *  - print data as returned by fp_print_serialize_full() using
+ *    %FP_PRINT_SERIALIZE_COMPACT
+ */
+static guint8 *
+store_build_record (guint8        type,
+                    const gchar  *key,
+                    const guint8 *data,
+                    guint32       length,
+                    guint32      *size)
+{
+  FpiByteWriter writer;
+  guint16 key_len = strlen (key);
+  guint32 crc;
+
+  crc = store_crc32 (0, &type, 1);
+  crc = store_crc32 (crc, (const guint8 *) key, key_len);
+  crc = store_crc32 (crc, data, length);
+
+  *size = FP_PRINT_STORE_RECORD_HEADER_SIZE + key_len + length;
+
+  fpi_byte_writer_init_with_size (&writer, *size, TRUE);
+  fpi_byte_writer_put_uint32_le (&writer, length);
+  fpi_byte_writer_put_uint16_le (&writer, key_len);
+  fpi_byte_writer_put_uint8 (&writer, type);
+  fpi_byte_writer_put_uint8 (&writer, 0);
+  fpi_byte_writer_put_uint32_le (&writer, crc);
+  fpi_byte_writer_put_data (&writer, (const guint8 *) key, key_len);
+  if (length > 0)
+    fpi_byte_writer_put_data (&writer, data, length);
+
+  return fpi_byte_writer_reset_and_get_data (&writer);
+}
+
+static void
+store_index_put (GHashTable *index,
+                 guint64    *live_size,
+                 gchar      *key,
+                 StoreEntry *entry)
+{
+  StoreEntry *old = g_hash_table_lookup (index, key);
+
+  if (old)
+    *live_size -= old->record_size;
+
+  *live_size += entry->record_size;
+  g_hash_table_replace (index, key, entry);
+}
+
+static void
+store_index_remove (GHashTable  *index,
+                    guint64     *live_size,
+                    const gchar *key)
+{
+  StoreEntry *old = g_hash_table_lookup (index, key);
+
+  if (!old)
+    return;
+
+  *live_size -= old->record_size;
+  g_hash_table_remove (index, key);
+}
+
+static GHashTable *
+store_index_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static gboolean
+is_zero (const guint8 *data,
+         gsize         size)
+{
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    if (data[i] != 0)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Applies the records in @data to @index. @base is the file offset of
+ * @data. Parsing stops at the first incomplete or corrupted record, the
+ * number of bytes that were parsed successfully is returned.
+ *
+ * @torn is set if parsing stopped at a torn write at the end of @data,
+ * i.e. a record running past the end or a zero filled tail as left by
+ * some file systems after a crash. Otherwise a record within @data is
+ * corrupted. */
+static gsize
+store_parse_records (const guint8 *data,
+                     gsize         size,
+                     guint64       base,
+                     GHashTable   *index,
+                     guint64      *live_size,
+                     gboolean     *torn)
+{
+  gsize parsed = 0;
+
+  *torn = FALSE;
+
+  while (parsed < size)
+    {
+      FpiByteReader reader;
+      const guint8 *key;
+      const guint8 *payload;
+      guint32 length;
+      guint16 key_len;
+      guint8 type;
+      guint32 crc;
+
+      if (size - parsed < FP_PRINT_STORE_RECORD_HEADER_SIZE)
+        {
+          *torn = TRUE;
+          break;
+        }
+
+      fpi_byte_reader_init (&reader, data + parsed, MIN (size - parsed, G_MAXUINT));
+      length = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+      key_len = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+      type = fpi_byte_reader_get_uint8_unchecked (&reader);
+      fpi_byte_reader_skip_unchecked (&reader, 1);
+      crc = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+
+      if (!fpi_byte_reader_get_data (&reader, key_len, &key) ||
+          !fpi_byte_reader_get_data (&reader, length, &payload))
+        {
+          *torn = TRUE;
+          break;
+        }
+
+      if (key_len == 0 ||
+          (type != RECORD_PUT && type != RECORD_DELETE) ||
+          (type == RECORD_DELETE && length != 0) ||
+          store_crc32 (store_crc32 (store_crc32 (0, &type, 1), key, key_len),
+                       payload, length) != crc)
+        {
+          *torn = is_zero (data + parsed, size - parsed);
+          break;
+        }
+
+      if (type == RECORD_PUT)
+        {
+          StoreEntry *entry = g_new0 (StoreEntry, 1);
+
+          entry->offset = base + parsed + FP_PRINT_STORE_RECORD_HEADER_SIZE + key_len;
+          entry->length = length;
+          entry->record_size = FP_PRINT_STORE_RECORD_HEADER_SIZE + key_len + length;
+          store_index_put (index, live_size,
+                           g_strndup ((const gchar *) key, key_len), entry);
+        }
+      else
+        {
+          g_autofree gchar *key_str = g_strndup ((const gchar *) key, key_len);
+
+          store_index_remove (index, live_size, key_str);
+        }
+
+      parsed += FP_PRINT_STORE_RECORD_HEADER_SIZE + key_len + length;
+    }
+
+  return parsed;
+}
+
+static gboolean
+store_sync (FpPrintStore *self,
+            GError      **error)
+{
+  g_clear_pointer (&self->sync_source, g_source_destroy);
+
+  if (fdatasync (self->fd) < 0)
+    {
+      store_set_error_from_errno (error, errno, "sync");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+store_sync_cb (gpointer user_data)
+{
+  FpPrintStore *self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  /* Destroying the source from its own callback is fine */
+  if (!store_sync (self, &error))
+    fp_warn ("%s", error->message);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void fp_print_store_compact_cb (GObject      *source_object,
+                                       GAsyncResult *res,
+                                       gpointer      user_data);
+
+static gboolean
+store_append (FpPrintStore *self,
+              guint8        type,
+              const gchar  *key,
+              const guint8 *data,
+              guint32       length,
+              GError      **error)
+{
+  g_autofree guint8 *record = NULL;
+  guint64 dead_size;
+  guint32 size;
+
+  record = store_build_record (type, key, data, length, &size);
+  if (!store_pwrite_all (self->fd, record, size, self->end, error))
+    {
+      /* Drop whatever was written, later records would be lost otherwise */
+      if (ftruncate (self->fd, self->end) < 0)
+        fp_warn ("Could not truncate print store: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  if (type == RECORD_PUT)
+    {
+      StoreEntry *entry = g_new0 (StoreEntry, 1);
+
+      entry->offset = self->end + size - length;
+      entry->length = length;
+      entry->record_size = size;
+      store_index_put (self->index, &self->live_size, g_strdup (key), entry);
+    }
+  else
+    {
+      store_index_remove (self->index, &self->live_size, key);
+    }
+
+  self->end += size;
+
+  if (self->sync_interval == 0)
+    {
+      if (!store_sync (self, error))
+        return FALSE;
+    }
+  else if (!self->sync_source)
+    {
+      self->sync_source = g_timeout_source_new (self->sync_interval);
+      g_source_set_callback (self->sync_source, store_sync_cb, self, NULL);
+      g_source_set_name (self->sync_source, "[fp-print-store] sync");
+      g_source_attach (self->sync_source, self->context);
+      g_source_unref (self->sync_source);
+    }
+
+  dead_size = self->end - FP_PRINT_STORE_HEADER_SIZE - self->live_size;
+  if (!self->compacting &&
+      dead_size >= FP_PRINT_STORE_COMPACT_MIN_SIZE &&
+      dead_size > self->live_size)
+    {
+      fp_dbg ("Compacting print store, %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes are obsolete",
+              dead_size, self->end);
+      fp_print_store_compact_async (self, NULL, fp_print_store_compact_cb, NULL);
+    }
+
+  return TRUE;
+}
+
+static void
+fp_print_store_finalize (GObject *object)
+{
+  FpPrintStore *self = FP_PRINT_STORE (object);
+
+  if (self->sync_source)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (!store_sync (self, &error))
+        fp_warn ("%s", error->message);
+    }
+
+  if (self->fd >= 0)
+    close (self->fd);
+
+  g_clear_pointer (&self->index, g_hash_table_unref);
+  g_clear_pointer (&self->context, g_main_context_unref);
+  g_clear_pointer (&self->filename, g_free);
+
+  G_OBJECT_CLASS (fp_print_store_parent_class)->finalize (object);
+}
+
+static void
+fp_print_store_class_init (FpPrintStoreClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  guint32 i, j;
+
+  object_class->finalize = fp_print_store_finalize;
+
+  for (i = 0; i < G_N_ELEMENTS (crc_table); i++)
+    {
+      guint32 c = i;
+
+      for (j = 0; j < 8; j++)
+        c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+
+      crc_table[i] = c;
+    }
+}
+
+static void
+fp_print_store_init (FpPrintStore *self)
+{
+  self->fd = -1;
+  self->index = store_index_new ();
+  self->context = g_main_context_ref_thread_default ();
+  self->sync_interval = FP_PRINT_STORE_DEFAULT_SYNC_INTERVAL;
+}
+
+/**
+ * fp_print_store_new:
+ * @filename: (type filename): The file to store the prints in
+ * @error: Return location for error
+ *
+ * Opens the print store in @filename, creating the file if it does not
+ * exist yet. The whole file is read once to build the index of the
+ * stored prints.
+ *
+ * Returns: (transfer full): A new #FpPrintStore, or %NULL on error
+ */
+FpPrintStore *
+fp_print_store_new (const gchar *filename,
+                    GError     **error)
+{
+  g_autoptr(FpPrintStore) self = NULL;
+  g_autoptr(GMappedFile) file = NULL;
+  FpiByteReader reader;
+  const guint8 *data;
+  struct stat st;
+  guint32 version;
+  gboolean torn;
+  gsize size;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  self = g_object_new (FP_TYPE_PRINT_STORE, NULL);
+  self->filename = g_strdup (filename);
+
+  self->fd = open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (self->fd < 0)
+    {
+      store_set_error_from_errno (error, errno, "open");
+      return NULL;
+    }
+
+  if (flock (self->fd, LOCK_EX | LOCK_NB) < 0)
+    {
+      store_set_error_from_errno (error, errno, "lock");
+      return NULL;
+    }
+
+  if (fstat (self->fd, &st) < 0)
+    {
+      store_set_error_from_errno (error, errno, "open");
+      return NULL;
+    }
+
+  if (st.st_size == 0)
+    {
+      guint8 header[FP_PRINT_STORE_HEADER_SIZE];
+
+      store_build_header (header);
+      if (!store_pwrite_all (self->fd, header, sizeof (header), 0, error))
+        return NULL;
+
+      self->end = FP_PRINT_STORE_HEADER_SIZE;
+
+      return g_steal_pointer (&self);
+    }
+
+  file = g_mapped_file_new_from_fd (self->fd, FALSE, error);
+  if (!file)
+    return NULL;
+
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  size = g_mapped_file_get_length (file);
+
+  if (size < FP_PRINT_STORE_HEADER_SIZE ||
+      memcmp (data, FP_PRINT_STORE_MAGIC, strlen (FP_PRINT_STORE_MAGIC)) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a print store", filename);
+      return NULL;
+    }
+
+  fpi_byte_reader_init (&reader, data, FP_PRINT_STORE_HEADER_SIZE);
+  fpi_byte_reader_skip_unchecked (&reader, strlen (FP_PRINT_STORE_MAGIC));
+  version = fpi_byte_reader_get_uint32_le_unchecked (&reader);
+  if (version != FP_PRINT_STORE_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported print store version %u", version);
+      return NULL;
+    }
+
+  self->end = FP_PRINT_STORE_HEADER_SIZE +
+              store_parse_records (data + FP_PRINT_STORE_HEADER_SIZE,
+                                   size - FP_PRINT_STORE_HEADER_SIZE,
+                                   FP_PRINT_STORE_HEADER_SIZE,
+                                   self->index,
+                                   &self->live_size,
+                                   &torn);
+
+  if (self->end < size && !torn)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Corrupted record at offset %" G_GUINT64_FORMAT " in %s",
+                   self->end, filename);
+      return NULL;
+    }
+  else if (self->end < size)
+    {
+      fp_warn ("Discarding %" G_GUINT64_FORMAT " bytes of incomplete data at the end of %s",
+               (guint64) size - self->end, filename);
+
+      if (ftruncate (self->fd, self->end) < 0)
+        {
+          store_set_error_from_errno (error, errno, "truncate");
+          return NULL;
+        }
+    }
+
+  fp_dbg ("Opened print store %s with %u prints", filename,
+          g_hash_table_size (self->index));
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * fp_print_store_set_sync_interval:
+ * @store: A #FpPrintStore
+ * @interval: The interval in milliseconds
+ *
+ * Sets how long changes may wait before they are flushed to the disk.
+ * All changes within the interval are flushed together. An interval of
+ * zero flushes every change before returning. The default is 100ms.
+ */
+void
+fp_print_store_set_sync_interval (FpPrintStore *store,
+                                  guint         interval)
+{
+  g_return_if_fail (FP_IS_PRINT_STORE (store));
+
+  store->sync_interval = interval;
+}
+
+/**
+ * fp_print_store_save:
+ * @store: A #FpPrintStore
+ * @key: The key to store the print under
+ * @print: The #FpPrint to store
+ * @error: Return location for error
+ *
+ * Stores @print under @key, replacing any print that was stored under
+ * the same key before.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_save (FpPrintStore *store,
+                     const gchar  *key,
+                     FpPrint      *print,
+                     GError      **error)
+{
+  g_autofree guchar *data = NULL;
+  gsize length;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+  g_return_val_if_fail (key != NULL && *key != '\0', FALSE);
+  g_return_val_if_fail (strlen (key) <= G_MAXUINT16, FALSE);
+  g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+  if (!fp_print_serialize_full (print, FP_PRINT_SERIALIZE_COMPACT,
+                                &data, &length, error))
+    return FALSE;
+
+  return store_append (store, RECORD_PUT, key, data, length, error);
+}
+
+/**
+ * fp_print_store_load:
+ * @store: A #FpPrintStore
+ * @key: The key of the print
+ * @error: Return location for error
+ *
+ * Loads the print stored under @key. If there is none, then
+ * %G_IO_ERROR_NOT_FOUND is returned.
+ *
+ * Returns: (transfer full): The stored #FpPrint, or %NULL on error
+ */
+FpPrint *
+fp_print_store_load (FpPrintStore *store,
+                     const gchar  *key,
+                     GError      **error)
+{
+  g_autofree guint8 *data = NULL;
+  g_autoptr(GBytes) buffer = NULL;
+  g_autoptr(GBytes) record = NULL;
+  StoreEntry *entry;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  entry = g_hash_table_lookup (store->index, key);
+  if (!entry)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No print stored for %s", key);
+      return NULL;
+    }
+
+  /* Offset the data so that it is aligned after the "FP3" header and the
+   * print can be deserialized without copying it again. */
+  data = g_malloc (FP_PRINT_STORE_LOAD_PADDING + entry->length);
+  if (!store_pread_all (store->fd, data + FP_PRINT_STORE_LOAD_PADDING, entry->length,
+                        entry->offset, error))
+    return NULL;
+
+  buffer = g_bytes_new_take (g_steal_pointer (&data),
+                             FP_PRINT_STORE_LOAD_PADDING + entry->length);
+  record = g_bytes_new_from_bytes (buffer, FP_PRINT_STORE_LOAD_PADDING, entry->length);
+
+  return fp_print_deserialize_bytes (record, error);
+}
+
+/**
+ * fp_print_store_delete:
+ * @store: A #FpPrintStore
+ * @key: The key of the print
+ * @error: Return location for error
+ *
+ * Deletes the print stored under @key. If there is none, then
+ * %G_IO_ERROR_NOT_FOUND is returned.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_delete (FpPrintStore *store,
+                       const gchar  *key,
+                       GError      **error)
+{
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  if (!g_hash_table_contains (store->index, key))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No print stored for %s", key);
+      return FALSE;
+    }
+
+  return store_append (store, RECORD_DELETE, key, NULL, 0, error);
+}
+
+/**
+ * fp_print_store_get_keys:
+ * @store: A #FpPrintStore
+ *
+ * Returns the keys of all stored prints in no particular order.
+ *
+ * Returns: (transfer full) (array zero-terminated=1): The keys
+ */
+GStrv
+fp_print_store_get_keys (FpPrintStore *store)
+{
+  GPtrArray *keys;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), NULL);
+
+  keys = g_ptr_array_new_full (g_hash_table_size (store->index) + 1, NULL);
+
+  g_hash_table_iter_init (&iter, store->index);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (keys, g_strdup (key));
+  g_ptr_array_add (keys, NULL);
+
+  return (GStrv) g_ptr_array_free (keys, FALSE);
+}
+
+/**
+ * fp_print_store_flush:
+ * @store: A #FpPrintStore
+ * @error: Return location for error
+ *
+ * Flushes all changes to the disk immediately.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_flush (FpPrintStore *store,
+                      GError      **error)
+{
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+
+  return store_sync (store, error);
+}
+
+typedef struct
+{
+  gint        fd;
+  gint        new_fd;
+  gchar      *tmp_filename;
+  GHashTable *index;
+  guint64     snapshot_end;
+  guint64     new_end;
+} CompactData;
+
+static void
+compact_data_free (CompactData *data)
+{
+  if (data->fd >= 0)
+    close (data->fd);
+  if (data->new_fd >= 0)
+    close (data->new_fd);
+  if (data->tmp_filename)
+    unlink (data->tmp_filename);
+
+  g_free (data->tmp_filename);
+  g_clear_pointer (&data->index, g_hash_table_unref);
+  g_free (data);
+}
+
+static void
+compact_thread_func (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  CompactData *data = task_data;
+  guint8 header[FP_PRINT_STORE_HEADER_SIZE];
+  GError *error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  data->new_fd = open (data->tmp_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (data->new_fd < 0 || flock (data->new_fd, LOCK_EX | LOCK_NB) < 0)
+    {
+      store_set_error_from_errno (&error, errno, "create");
+      g_task_return_error (task, error);
+      return;
+    }
+
+  store_build_header (header);
+  if (!store_pwrite_all (data->new_fd, header, sizeof (header), 0, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+  data->new_end = FP_PRINT_STORE_HEADER_SIZE;
+
+  /* Records are copied unchanged, their checksum was verified before */
+  g_hash_table_iter_init (&iter, data->index);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      StoreEntry *entry = value;
+      g_autofree guint8 *record = NULL;
+      guint32 header_size = entry->record_size - entry->length;
+
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      record = g_malloc (entry->record_size);
+      if (!store_pread_all (data->fd, record, entry->record_size,
+                            entry->offset - header_size, &error) ||
+          !store_pwrite_all (data->new_fd, record, entry->record_size,
+                             data->new_end, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      entry->offset = data->new_end + header_size;
+      data->new_end += entry->record_size;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+compact_thread_done_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+  FpPrintStore *self = FP_PRINT_STORE (source_object);
+  CompactData *data = g_task_get_task_data (G_TASK (res));
+  g_autoptr(GTask) task = user_data;
+  g_autofree guint8 *tail = NULL;
+  g_autofree gchar *dirname = NULL;
+  GError *error = NULL;
+  guint64 live_size;
+  gsize tail_size;
+  gboolean torn;
+  gint dir_fd;
+
+  self->compacting = FALSE;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  /* Carry over the changes that were made while compacting */
+  live_size = data->new_end - FP_PRINT_STORE_HEADER_SIZE;
+  tail_size = self->end - data->snapshot_end;
+  if (tail_size > 0)
+    {
+      tail = g_malloc (tail_size);
+      if (!store_pread_all (self->fd, tail, tail_size, data->snapshot_end, &error) ||
+          !store_pwrite_all (data->new_fd, tail, tail_size, data->new_end, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      /* Written by ourselves while compacting, so the records are complete */
+      store_parse_records (tail, tail_size, data->new_end, data->index, &live_size, &torn);
+      data->new_end += tail_size;
+    }
+
+  if (fdatasync (data->new_fd) < 0 ||
+      rename (data->tmp_filename, self->filename) < 0)
+    {
+      store_set_error_from_errno (&error, errno, "replace");
+      g_task_return_error (task, error);
+      return;
+    }
+  g_clear_pointer (&data->tmp_filename, g_free);
+
+  /* Make the rename itself persistent */
+  dirname = g_path_get_dirname (self->filename);
+  dir_fd = open (dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0)
+    {
+      fsync (dir_fd);
+      close (dir_fd);
+    }
+
+  fp_dbg ("Compacted print store from %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes",
+          self->end, data->new_end);
+
+  close (self->fd);
+  self->fd = data->new_fd;
+  data->new_fd = -1;
+  self->end = data->new_end;
+
+  g_hash_table_unref (self->index);
+  self->index = g_steal_pointer (&data->index);
+  self->live_size = live_size;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+fp_print_store_compact_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!fp_print_store_compact_finish (FP_PRINT_STORE (source_object), res, &error))
+    fp_warn ("Could not compact print store: %s", error->message);
+}
+
+/**
+ * fp_print_store_compact_async:
+ * @store: A #FpPrintStore
+ * @cancellable: (nullable): A #GCancellable, or %NULL
+ * @callback: The function to call on completion
+ * @user_data: The data to pass to @callback
+ *
+ * Rewrites the file of @store so that it only contains the current
+ * prints. The file is written in a worker thread, @store can be used
+ * normally while the compaction is running. Only one compaction can
+ * run at a time, %G_IO_ERROR_PENDING is returned otherwise.
+ */
+void
+fp_print_store_compact_async (FpPrintStore       *store,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) thread_task = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  CompactData *data;
+
+  g_return_if_fail (FP_IS_PRINT_STORE (store));
+
+  task = g_task_new (store, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_print_store_compact_async);
+
+  if (store->compacting)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                               "Print store is already being compacted");
+      return;
+    }
+
+  data = g_new0 (CompactData, 1);
+  data->new_fd = -1;
+  data->fd = dup (store->fd);
+  if (data->fd < 0)
+    {
+      GError *error = NULL;
+
+      store_set_error_from_errno (&error, errno, "compact");
+      compact_data_free (data);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  /* The worker thread gets its own copy of the index */
+  data->index = store_index_new ();
+  g_hash_table_iter_init (&iter, store->index);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (data->index, g_strdup (key), g_memdup (value, sizeof (StoreEntry)));
+
+  data->tmp_filename = g_strconcat (store->filename, ".compact", NULL);
+  data->snapshot_end = store->end;
+
+  store->compacting = TRUE;
+
+  thread_task = g_task_new (store, cancellable, compact_thread_done_cb,
+                            g_steal_pointer (&task));
+  g_task_set_task_data (thread_task, data, (GDestroyNotify) compact_data_free);
+  fpi_worker_pool_run_task (fpi_worker_pool_get_default (), thread_task,
+                            compact_thread_func);
+}
+
+/**
+ * fp_print_store_compact_finish:
+ * @store: A #FpPrintStore
+ * @result: A #GAsyncResult
+ * @error: Return location for error
+ *
+ * Finishes an operation started with fp_print_store_compact_async().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_compact_finish (FpPrintStore *store,
+                               GAsyncResult *result,
+                               GError      **error)
+{
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, store), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
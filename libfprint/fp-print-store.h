@@ -0,0 +1,58 @@
+/*
+ * FpPrintStore - Persistent log structured print storage
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include "fp-print.h"
+
+G_BEGIN_DECLS
+
+#define FP_TYPE_PRINT_STORE (fp_print_store_get_type ())
+G_DECLARE_FINAL_TYPE (FpPrintStore, fp_print_store, FP, PRINT_STORE, GObject)
+
+FpPrintStore *fp_print_store_new (const gchar *filename,
+                                  GError     **error);
+
+void          fp_print_store_set_sync_interval (FpPrintStore *store,
+                                                guint         interval);
+
+gboolean      fp_print_store_save (FpPrintStore *store,
+                                   const gchar  *key,
+                                   FpPrint      *print,
+                                   GError      **error);
+FpPrint      *fp_print_store_load (FpPrintStore *store,
+                                   const gchar  *key,
+                                   GError      **error);
+gboolean      fp_print_store_delete (FpPrintStore *store,
+                                     const gchar  *key,
+                                     GError      **error);
+GStrv         fp_print_store_get_keys (FpPrintStore *store);
+
+gboolean      fp_print_store_flush (FpPrintStore *store,
+                                    GError      **error);
+
+void          fp_print_store_compact_async (FpPrintStore       *store,
+                                            GCancellable       *cancellable,
+                                            GAsyncReadyCallback callback,
+                                            gpointer            user_data);
+gboolean      fp_print_store_compact_finish (FpPrintStore *store,
+                                             GAsyncResult *result,
+                                             GError      **error);
+
+G_END_DECLS
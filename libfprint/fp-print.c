@@ -21,8 +21,11 @@
 #define FP_COMPONENT "print"
 
 #include "fp-print-private.h"
+#include "fpi-byte-reader.h"
+#include "fpi-byte-writer.h"
 #include "fpi-compat.h"
 #include "fpi-log.h"
+#include "fpi-worker-pool.h"
 
 /**
  * SECTION: fp-print
@@ -79,6 +82,11 @@ fp_print_finalize (GObject *object)
   g_clear_pointer (&self->enroll_date, g_date_free);
   g_clear_pointer (&self->data, g_variant_unref);
   g_clear_pointer (&self->prints, g_ptr_array_unref);
+  g_clear_pointer (&self->lazy_metadata, g_variant_unref);
+  g_clear_pointer (&self->lazy_prints, g_variant_unref);
+  g_clear_pointer (&self->bz3_data, g_variant_unref);
+  fpi_print_bz3_tables_clear (self);
+  g_mutex_clear (&self->decode_lock);
 
   G_OBJECT_CLASS (fp_print_parent_class)->finalize (object);
 }
@@ -91,6 +99,8 @@ fp_print_get_property (GObject    *object,
 {
   FpPrint *self = FP_PRINT (object);
 
+  fpi_print_decode_metadata (self);
+
   switch (prop_id)
     {
     case PROP_DRIVER:
@@ -146,6 +156,8 @@ fp_print_set_property (GObject      *object,
 {
   FpPrint *self = FP_PRINT (object);
 
+  fpi_print_decode_metadata (self);
+
   switch (prop_id)
     {
     case PROP_FPI_TYPE:
@@ -186,6 +198,7 @@ fp_print_set_property (GObject      *object,
     case PROP_FPI_DATA:
       g_clear_pointer (&self->data, g_variant_unref);
       self->data = g_value_dup_variant (value);
+      fpi_print_invalidate_hash (self);
       break;
 
     default:
@@ -305,6 +318,7 @@ fp_print_class_init (FpPrintClass *klass)
 static void
 fp_print_init (FpPrint *self)
 {
+  g_mutex_init (&self->decode_lock);
 }
 
 /**
@@ -407,6 +421,8 @@ fp_print_get_finger (FpPrint *print)
 {
   g_return_val_if_fail (FP_IS_PRINT (print), FP_FINGER_UNKNOWN);
 
+  fpi_print_decode_metadata (print);
+
   return print->finger;
 }
 
@@ -423,6 +439,8 @@ fp_print_get_username (FpPrint *print)
 {
   g_return_val_if_fail (FP_IS_PRINT (print), NULL);
 
+  fpi_print_decode_metadata (print);
+
   return print->username;
 }
 
@@ -439,6 +457,8 @@ fp_print_get_description (FpPrint *print)
 {
   g_return_val_if_fail (FP_IS_PRINT (print), NULL);
 
+  fpi_print_decode_metadata (print);
+
   return print->description;
 }
 
@@ -455,6 +475,8 @@ fp_print_get_enroll_date (FpPrint *print)
 {
   g_return_val_if_fail (FP_IS_PRINT (print), NULL);
 
+  fpi_print_decode_metadata (print);
+
   return print->enroll_date;
 }
 
@@ -471,6 +493,7 @@ fp_print_set_finger (FpPrint *print,
 {
   g_return_if_fail (FP_IS_PRINT (print));
 
+  fpi_print_decode_metadata (print);
   print->finger = finger;
   g_object_notify_by_pspec (G_OBJECT (print), properties[PROP_FINGER]);
 }
@@ -488,6 +511,7 @@ fp_print_set_username (FpPrint     *print,
 {
   g_return_if_fail (FP_IS_PRINT (print));
 
+  fpi_print_decode_metadata (print);
   g_clear_pointer (&print->username, g_free);
   print->username = g_strdup (username);
   g_object_notify_by_pspec (G_OBJECT (print), properties[PROP_USERNAME]);
@@ -506,6 +530,7 @@ fp_print_set_description (FpPrint     *print,
 {
   g_return_if_fail (FP_IS_PRINT (print));
 
+  fpi_print_decode_metadata (print);
   g_clear_pointer (&print->description, g_free);
   print->description = g_strdup (description);
   g_object_notify_by_pspec (G_OBJECT (print), properties[PROP_DESCRIPTION]);
@@ -524,6 +549,7 @@ fp_print_set_enroll_date (FpPrint     *print,
 {
   g_return_if_fail (FP_IS_PRINT (print));
 
+  fpi_print_decode_metadata (print);
   g_clear_pointer (&print->enroll_date, g_date_free);
   if (enroll_date)
     print->enroll_date = g_date_copy (enroll_date);
@@ -576,6 +602,12 @@ fp_print_equal (FpPrint *self, FpPrint *other)
   if (self->type != other->type)
     return FALSE;
 
+  /* Cheap rejection if both hashes are known already */
+  if (g_atomic_int_get (&self->hash) != 0 &&
+      g_atomic_int_get (&other->hash) != 0 &&
+      g_atomic_int_get (&self->hash) != g_atomic_int_get (&other->hash))
+    return FALSE;
+
   if (g_strcmp0 (self->driver, other->driver))
     return FALSE;
 
@@ -590,6 +622,10 @@ fp_print_equal (FpPrint *self, FpPrint *other)
     {
       guint i;
 
+      if (!fpi_print_decode_prints (self, NULL) ||
+          !fpi_print_decode_prints (other, NULL))
+        return FALSE;
+
       if (self->prints->len != other->prints->len)
         return FALSE;
 
@@ -597,8 +633,13 @@ fp_print_equal (FpPrint *self, FpPrint *other)
         {
           struct xyt_struct *a = g_ptr_array_index (self->prints, i);
           struct xyt_struct *b = g_ptr_array_index (other->prints, i);
+          gsize size = sizeof (a->xcol[0]) * a->nrows;
 
-          if (memcmp (a, b, sizeof (struct xyt_struct)) != 0)
+          /* Only the used part of the columns matters */
+          if (a->nrows != b->nrows ||
+              memcmp (a->xcol, b->xcol, size) != 0 ||
+              memcmp (a->ycol, b->ycol, size) != 0 ||
+              memcmp (a->thetacol, b->thetacol, size) != 0)
             return FALSE;
         }
 
@@ -610,274 +651,1422 @@ fp_print_equal (FpPrint *self, FpPrint *other)
     }
 }
 
-#define FPI_PRINT_VARIANT_TYPE G_VARIANT_TYPE ("(issbymsmsia{sv}v)")
+static guint32
+hash_string (guint32 hash, const gchar *str)
+{
+  /* Include the terminator so that concatenations differ */
+  if (!str)
+    return fpi_fnv1a_int32 (hash, -1);
 
-G_STATIC_ASSERT (sizeof (((struct xyt_struct *) NULL)->xcol[0]) == 4);
+  return fpi_fnv1a_bytes (hash, (const guint8 *) str, strlen (str) + 1);
+}
 
 /**
- * fp_print_serialize:
+ * fp_print_hash:
  * @print: A #FpPrint
- * @data: (array length=length) (transfer full) (out): Return location for data pointer
- * @length: (transfer full) (out): Length of @data
- * @error: Return location for error
  *
- * Serialize a print definition for permanent storage. Note that this is
- * lossy in the sense that e.g. the image data is discarded.
+ * Computes a hash of the print data that is consistent with
+ * fp_print_equal(). Like fp_print_equal() it does not include the
+ * metadata. The hash only depends on the print content, so it is the same
+ * on all machines, and it is cached on @print.
  *
- * Returns: (type void): %TRUE on success
+ * This function can be passed as #GHashFunc to g_hash_table_new() together
+ * with fp_print_equal() as #GEqualFunc to create sets of prints.
+ *
+ * Returns: The hash value
  */
-gboolean
-fp_print_serialize (FpPrint *print,
-                    guchar **data,
-                    gsize   *length,
-                    GError **error)
+guint
+fp_print_hash (FpPrint *print)
 {
-  g_autoptr(GVariant) result = NULL;
-  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_VARIANT_TYPE);
-  gsize len;
-
-  g_assert (data);
-  g_assert (length);
+  guint32 hash;
+  guint i;
 
-  g_variant_builder_add (&builder, "i", print->type);
-  g_variant_builder_add (&builder, "s", print->driver);
-  g_variant_builder_add (&builder, "s", print->device_id);
-  g_variant_builder_add (&builder, "b", print->device_stored);
+  g_return_val_if_fail (FP_IS_PRINT (print), 0);
+  g_return_val_if_fail (print->type != FPI_PRINT_UNDEFINED, 0);
 
-  /* Metadata */
-  g_variant_builder_add (&builder, "y", print->finger);
-  g_variant_builder_add (&builder, "ms", print->username);
-  g_variant_builder_add (&builder, "ms", print->description);
-  if (print->enroll_date && g_date_valid (print->enroll_date))
-    g_variant_builder_add (&builder, "i", g_date_get_julian (print->enroll_date));
-  else
-    g_variant_builder_add (&builder, "i", G_MININT32);
+  hash = g_atomic_int_get (&print->hash);
+  if (hash != 0)
+    return hash;
 
-  /* Unused a{sv} for expansion */
-  g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
-  g_variant_builder_close (&builder);
+  /* FNV-1a over little endian values */
+  hash = FPI_FNV1A_INIT;
+  hash = fpi_fnv1a_int32 (hash, print->type);
+  hash = hash_string (hash, print->driver);
+  hash = hash_string (hash, print->device_id);
 
-  /* Insert NBIS print data for type NBIS, otherwise the GVariant directly */
   if (print->type == FPI_PRINT_NBIS)
     {
-      GVariantBuilder nested = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(a(aiaiai))"));
-      guint i;
+      /* Invalid prints are empty and hash accordingly */
+      fpi_print_decode_prints (print, NULL);
 
-      g_variant_builder_open (&nested, G_VARIANT_TYPE ("a(aiaiai)"));
       for (i = 0; i < print->prints->len; i++)
         {
           struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
-
-          g_variant_builder_open (&nested, G_VARIANT_TYPE ("(aiaiai)"));
-
-          g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->xcol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->xcol[0])));
-          g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->ycol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->ycol[0])));
-          g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->thetacol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->thetacol[0])));
-          g_variant_builder_close (&nested);
+          gint j;
+
+          hash = fpi_fnv1a_int32 (hash, xyt->nrows);
+          for (j = 0; j < xyt->nrows; j++)
+            {
+              hash = fpi_fnv1a_int32 (hash, xyt->xcol[j]);
+              hash = fpi_fnv1a_int32 (hash, xyt->ycol[j]);
+              hash = fpi_fnv1a_int32 (hash, xyt->thetacol[j]);
+            }
         }
-
-      g_variant_builder_close (&nested);
-      g_variant_builder_add (&builder, "v", g_variant_builder_end (&nested));
     }
-  else
+  else if (print->data)
     {
-      g_variant_builder_add (&builder, "v", g_variant_new_variant (print->data));
+      g_autoptr(GVariant) normal = g_variant_get_normal_form (print->data);
+      g_autoptr(GVariant) data = NULL;
+
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        data = g_variant_byteswap (normal);
+      else
+        data = g_variant_ref (normal);
+
+      hash = hash_string (hash, g_variant_get_type_string (data));
+      hash = fpi_fnv1a_bytes (hash, g_variant_get_data (data), g_variant_get_size (data));
     }
 
-  result = g_variant_builder_end (&builder);
+  /* Zero marks the hash as unknown */
+  if (hash == 0)
+    hash = 1;
 
-  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+  g_atomic_int_set (&print->hash, hash);
+
+  return hash;
+}
+
+/**
+ * fp_print_match:
+ * @enrolled: The enrolled #FpPrint
+ * @probe: The #FpPrint to test
+ * @threshold: The score required for a match, or 0 for the default
+ * @score: (out) (optional): Return location for the score
+ * @error: Return location for error
+ *
+ * Matches @probe against @enrolled without a device. This is only
+ * possible for prints that are matched by the library, i.e. prints of
+ * image devices. The score is the best bozorth3 score of any print in
+ * @probe against any print stored in @enrolled, so @probe may also be an
+ * enrolled print. Drivers may use a different threshold than the default
+ * one.
+ *
+ * This function is thread-safe, but matches are done one at a time.
+ *
+ * Returns: %TRUE if the prints match, %FALSE if they do not match or
+ *   @error is set
+ */
+gboolean
+fp_print_match (FpPrint *enrolled,
+                FpPrint *probe,
+                gint     threshold,
+                gint    *score,
+                GError **error)
+{
+  gint best;
+
+  g_return_val_if_fail (FP_IS_PRINT (enrolled), FALSE);
+  g_return_val_if_fail (FP_IS_PRINT (probe), FALSE);
+  g_return_val_if_fail (threshold >= 0, FALSE);
+
+  if (threshold == 0)
+    threshold = BOZORTH3_DEFAULT_THRESHOLD;
+
+  if (score)
+    *score = 0;
+
+  if (!fpi_print_bz3_score (enrolled, probe, G_MAXINT, &best, error))
+    return FALSE;
+
+  if (score)
+    *score = best;
+
+  return best >= threshold;
+}
+
+typedef struct
+{
+  GPtrArray *gallery;
+  gint       threshold;
+  FpPrint   *match;
+  gint       score;
+} IdentifyData;
+
+static void
+identify_data_free (IdentifyData *data)
+{
+  g_ptr_array_unref (data->gallery);
+  g_clear_object (&data->match);
+  g_free (data);
+}
+
+static void
+identify_thread_func (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  IdentifyData *data = task_data;
+  FpPrint *probe = source_object;
+  GError *error = NULL;
+  guint i;
+
+  for (i = 0; i < data->gallery->len; i++)
     {
-      GVariant *tmp;
-      tmp = g_variant_byteswap (result);
-      g_variant_unref (result);
-      result = tmp;
-    }
+      FpPrint *template = g_ptr_array_index (data->gallery, i);
+      gint score;
 
-  len = g_variant_get_size (result);
-  /* Add 3 bytes of header */
-  len += 3;
+      if (g_task_return_error_if_cancelled (task))
+        return;
 
-  *data = g_malloc (len);
-  *length = len;
+      if (!fpi_print_bz3_score (template, probe, G_MAXINT, &score, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
 
-  (*data)[0] = (guchar) 'F';
-  (*data)[1] = (guchar) 'P';
-  (*data)[2] = (guchar) '3';
+      if (score >= data->threshold && (!data->match || score > data->score))
+        {
+          g_set_object (&data->match, template);
+          data->score = score;
+        }
+    }
 
-  g_variant_get_data (result);
-  g_variant_store (result, (*data) + 3);
+  g_task_return_boolean (task, TRUE);
+}
 
-  return TRUE;
+/**
+ * fp_print_identify_async:
+ * @probe: The #FpPrint to identify
+ * @gallery: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @threshold: The score required for a match, or 0 for the default
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Matches @probe against all prints in @gallery in a worker thread, see
+ * fp_print_match(). Retrieve the result with fp_print_identify_finish().
+ */
+void
+fp_print_identify_async (FpPrint            *probe,
+                         GPtrArray          *gallery,
+                         gint                threshold,
+                         GCancellable       *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  IdentifyData *data;
+  guint i;
+
+  g_return_if_fail (FP_IS_PRINT (probe));
+  g_return_if_fail (gallery != NULL);
+  g_return_if_fail (threshold >= 0);
+
+  task = g_task_new (probe, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_print_identify_async);
+
+  /* Keep our own references, the caller may modify the array */
+  data = g_new0 (IdentifyData, 1);
+  data->gallery = g_ptr_array_new_full (gallery->len, g_object_unref);
+  for (i = 0; i < gallery->len; i++)
+    g_ptr_array_add (data->gallery, g_object_ref (g_ptr_array_index (gallery, i)));
+  data->threshold = threshold > 0 ? threshold : BOZORTH3_DEFAULT_THRESHOLD;
+  g_task_set_task_data (task, data, (GDestroyNotify) identify_data_free);
+
+  fpi_worker_pool_run_task (fpi_worker_pool_get_default (), task,
+                            identify_thread_func);
 }
 
 /**
- * fp_print_deserialize:
- * @data: (array length=length): The binary data
- * @length: Length of the data
+ * fp_print_identify_finish:
+ * @probe: The #FpPrint that was identified
+ * @result: A #GAsyncResult
+ * @match: (out) (transfer full) (optional) (nullable): Return location for
+ *   the best matching #FpPrint from the gallery, or %NULL if none matched
+ * @score: (out) (optional): Return location for the score of @match
  * @error: Return location for error
  *
- * Deserialize a print definition from permanent storage.
+ * Finishes fp_print_identify_async().
  *
- * Returns: (transfer full): A newly created #FpPrint on success
+ * Returns: %FALSE on error, %TRUE otherwise
  */
-FpPrint *
-fp_print_deserialize (const guchar *data,
-                      gsize         length,
-                      GError      **error)
+gboolean
+fp_print_identify_finish (FpPrint      *probe,
+                          GAsyncResult *result,
+                          FpPrint     **match,
+                          gint         *score,
+                          GError      **error)
 {
-  g_autoptr(FpPrint) result = NULL;
-  g_autoptr(GVariant) raw_value = NULL;
-  g_autoptr(GVariant) value = NULL;
-  g_autoptr(GVariant) print_data = NULL;
-  g_autoptr(GDate) date = NULL;
-  guchar *aligned_data = NULL;
-  guint8 finger_int8;
-  FpFinger finger;
-  g_autofree gchar *username = NULL;
-  g_autofree gchar *description = NULL;
-  gint julian_date;
-  FpiPrintType type;
-  const gchar *driver;
-  const gchar *device_id;
-  gboolean device_stored;
+  IdentifyData *data;
 
-  g_assert (data);
-  g_assert (length > 3);
+  g_return_val_if_fail (g_task_is_valid (result, probe), FALSE);
 
-  if (memcmp (data, "FP3", 3) != 0)
-    goto invalid_format;
+  data = g_task_get_task_data (G_TASK (result));
+  if (match)
+    *match = NULL;
+  if (score)
+    *score = 0;
 
-  /* NOTE:
-   * We make sure that we have no variant left over from the parsing at the end
-   * of this function (meaning we don't need to keep the data around.
-   */
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
 
-  /* To support GLIB < 2.60 we need to make sure that the memory is aligned correctly.
-   * We also need to copy the backing store for the raw data that we may keep for
-   * longer. */
-  aligned_data = g_malloc (length - 3);
-  memcpy (aligned_data, data + 3, length - 3);
-  raw_value = g_variant_new_from_data (FPI_PRINT_VARIANT_TYPE,
-                                       aligned_data, length - 3,
-                                       FALSE, g_free, aligned_data);
+  if (match && data->match)
+    *match = g_object_ref (data->match);
+  if (score)
+    *score = data->score;
 
-  if (!raw_value)
-    goto invalid_format;
+  return TRUE;
+}
 
-  if (G_BYTE_ORDER == G_BIG_ENDIAN)
-    value = g_variant_byteswap (raw_value);
-  else
-    value = g_variant_get_normal_form (raw_value);
+#define FPI_PRINT_VARIANT_TYPE G_VARIANT_TYPE ("(issbymsmsia{sv}v)")
+/* Driver and device ID are indices into the leading string table */
+#define FPI_PRINT_MANY_VARIANT_TYPE G_VARIANT_TYPE ("(asa(iuubymsmsia{sv}v))")
+#define FPI_PRINT_MANY_CHUNK_SIZE 256
+
+/* Content of the print data variant for NBIS prints */
+#define FPI_PRINT_NBIS_VARIANT_TYPE G_VARIANT_TYPE ("(a(aiaiai))")
+#define FPI_PRINT_NBIS_COMPACT_VARIANT_TYPE G_VARIANT_TYPE ("(yaay)")
+#define FPI_PRINT_NBIS_COMPACT_VERSION 1
+/* Fixed layout record, see FpPrintSerializeFlags */
+#define FPI_PRINT_NBIS_FIXED_VARIANT_TYPE G_VARIANT_TYPE_BYTESTRING
+#define FPI_PRINT_NBIS_FIXED_MAGIC "XYT"
+#define FPI_PRINT_NBIS_FIXED_VERSION 1
+#define FPI_PRINT_NBIS_FIXED_RECORD_SIZE 6
 
-  g_variant_get (value,
-                 "(i&s&sbymsmsi@a{sv}v)",
-                 &type,
-                 &driver,
-                 &device_id,
-                 &device_stored,
-                 &finger_int8,
-                 &username,
-                 &description,
-                 &julian_date,
-                 NULL,
-                 &print_data);
+G_STATIC_ASSERT (sizeof (((struct xyt_struct *) NULL)->xcol[0]) == 4);
 
-  finger = finger_int8;
+/*
+ * Compact NBIS encoding
+ *
+ * Each stage is stored as a byte string. It starts with the number of
+ * minutiae, followed by the first x coordinate and three bit-packed
+ * streams: the x deltas between consecutive minutiae (which are sorted by
+ * x), the y coordinates and the angles. Each stream starts with its
+ * minimum value and the number of bits used per value, followed by the
+ * offsets from that minimum packed LSB first. Counts and minimums are
+ * stored as (zigzag) varints.
+ */
 
-  /* Assume data is valid at this point if the values are somewhat sane. */
-  if (type == FPI_PRINT_NBIS)
-    {
-      g_autoptr(GVariant) prints = g_variant_get_child_value (print_data, 0);
-      guint i;
+static inline guint32
+zigzag_encode (gint32 value)
+{
+  return ((guint32) value << 1) ^ (guint32) (value >> 31);
+}
 
-      result = g_object_new (FP_TYPE_PRINT,
-                             "driver", driver,
-                             "device-id", device_id,
-                             "device-stored", device_stored,
-                             NULL);
-      g_object_ref_sink (result);
-      fpi_print_set_type (result, FPI_PRINT_NBIS);
-      for (i = 0; i < g_variant_n_children (prints); i++)
-        {
-          g_autofree struct xyt_struct *xyt = NULL;
-          const gint32 *xcol, *ycol, *thetacol;
-          gsize xlen, ylen, thetalen;
-          g_autoptr(GVariant) xyt_data = NULL;
-          GVariant *child;
+static inline gint32
+zigzag_decode (guint32 value)
+{
+  return (gint32) ((value >> 1) ^ -(value & 1));
+}
+
+static void
+put_varint (FpiByteWriter *writer, guint32 value)
+{
+  while (value >= 0x80)
+    {
+      fpi_byte_writer_put_uint8 (writer, (value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+  fpi_byte_writer_put_uint8 (writer, value);
+}
 
-          xyt_data = g_variant_get_child_value (prints, i);
+static gboolean
+get_varint (FpiByteReader *reader, guint32 *value)
+{
+  guint32 result = 0;
+  guint shift;
+  guint8 byte;
 
-          child = g_variant_get_child_value (xyt_data, 0);
-          xcol = g_variant_get_fixed_array (child, &xlen, sizeof (gint32));
-          g_variant_unref (child);
+  for (shift = 0; shift < 35; shift += 7)
+    {
+      if (!fpi_byte_reader_get_uint8 (reader, &byte))
+        return FALSE;
 
-          child = g_variant_get_child_value (xyt_data, 1);
-          ycol = g_variant_get_fixed_array (child, &ylen, sizeof (gint32));
-          g_variant_unref (child);
+      result |= (guint32) (byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        {
+          *value = result;
+          return TRUE;
+        }
+    }
 
-          child = g_variant_get_child_value (xyt_data, 2);
-          thetacol = g_variant_get_fixed_array (child, &thetalen, sizeof (gint32));
-          g_variant_unref (child);
+  return FALSE;
+}
 
-          if (xlen != ylen || xlen != thetalen)
-            goto invalid_format;
+static void
+pack_stream (FpiByteWriter *writer, const gint32 *values, guint n_values)
+{
+  gint32 min = n_values > 0 ? values[0] : 0;
+  guint32 max_offset = 0;
+  guint64 bits = 0;
+  guint n_bits = 0;
+  guint width = 0;
+  guint i;
+
+  for (i = 1; i < n_values; i++)
+    min = MIN (min, values[i]);
+  for (i = 0; i < n_values; i++)
+    max_offset = MAX (max_offset, (guint32) values[i] - (guint32) min);
+  while (width < 32 && (max_offset >> width) != 0)
+    width++;
+
+  put_varint (writer, zigzag_encode (min));
+  fpi_byte_writer_put_uint8 (writer, width);
+
+  for (i = 0; i < n_values; i++)
+    {
+      bits |= (guint64) ((guint32) values[i] - (guint32) min) << n_bits;
+      n_bits += width;
+      while (n_bits >= 8)
+        {
+          fpi_byte_writer_put_uint8 (writer, bits & 0xff);
+          bits >>= 8;
+          n_bits -= 8;
+        }
+    }
+  if (n_bits > 0)
+    fpi_byte_writer_put_uint8 (writer, bits & 0xff);
+}
 
-          if (xlen > G_N_ELEMENTS (xyt->xcol))
-            goto invalid_format;
+static gboolean
+unpack_stream (FpiByteReader *reader, gint32 *values, guint n_values)
+{
+  const guint8 *packed;
+  guint32 min;
+  guint64 mask;
+  guint64 bits = 0;
+  guint n_bits = 0;
+  guint8 width;
+  guint i;
+
+  if (!get_varint (reader, &min) ||
+      !fpi_byte_reader_get_uint8 (reader, &width) ||
+      width > 32)
+    return FALSE;
 
-          xyt = g_new0 (struct xyt_struct, 1);
-          xyt->nrows = xlen;
-          memcpy (xyt->xcol, xcol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->ycol, ycol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->thetacol, thetacol, sizeof (xcol[0]) * xlen);
+  if (!fpi_byte_reader_get_data (reader, (n_values * width + 7) / 8, &packed))
+    return FALSE;
 
-          g_ptr_array_add (result->prints, g_steal_pointer (&xyt));
+  min = (guint32) zigzag_decode (min);
+  mask = (G_GUINT64_CONSTANT (1) << width) - 1;
+  for (i = 0; i < n_values; i++)
+    {
+      while (n_bits < width)
+        {
+          bits |= (guint64) *packed++ << n_bits;
+          n_bits += 8;
         }
+      values[i] = (gint32) (min + (guint32) (bits & mask));
+      bits >>= width;
+      n_bits -= width;
     }
-  else if (type == FPI_PRINT_RAW || type == FPI_PRINT_SDCP)
+
+  return TRUE;
+}
+
+static GVariant *
+fp_print_encode_xyt_compact (struct xyt_struct *xyt)
+{
+  FpiByteWriter writer;
+  gint32 dx[G_N_ELEMENTS (xyt->xcol)];
+  guint8 *data;
+  guint size;
+  gint i;
+
+  fpi_byte_writer_init_with_size (&writer, 16 + xyt->nrows * 4, FALSE);
+
+  put_varint (&writer, xyt->nrows);
+  if (xyt->nrows > 0)
     {
-      g_autoptr(GVariant) fp_data = g_variant_get_child_value (print_data, 0);
+      for (i = 1; i < xyt->nrows; i++)
+        dx[i - 1] = (gint32) ((guint32) xyt->xcol[i] - (guint32) xyt->xcol[i - 1]);
 
-      result = g_object_new (FP_TYPE_PRINT,
-                             "fpi-type", type,
-                             "driver", driver,
-                             "device-id", device_id,
-                             "device-stored", device_stored,
-                             "fpi-data", fp_data,
-                             NULL);
-      g_object_ref_sink (result);
+      put_varint (&writer, zigzag_encode (xyt->xcol[0]));
+      pack_stream (&writer, dx, xyt->nrows - 1);
+      pack_stream (&writer, xyt->ycol, xyt->nrows);
+      pack_stream (&writer, xyt->thetacol, xyt->nrows);
     }
-  else
+
+  size = fpi_byte_writer_get_pos (&writer);
+  data = fpi_byte_writer_reset_and_get_data (&writer);
+
+  return g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING,
+                                  data, size, TRUE, g_free, data);
+}
+
+static struct xyt_struct *
+fp_print_decode_xyt_compact (GVariant *stage)
+{
+  g_autofree struct xyt_struct *xyt = NULL;
+  FpiByteReader reader;
+  const guint8 *data;
+  guint32 nrows;
+  guint32 x0;
+  gsize size;
+  gint i;
+
+  data = g_variant_get_fixed_array (stage, &size, 1);
+  fpi_byte_reader_init (&reader, data, size);
+
+  if (!get_varint (&reader, &nrows) || nrows > G_N_ELEMENTS (xyt->xcol))
+    return NULL;
+
+  xyt = g_new0 (struct xyt_struct, 1);
+  xyt->nrows = nrows;
+  if (nrows == 0)
+    return fpi_byte_reader_get_remaining (&reader) == 0 ? g_steal_pointer (&xyt) : NULL;
+
+  if (!get_varint (&reader, &x0) ||
+      !unpack_stream (&reader, xyt->xcol + 1, nrows - 1) ||
+      !unpack_stream (&reader, xyt->ycol, nrows) ||
+      !unpack_stream (&reader, xyt->thetacol, nrows) ||
+      fpi_byte_reader_get_remaining (&reader) != 0)
+    return NULL;
+
+  xyt->xcol[0] = zigzag_decode (x0);
+  for (i = 1; i < xyt->nrows; i++)
+    xyt->xcol[i] = (gint32) ((guint32) xyt->xcol[i - 1] + (guint32) xyt->xcol[i]);
+
+  return g_steal_pointer (&xyt);
+}
+
+/*
+ * Fixed layout NBIS encoding
+ *
+ * The record is stored as the bare print data bytestring, which GVariant
+ * places at the 8 byte aligned start of the print data variant. When it is
+ * deserialized from a buffer, the minutiae are read in place and only need
+ * to be converted on big endian machines.
+ */
+
+static GVariant *
+fp_print_encode_fixed (FpPrint *print)
+{
+  FpiByteWriter writer;
+  guint8 *data;
+  guint size;
+  guint i;
+  gint j;
+
+  if (print->prints->len > G_MAXUINT16)
+    return NULL;
+
+  fpi_byte_writer_init_with_size (&writer, 8 + print->prints->len * 256, FALSE);
+  fpi_byte_writer_put_data (&writer, (const guint8 *) FPI_PRINT_NBIS_FIXED_MAGIC, 4);
+  fpi_byte_writer_put_uint16_le (&writer, FPI_PRINT_NBIS_FIXED_VERSION);
+  fpi_byte_writer_put_uint16_le (&writer, print->prints->len);
+
+  for (i = 0; i < print->prints->len; i++)
     {
-      g_warning ("Invalid print type: 0x%X", type);
-      goto invalid_format;
+      struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+
+      fpi_byte_writer_put_uint16_le (&writer, xyt->nrows);
+      fpi_byte_writer_put_uint16_le (&writer, 0);
+
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          /* Not representable, the caller falls back to the default */
+          if (xyt->xcol[j] != (gint16) xyt->xcol[j] ||
+              xyt->ycol[j] != (gint16) xyt->ycol[j] ||
+              xyt->thetacol[j] != (gint16) xyt->thetacol[j])
+            {
+              fpi_byte_writer_reset (&writer);
+              return NULL;
+            }
+
+          fpi_byte_writer_put_int16_le (&writer, xyt->xcol[j]);
+          fpi_byte_writer_put_int16_le (&writer, xyt->ycol[j]);
+          fpi_byte_writer_put_int16_le (&writer, xyt->thetacol[j]);
+        }
     }
 
-  date = g_date_new_julian (julian_date);
-  g_object_set (result,
-                "finger", finger,
-                "username", username,
-                "description", description,
-                "enroll_date", date,
-                NULL);
+  size = fpi_byte_writer_get_pos (&writer);
+  data = fpi_byte_writer_reset_and_get_data (&writer);
 
-  return g_steal_pointer (&result);
+  return g_variant_new_from_data (FPI_PRINT_NBIS_FIXED_VARIANT_TYPE,
+                                  data, size, TRUE, g_free, data);
+}
 
-invalid_format:
-  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-               "Data could not be parsed");
-  return NULL;
+static inline gint
+fixed_get_int16 (const guint8 *data)
+{
+  gint16 value;
+
+  /* A plain load on little endian machines */
+  memcpy (&value, data, sizeof (value));
+
+  return GINT16_FROM_LE (value);
+}
+
+static gboolean
+fp_print_decode_fixed (GVariant  *record,
+                       GPtrArray *prints)
+{
+  FpiByteReader reader;
+  const guint8 *data;
+  const guint8 *magic;
+  guint16 version;
+  guint16 n_stages;
+  gsize size;
+  guint i;
+
+  data = g_variant_get_fixed_array (record, &size, 1);
+  fpi_byte_reader_init (&reader, data, size);
+
+  if (!fpi_byte_reader_get_data (&reader, 4, &magic) ||
+      memcmp (magic, FPI_PRINT_NBIS_FIXED_MAGIC, 4) != 0 ||
+      !fpi_byte_reader_get_uint16_le (&reader, &version) ||
+      version != FPI_PRINT_NBIS_FIXED_VERSION ||
+      !fpi_byte_reader_get_uint16_le (&reader, &n_stages))
+    return FALSE;
+
+  for (i = 0; i < n_stages; i++)
+    {
+      struct xyt_struct *xyt;
+      const guint8 *records;
+      guint16 nrows;
+      gint j;
+
+      if (!fpi_byte_reader_get_uint16_le (&reader, &nrows) ||
+          nrows > G_N_ELEMENTS (xyt->xcol) ||
+          !fpi_byte_reader_skip (&reader, 2) ||
+          !fpi_byte_reader_get_data (&reader, nrows * FPI_PRINT_NBIS_FIXED_RECORD_SIZE, &records))
+        return FALSE;
+
+      xyt = g_new0 (struct xyt_struct, 1);
+      xyt->nrows = nrows;
+      for (j = 0; j < nrows; j++)
+        {
+          const guint8 *minutia = records + j * FPI_PRINT_NBIS_FIXED_RECORD_SIZE;
+
+          xyt->xcol[j] = fixed_get_int16 (minutia);
+          xyt->ycol[j] = fixed_get_int16 (minutia + 2);
+          xyt->thetacol[j] = fixed_get_int16 (minutia + 4);
+        }
+
+      g_ptr_array_add (prints, xyt);
+    }
+
+  return fpi_byte_reader_get_remaining (&reader) == 0;
+}
+
+/* Adds the metadata fields following the driver and device information */
+static void
+fp_print_add_metadata (FpPrint              *print,
+                       FpPrintSerializeFlags flags,
+                       GVariantBuilder      *builder)
+{
+  g_variant_builder_add (builder, "y", print->finger);
+  g_variant_builder_add (builder, "ms", print->username);
+  g_variant_builder_add (builder, "ms", print->description);
+  if (print->enroll_date && g_date_valid (print->enroll_date))
+    g_variant_builder_add (builder, "i", g_date_get_julian (print->enroll_date));
+  else
+    g_variant_builder_add (builder, "i", G_MININT32);
+
+  /* a{sv} for optional data and expansion */
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARDICT);
+  if ((flags & FP_PRINT_SERIALIZE_MATCHER_DATA) && print->type == FPI_PRINT_NBIS)
+    g_variant_builder_add (builder, "{sv}", "bz3-tables",
+                           fpi_print_bz3_tables_serialize (print));
+  g_variant_builder_close (builder);
+}
+
+/* Returns the content of the trailing variant holding the print data */
+static GVariant *
+fp_print_get_data_variant (FpPrint              *print,
+                           FpPrintSerializeFlags flags)
+{
+  GVariantBuilder nested = G_VARIANT_BUILDER_INIT (FPI_PRINT_NBIS_VARIANT_TYPE);
+  guint i;
+
+  /* Insert NBIS print data for type NBIS, otherwise the GVariant directly */
+  if (print->type != FPI_PRINT_NBIS)
+    return g_variant_new_variant (print->data);
+
+  if (flags & FP_PRINT_SERIALIZE_COMPACT)
+    {
+      GVariantBuilder stages = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("aay"));
+
+      for (i = 0; i < print->prints->len; i++)
+        g_variant_builder_add_value (&stages,
+                                     fp_print_encode_xyt_compact (g_ptr_array_index (print->prints, i)));
+
+      return g_variant_new ("(y@aay)", FPI_PRINT_NBIS_COMPACT_VERSION,
+                            g_variant_builder_end (&stages));
+    }
+
+  if (flags & FP_PRINT_SERIALIZE_FIXED_LAYOUT)
+    {
+      GVariant *record = fp_print_encode_fixed (print);
+
+      if (record)
+        return record;
+      fp_dbg ("Minutiae exceed the fixed layout, using the default encoding");
+    }
+
+  g_variant_builder_open (&nested, G_VARIANT_TYPE ("a(aiaiai)"));
+  for (i = 0; i < print->prints->len; i++)
+    {
+      struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+
+      g_variant_builder_open (&nested, G_VARIANT_TYPE ("(aiaiai)"));
+
+      g_variant_builder_add_value (&nested,
+                                   g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                              xyt->xcol,
+                                                              xyt->nrows,
+                                                              sizeof (xyt->xcol[0])));
+      g_variant_builder_add_value (&nested,
+                                   g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                              xyt->ycol,
+                                                              xyt->nrows,
+                                                              sizeof (xyt->ycol[0])));
+      g_variant_builder_add_value (&nested,
+                                   g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                              xyt->thetacol,
+                                                              xyt->nrows,
+                                                              sizeof (xyt->thetacol[0])));
+      g_variant_builder_close (&nested);
+    }
+
+  g_variant_builder_close (&nested);
+
+  return g_variant_builder_end (&nested);
+}
+
+/* Stores @value in little endian byte order after the 3 byte @magic */
+static void
+fp_print_store_variant (GVariant    *value,
+                        const gchar *magic,
+                        guchar     **data,
+                        gsize       *length)
+{
+  g_autoptr(GVariant) result = g_variant_ref_sink (value);
+  gsize len;
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *tmp;
+      tmp = g_variant_byteswap (result);
+      g_variant_unref (result);
+      result = tmp;
+    }
+
+  len = g_variant_get_size (result);
+  /* Add 3 bytes of header */
+  len += 3;
+
+  *data = g_malloc (len);
+  *length = len;
+
+  memcpy (*data, magic, 3);
+
+  g_variant_get_data (result);
+  g_variant_store (result, (*data) + 3);
+}
+
+/**
+ * fp_print_serialize:
+ * @print: A #FpPrint
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Serialize a print definition for permanent storage. Note that this is
+ * lossy in the sense that e.g. the image data is discarded.
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize (FpPrint *print,
+                    guchar **data,
+                    gsize   *length,
+                    GError **error)
+{
+  return fp_print_serialize_full (print, FP_PRINT_SERIALIZE_NONE,
+                                  data, length, error);
+}
+
+/**
+ * fp_print_serialize_full:
+ * @print: A #FpPrint
+ * @flags: #FpPrintSerializeFlags to use
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Like fp_print_serialize() but allows selecting what is stored using
+ * @flags. The result can be loaded using fp_print_deserialize().
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize_full (FpPrint              *print,
+                         FpPrintSerializeFlags flags,
+                         guchar              **data,
+                         gsize                *length,
+                         GError              **error)
+{
+  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_VARIANT_TYPE);
+
+  g_assert (data);
+  g_assert (length);
+
+  fpi_print_decode_metadata (print);
+  if (!fpi_print_decode_prints (print, error))
+    return FALSE;
+
+  g_variant_builder_add (&builder, "i", print->type);
+  g_variant_builder_add (&builder, "s", print->driver);
+  g_variant_builder_add (&builder, "s", print->device_id);
+  g_variant_builder_add (&builder, "b", print->device_stored);
+
+  fp_print_add_metadata (print, flags, &builder);
+
+  g_variant_builder_add (&builder, "v", fp_print_get_data_variant (print, flags));
+
+  fp_print_store_variant (g_variant_builder_end (&builder), "FP3", data, length);
+
+  return TRUE;
+}
+
+static guint
+intern_string (GHashTable  *table,
+               GPtrArray   *strings,
+               const gchar *str)
+{
+  gpointer index;
+
+  if (g_hash_table_lookup_extended (table, str, NULL, &index))
+    return GPOINTER_TO_UINT (index);
+
+  g_hash_table_insert (table, (gpointer) str, GUINT_TO_POINTER (strings->len));
+  g_ptr_array_add (strings, (gpointer) str);
+
+  return strings->len - 1;
+}
+
+/**
+ * fp_print_serialize_many:
+ * @prints: (element-type FpPrint): The prints to serialize
+ * @flags: #FpPrintSerializeFlags to use
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Serialize a whole set of prints into a single buffer, which can be
+ * loaded again using fp_print_deserialize_many(). The driver and device
+ * ID strings are only stored once for all prints, so the result is
+ * smaller than serializing each print on its own.
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize_many (GPtrArray            *prints,
+                         FpPrintSerializeFlags flags,
+                         guchar              **data,
+                         gsize                *length,
+                         GError              **error)
+{
+  g_autoptr(GHashTable) table = NULL;
+  g_autoptr(GPtrArray) strings = NULL;
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(iuubymsmsia{sv}v)"));
+  GVariant *value;
+  guint i;
+
+  g_return_val_if_fail (prints != NULL, FALSE);
+  g_assert (data);
+  g_assert (length);
+
+  table = g_hash_table_new (g_str_hash, g_str_equal);
+  strings = g_ptr_array_new ();
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+
+      g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+      fpi_print_decode_metadata (print);
+      if (!fpi_print_decode_prints (print, error))
+        return FALSE;
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("(iuubymsmsia{sv}v)"));
+      g_variant_builder_add (&builder, "i", print->type);
+      g_variant_builder_add (&builder, "u", intern_string (table, strings, print->driver));
+      g_variant_builder_add (&builder, "u", intern_string (table, strings, print->device_id));
+      g_variant_builder_add (&builder, "b", print->device_stored);
+      fp_print_add_metadata (print, flags, &builder);
+      g_variant_builder_add (&builder, "v", fp_print_get_data_variant (print, flags));
+      g_variant_builder_close (&builder);
+    }
+
+  g_ptr_array_add (strings, NULL);
+  value = g_variant_new ("(^as@a(iuubymsmsia{sv}v))",
+                         (const gchar * const *) strings->pdata,
+                         g_variant_builder_end (&builder));
+  fp_print_store_variant (value, "FPM", data, length);
+
+  return TRUE;
+}
+
+/* The metadata is at the same position in all serialization formats */
+static void
+fp_print_load_metadata (FpPrint  *print,
+                        GVariant *value)
+{
+  const gchar *username = NULL;
+  const gchar *description = NULL;
+  guint8 finger;
+  gint julian_date;
+
+  g_variant_get_child (value, 4, "y", &finger);
+  g_variant_get_child (value, 5, "m&s", &username);
+  g_variant_get_child (value, 6, "m&s", &description);
+  g_variant_get_child (value, 7, "i", &julian_date);
+
+  print->finger = finger;
+  print->username = g_strdup (username);
+  print->description = g_strdup (description);
+  if (g_date_valid_julian (julian_date))
+    print->enroll_date = g_date_new_julian (julian_date);
+}
+
+/* Decodes the metadata of a print that was deserialized lazily. This is a
+ * no-op if the metadata has been decoded already. */
+void
+fpi_print_decode_metadata (FpPrint *print)
+{
+  GVariant *value;
+
+  if (G_LIKELY (g_atomic_pointer_get (&print->lazy_metadata) == NULL))
+    return;
+
+  g_mutex_lock (&print->decode_lock);
+  value = print->lazy_metadata;
+  if (value)
+    {
+      fp_print_load_metadata (print, value);
+
+      g_atomic_pointer_set (&print->lazy_metadata, NULL);
+      g_variant_unref (value);
+    }
+  g_mutex_unlock (&print->decode_lock);
+}
+
+static struct xyt_struct *
+fp_print_decode_xyt (GVariant *xyt_data)
+{
+  struct xyt_struct *xyt;
+  const gint32 *xcol, *ycol, *thetacol;
+  gsize xlen, ylen, thetalen;
+  GVariant *child;
+
+  child = g_variant_get_child_value (xyt_data, 0);
+  xcol = g_variant_get_fixed_array (child, &xlen, sizeof (gint32));
+  g_variant_unref (child);
+
+  child = g_variant_get_child_value (xyt_data, 1);
+  ycol = g_variant_get_fixed_array (child, &ylen, sizeof (gint32));
+  g_variant_unref (child);
+
+  child = g_variant_get_child_value (xyt_data, 2);
+  thetacol = g_variant_get_fixed_array (child, &thetalen, sizeof (gint32));
+  g_variant_unref (child);
+
+  if (xlen != ylen || xlen != thetalen)
+    return NULL;
+
+  if (xlen > G_N_ELEMENTS (xyt->xcol))
+    return NULL;
+
+  xyt = g_new0 (struct xyt_struct, 1);
+  xyt->nrows = xlen;
+  memcpy (xyt->xcol, xcol, sizeof (xcol[0]) * xlen);
+  memcpy (xyt->ycol, ycol, sizeof (xcol[0]) * xlen);
+  memcpy (xyt->thetacol, thetacol, sizeof (xcol[0]) * xlen);
+
+  return xyt;
+}
+
+/* Decodes the NBIS prints of a print that was deserialized lazily. This is
+ * a no-op if the prints have been decoded already. If the data is invalid,
+ * then an error is returned once and the print stays empty. */
+gboolean
+fpi_print_decode_prints (FpPrint *print, GError **error)
+{
+  g_autoptr(GVariant) stages = NULL;
+  GVariant *prints;
+  gboolean compact;
+  gboolean res = TRUE;
+  gsize i;
+
+  if (G_LIKELY (g_atomic_pointer_get (&print->lazy_prints) == NULL))
+    return TRUE;
+
+  g_mutex_lock (&print->decode_lock);
+  prints = print->lazy_prints;
+  if (prints && g_variant_is_of_type (prints, FPI_PRINT_NBIS_FIXED_VARIANT_TYPE))
+    {
+      if (!fp_print_decode_fixed (prints, print->prints))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Data could not be parsed");
+          g_ptr_array_set_size (print->prints, 0);
+          res = FALSE;
+        }
+
+      g_atomic_pointer_set (&print->lazy_prints, NULL);
+      g_variant_unref (prints);
+    }
+  else if (prints)
+    {
+      guint8 version = FPI_PRINT_NBIS_COMPACT_VERSION;
+
+      compact = g_variant_is_of_type (prints, FPI_PRINT_NBIS_COMPACT_VARIANT_TYPE);
+      if (compact)
+        g_variant_get (prints, "(y@aay)", &version, &stages);
+      else
+        stages = g_variant_get_child_value (prints, 0);
+
+      if (version != FPI_PRINT_NBIS_COMPACT_VERSION)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Unsupported print encoding version %u", version);
+          res = FALSE;
+          g_clear_pointer (&stages, g_variant_unref);
+        }
+
+      for (i = 0; stages && i < g_variant_n_children (stages); i++)
+        {
+          g_autoptr(GVariant) xyt_data = g_variant_get_child_value (stages, i);
+          struct xyt_struct *xyt;
+
+          if (compact)
+            xyt = fp_print_decode_xyt_compact (xyt_data);
+          else
+            xyt = fp_print_decode_xyt (xyt_data);
+
+          if (!xyt)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Data could not be parsed");
+              g_ptr_array_set_size (print->prints, 0);
+              res = FALSE;
+              break;
+            }
+
+          g_ptr_array_add (print->prints, xyt);
+        }
+
+      g_atomic_pointer_set (&print->lazy_prints, NULL);
+      g_variant_unref (prints);
+    }
+  g_mutex_unlock (&print->decode_lock);
+
+  return res;
+}
+
+/* Picks up optional data stored in the a{sv} of the print */
+static void
+fp_print_load_extensions (FpPrint  *print,
+                          GVariant *value)
+{
+  g_autoptr(GVariant) dict = g_variant_get_child_value (value, 8);
+
+  if (print->type == FPI_PRINT_NBIS)
+    print->bz3_data = g_variant_lookup_value (dict, "bz3-tables",
+                                              G_VARIANT_TYPE ("(ua(uai))"));
+}
+
+static FpPrint *
+fp_print_new_from_fields (FpiPrintType type,
+                          const gchar *driver,
+                          const gchar *device_id,
+                          gboolean     device_stored,
+                          GVariant    *print_data,
+                          GError     **error)
+{
+  FpPrint *result;
+
+  /* Assume data is valid at this point if the values are somewhat sane. */
+  if (type == FPI_PRINT_NBIS)
+    {
+      result = g_object_new (FP_TYPE_PRINT,
+                             "driver", driver,
+                             "device-id", device_id,
+                             "device-stored", device_stored,
+                             NULL);
+      g_object_ref_sink (result);
+      fpi_print_set_type (result, FPI_PRINT_NBIS);
+
+      if (!g_variant_is_of_type (print_data, FPI_PRINT_NBIS_VARIANT_TYPE) &&
+          !g_variant_is_of_type (print_data, FPI_PRINT_NBIS_COMPACT_VARIANT_TYPE) &&
+          !g_variant_is_of_type (print_data, FPI_PRINT_NBIS_FIXED_VARIANT_TYPE))
+        {
+          g_object_unref (result);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Data could not be parsed");
+          return NULL;
+        }
+      result->lazy_prints = g_variant_ref (print_data);
+    }
+  else if (type == FPI_PRINT_RAW || type == FPI_PRINT_SDCP)
+    {
+      g_autoptr(GVariant) fp_data = g_variant_get_child_value (print_data, 0);
+
+      result = g_object_new (FP_TYPE_PRINT,
+                             "fpi-type", type,
+                             "driver", driver,
+                             "device-id", device_id,
+                             "device-stored", device_stored,
+                             "fpi-data", fp_data,
+                             NULL);
+      g_object_ref_sink (result);
+    }
+  else
+    {
+      g_warning ("Invalid print type: 0x%X", type);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  return result;
+}
+
+static FpPrint *
+fp_print_new_from_variant (GVariant *value,
+                           gboolean  lazy,
+                           GError  **error)
+{
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GVariant) print_data = NULL;
+  FpiPrintType type;
+  const gchar *driver;
+  const gchar *device_id;
+  gboolean device_stored;
+
+  /* Only the data needed to construct the object is decoded here */
+  g_variant_get (value,
+                 "(i&s&sbymsmsi@a{sv}v)",
+                 &type,
+                 &driver,
+                 &device_id,
+                 &device_stored,
+                 NULL,
+                 NULL,
+                 NULL,
+                 NULL,
+                 NULL,
+                 &print_data);
+
+  result = fp_print_new_from_fields (type, driver, device_id, device_stored,
+                                     print_data, error);
+  if (!result)
+    return NULL;
+
+  fp_print_load_extensions (result, value);
+  result->lazy_metadata = g_variant_ref (value);
+
+  if (!lazy)
+    {
+      fpi_print_decode_metadata (result);
+      if (!fpi_print_decode_prints (result, error))
+        return NULL;
+    }
+
+  return g_steal_pointer (&result);
+}
+
+/**
+ * fp_print_deserialize:
+ * @data: (array length=length): The binary data
+ * @length: Length of the data
+ * @error: Return location for error
+ *
+ * Deserialize a print definition from permanent storage.
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize (const guchar *data,
+                      gsize         length,
+                      GError      **error)
+{
+  g_autoptr(GVariant) raw_value = NULL;
+  g_autoptr(GVariant) value = NULL;
+  guchar *aligned_data = NULL;
+
+  g_assert (data);
+  g_assert (length > 3);
+
+  if (memcmp (data, "FP3", 3) != 0)
+    goto invalid_format;
+
+  /* NOTE:
+   * We make sure that we have no variant left over from the parsing at the end
+   * of this function (meaning we don't need to keep the data around.
+   */
+
+  /* To support GLIB < 2.60 we need to make sure that the memory is aligned correctly.
+   * We also need to copy the backing store for the raw data that we may keep for
+   * longer. */
+  aligned_data = g_malloc (length - 3);
+  memcpy (aligned_data, data + 3, length - 3);
+  raw_value = g_variant_new_from_data (FPI_PRINT_VARIANT_TYPE,
+                                       aligned_data, length - 3,
+                                       FALSE, g_free, aligned_data);
+
+  if (!raw_value)
+    goto invalid_format;
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    value = g_variant_byteswap (raw_value);
+  else
+    value = g_variant_get_normal_form (raw_value);
+
+  return fp_print_new_from_variant (value, FALSE, error);
+
+invalid_format:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Data could not be parsed");
+  return NULL;
+}
+
+/**
+ * fp_print_deserialize_bytes:
+ * @data: The serialized print
+ * @error: Return location for error
+ *
+ * Deserialize a print definition from permanent storage without copying
+ * or decoding all of it. The returned print keeps a reference to @data,
+ * the metadata and the print data are only decoded when they are first
+ * accessed. This makes it cheap to load many prints of which only a few
+ * are going to be used, e.g. after filtering them by finger.
+ *
+ * @data is only referenced if the data following the 3 byte header is
+ * 8 byte aligned, it is copied otherwise.
+ *
+ * Unlike fp_print_deserialize(), this function cannot detect all errors
+ * in the print data. Invalid print data is reported when matching and
+ * the print will not match anything.
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize_bytes (GBytes  *data,
+                            GError **error)
+{
+  g_autoptr(GBytes) payload = NULL;
+  g_autoptr(GVariant) value = NULL;
+  const guint8 *raw;
+  gsize length;
+
+  g_return_val_if_fail (data != NULL, NULL);
+
+  raw = g_bytes_get_data (data, &length);
+  if (length <= 3 || memcmp (raw, "FP3", 3) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  if (GPOINTER_TO_SIZE (raw + 3) % 8 == 0)
+    payload = g_bytes_new_from_bytes (data, 3, length - 3);
+  else
+    payload = g_bytes_new (raw + 3, length - 3);
+
+  value = g_variant_ref_sink (g_variant_new_from_bytes (FPI_PRINT_VARIANT_TYPE,
+                                                        payload, FALSE));
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *tmp = g_variant_byteswap (value);
+
+      g_variant_unref (value);
+      value = tmp;
+    }
+
+  return fp_print_new_from_variant (value, TRUE, error);
+}
+
+typedef struct
+{
+  GVariant     *prints;
+  const gchar **strings;
+  gsize         n_strings;
+  FpPrint     **results;
+
+  GMutex        error_lock;
+  GError       *error;
+} DeserializeManyData;
+
+typedef struct
+{
+  gsize start;
+  gsize end;
+} DeserializeManyChunk;
+
+static void
+deserialize_many_chunk (gpointer item, gpointer user_data)
+{
+  DeserializeManyChunk *chunk = item;
+  DeserializeManyData *data = user_data;
+  gsize i;
+
+  for (i = chunk->start; i < chunk->end; i++)
+    {
+      g_autoptr(GVariant) value = g_variant_get_child_value (data->prints, i);
+      g_autoptr(GVariant) print_data = NULL;
+      g_autoptr(FpPrint) print = NULL;
+      g_autoptr(GError) error = NULL;
+      FpiPrintType type;
+      guint driver;
+      guint device_id;
+      gboolean device_stored;
+
+      g_variant_get (value,
+                     "(iuubymsmsi@a{sv}v)",
+                     &type,
+                     &driver,
+                     &device_id,
+                     &device_stored,
+                     NULL,
+                     NULL,
+                     NULL,
+                     NULL,
+                     NULL,
+                     &print_data);
+
+      if (driver >= data->n_strings || device_id >= data->n_strings)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "Data could not be parsed");
+      else
+        print = fp_print_new_from_fields (type,
+                                          data->strings[driver],
+                                          data->strings[device_id],
+                                          device_stored,
+                                          print_data,
+                                          &error);
+
+      if (print)
+        {
+          fp_print_load_extensions (print, value);
+          fp_print_load_metadata (print, value);
+          fpi_print_decode_prints (print, &error);
+        }
+
+      if (error)
+        {
+          g_mutex_lock (&data->error_lock);
+          if (!data->error)
+            data->error = g_steal_pointer (&error);
+          g_mutex_unlock (&data->error_lock);
+          return;
+        }
+
+      data->results[i] = g_steal_pointer (&print);
+    }
+}
+
+/**
+ * fp_print_deserialize_many:
+ * @data: (array length=length): The binary data
+ * @length: Length of the data
+ * @error: Return location for error
+ *
+ * Deserialize a set of prints that was stored using
+ * fp_print_serialize_many(). The prints are decoded in parallel on the
+ * library worker threads.
+ *
+ * Returns: (transfer container) (element-type FpPrint): The prints, or
+ *   %NULL on error
+ */
+GPtrArray *
+fp_print_deserialize_many (const guchar *data,
+                           gsize         length,
+                           GError      **error)
+{
+  g_autoptr(GVariant) value = NULL;
+  g_autoptr(GVariant) prints = NULL;
+  g_autofree const gchar **strings = NULL;
+  g_autofree DeserializeManyChunk *chunks = NULL;
+  g_autofree gpointer *items = NULL;
+  DeserializeManyData decode = { 0, };
+  GPtrArray *result;
+  guchar *aligned_data;
+  gsize n_prints;
+  gsize n_chunks;
+  gsize i;
+
+  g_assert (data);
+
+  if (length <= 3 || memcmp (data, "FPM", 3) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  /* A single aligned copy is shared by all prints. Converting the whole
+   * tree into normal form would mean another copy, the accessors are safe
+   * to use on untrusted data. */
+  aligned_data = g_malloc (length - 3);
+  memcpy (aligned_data, data + 3, length - 3);
+  value = g_variant_ref_sink (g_variant_new_from_data (FPI_PRINT_MANY_VARIANT_TYPE,
+                                                       aligned_data, length - 3,
+                                                       FALSE, g_free, aligned_data));
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *tmp = g_variant_byteswap (value);
+
+      g_variant_unref (value);
+      value = tmp;
+    }
+
+  g_variant_get (value, "(^a&s@a(iuubymsmsia{sv}v))", &strings, &prints);
+
+  n_prints = g_variant_n_children (prints);
+  n_chunks = (n_prints + FPI_PRINT_MANY_CHUNK_SIZE - 1) / FPI_PRINT_MANY_CHUNK_SIZE;
+
+  decode.prints = prints;
+  decode.strings = strings;
+  decode.n_strings = g_strv_length ((gchar **) strings);
+  decode.results = g_new0 (FpPrint *, n_prints);
+  g_mutex_init (&decode.error_lock);
+
+  chunks = g_new0 (DeserializeManyChunk, n_chunks);
+  items = g_new0 (gpointer, n_chunks);
+  for (i = 0; i < n_chunks; i++)
+    {
+      chunks[i].start = i * FPI_PRINT_MANY_CHUNK_SIZE;
+      chunks[i].end = MIN (n_prints, chunks[i].start + FPI_PRINT_MANY_CHUNK_SIZE);
+      items[i] = &chunks[i];
+    }
+
+  fpi_worker_pool_run_parallel (fpi_worker_pool_get_default (),
+                                deserialize_many_chunk,
+                                items, n_chunks, &decode);
+  g_mutex_clear (&decode.error_lock);
+
+  if (decode.error)
+    {
+      for (i = 0; i < n_prints; i++)
+        g_clear_object (&decode.results[i]);
+      g_free (decode.results);
+      g_propagate_error (error, decode.error);
+      return NULL;
+    }
+
+  result = g_ptr_array_new_full (n_prints, g_object_unref);
+  for (i = 0; i < n_prints; i++)
+    g_ptr_array_add (result, decode.results[i]);
+  g_free (decode.results);
+
+  return result;
 }
@@ -78,6 +78,35 @@ typedef enum {
   FP_FINGER_STATUS_PRESENT = 1 << 1,
 } FpFingerStatusFlags;
 
+/**
+ * FpPrintSerializeFlags:
+ * @FP_PRINT_SERIALIZE_NONE: No flags
+ * @FP_PRINT_SERIALIZE_MATCHER_DATA: Include data that the matcher would
+ *   otherwise need to compute again after loading the print. This makes
+ *   the serialized print larger but matching a loaded print faster.
+ * @FP_PRINT_SERIALIZE_COMPACT: Use a compact encoding for the print data.
+ *   This reduces the size of NBIS prints several times over.
+ * @FP_PRINT_SERIALIZE_FIXED_LAYOUT: Store NBIS print data as a fixed layout
+ *   little endian minutiae record that can be read without decoding or
+ *   byte swapping on little endian machines. Ignored together with
+ *   @FP_PRINT_SERIALIZE_COMPACT.
+ *
+ * Flags to control how prints are serialized.
+ *
+ * The fixed layout record is similar to the minutia records of ISO/IEC
+ * 19794-2 but keeps the full NBIS precision. It starts with the 4 bytes
+ * "XYT\0", a 16 bit version (1) and the 16 bit number of stages. Each
+ * stage is a 16 bit number of minutiae and 16 reserved bits, followed by
+ * a 6 byte record per minutia holding the signed 16 bit x and y
+ * coordinates and the angle in degrees. All values are little endian.
+ */
+typedef enum {
+  FP_PRINT_SERIALIZE_NONE         = 0,
+  FP_PRINT_SERIALIZE_MATCHER_DATA = 1 << 0,
+  FP_PRINT_SERIALIZE_COMPACT      = 1 << 1,
+  FP_PRINT_SERIALIZE_FIXED_LAYOUT = 1 << 2,
+} FpPrintSerializeFlags;
+
 FpPrint *fp_print_new (FpDevice *device);
 
 const gchar *fp_print_get_driver (FpPrint *print);
@@ -103,14 +132,48 @@ gboolean fp_print_compatible (FpPrint  *self,
                               FpDevice *device);
 gboolean fp_print_equal (FpPrint *self,
                          FpPrint *other);
+guint    fp_print_hash (FpPrint *print);
+
+gboolean fp_print_match (FpPrint *enrolled,
+                         FpPrint *probe,
+                         gint     threshold,
+                         gint    *score,
+                         GError **error);
+void     fp_print_identify_async (FpPrint            *probe,
+                                  GPtrArray          *gallery,
+                                  gint                threshold,
+                                  GCancellable       *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer            user_data);
+gboolean fp_print_identify_finish (FpPrint      *probe,
+                                   GAsyncResult *result,
+                                   FpPrint     **match,
+                                   gint         *score,
+                                   GError      **error);
 
 gboolean fp_print_serialize (FpPrint *print,
                              guchar **data,
                              gsize   *length,
                              GError **error);
+gboolean fp_print_serialize_full (FpPrint              *print,
+                                  FpPrintSerializeFlags flags,
+                                  guchar              **data,
+                                  gsize                *length,
+                                  GError              **error);
 
 FpPrint *fp_print_deserialize (const guchar *data,
                                gsize         length,
                                GError      **error);
+FpPrint *fp_print_deserialize_bytes (GBytes  *data,
+                                     GError **error);
+
+gboolean   fp_print_serialize_many (GPtrArray            *prints,
+                                    FpPrintSerializeFlags flags,
+                                    guchar              **data,
+                                    gsize                *length,
+                                    GError              **error);
+GPtrArray *fp_print_deserialize_many (const guchar *data,
+                                      gsize         length,
+                                      GError      **error);
 
 G_END_DECLS
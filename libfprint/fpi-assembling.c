@@ -23,7 +23,9 @@
 
 #include "fpi-log.h"
 #include "fpi-image.h"
+#include "fpi-worker-pool.h"
 
+#include <math.h>
 #include <string.h>
 
 #include "fpi-assembling.h"
@@ -129,54 +131,280 @@ find_overlap (struct fpi_frame_asmbl_ctx *ctx,
     }
 }
 
-static unsigned int
-do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
-                        GSList *stripes, gboolean reverse)
+/* Number of vertical offsets suggested by the phase correlation that are
+ * verified by comparing the frames.
+ */
+#define PROJECTION_CANDIDATES 8
+
+/* In-place iterative radix-2 FFT, n must be a power of two. */
+static void
+fft (double *re, double *im, guint n, gboolean inverse)
 {
-  GSList *l;
-  GTimer *timer;
-  guint num_frames = 1;
-  struct fpi_frame *prev_stripe;
-  unsigned int min_error;
-  /* Max error is width * height * 255, for AES2501 which has the largest
-   * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
-   * we might get int overflow. Use 64bit value here to prevent integer overflow
-   */
-  unsigned long long total_error = 0;
+  guint i, j, len;
 
-  timer = g_timer_new ();
+  for (i = 1, j = 0; i < n; i++)
+    {
+      guint bit = n >> 1;
 
-  /* Skip the first frame */
-  prev_stripe = stripes->data;
+      for (; j & bit; bit >>= 1)
+        j ^= bit;
+      j ^= bit;
+
+      if (i < j)
+        {
+          double t;
+
+          t = re[i];
+          re[i] = re[j];
+          re[j] = t;
+          t = im[i];
+          im[i] = im[j];
+          im[j] = t;
+        }
+    }
 
-  for (l = stripes->next; l != NULL; l = l->next, num_frames++)
+  for (len = 2; len <= n; len <<= 1)
     {
-      struct fpi_frame *cur_stripe = l->data;
+      double ang = 2 * G_PI / len * (inverse ? 1 : -1);
+      double wlen_re = cos (ang), wlen_im = sin (ang);
 
-      if (reverse)
+      for (i = 0; i < n; i += len)
         {
-          find_overlap (ctx, prev_stripe, cur_stripe,
-                        &cur_stripe->delta_x, &cur_stripe->delta_y,
-                        &min_error);
-          cur_stripe->delta_y = -cur_stripe->delta_y;
-          cur_stripe->delta_x = -cur_stripe->delta_x;
+          double w_re = 1, w_im = 0;
+
+          for (j = 0; j < len / 2; j++)
+            {
+              double *u_re = &re[i + j], *u_im = &im[i + j];
+              double *v_re = &re[i + j + len / 2], *v_im = &im[i + j + len / 2];
+              double t_re = *v_re * w_re - *v_im * w_im;
+              double t_im = *v_re * w_im + *v_im * w_re;
+              double next_w_re;
+
+              *v_re = *u_re - t_re;
+              *v_im = *u_im - t_im;
+              *u_re += t_re;
+              *u_im += t_im;
+
+              next_w_re = w_re * wlen_re - w_im * wlen_im;
+              w_im = w_re * wlen_im + w_im * wlen_re;
+              w_re = next_w_re;
+            }
+        }
+    }
+}
+
+/* Mean brightness of every row of the frame with the average removed,
+ * zero padded up to the FFT size.
+ */
+static void
+row_projection (struct fpi_frame_asmbl_ctx *ctx,
+                struct fpi_frame           *frame,
+                double                     *out,
+                guint                       n)
+{
+  double mean = 0;
+  guint x, y;
+
+  for (y = 0; y < ctx->frame_height; y++)
+    {
+      guint sum = 0;
+
+      for (x = 0; x < ctx->frame_width; x++)
+        sum += ctx->get_pixel (ctx, frame, x, y);
+      out[y] = (double) sum / ctx->frame_width;
+      mean += out[y];
+    }
+  mean /= ctx->frame_height;
+
+  for (y = 0; y < ctx->frame_height; y++)
+    out[y] -= mean;
+  for (; y < n; y++)
+    out[y] = 0;
+}
+
+/* Finds the horizontal offset once the vertical one is known by comparing
+ * the column sums over the rows in which the frames overlap.
+ */
+static int
+find_dx_for_dy (struct fpi_frame_asmbl_ctx *ctx,
+                struct fpi_frame           *first_frame,
+                struct fpi_frame           *second_frame,
+                int                         dy,
+                guint                      *col1,
+                guint                      *col2)
+{
+  guint height = ctx->frame_height - dy;
+  guint64 best_err = G_MAXUINT64;
+  int dx, best_dx = 0;
+  guint x, y;
+
+  for (x = 0; x < ctx->frame_width; x++)
+    {
+      col1[x] = 0;
+      col2[x] = 0;
+      for (y = 0; y < height; y++)
+        {
+          col1[x] += ctx->get_pixel (ctx, first_frame, x, y);
+          col2[x] += ctx->get_pixel (ctx, second_frame, x, y + dy);
+        }
+    }
+
+  for (dx = -8; dx < 8; dx++)
+    {
+      guint width = ctx->frame_width - ABS (dx);
+      guint x1 = dx < 0 ? 0 : dx;
+      guint x2 = dx < 0 ? -dx : 0;
+      guint64 err = 0;
+
+      if (width == 0)
+        continue;
+
+      for (x = 0; x < width; x++)
+        err += ABS ((gint64) col1[x1 + x] - (gint64) col2[x2 + x]);
+
+      /* Normalize error */
+      err = err * ctx->frame_width / width;
+      if (err < best_err)
+        {
+          best_err = err;
+          best_dx = dx;
+        }
+    }
+
+  return best_dx;
+}
+
+/* Finds the offset using 1-D phase correlation of the row projections,
+ * which costs O(h log h) rather than a full frame comparison for every
+ * vertical offset. The strongest correlation peaks are then verified
+ * with calc_error() so that the result is still based on the real
+ * pixel difference.
+ */
+static void
+find_overlap_projection (struct fpi_frame_asmbl_ctx *ctx,
+                         struct fpi_frame           *first_frame,
+                         struct fpi_frame           *second_frame,
+                         int                        *dx_out,
+                         int                        *dy_out,
+                         unsigned int               *min_error)
+{
+  g_autofree double *re1 = NULL;
+  g_autofree double *im1 = NULL;
+  g_autofree double *re2 = NULL;
+  g_autofree double *im2 = NULL;
+  g_autofree guint *col1 = NULL;
+  g_autofree guint *col2 = NULL;
+  int candidates[PROJECTION_CANDIDATES];
+  guint n_candidates = 0;
+  guint n = 1;
+  guint i;
+  int dy;
+
+  *min_error = 255 * ctx->frame_height * ctx->frame_width;
+
+  if (ctx->frame_height <= 2)
+    return;
+
+  /* Zero padding to twice the height avoids circular wrap-around */
+  while (n < 2 * ctx->frame_height)
+    n <<= 1;
+
+  re1 = g_new0 (double, n);
+  im1 = g_new0 (double, n);
+  re2 = g_new0 (double, n);
+  im2 = g_new0 (double, n);
+  col1 = g_new (guint, ctx->frame_width);
+  col2 = g_new (guint, ctx->frame_width);
+
+  row_projection (ctx, first_frame, re1, n);
+  row_projection (ctx, second_frame, re2, n);
+
+  fft (re1, im1, n, FALSE);
+  fft (re2, im2, n, FALSE);
+
+  /* Cross power spectrum conj(F1) * F2, stored in re1/im1. It is only
+   * partially whitened (divided by the square root of its magnitude), as
+   * full phase correlation is too noisy for signals this short.
+   */
+  for (i = 0; i < n; i++)
+    {
+      double r = re1[i] * re2[i] + im1[i] * im2[i];
+      double m = re1[i] * im2[i] - im1[i] * re2[i];
+      double mag = sqrt (sqrt (r * r + m * m));
+
+      if (mag > 1e-9)
+        {
+          re1[i] = r / mag;
+          im1[i] = m / mag;
         }
       else
         {
-          find_overlap (ctx, cur_stripe, prev_stripe,
-                        &cur_stripe->delta_x, &cur_stripe->delta_y,
-                        &min_error);
+          re1[i] = 0;
+          im1[i] = 0;
         }
-      total_error += min_error;
+    }
+
+  fft (re1, im1, n, TRUE);
+
+  /* re1[dy] is now the correlation of first_frame row y with
+   * second_frame row y + dy. Keep the best peaks in the same range the
+   * exhaustive search would cover.
+   */
+  for (dy = 2; dy < ctx->frame_height; dy++)
+    {
+      guint pos = n_candidates;
+
+      while (pos > 0 && re1[candidates[pos - 1]] < re1[dy])
+        pos--;
 
-      prev_stripe = cur_stripe;
+      if (pos >= PROJECTION_CANDIDATES)
+        continue;
+
+      if (n_candidates < PROJECTION_CANDIDATES)
+        n_candidates++;
+      memmove (&candidates[pos + 1], &candidates[pos],
+               (n_candidates - pos - 1) * sizeof (int));
+      candidates[pos] = dy;
     }
 
-  g_timer_stop (timer);
-  fp_dbg ("calc delta completed in %f secs", g_timer_elapsed (timer, NULL));
-  g_timer_destroy (timer);
+  for (i = 0; i < n_candidates; i++)
+    {
+      unsigned int err;
+      int dx;
 
-  return total_error / num_frames;
+      dy = candidates[i];
+      dx = find_dx_for_dy (ctx, first_frame, second_frame, dy, col1, col2);
+      err = calc_error (ctx, first_frame, second_frame, dx, dy);
+      if (err < *min_error)
+        {
+          *min_error = err;
+          *dx_out = -dx;
+          *dy_out = dy;
+        }
+    }
+}
+
+typedef struct
+{
+  struct fpi_frame_asmbl_ctx *ctx;
+  struct fpi_frame           *first_frame;
+  struct fpi_frame           *second_frame;
+  int                         dx;
+  int                         dy;
+  unsigned int                min_error;
+} OverlapJob;
+
+static void
+find_overlap_job (gpointer data, gpointer user_data)
+{
+  OverlapJob *job = data;
+
+  if (job->ctx->motion_estimator == FPI_FRAME_MOTION_ESTIMATOR_PROJECTION)
+    find_overlap_projection (job->ctx, job->first_frame, job->second_frame,
+                             &job->dx, &job->dy, &job->min_error);
+  else
+    find_overlap (job->ctx, job->first_frame, job->second_frame,
+                  &job->dx, &job->dy, &job->min_error);
 }
 
 /**
@@ -190,18 +418,90 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
  * This function is used for devices that don't do movement estimation
  * in hardware. If hardware movement estimation is supported, the driver
  * should populate @delta_x and @delta_y instead.
+ *
+ * The search algorithm is selected by the @motion_estimator field of @ctx.
+ * The frame pairs are independent, so they are searched in parallel on
+ * the worker threads.
  */
 void
 fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
                             GSList                     *stripes)
 {
-  int err, rev_err;
+  guint num_frames = g_slist_length (stripes);
+  guint n_pairs, i;
+  g_autofree OverlapJob *jobs = NULL;
+  g_autofree gpointer *items = NULL;
+  GTimer *timer;
+  GSList *l;
+  /* Max error is width * height * 255, for AES2501 which has the largest
+   * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
+   * we might get int overflow. Use 64bit value here to prevent integer overflow
+   */
+  unsigned long long total_error = 0, total_rev_error = 0;
+  unsigned int err, rev_err;
+  gboolean reverse;
+
+  if (num_frames < 2)
+    return;
+
+  /* The forward estimates come first, followed by the reverse ones */
+  n_pairs = num_frames - 1;
+  jobs = g_new0 (OverlapJob, 2 * n_pairs);
+  items = g_new (gpointer, 2 * n_pairs);
+
+  for (l = stripes, i = 0; l->next != NULL; l = l->next, i++)
+    {
+      struct fpi_frame *prev_stripe = l->data;
+      struct fpi_frame *cur_stripe = l->next->data;
+
+      jobs[i].ctx = ctx;
+      jobs[i].first_frame = cur_stripe;
+      jobs[i].second_frame = prev_stripe;
+
+      jobs[n_pairs + i].ctx = ctx;
+      jobs[n_pairs + i].first_frame = prev_stripe;
+      jobs[n_pairs + i].second_frame = cur_stripe;
+    }
+
+  for (i = 0; i < 2 * n_pairs; i++)
+    items[i] = &jobs[i];
+
+  timer = g_timer_new ();
+
+  fpi_worker_pool_run_parallel (fpi_worker_pool_get_default (),
+                                find_overlap_job, items, 2 * n_pairs, NULL);
+
+  g_timer_stop (timer);
+  fp_dbg ("calc delta completed in %f secs", g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+
+  for (i = 0; i < n_pairs; i++)
+    {
+      total_error += jobs[i].min_error;
+      total_rev_error += jobs[n_pairs + i].min_error;
+    }
+
+  err = total_error / num_frames;
+  rev_err = total_rev_error / num_frames;
+  fp_dbg ("errors: %u rev: %u", err, rev_err);
+  reverse = !(err < rev_err);
+
+  /* Skip the first frame */
+  for (l = stripes->next, i = 0; l != NULL; l = l->next, i++)
+    {
+      struct fpi_frame *cur_stripe = l->data;
 
-  err = do_movement_estimation (ctx, stripes, FALSE);
-  rev_err = do_movement_estimation (ctx, stripes, TRUE);
-  fp_dbg ("errors: %d rev: %d", err, rev_err);
-  if (err < rev_err)
-    do_movement_estimation (ctx, stripes, FALSE);
+      if (reverse)
+        {
+          cur_stripe->delta_x = -jobs[n_pairs + i].dx;
+          cur_stripe->delta_y = -jobs[n_pairs + i].dy;
+        }
+      else
+        {
+          cur_stripe->delta_x = jobs[i].dx;
+          cur_stripe->delta_y = jobs[i].dy;
+        }
+    }
 }
 
 static inline void
@@ -346,6 +646,13 @@ fpi_assemble_frames (struct fpi_frame_asmbl_ctx *ctx,
   return img;
 }
 
+/* Histograms wider than this are built over the ranks of the values
+ * instead of the values themselves. Speed estimates from the line
+ * assembling code are always within max_search_offset, so this only
+ * kicks in for unusual callers.
+ */
+#define MEDIAN_MAX_DIRECT_RANGE 4096
+
 static int
 cmpint (const void *p1, const void *p2, gpointer data)
 {
@@ -360,28 +667,134 @@ cmpint (const void *p1, const void *p2, gpointer data)
     return 1;
 }
 
-static void
-median_filter (int *data, int size, int filtersize)
+static gsize
+find_rank (const int *sorted, gsize len, int value)
 {
-  int i;
-  int *result = (int *) g_malloc0 (size * sizeof (int));
-  int *sortbuf = (int *) g_malloc0 (filtersize * sizeof (int));
+  gsize lo = 0, hi = len;
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (sorted[mid] < value)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/**
+ * fpi_median_filter:
+ * @data: (array length=size): the values to filter in place
+ * @size: number of items in @data
+ * @filtersize: width of the median window
+ *
+ * Replaces every item in @data with the median of the window of
+ * @filtersize items centred on it. The window is truncated at both ends
+ * of @data, and for windows with an even number of items the upper
+ * median is used.
+ *
+ * The window is tracked as a histogram that is updated incrementally
+ * while it slides over @data, so the cost is linear in @size for
+ * values spanning a small range (such as per-line speed estimates)
+ * rather than proportional to @filtersize.
+ */
+void
+fpi_median_filter (int  *data,
+                   gsize size,
+                   guint filtersize)
+{
+  g_autofree int *sorted = NULL;
+  g_autofree int *bins = NULL;
+  g_autofree guint *hist = NULL;
+  gsize half, i, lo, hi;
+  gsize n_bins, count, below, med;
+  int min, max;
+
+  if (size == 0 || filtersize <= 1)
+    return;
+
+  half = (filtersize - 1) / 2;
+
+  min = max = data[0];
+  for (i = 1; i < size; i++)
+    {
+      min = MIN (min, data[i]);
+      max = MAX (max, data[i]);
+    }
+
+  /* Map each value to its histogram bin */
+  bins = g_new (int, size);
+  if ((gint64) max - min < MEDIAN_MAX_DIRECT_RANGE)
+    {
+      n_bins = max - min + 1;
+      for (i = 0; i < size; i++)
+        bins[i] = data[i] - min;
+    }
+  else
+    {
+      sorted = g_memdup (data, size * sizeof (int));
+      g_qsort_with_data (sorted, size, sizeof (int), cmpint, NULL);
+      n_bins = size;
+      for (i = 0; i < size; i++)
+        bins[i] = find_rank (sorted, size, data[i]);
+    }
+
+  hist = g_new0 (guint, n_bins);
+
+  /* Prime the window for the first output item; lo..hi is inclusive */
+  lo = 0;
+  hi = MIN (half, size - 1);
+  for (i = lo; i <= hi; i++)
+    hist[bins[i]]++;
+  count = hi - lo + 1;
+
+  /* med is the bin holding the element at index count / 2 of the sorted
+   * window and below is the number of elements in bins lower than med.
+   */
+  med = 0;
+  below = 0;
 
   for (i = 0; i < size; i++)
     {
-      int i1 = i - (filtersize - 1) / 2;
-      int i2 = i + (filtersize - 1) / 2;
-      if (i1 < 0)
-        i1 = 0;
-      if (i2 >= size)
-        i2 = size - 1;
-      memmove (sortbuf, data + i1, (i2 - i1 + 1) * sizeof (int));
-      g_qsort_with_data (sortbuf, i2 - i1 + 1, sizeof (int), cmpint, NULL);
-      result[i] = sortbuf[(i2 - i1 + 1) / 2];
+      gsize target;
+
+      if (i > half)
+        {
+          hist[bins[lo]]--;
+          if (bins[lo] < med)
+            below--;
+          lo++;
+          count--;
+        }
+      if (i > 0 && i + half < size)
+        {
+          hi++;
+          hist[bins[hi]]++;
+          if (bins[hi] < med)
+            below++;
+          count++;
+        }
+
+      target = count / 2;
+      while (below > target)
+        {
+          med--;
+          below -= hist[med];
+        }
+      while (below + hist[med] <= target)
+        {
+          below += hist[med];
+          med++;
+        }
+
+      if (sorted)
+        data[i] = sorted[med];
+      else
+        data[i] = med + min;
     }
-  memmove (data, result, size * sizeof (int));
-  g_free (result);
-  g_free (sortbuf);
 }
 
 static void
@@ -476,7 +889,7 @@ fpi_assemble_lines (struct fpi_line_asmbl_ctx *ctx,
         row1 = g_slist_next (row1);
     }
 
-  median_filter (offsets, (num_lines / 2) - 1, ctx->median_filter_size);
+  fpi_median_filter (offsets, (num_lines / 2) - 1, ctx->median_filter_size);
 
   fp_dbg ("offsets_filtered: %"G_GINT64_FORMAT, g_get_real_time ());
   for (i = 0; i <= (num_lines / 2) - 1; i++)
@@ -38,12 +38,33 @@ struct fpi_frame
   unsigned char data[0];
 };
 
+/**
+ * FpiFrameMotionEstimator:
+ * @FPI_FRAME_MOTION_ESTIMATOR_EXHAUSTIVE: compare the frames at every
+ *   candidate offset, the cost grows with the square of the frame height
+ * @FPI_FRAME_MOTION_ESTIMATOR_PROJECTION: find the vertical offset by phase
+ *   correlation of the row projections of both frames, then only compare
+ *   the frames at the few best candidates
+ *
+ * Algorithm used by fpi_do_movement_estimation() to find the offset
+ * between two frames.
+ *
+ * The projection based estimator is meant for tall frames, for which it is
+ * much cheaper. For frames of only a few rows the exhaustive search is
+ * more reliable.
+ */
+typedef enum {
+  FPI_FRAME_MOTION_ESTIMATOR_EXHAUSTIVE = 0,
+  FPI_FRAME_MOTION_ESTIMATOR_PROJECTION,
+} FpiFrameMotionEstimator;
+
 /**
  * fpi_frame_asmbl_ctx:
  * @frame_width: width of the frame
  * @frame_height: height of the frame
  * @image_width: resulting image width
  * @get_pixel: pixel accessor, returns pixel brightness at x,y of frame
+ * @motion_estimator: the #FpiFrameMotionEstimator to use
  *
  * #fpi_frame_asmbl_ctx is a structure holding the context for frame
  * assembling routines.
@@ -61,6 +82,7 @@ struct fpi_frame_asmbl_ctx
                              struct fpi_frame           *frame,
                              unsigned int                x,
                              unsigned int                y);
+  FpiFrameMotionEstimator motion_estimator;
 };
 
 void fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
@@ -115,3 +137,7 @@ struct fpi_line_asmbl_ctx
 FpImage *fpi_assemble_lines (struct fpi_line_asmbl_ctx *ctx,
                              GSList                    *lines,
                              size_t                     num_lines);
+
+void fpi_median_filter (int  *data,
+                        gsize size,
+                        guint filtersize);
@@ -22,6 +22,7 @@
 #include "fpi-log.h"
 
 #include "fp-device-private.h"
+#include "fpi-ssm.h"
 
 /**
  * SECTION: fpi-device
@@ -446,6 +447,7 @@ match_data_free (FpMatchData *data)
 
   g_clear_object (&data->enrolled_print);
   g_clear_pointer (&data->gallery, g_ptr_array_unref);
+  g_clear_object (&data->gallery_model);
 
   g_free (data);
 }
@@ -523,7 +525,9 @@ fpi_device_get_verify_data (FpDevice *device,
  * @device: The #FpDevice
  * @prints: (out) (transfer none) (element-type FpPrint): The gallery of prints
  *
- * Get data for identify.
+ * Get data for identify. If the operation was started with
+ * fp_device_identify_model(), then all prints are loaded from the model
+ * on the first call.
  */
 void
 fpi_device_get_identify_data (FpDevice   *device,
@@ -538,10 +542,85 @@ fpi_device_get_identify_data (FpDevice   *device,
   data = g_task_get_task_data (priv->current_task);
   g_assert (data);
 
+  if (!data->gallery && data->gallery_model)
+    {
+      guint n_items = g_list_model_get_n_items (data->gallery_model);
+      guint i;
+
+      data->gallery = g_ptr_array_new_full (n_items, g_object_unref);
+      for (i = 0; i < n_items; i++)
+        {
+          FpPrint *print = g_list_model_get_item (data->gallery_model, i);
+
+          if (print)
+            g_ptr_array_add (data->gallery, print);
+        }
+    }
+
   if (prints)
     *prints = data->gallery;
 }
 
+/**
+ * fpi_device_get_identify_model:
+ * @device: The #FpDevice
+ * @gallery: (out) (transfer none) (nullable): The gallery model
+ *
+ * Get the model the prints of an identify operation are fetched from.
+ * This is %NULL unless the operation was started with
+ * fp_device_identify_model() and nothing loaded the prints yet using
+ * fpi_device_get_identify_data().
+ *
+ * Drivers that fetch the prints from the model themselves should report
+ * the #FpPrint returned by the model as the match.
+ */
+void
+fpi_device_get_identify_model (FpDevice    *device,
+                               GListModel **gallery)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_IDENTIFY);
+
+  data = g_task_get_task_data (priv->current_task);
+  g_assert (data);
+
+  if (gallery)
+    *gallery = data->gallery ? NULL : data->gallery_model;
+}
+
+/**
+ * fpi_device_identify_is_continuous:
+ * @device: The #FpDevice
+ *
+ * Whether the current identify operation was started with
+ * fp_device_identify_continuous(). Such an operation reports every scan
+ * with fpi_device_identify_report() and only completes once it is
+ * cancelled or fails.
+ *
+ * Drivers do not need to handle this, after fpi_device_identify_complete()
+ * the identify handler is simply called again. Drivers that can keep
+ * the sensor ready between scans should use this to avoid completing
+ * the operation.
+ *
+ * Returns: %TRUE if the identify operation is continuous
+ */
+gboolean
+fpi_device_identify_is_continuous (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail (priv->current_action == FPI_DEVICE_ACTION_IDENTIFY, FALSE);
+
+  data = g_task_get_task_data (priv->current_task);
+
+  return data->continuous;
+}
+
 /**
  * fpi_device_get_delete_data:
  * @device: The #FpDevice
@@ -610,6 +689,8 @@ fpi_device_remove (FpDevice *device)
 
   priv->is_removed = TRUE;
 
+  fpi_device_clear_calibration (device);
+
   g_object_notify (G_OBJECT (device), "removed");
 
   /* If there is a pending action, we wait for it to fail, otherwise we
@@ -628,6 +709,155 @@ fpi_device_remove (FpDevice *device)
     }
 }
 
+typedef struct
+{
+  GVariant *data;
+  gint64    expires;
+} CalibrationEntry;
+
+G_LOCK_DEFINE_STATIC (calibration);
+static GHashTable *calibration_cache = NULL;
+
+static void
+calibration_entry_free (CalibrationEntry *entry)
+{
+  g_variant_unref (entry->data);
+  g_free (entry);
+}
+
+/* The cache is shared by all FpDevice instances (e.g. from different
+ * FpContext objects), so the key identifies the physical device.
+ */
+static gchar *
+calibration_key (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  const gchar *location = "";
+
+  if (priv->type == FP_DEVICE_TYPE_USB && priv->usb_device)
+    location = g_usb_device_get_platform_id (priv->usb_device);
+  else if (priv->type == FP_DEVICE_TYPE_VIRTUAL && priv->virtual_env)
+    location = priv->virtual_env;
+
+  return g_strdup_printf ("%s/%s/%s", FP_DEVICE_GET_CLASS (device)->id,
+                          location, priv->device_id);
+}
+
+/**
+ * fpi_device_set_calibration:
+ * @device: The #FpDevice
+ * @data: (transfer floating): The calibration data
+ * @lifetime: Number of seconds the data stays valid, or 0 for no limit
+ *
+ * Store calibration data of the device so that it does not need to be
+ * recalculated the next time the device is opened or activated. The data
+ * is kept in memory for the lifetime of the process, keyed by the driver
+ * and the device.
+ *
+ * The data is dropped once @lifetime expired, when the device is
+ * removed, and when an action of the device fails with an error that
+ * indicates a device or protocol issue. Drivers should also call
+ * fpi_device_clear_calibration() when they detect that the stored
+ * calibration does not work anymore.
+ */
+void
+fpi_device_set_calibration (FpDevice *device,
+                            GVariant *data,
+                            guint     lifetime)
+{
+  CalibrationEntry *entry;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (data != NULL);
+
+  entry = g_new0 (CalibrationEntry, 1);
+  entry->data = g_variant_ref_sink (data);
+  if (lifetime > 0)
+    entry->expires = g_get_monotonic_time () + lifetime * G_USEC_PER_SEC;
+
+  G_LOCK (calibration);
+  if (!calibration_cache)
+    calibration_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) calibration_entry_free);
+  g_hash_table_replace (calibration_cache, calibration_key (device), entry);
+  G_UNLOCK (calibration);
+}
+
+/**
+ * fpi_device_get_calibration:
+ * @device: The #FpDevice
+ * @type: The expected #GVariantType of the data
+ *
+ * Retrieve calibration data previously stored using
+ * fpi_device_set_calibration(). Data that has expired or does not have
+ * the expected @type is ignored.
+ *
+ * Returns: (transfer full) (nullable): The calibration data or %NULL
+ */
+GVariant *
+fpi_device_get_calibration (FpDevice           *device,
+                            const GVariantType *type)
+{
+  g_autofree gchar *key = NULL;
+  CalibrationEntry *entry;
+  GVariant *res = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  key = calibration_key (device);
+
+  G_LOCK (calibration);
+  entry = calibration_cache ? g_hash_table_lookup (calibration_cache, key) : NULL;
+  if (entry && entry->expires && entry->expires < g_get_monotonic_time ())
+    {
+      fp_dbg ("Stored calibration data has expired");
+      g_hash_table_remove (calibration_cache, key);
+      entry = NULL;
+    }
+  if (entry && g_variant_is_of_type (entry->data, type))
+    res = g_variant_ref (entry->data);
+  G_UNLOCK (calibration);
+
+  return res;
+}
+
+/**
+ * fpi_device_clear_calibration:
+ * @device: The #FpDevice
+ *
+ * Drop any calibration data stored for the device.
+ */
+void
+fpi_device_clear_calibration (FpDevice *device)
+{
+  g_autofree gchar *key = NULL;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+
+  key = calibration_key (device);
+
+  G_LOCK (calibration);
+  if (calibration_cache && g_hash_table_remove (calibration_cache, key))
+    fp_dbg ("Dropped stored calibration data");
+  G_UNLOCK (calibration);
+}
+
+/* Whether an error hints at the device not being in the expected state */
+static gboolean
+error_invalidates_calibration (const GError *error)
+{
+  if (error->domain == FP_DEVICE_RETRY ||
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return FALSE;
+
+  if (error->domain != FP_DEVICE_ERROR)
+    return TRUE;
+
+  return error->code == FP_DEVICE_ERROR_GENERAL ||
+         error->code == FP_DEVICE_ERROR_PROTO ||
+         error->code == FP_DEVICE_ERROR_REMOVED;
+}
+
 /**
  * fpi_device_action_error:
  * @device: The #FpDevice
@@ -806,6 +1036,8 @@ fp_device_task_return_in_idle_cb (gpointer user_data)
       break;
 
     case FP_DEVICE_TASK_RETURN_ERROR:
+      if (error_invalidates_calibration (data->result))
+        fpi_device_clear_calibration (data->device);
       g_task_return_error (task, g_steal_pointer (&data->result));
       break;
 
@@ -847,6 +1079,37 @@ fpi_device_task_return_data_free (FpDeviceTaskReturnData *data)
   g_free (data);
 }
 
+/* Logs the trace as offsets to the start of the action */
+static void
+fpi_device_trace_dump (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  g_autoptr(GString) str = NULL;
+  GEnumClass *trace_class;
+  gint64 start;
+  guint i;
+
+  if (priv->trace->len == 0)
+    return;
+
+  trace_class = g_type_class_ref (FP_TYPE_DEVICE_TRACE_POINT);
+  start = g_array_index (priv->trace, FpDeviceTraceEntry, 0).time;
+  str = g_string_new (NULL);
+
+  for (i = 0; i < priv->trace->len; i++)
+    {
+      FpDeviceTraceEntry *entry = &g_array_index (priv->trace, FpDeviceTraceEntry, i);
+      GEnumValue *value = g_enum_get_value (trace_class, entry->point);
+
+      g_string_append_printf (str, " %s@%.1fms",
+                              value ? value->value_nick : "unknown",
+                              (entry->time - start) / 1000.0);
+    }
+
+  fp_dbg ("Action trace:%s", str->str);
+  g_type_class_unref (trace_class);
+}
+
 static void
 fpi_device_return_task_in_idle (FpDevice              *device,
                                 FpDeviceTaskReturnType return_type,
@@ -855,6 +1118,9 @@ fpi_device_return_task_in_idle (FpDevice              *device,
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
   FpDeviceTaskReturnData *data;
 
+  fpi_device_trace (device, FP_DEVICE_TRACE_ACTION_COMPLETE);
+  fpi_device_trace_dump (device);
+
   data = g_new0 (FpDeviceTaskReturnData, 1);
   data->device = g_object_ref (device);
   data->type = return_type;
@@ -966,6 +1232,7 @@ fpi_device_close_complete (FpDevice *device, GError *error)
   g_debug ("Device reported close completion");
 
   clear_device_cancel_action (device);
+  fpi_ssm_dump_stats (device);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
 
   switch (priv->type)
@@ -1125,6 +1392,22 @@ fpi_device_verify_complete (FpDevice *device,
     }
 }
 
+static void
+identify_restart_cb (FpDevice *device,
+                     gpointer  user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (g_task_get_cancellable (priv->current_task), &error))
+    {
+      fpi_device_identify_complete (device, error);
+      return;
+    }
+
+  FP_DEVICE_GET_CLASS (device)->identify (device);
+}
+
 /**
  * fpi_device_identify_complete:
  * @device: The #FpDevice
@@ -1133,6 +1416,9 @@ fpi_device_verify_complete (FpDevice *device,
  * Finish an ongoing identify operation. The match that was identified is
  * returned in @match. The @print parameter returns the newly created scan
  * that was used for matching.
+ *
+ * For a continuous identify operation the identify handler is called
+ * again unless @error is set, see fpi_device_identify_is_continuous().
  */
 void
 fpi_device_identify_complete (FpDevice *device,
@@ -1148,6 +1434,17 @@ fpi_device_identify_complete (FpDevice *device,
 
   data = g_task_get_task_data (priv->current_task);
 
+  /* The result is cleared after every report, a scan without one is
+   * caught below like for a single identify operation. */
+  if (!error && data->continuous && !data->error && data->scan_reported)
+    {
+      g_debug ("Restarting continuous identify");
+      data->scan_reported = FALSE;
+      fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
+      fpi_device_add_timeout (device, 0, identify_restart_cb, NULL, NULL);
+      return;
+    }
+
   clear_device_cancel_action (device);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
 
@@ -1331,6 +1628,7 @@ fpi_device_enroll_progress (FpDevice *device,
   g_return_if_fail (error == NULL || error->domain == FP_DEVICE_RETRY);
 
   g_debug ("Device reported enroll progress, reported %i of %i have been completed", completed_stages, priv->nr_enroll_stages);
+  fpi_device_trace (device, FP_DEVICE_TRACE_REPORT);
 
   if (print)
     g_object_ref_sink (print);
@@ -1384,6 +1682,7 @@ fpi_device_verify_report (FpDevice      *device,
   data->result_reported = TRUE;
 
   g_debug ("Device reported verify result");
+  fpi_device_trace (device, FP_DEVICE_TRACE_REPORT);
 
   if (print)
     print = g_object_ref_sink (print);
@@ -1438,6 +1737,10 @@ fpi_device_verify_report (FpDevice      *device,
  * Report the result of a identify operation. Note that the passed @error must be
  * a retry error with the %FP_DEVICE_RETRY domain. For all other error cases,
  * the error should passed to fpi_device_identify_complete().
+ *
+ * During a continuous identify operation the result is cleared again once
+ * it was passed to the match callback, so that the next scan can be
+ * reported.
  */
 void
 fpi_device_identify_report (FpDevice *device,
@@ -1454,6 +1757,7 @@ fpi_device_identify_report (FpDevice *device,
   g_return_if_fail (data->result_reported == FALSE);
 
   data->result_reported = TRUE;
+  data->scan_reported = TRUE;
 
   if (match)
     g_object_ref (match);
@@ -1461,13 +1765,15 @@ fpi_device_identify_report (FpDevice *device,
   if (print)
     print = g_object_ref_sink (print);
 
-  if (match && !g_ptr_array_find (data->gallery, match, NULL))
+  /* Prints fetched from a model cannot be checked */
+  if (match && data->gallery && !g_ptr_array_find (data->gallery, match, NULL))
     {
       g_warning ("Driver reported a match to a print that was not in the gallery, ignoring match.");
       g_clear_object (&match);
     }
 
   g_debug ("Device reported identify result");
+  fpi_device_trace (device, FP_DEVICE_TRACE_REPORT);
 
   if (error)
     {
@@ -1502,6 +1808,47 @@ fpi_device_identify_report (FpDevice *device,
 
   if (call_cb && data->match_cb)
     data->match_cb (device, data->match, data->print, data->match_data, data->error);
+
+  if (call_cb && data->continuous)
+    {
+      g_clear_object (&data->match);
+      g_clear_object (&data->print);
+      g_clear_error (&data->error);
+      data->result_reported = FALSE;
+    }
+}
+
+/**
+ * fpi_device_trace:
+ * @device: The #FpDevice
+ * @point: The #FpDeviceTracePoint that was reached
+ *
+ * Record that the current action reached @point, see fp_device_get_trace().
+ * The core records all points it can see itself, drivers only need to call
+ * this for points that are hidden from it, e.g. when matching happens on
+ * the device and the sensor signals the start and end of it.
+ *
+ * %FP_DEVICE_TRACE_ACTION_START discards the trace of the previous action.
+ */
+void
+fpi_device_trace (FpDevice          *device,
+                  FpDeviceTracePoint point)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceTraceEntry entry;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+
+  entry.point = point;
+  entry.time = g_get_monotonic_time ();
+
+  /* Long running actions (e.g. continuous identify) keep the latest points */
+  if (point == FP_DEVICE_TRACE_ACTION_START)
+    g_array_set_size (priv->trace, 0);
+  else if (priv->trace->len >= FP_DEVICE_TRACE_MAX_POINTS)
+    g_array_remove_index (priv->trace, 0);
+
+  g_array_append_val (priv->trace, entry);
 }
 
 /**
@@ -1520,6 +1867,7 @@ fpi_device_report_finger_status (FpDevice           *device,
 {
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
   g_autofree char *status_string = NULL;
+  FpFingerStatusFlags added_status;
 
   if (priv->finger_status == finger_status)
     return FALSE;
@@ -1527,6 +1875,12 @@ fpi_device_report_finger_status (FpDevice           *device,
   status_string = g_flags_to_string (FP_TYPE_FINGER_STATUS_FLAGS, finger_status);
   fp_dbg ("Device reported finger status change: %s", status_string);
 
+  added_status = finger_status & ~priv->finger_status;
+  if (added_status & FP_FINGER_STATUS_NEEDED)
+    fpi_device_trace (device, FP_DEVICE_TRACE_FINGER_NEEDED);
+  if (added_status & FP_FINGER_STATUS_PRESENT)
+    fpi_device_trace (device, FP_DEVICE_TRACE_FINGER_PRESENT);
+
   priv->finger_status = finger_status;
   g_object_notify (G_OBJECT (device), "finger-status");
 
@@ -198,12 +198,22 @@ void fpi_device_get_verify_data (FpDevice *device,
                                  FpPrint **print);
 void fpi_device_get_identify_data (FpDevice   *device,
                                    GPtrArray **prints);
+void fpi_device_get_identify_model (FpDevice    *device,
+                                    GListModel **gallery);
+gboolean fpi_device_identify_is_continuous (FpDevice *device);
 void fpi_device_get_delete_data (FpDevice *device,
                                  FpPrint **print);
 GCancellable *fpi_device_get_cancellable (FpDevice *device);
 
 void fpi_device_remove (FpDevice *device);
 
+void      fpi_device_set_calibration (FpDevice *device,
+                                      GVariant *data,
+                                      guint     lifetime);
+GVariant *fpi_device_get_calibration (FpDevice           *device,
+                                      const GVariantType *type);
+void      fpi_device_clear_calibration (FpDevice *device);
+
 GSource * fpi_device_add_timeout (FpDevice      *device,
                                   gint           interval,
                                   FpTimeoutFunc  func,
@@ -256,6 +266,9 @@ void fpi_device_identify_report (FpDevice *device,
                                  FpPrint  *print,
                                  GError   *error);
 
+void fpi_device_trace (FpDevice          *device,
+                       FpDeviceTracePoint point);
+
 gboolean fpi_device_report_finger_status (FpDevice           *device,
                                           FpFingerStatusFlags finger_status);
 gboolean fpi_device_report_finger_status_changes (FpDevice           *device,
@@ -19,6 +19,7 @@
 
 #define FP_COMPONENT "image_device"
 #include "fpi-log.h"
+#include "fpi-worker-pool.h"
 
 #include "fp-image-device-private.h"
 #include "fp-image-device.h"
@@ -156,18 +157,53 @@ fp_image_device_change_state (FpImageDevice *self, FpiImageDeviceState state)
 }
 
 static void
-fp_image_device_enroll_maybe_await_finger_on (FpImageDevice *self)
+fp_image_device_maybe_await_finger_on (FpImageDevice *self)
 {
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  guint pending = g_queue_get_length (&priv->pending_scans);
 
-  /* We wait for both the minutiae scan to complete and the finger to
-   * be removed before we switch to AWAIT_FINGER_ON. */
-  if (priv->minutiae_scan_active || priv->finger_present)
+  if (priv->state != FPI_IMAGE_DEVICE_STATE_IDLE || priv->finger_present)
+    return;
+
+  /* We wait for the finger to be removed and for enough scans to be
+   * processed before we switch to AWAIT_FINGER_ON. By default that is
+   * all of them; with a deeper pipeline the next finger is detected
+   * while earlier scans are still being processed.
+   */
+  if (pending >= priv->pipeline_depth)
+    return;
+
+  /* Do not capture more images than the enrollment may still need. */
+  if (fpi_device_get_current_action (FP_DEVICE (self)) == FPI_DEVICE_ACTION_ENROLL &&
+      priv->enroll_stage + (gint) pending >= IMG_ENROLL_STAGES)
     return;
 
   fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON);
 }
 
+/* A continuous identify keeps the device active and scans again after
+ * every result, until it is cancelled or an error occurs.
+ */
+static gboolean
+fp_image_device_is_continuous (FpImageDevice *self)
+{
+  FpDevice *device = FP_DEVICE (self);
+
+  return fpi_device_get_current_action (device) == FPI_DEVICE_ACTION_IDENTIFY &&
+         fpi_device_identify_is_continuous (device);
+}
+
+static void
+fp_image_device_continue_session (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  if (priv->action_error)
+    fpi_image_device_deactivate (self, TRUE);
+  else
+    fp_image_device_maybe_await_finger_on (self);
+}
+
 static void
 fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
 {
@@ -190,8 +226,8 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
         }
     }
 
-  /* Do not complete if the device is still active or a minutiae scan is pending. */
-  if (priv->active || priv->minutiae_scan_active)
+  /* Do not complete if the device is still active or a scan is pending. */
+  if (priv->active || !g_queue_is_empty (&priv->pending_scans))
     return;
 
   if (!priv->action_error)
@@ -232,139 +268,366 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
     }
 }
 
+typedef struct
+{
+  FpImageDevice *device;
+  FpImage       *image;
+  FpPrint       *print;
+  GPtrArray     *templates;
+  GListModel    *gallery;
+  guint          gallery_pos;
+  guint          gallery_n_items;
+  GPtrArray     *next_templates;
+  gint           bz3_threshold;
+  gint           match;
+  GError        *error;
+  gboolean       done;
+} ScanData;
+
+/* Creates a scan and appends it to the pending scans */
+static ScanData *
+scan_data_new (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  ScanData *scan = g_new0 (ScanData, 1);
+
+  scan->device = self;
+  scan->match = -1;
+  g_queue_push_tail (&priv->pending_scans, scan);
+
+  return scan;
+}
+
 static void
-fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
+scan_data_free (ScanData *scan)
 {
-  g_autoptr(FpImage) image = FP_IMAGE (source_object);
-  g_autoptr(FpPrint) print = NULL;
-  GError *error = NULL;
-  FpImageDevice *self = FP_IMAGE_DEVICE (user_data);
+  g_clear_object (&scan->image);
+  g_clear_object (&scan->print);
+  g_clear_pointer (&scan->templates, g_ptr_array_unref);
+  g_clear_pointer (&scan->next_templates, g_ptr_array_unref);
+  g_clear_object (&scan->gallery);
+  g_clear_error (&scan->error);
+  g_free (scan);
+}
+
+/* Report the result of a scan that has been fully processed */
+static void
+fp_image_device_report_scan (FpImageDevice *self, ScanData *scan)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
   FpDevice *device = FP_DEVICE (self);
-  FpImageDevicePrivate *priv;
   FpiDeviceAction action;
 
-  /* Note: We rely on the device to not disappear during an operation. */
-  priv = fp_image_device_get_instance_private (FP_IMAGE_DEVICE (device));
-  priv->minutiae_scan_active = FALSE;
-
-  if (!fp_image_detect_minutiae_finish (image, res, &error))
+  /* Anything but a retry error (e.g. cancellation) aborts the session. */
+  if (scan->error && scan->error->domain != FP_DEVICE_RETRY)
     {
-      /* Cancel operation . */
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        {
-          fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
-          fpi_image_device_deactivate (self, TRUE);
-          return;
-        }
-
-      /* Replace error with a retry condition. */
-      g_warning ("Failed to detect minutiae: %s", error->message);
-      g_clear_pointer (&error, g_error_free);
-
-      error = fpi_device_retry_new_msg (FP_DEVICE_RETRY_GENERAL, "Minutiae detection failed, please retry");
+      fp_image_device_maybe_complete_action (self, g_steal_pointer (&scan->error));
+      /* We might not yet be deactivating, if we are enrolling. */
+      fpi_image_device_deactivate (self, TRUE);
+      return;
     }
 
   action = fpi_device_get_current_action (device);
 
   if (action == FPI_DEVICE_ACTION_CAPTURE)
     {
-      priv->capture_image = g_steal_pointer (&image);
-      fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
-      return;
+      priv->capture_image = g_steal_pointer (&scan->image);
+      fp_image_device_maybe_complete_action (self, g_steal_pointer (&scan->error));
     }
-
-  if (!error)
-    {
-      print = fp_print_new (device);
-      fpi_print_set_type (print, FPI_PRINT_NBIS);
-      if (!fpi_print_add_from_image (print, image, &error))
-        {
-          g_clear_object (&print);
-
-          if (error->domain != FP_DEVICE_RETRY)
-            {
-              fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
-              /* We might not yet be deactivating, if we are enrolling. */
-              fpi_image_device_deactivate (self, TRUE);
-              return;
-            }
-        }
-    }
-
-  if (action == FPI_DEVICE_ACTION_ENROLL)
+  else if (action == FPI_DEVICE_ACTION_ENROLL)
     {
       FpPrint *enroll_print;
       fpi_device_get_enroll_data (device, &enroll_print);
 
-      if (print)
+      if (scan->print)
         {
-          fpi_print_add_print (enroll_print, print);
+          fpi_print_add_print (enroll_print, scan->print);
           priv->enroll_stage += 1;
         }
 
       fpi_device_enroll_progress (device, priv->enroll_stage,
-                                  g_steal_pointer (&print), error);
+                                  g_steal_pointer (&scan->print),
+                                  g_steal_pointer (&scan->error));
 
       /* Start another scan or deactivate. */
       if (priv->enroll_stage == IMG_ENROLL_STAGES)
         {
-          fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
+          fp_image_device_maybe_complete_action (self, NULL);
           fpi_image_device_deactivate (self, FALSE);
         }
       else
         {
-          fp_image_device_enroll_maybe_await_finger_on (FP_IMAGE_DEVICE (device));
+          /* The session may have been aborted while the scan was pending */
+          fp_image_device_maybe_complete_action (self, NULL);
+          fp_image_device_maybe_await_finger_on (self);
         }
     }
   else if (action == FPI_DEVICE_ACTION_VERIFY)
     {
-      FpPrint *template;
       FpiMatchResult result;
 
-      fpi_device_get_verify_data (device, &template);
-      if (print)
-        result = fpi_print_bz3_match (template, print, priv->bz3_threshold, &error);
-      else
+      if (scan->error)
         result = FPI_MATCH_ERROR;
+      else
+        result = scan->match >= 0 ? FPI_MATCH_SUCCESS : FPI_MATCH_FAIL;
 
-      if (!error || error->domain == FP_DEVICE_RETRY)
-        fpi_device_verify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
-
-      fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
+      fpi_device_verify_report (device, result, g_steal_pointer (&scan->print),
+                                g_steal_pointer (&scan->error));
+      fp_image_device_maybe_complete_action (self, NULL);
     }
   else if (action == FPI_DEVICE_ACTION_IDENTIFY)
     {
-      gint i;
-      GPtrArray *templates;
-      FpPrint *result = NULL;
+      FpPrint *match = NULL;
+
+      if (!scan->error && scan->match >= 0)
+        match = g_ptr_array_index (scan->templates, scan->match);
+
+      fpi_device_identify_report (device, match, g_steal_pointer (&scan->print),
+                                  g_steal_pointer (&scan->error));
+      fp_image_device_maybe_complete_action (self, NULL);
+
+      if (fp_image_device_is_continuous (self))
+        fp_image_device_continue_session (self);
+    }
+  else
+    {
+      g_assert_not_reached ();
+    }
+}
 
-      fpi_device_get_identify_data (device, &templates);
-      for (i = 0; !error && i < templates->len; i++)
+/* Scans may finish processing out of order when the pipeline is used,
+ * report all scans at the head of the queue that are done.
+ */
+static void
+fp_image_device_scan_done (FpImageDevice *self, ScanData *scan)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  scan->done = TRUE;
+
+  while ((scan = g_queue_peek_head (&priv->pending_scans)) && scan->done)
+    {
+      g_queue_pop_head (&priv->pending_scans);
+      fp_image_device_report_scan (self, scan);
+      scan_data_free (scan);
+    }
+}
+
+/* Returns the index of the first matching template, or -1 */
+static void
+fpi_image_device_match_thread_func (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+  ScanData *scan = task_data;
+  GError *error = NULL;
+  gint i;
+
+  for (i = 0; i < scan->templates->len; i++)
+    {
+      FpPrint *template = g_ptr_array_index (scan->templates, i);
+
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      switch (fpi_print_bz3_match (template, scan->print, scan->bz3_threshold, &error))
         {
-          FpPrint *template = g_ptr_array_index (templates, i);
+        case FPI_MATCH_SUCCESS:
+          g_task_return_int (task, i);
+          return;
+
+        case FPI_MATCH_ERROR:
+          g_task_return_error (task, error);
+          return;
 
-          if (fpi_print_bz3_match (template, print, priv->bz3_threshold, &error) == FPI_MATCH_SUCCESS)
-            {
-              result = template;
-              break;
-            }
+        default:
+          break;
         }
+    }
+
+  g_task_return_int (task, -1);
+}
+
+/* Fetches the next chunk of templates from the gallery model, entries
+ * the model fails to load are skipped like in fpi_device_get_identify_data().
+ */
+static GPtrArray *
+scan_data_fetch_chunk (ScanData *scan)
+{
+  GPtrArray *chunk = g_ptr_array_new_full (IMG_IDENTIFY_CHUNK_SIZE, g_object_unref);
+
+  while (chunk->len < IMG_IDENTIFY_CHUNK_SIZE &&
+         scan->gallery_pos < scan->gallery_n_items)
+    {
+      FpPrint *template = g_list_model_get_item (scan->gallery, scan->gallery_pos);
+
+      scan->gallery_pos++;
+      if (template)
+        g_ptr_array_add (chunk, template);
+    }
+
+  return chunk;
+}
+
+static void fpi_image_device_match_templates (FpImageDevice *self,
+                                              ScanData      *scan);
+
+static void
+fpi_image_device_match_done (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (source_object);
+  ScanData *scan = g_task_get_task_data (G_TASK (res));
+
+  scan->match = g_task_propagate_int (G_TASK (res), &scan->error);
+
+  /* Too much work is queued up, let the user retry the scan. */
+  if (g_error_matches (scan->error, G_IO_ERROR, G_IO_ERROR_BUSY))
+    {
+      fp_dbg ("Could not match scan: %s", scan->error->message);
+      g_clear_error (&scan->error);
+
+      scan->error = fpi_device_retry_new (FP_DEVICE_RETRY_GENERAL);
+    }
+
+  /* Continue with the chunk that was fetched in the meantime */
+  if (!scan->error && scan->match < 0 &&
+      scan->next_templates && scan->next_templates->len > 0)
+    {
+      g_clear_pointer (&scan->templates, g_ptr_array_unref);
+      scan->templates = g_steal_pointer (&scan->next_templates);
+      fpi_image_device_match_templates (self, scan);
+      return;
+    }
+
+  fpi_device_trace (FP_DEVICE (self), FP_DEVICE_TRACE_MATCH_END);
+
+  fp_image_device_scan_done (self, scan);
+}
 
-      if (!error || error->domain == FP_DEVICE_RETRY)
-        fpi_device_identify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
+static void
+fpi_image_device_match_templates (FpImageDevice *self,
+                                  ScanData      *scan)
+{
+  FpDevice *device = FP_DEVICE (self);
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (self,
+                     fpi_device_get_cancellable (device),
+                     fpi_image_device_match_done,
+                     NULL);
+  g_task_set_task_data (task, scan, NULL);
+  fpi_worker_pool_run_task (fpi_worker_pool_get_default (), task,
+                            fpi_image_device_match_thread_func);
+
+  /* Load the next chunk while the current one is being matched */
+  if (scan->gallery)
+    scan->next_templates = scan_data_fetch_chunk (scan);
+}
 
-      fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
+/* Matching runs in a worker thread, the scan remains pending until it is
+ * done so that the action does not complete in the meantime.
+ *
+ * Galleries given as a model are matched chunk by chunk, so at most two
+ * chunks of templates are loaded at the same time.
+ */
+static void
+fpi_image_device_match (FpImageDevice *self,
+                        ScanData      *scan)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpDevice *device = FP_DEVICE (self);
+
+  if (fpi_device_get_current_action (device) == FPI_DEVICE_ACTION_VERIFY)
+    {
+      FpPrint *template;
+
+      fpi_device_get_verify_data (device, &template);
+      scan->templates = g_ptr_array_new_full (1, g_object_unref);
+      g_ptr_array_add (scan->templates, g_object_ref (template));
     }
   else
     {
-      /* XXX: This can be hit currently due to a race condition in the enroll code!
-       *      In that case we scan a further image even though the minutiae for the previous
-       *      one have not yet been detected.
-       *      We need to keep track on the pending minutiae detection and the fact that
-       *      it will finish eventually (or we may need to retry on error and activate the
-       *      device again). */
-      g_assert_not_reached ();
+      GListModel *gallery;
+      GPtrArray *templates;
+
+      fpi_device_get_identify_model (device, &gallery);
+      if (gallery)
+        {
+          scan->gallery = g_object_ref (gallery);
+          scan->gallery_n_items = g_list_model_get_n_items (gallery);
+          scan->templates = scan_data_fetch_chunk (scan);
+        }
+      else
+        {
+          fpi_device_get_identify_data (device, &templates);
+          scan->templates = g_ptr_array_ref (templates);
+        }
     }
+
+  scan->bz3_threshold = priv->bz3_threshold;
+
+  fpi_device_trace (device, FP_DEVICE_TRACE_MATCH_START);
+  fpi_image_device_match_templates (self, scan);
+}
+
+static void
+fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(FpImage) image = FP_IMAGE (source_object);
+  ScanData *scan = user_data;
+  FpImageDevice *self = scan->device;
+  FpDevice *device = FP_DEVICE (self);
+  GError *error = NULL;
+  FpiDeviceAction action;
+
+  /* Note: We rely on the device to not disappear during an operation. */
+
+  if (!fp_image_detect_minutiae_finish (image, res, &error))
+    {
+      /* Cancel operation . */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          scan->error = error;
+          fp_image_device_scan_done (self, scan);
+          return;
+        }
+
+      /* Replace error with a retry condition. */
+      g_warning ("Failed to detect minutiae: %s", error->message);
+      g_clear_pointer (&error, g_error_free);
+
+      error = fpi_device_retry_new_msg (FP_DEVICE_RETRY_GENERAL, "Minutiae detection failed, please retry");
+    }
+
+  fpi_device_trace (device, FP_DEVICE_TRACE_MINUTIAE_END);
+  action = fpi_device_get_current_action (device);
+
+  if (action == FPI_DEVICE_ACTION_CAPTURE)
+    {
+      scan->image = g_steal_pointer (&image);
+      scan->error = error;
+      fp_image_device_scan_done (self, scan);
+      return;
+    }
+
+  if (!error)
+    {
+      scan->print = fp_print_new (device);
+      fpi_print_set_type (scan->print, FPI_PRINT_NBIS);
+      if (!fpi_print_add_from_image (scan->print, image, &error))
+        g_clear_object (&scan->print);
+    }
+
+  if (scan->print && (action == FPI_DEVICE_ACTION_VERIFY ||
+                      action == FPI_DEVICE_ACTION_IDENTIFY))
+    {
+      fpi_image_device_match (self, scan);
+      return;
+    }
+
+  scan->error = error;
+  fp_image_device_scan_done (self, scan);
 }
 
 /*********************************************************/
@@ -447,17 +710,20 @@ fpi_image_device_report_finger_status (FpImageDevice *self,
     }
   else if (!present && priv->state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF)
     {
-      /* If we are in the non-enroll case, we always deactivate.
+      /* If we are in the non-enroll case, we always deactivate, unless
+       * a continuous identify session is running.
        *
        * In the enroll case, the decision can only be made after minutiae
        * detection has finished.
        */
       fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_IDLE);
 
-      if (action != FPI_DEVICE_ACTION_ENROLL)
-        fpi_image_device_deactivate (self, FALSE);
+      if (action == FPI_DEVICE_ACTION_ENROLL)
+        fp_image_device_maybe_await_finger_on (self);
+      else if (fp_image_device_is_continuous (self))
+        fp_image_device_continue_session (self);
       else
-        fp_image_device_enroll_maybe_await_finger_on (self);
+        fpi_image_device_deactivate (self, FALSE);
     }
 }
 
@@ -491,15 +757,15 @@ fpi_image_device_image_captured (FpImageDevice *self, FpImage *image)
                     action == FPI_DEVICE_ACTION_CAPTURE);
 
   g_debug ("Image device captured an image");
-
-  priv->minutiae_scan_active = TRUE;
+  fpi_device_trace (FP_DEVICE (self), FP_DEVICE_TRACE_CAPTURE_COMPLETE);
+  fpi_device_trace (FP_DEVICE (self), FP_DEVICE_TRACE_MINUTIAE_START);
 
   /* XXX: We also detect minutiae in capture mode, we solely do this
    *      to normalize the image which will happen as a by-product. */
   fp_image_detect_minutiae (image,
                             fpi_device_get_cancellable (FP_DEVICE (self)),
                             fpi_image_device_minutiae_detected,
-                            self);
+                            scan_data_new (self));
 
   /* XXX: This is wrong if we add support for raw capture mode. */
   fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
@@ -519,6 +785,7 @@ fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
 {
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
   FpiDeviceAction action;
+  ScanData *scan;
   GError *error;
 
   action = fpi_device_get_current_action (FP_DEVICE (self));
@@ -536,7 +803,10 @@ fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
   if (action == FPI_DEVICE_ACTION_ENROLL)
     {
       g_debug ("Reporting retry during enroll");
-      fpi_device_enroll_progress (FP_DEVICE (self), priv->enroll_stage, NULL, error);
+      /* Queued so that it is reported after pending scans */
+      scan = scan_data_new (self);
+      scan->error = error;
+      fp_image_device_scan_done (self, scan);
 
       fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
     }
@@ -547,6 +817,16 @@ fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
       fpi_image_device_deactivate (self, TRUE);
 
     }
+  else if (action == FPI_DEVICE_ACTION_IDENTIFY && fp_image_device_is_continuous (self))
+    {
+      g_debug ("Reporting retry during continuous identify");
+      scan = scan_data_new (self);
+      scan->error = error;
+      fp_image_device_scan_done (self, scan);
+
+      if (priv->state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+        fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
+    }
   else if (action == FPI_DEVICE_ACTION_IDENTIFY)
     {
       fpi_device_identify_report (FP_DEVICE (self), NULL, NULL, error);
@@ -22,13 +22,10 @@
 
 #include "fpi-image.h"
 #include "fpi-log.h"
+#include "fpi-stats.h"
 
 #include <nbis.h>
 
-#if HAVE_PIXMAN
-#include <pixman.h>
-#endif
-
 /**
  * SECTION: fpi-image
  * @title: Internal FpImage
@@ -57,21 +54,7 @@ gint
 fpi_std_sq_dev (const guint8 *buf,
                 gint          size)
 {
-  guint64 res = 0, mean = 0;
-  gint i;
-
-  for (i = 0; i < size; i++)
-    mean += buf[i];
-
-  mean /= size;
-
-  for (i = 0; i < size; i++)
-    {
-      int dev = (int) buf[i] - mean;
-      res += dev * dev;
-    }
-
-  return res / size;
+  return fpi_stats_sq_dev (buf, size) / size;
 }
 
 /**
@@ -96,54 +79,102 @@ fpi_mean_sq_diff_norm (const guint8 *buf1,
                        const guint8 *buf2,
                        gint          size)
 {
-  int res = 0, i;
+  return fpi_stats_sq_diff (buf1, buf2, size) / size;
+}
 
-  for (i = 0; i < size; i++)
+/* Sampling positions and weights of the bilinear filter in 16.16 fixed
+ * point. Source pixels are sampled at their centers and the weights are
+ * quantized to 7 bits, so the result is identical to what pixman produces
+ * for a scaling transform, which is what this code used to rely on.
+ */
+static void
+resize_axis_weights (guint   len,
+                     guint   factor,
+                     gint   *index,
+                     guint8 *weight)
+{
+  gint64 step = 0x10000 / factor;
+  gint64 pos = (step * 0x8000 + 0x8000) >> 16;
+  guint i;
+
+  for (i = 0; i < len * factor; i++, pos += step)
     {
-      int dev = (int) buf1[i] - (int) buf2[i];
-      res += dev * dev;
-    }
+      gint32 p = pos - 0x8000;
 
-  return res / size;
+      index[i] = p >> 16;
+      weight[i] = ((p >> 9) & 0x7f) << 1;
+    }
 }
 
-#if HAVE_PIXMAN
+/**
+ * fpi_image_resize:
+ * @orig: The #FpImage to scale up
+ * @w_factor: horizontal scaling factor
+ * @h_factor: vertical scaling factor
+ *
+ * Scales up @orig by integer factors using bilinear interpolation.
+ * Pixels outside of @orig are treated as 0.
+ *
+ * Returns: (transfer full): a new #FpImage
+ */
 FpImage *
 fpi_image_resize (FpImage *orig_img,
                   guint    w_factor,
                   guint    h_factor)
 {
-  int new_width = orig_img->width * w_factor;
-  int new_height = orig_img->height * h_factor;
-  pixman_image_t *orig, *resized;
-  pixman_transform_t transform;
+  guint width = orig_img->width;
+  guint height = orig_img->height;
+  guint new_width = width * w_factor;
+  guint new_height = height * h_factor;
+  g_autofree gint *x_index = g_new (gint, new_width);
+  g_autofree guint8 *x_weight = g_new (guint8, new_width);
+  g_autofree gint *y_index = g_new (gint, new_height);
+  g_autofree guint8 *y_weight = g_new (guint8, new_height);
+  g_autofree guint32 *line = g_new0 (guint32, width + 2);
   FpImage *newimg;
+  guint x, y;
 
-  orig = pixman_image_create_bits (PIXMAN_a8, orig_img->width, orig_img->height, (uint32_t *) orig_img->data, orig_img->width);
-  resized = pixman_image_create_bits (PIXMAN_a8, new_width, new_height, NULL, new_width);
-
-  pixman_transform_init_identity (&transform);
-  pixman_transform_scale (NULL, &transform, pixman_int_to_fixed (w_factor), pixman_int_to_fixed (h_factor));
-  pixman_image_set_transform (orig, &transform);
-  pixman_image_set_filter (orig, PIXMAN_FILTER_BILINEAR, NULL, 0);
-  pixman_image_composite32 (PIXMAN_OP_SRC,
-                            orig, /* src */
-                            NULL, /* mask */
-                            resized, /* dst */
-                            0, 0, /* src x y */
-                            0, 0, /* mask x y */
-                            0, 0, /* dst x y */
-                            new_width, new_height /* width height */
-                           );
+  g_return_val_if_fail (w_factor > 0 && h_factor > 0, NULL);
 
   newimg = fp_image_new (new_width, new_height);
   newimg->flags = orig_img->flags;
 
-  memcpy (newimg->data, pixman_image_get_data (resized), new_width * new_height);
+  resize_axis_weights (width, w_factor, x_index, x_weight);
+  resize_axis_weights (height, h_factor, y_index, y_weight);
 
-  pixman_image_unref (orig);
-  pixman_image_unref (resized);
+  for (y = 0; y < new_height; y++)
+    {
+      const guint8 *top = NULL, *bottom = NULL;
+      guint32 wb = y_weight[y];
+      guint32 wt = 256 - wb;
+      guint8 *out = newimg->data + y * new_width;
+
+      if (y_index[y] >= 0)
+        top = orig_img->data + y_index[y] * width;
+      if (y_index[y] + 1 < (gint) height)
+        bottom = orig_img->data + (y_index[y] + 1) * width;
+
+      /* Blend the two source lines first, line[0] and line[width + 1]
+       * stay 0 for the pixels left and right of the image.
+       */
+      if (top && bottom)
+        for (x = 0; x < width; x++)
+          line[x + 1] = top[x] * wt + bottom[x] * wb;
+      else if (top)
+        for (x = 0; x < width; x++)
+          line[x + 1] = top[x] * wt;
+      else
+        for (x = 0; x < width; x++)
+          line[x + 1] = bottom[x] * wb;
+
+      for (x = 0; x < new_width; x++)
+        {
+          const guint32 *src = line + x_index[x] + 1;
+          guint32 wr = x_weight[x];
+
+          out[x] = (src[0] * (256 - wr) + src[1] * wr) >> 16;
+        }
+    }
 
   return newimg;
 }
-#endif
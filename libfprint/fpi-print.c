@@ -34,6 +34,49 @@
  * #FpPrint routines.
  */
 
+/**
+ * fpi_fnv1a_bytes:
+ * @hash: The hash so far, start with %FPI_FNV1A_INIT
+ * @data: (array length=length): The data to add
+ * @length: Length of the data
+ *
+ * Adds @data to a 32 bit FNV-1a hash. This is used for all hashes and
+ * checksums that are stored, so the algorithm must not change.
+ *
+ * Returns: The updated hash
+ */
+guint32
+fpi_fnv1a_bytes (guint32 hash, const guint8 *data, gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      hash ^= data[i];
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+/**
+ * fpi_fnv1a_int32:
+ * @hash: The hash so far, start with %FPI_FNV1A_INIT
+ * @value: The value to add
+ *
+ * Adds @value in little endian byte order to a 32 bit FNV-1a hash, see
+ * fpi_fnv1a_bytes().
+ *
+ * Returns: The updated hash
+ */
+guint32
+fpi_fnv1a_int32 (guint32 hash, gint32 value)
+{
+  guint32 le = GUINT32_TO_LE (value);
+
+  return fpi_fnv1a_bytes (hash, (const guint8 *) &le, sizeof (le));
+}
+
 /**
  * fpi_print_add_print:
  * @print: A #FpPrint
@@ -49,8 +92,12 @@ fpi_print_add_print (FpPrint *print, FpPrint *add)
   g_return_if_fail (print->type == FPI_PRINT_NBIS);
   g_return_if_fail (add->type == FPI_PRINT_NBIS);
 
+  fpi_print_decode_prints (print, NULL);
+  fpi_print_decode_prints (add, NULL);
+
   g_assert (add->prints->len == 1);
   g_ptr_array_add (print->prints, g_memdup (add->prints->pdata[0], sizeof (struct xyt_struct)));
+  fpi_print_invalidate_hash (print);
 }
 
 /**
@@ -169,6 +216,9 @@ fpi_print_add_from_image (FpPrint *print,
       return FALSE;
     }
 
+  if (!fpi_print_decode_prints (print, error))
+    return FALSE;
+
   minutiae = fp_image_get_minutiae (image);
   if (!minutiae || minutiae->len == 0)
     {
@@ -186,6 +236,7 @@ fpi_print_add_from_image (FpPrint *print,
   xyt = g_new0 (struct xyt_struct, 1);
   minutiae_to_xyt (&_minutiae, image->width, image->height, xyt);
   g_ptr_array_add (print->prints, xyt);
+  fpi_print_invalidate_hash (print);
 
   g_clear_object (&print->image);
   print->image = g_object_ref (image);
@@ -194,59 +245,367 @@ fpi_print_add_from_image (FpPrint *print,
   return TRUE;
 }
 
+/* bozorth3 keeps its state in global variables */
+G_LOCK_DEFINE_STATIC (bozorth);
+
+/* Bump whenever bozorth3 changes in a way that affects the pair tables */
+#define FPI_PRINT_BZ3_TABLE_VERSION 1
+
+/* The pruned and sorted pair table of a print as computed by
+ * bozorth_gallery_init(), rows are COLS_SIZE_2 integers each. */
+typedef struct
+{
+  guint32 checksum;
+  gint    n_rows;
+  gint   *rows;
+} FpiBz3Table;
+
+static void
+fpi_bz3_table_free (FpiBz3Table *table)
+{
+  g_free (table->rows);
+  g_free (table);
+}
+
+/* Identifies the minutiae a table was computed from */
+static guint32
+xyt_checksum (struct xyt_struct *xyt)
+{
+  guint32 hash = FPI_FNV1A_INIT;
+  gint i;
+
+  hash = fpi_fnv1a_int32 (hash, xyt->nrows);
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      hash = fpi_fnv1a_int32 (hash, xyt->xcol[i]);
+      hash = fpi_fnv1a_int32 (hash, xyt->ycol[i]);
+      hash = fpi_fnv1a_int32 (hash, xyt->thetacol[i]);
+    }
+
+  return hash;
+}
+
+/* Must be called with the bozorth lock held, overwrites the gallery state */
+static FpiBz3Table *
+bz3_table_compute (struct xyt_struct *xyt)
+{
+  FpiBz3Table *table;
+  gint i;
+
+  table = g_new0 (FpiBz3Table, 1);
+  table->checksum = xyt_checksum (xyt);
+  table->n_rows = bozorth_gallery_init (xyt);
+  table->rows = g_new (gint, table->n_rows * COLS_SIZE_2);
+  for (i = 0; i < table->n_rows; i++)
+    memcpy (table->rows + i * COLS_SIZE_2, fcolpt[i], sizeof (gint) * COLS_SIZE_2);
+
+  return table;
+}
+
+static FpiBz3Table *
+bz3_table_from_variant (GVariant *stage, struct xyt_struct *xyt)
+{
+  g_autoptr(GVariant) rows_data = NULL;
+  FpiBz3Table *table;
+  const gint32 *rows;
+  guint32 checksum;
+  gsize n_values;
+  gsize i;
+
+  g_variant_get (stage, "(u@ai)", &checksum, &rows_data);
+  if (checksum != xyt_checksum (xyt))
+    return NULL;
+
+  rows = g_variant_get_fixed_array (rows_data, &n_values, sizeof (gint32));
+  if (n_values % COLS_SIZE_2 != 0 || n_values / COLS_SIZE_2 > FCOLS_SIZE_1)
+    return NULL;
+
+  /* The matcher uses the minutia indices without checking them */
+  for (i = 0; i < n_values; i += COLS_SIZE_2)
+    {
+      if (rows[i + 3] < 1 || rows[i + 3] > xyt->nrows ||
+          rows[i + 4] < 1 || rows[i + 4] > xyt->nrows)
+        return NULL;
+    }
+
+  table = g_new0 (FpiBz3Table, 1);
+  table->checksum = checksum;
+  table->n_rows = n_values / COLS_SIZE_2;
+  table->rows = g_memdup (rows, n_values * sizeof (gint32));
+
+  return table;
+}
+
+/* The pair tables are large, so they are only kept for the most recently
+ * used templates, up to this many bytes in total. Tables that were stored
+ * with the print are cheap to restore, all others need to be computed
+ * again after they have been dropped.
+ */
+#define FPI_PRINT_BZ3_CACHE_SIZE (64 * 1024 * 1024)
+
+/* Templates with pair tables, the least recently used one first */
+static GQueue bz3_cache = G_QUEUE_INIT;
+static gsize bz3_cache_size = 0;
+
+static gsize
+bz3_table_size (FpiBz3Table *table)
+{
+  return sizeof (FpiBz3Table) + sizeof (gint) * COLS_SIZE_2 * table->n_rows;
+}
+
+/* Must be called with the bozorth lock held */
+static void
+bz3_drop_tables (FpPrint *print)
+{
+  guint i;
+
+  if (!print->bz3_tables)
+    return;
+
+  for (i = 0; i < print->bz3_tables->len; i++)
+    bz3_cache_size -= bz3_table_size (g_ptr_array_index (print->bz3_tables, i));
+
+  g_queue_delete_link (&bz3_cache, print->bz3_cache_link);
+  print->bz3_cache_link = NULL;
+  g_clear_pointer (&print->bz3_tables, g_ptr_array_unref);
+}
+
+/* Makes sure a pair table exists for every print in @print. Stored tables
+ * are used if they are still valid, all others are computed. Tables of
+ * other templates may be dropped to stay within the cache size. Must be
+ * called with the bozorth lock held. */
+static void
+bz3_ensure_tables (FpPrint *print)
+{
+  g_autoptr(GVariant) stages = NULL;
+  guint i;
+
+  if (print->bz3_tables)
+    {
+      g_queue_unlink (&bz3_cache, print->bz3_cache_link);
+      g_queue_push_tail_link (&bz3_cache, print->bz3_cache_link);
+    }
+  else
+    {
+      print->bz3_tables = g_ptr_array_new_with_free_func ((GDestroyNotify) fpi_bz3_table_free);
+      g_queue_push_tail (&bz3_cache, print);
+      print->bz3_cache_link = bz3_cache.tail;
+    }
+
+  if (print->bz3_tables->len < print->prints->len && print->bz3_data)
+    {
+      guint32 version;
+
+      g_variant_get (print->bz3_data, "(u@a(uai))", &version, &stages);
+      if (version != FPI_PRINT_BZ3_TABLE_VERSION)
+        {
+          g_clear_pointer (&stages, g_variant_unref);
+          g_clear_pointer (&print->bz3_data, g_variant_unref);
+        }
+    }
+
+  for (i = print->bz3_tables->len; i < print->prints->len; i++)
+    {
+      struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+      FpiBz3Table *table = NULL;
+
+      if (stages && i < g_variant_n_children (stages))
+        {
+          g_autoptr(GVariant) stage = g_variant_get_child_value (stages, i);
+
+          table = bz3_table_from_variant (stage, xyt);
+          if (!table)
+            fp_dbg ("Stored matcher data is stale, regenerating it");
+        }
+
+      if (!table)
+        table = bz3_table_compute (xyt);
+
+      bz3_cache_size += bz3_table_size (table);
+      g_ptr_array_add (print->bz3_tables, table);
+    }
+
+  while (bz3_cache_size > FPI_PRINT_BZ3_CACHE_SIZE &&
+         bz3_cache.head->data != print)
+    bz3_drop_tables (bz3_cache.head->data);
+}
+
 /**
- * fpi_print_bz3_match:
+ * fpi_print_bz3_tables_clear:
+ * @print: A #FpPrint
+ *
+ * Drops the cached bozorth3 pair tables of @print. This must be done
+ * before @print is freed.
+ */
+void
+fpi_print_bz3_tables_clear (FpPrint *print)
+{
+  G_LOCK (bozorth);
+  bz3_drop_tables (print);
+  G_UNLOCK (bozorth);
+}
+
+/* Equivalent to bozorth_to_gallery() but using a precomputed table */
+static gint
+bz3_table_match (gint               probe_len,
+                 struct xyt_struct *pstruct,
+                 struct xyt_struct *gstruct,
+                 FpiBz3Table       *table)
+{
+  gint np;
+  gint i;
+
+  memcpy (fcols, table->rows, sizeof (gint) * COLS_SIZE_2 * table->n_rows);
+  for (i = 0; i < table->n_rows; i++)
+    fcolpt[i] = fcols[i];
+
+  np = bz_match (probe_len, table->n_rows);
+
+  return bz_match_score (np, pstruct, gstruct);
+}
+
+/**
+ * fpi_print_bz3_tables_serialize:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ *
+ * Serializes the bozorth3 pair tables of all prints in @print so that they
+ * do not need to be computed again after loading it. The tables are
+ * computed and cached if needed.
+ *
+ * Returns: (transfer floating): The serialized tables
+ */
+GVariant *
+fpi_print_bz3_tables_serialize (FpPrint *print)
+{
+  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(uai)"));
+  guint i;
+
+  g_return_val_if_fail (print->type == FPI_PRINT_NBIS, NULL);
+
+  G_LOCK (bozorth);
+  bz3_ensure_tables (print);
+  for (i = 0; i < print->bz3_tables->len; i++)
+    {
+      FpiBz3Table *table = g_ptr_array_index (print->bz3_tables, i);
+
+      g_variant_builder_add (&builder, "(u@ai)",
+                             table->checksum,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                        table->rows,
+                                                        table->n_rows * COLS_SIZE_2,
+                                                        sizeof (gint32)));
+    }
+  G_UNLOCK (bozorth);
+
+  return g_variant_new ("(u@a(uai))", FPI_PRINT_BZ3_TABLE_VERSION,
+                        g_variant_builder_end (&builder));
+}
+
+/**
+ * fpi_print_bz3_score:
  * @template: A #FpPrint containing one or more prints
  * @print: A newly scanned #FpPrint to test
- * @bz3_threshold: The BZ3 match threshold
+ * @stop_score: Stop at the first print scoring at least this
+ * @score: (out): Return location for the best score
  * @error: Return location for error
  *
- * Match the newly scanned @print (containing exactly one print) against the
- * prints contained in @template which will have been stored during enrollment.
+ * Compute the bozorth3 score of @print against the prints contained in
+ * @template. Every print of @print is compared with every print of
+ * @template, in order, until a pair reaches @stop_score. Pass %G_MAXINT to
+ * get the best score of all pairs.
  *
- * Both @template and @print need to be of type #FPI_PRINT_NBIS for this to
- * work.
+ * This function may be called from any thread, but matches are done one
+ * at a time. The pair tables of @template are taken from the stored matcher
+ * data if it is still valid, or computed otherwise. They are cached for the
+ * most recently used templates.
  *
- * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
+ * Returns: %TRUE on success, %FALSE and @error set otherwise
  */
-FpiMatchResult
-fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GError **error)
+gboolean
+fpi_print_bz3_score (FpPrint *template,
+                     FpPrint *print,
+                     gint     stop_score,
+                     gint    *score,
+                     GError **error)
 {
-  struct xyt_struct *pstruct;
-  gint probe_len;
-  gint i;
+  gint i, j;
+
+  *score = 0;
 
   /* XXX: Use a different error type? */
   if (template->type != FPI_PRINT_NBIS || print->type != FPI_PRINT_NBIS)
     {
-      *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
-                                         "It is only possible to match NBIS type print data");
-      return FPI_MATCH_ERROR;
+      g_set_error_literal (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED,
+                           "It is only possible to match NBIS type print data");
+      return FALSE;
     }
 
-  if (print->prints->len != 1)
+  /* Prints that were deserialized lazily are decoded on first use */
+  if (!fpi_print_decode_prints (template, error) ||
+      !fpi_print_decode_prints (print, error))
+    return FALSE;
+
+  if (print->prints->len == 0)
     {
-      *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
-                                         "New print contains more than one print!");
-      return FPI_MATCH_ERROR;
+      g_set_error_literal (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                           "New print does not contain any print!");
+      return FALSE;
     }
 
-  pstruct = g_ptr_array_index (print->prints, 0);
-  probe_len = bozorth_probe_init (pstruct);
+  G_LOCK (bozorth);
+
+  bz3_ensure_tables (template);
 
-  for (i = 0; i < template->prints->len; i++)
+  for (j = 0; j < print->prints->len && *score < stop_score; j++)
     {
-      struct xyt_struct *gstruct;
-      gint score;
-      gstruct = g_ptr_array_index (template->prints, i);
-      score = bozorth_to_gallery (probe_len, pstruct, gstruct);
-      fp_dbg ("score %d/%d", score, bz3_threshold);
-
-      if (score >= bz3_threshold)
-        return FPI_MATCH_SUCCESS;
+      struct xyt_struct *pstruct = g_ptr_array_index (print->prints, j);
+      gint probe_len = bozorth_probe_init (pstruct);
+
+      for (i = 0; i < template->prints->len && *score < stop_score; i++)
+        {
+          struct xyt_struct *gstruct;
+          gint stage_score;
+
+          gstruct = g_ptr_array_index (template->prints, i);
+          stage_score = bz3_table_match (probe_len, pstruct, gstruct,
+                                         g_ptr_array_index (template->bz3_tables, i));
+          fp_dbg ("score %d", stage_score);
+
+          *score = MAX (*score, stage_score);
+        }
     }
 
-  return FPI_MATCH_FAIL;
+  G_UNLOCK (bozorth);
+
+  return TRUE;
+}
+
+/**
+ * fpi_print_bz3_match:
+ * @template: A #FpPrint containing one or more prints
+ * @print: A newly scanned #FpPrint to test
+ * @bz3_threshold: The BZ3 match threshold
+ * @error: Return location for error
+ *
+ * Match the newly scanned @print against the prints contained in @template
+ * which will have been stored during enrollment.
+ *
+ * Both @template and @print need to be of type #FPI_PRINT_NBIS for this to
+ * work. See fpi_print_bz3_score() for details.
+ *
+ * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
+ */
+FpiMatchResult
+fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GError **error)
+{
+  gint score;
+
+  if (!fpi_print_bz3_score (template, print, bz3_threshold, &score, error))
+    return FPI_MATCH_ERROR;
+
+  fp_dbg ("best score %d/%d", score, bz3_threshold);
+
+  return score >= bz3_threshold ? FPI_MATCH_SUCCESS : FPI_MATCH_FAIL;
 }
 
 /**
@@ -6,6 +6,9 @@
 
 G_BEGIN_DECLS
 
+/* Score needed for a match unless the driver overrides it */
+#define BOZORTH3_DEFAULT_THRESHOLD 40
+
 /**
  * FpiPrintType:
  * @FPI_PRINT_UNDEFINED: Undefined type, this happens prior to enrollment
@@ -44,11 +47,25 @@ gboolean fpi_print_add_from_image (FpPrint *print,
                                    FpImage *image,
                                    GError **error);
 
+gboolean fpi_print_bz3_score (FpPrint *template,
+                              FpPrint *print,
+                              gint     stop_score,
+                              gint    *score,
+                              GError **error);
 FpiMatchResult fpi_print_bz3_match (FpPrint * template,
                                     FpPrint * print,
                                     gint bz3_threshold,
                                     GError **error);
 
+/* 32 bit FNV-1a, used for the hashes and checksums that are stored */
+#define FPI_FNV1A_INIT 2166136261U
+
+guint32  fpi_fnv1a_bytes (guint32       hash,
+                          const guint8 *data,
+                          gsize         length);
+guint32  fpi_fnv1a_int32 (guint32 hash,
+                          gint32  value);
+
 /* Helpers to encode metadata into user ID strings. */
 gchar *  fpi_print_generate_user_id (FpPrint *print);
 gboolean fpi_print_fill_from_user_id (FpPrint    *print,
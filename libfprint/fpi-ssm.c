@@ -76,6 +76,12 @@
  * Your completion callback should examine the return value of
  * fpi_ssm_get_error() in order to determine whether the #FpiSsm completed or
  * failed. An error code of zero indicates successful completion.
+ *
+ * When the `FP_DEBUG_SSM_STATS` environment variable is set, the time spent
+ * in every state is recorded per device for all machines with the same
+ * name. This includes the delay of delayed state changes and the time a
+ * sub-SSM takes to run. The statistics can be retrieved with
+ * fpi_ssm_get_state_stats() and are logged when the device is closed.
  */
 
 struct _FpiSsm
@@ -94,8 +100,13 @@ struct _FpiSsm
   GError                 *error;
   FpiSsmCompletedCallback callback;
   FpiSsmHandlerCallback   handler;
+  GArray                 *stats;
+  gint64                  state_start;
 };
 
+#define FPI_SSM_STATS_KEY "fpi-ssm-stats"
+#define FPI_SSM_STATS_UNNAMED "(unnamed)"
+
 /**
  * fpi_ssm_new:
  * @dev: a #fp_dev fingerprint device
@@ -282,16 +293,77 @@ fpi_ssm_free (FpiSsm *machine)
     g_clear_pointer (&machine->ssm_data, machine->ssm_data_destroy);
   g_clear_pointer (&machine->error, g_error_free);
   g_clear_pointer (&machine->name, g_free);
+  g_clear_pointer (&machine->stats, g_array_unref);
   fpi_ssm_clear_delayed_action (machine);
   g_free (machine);
 }
 
+/* Returns the per state statistics shared by all machines of the device
+ * with the same name, or %NULL if statistics are disabled.
+ */
+static GArray *
+fpi_ssm_stats_lookup (FpiSsm *machine)
+{
+  const char *name = machine->name ? machine->name : FPI_SSM_STATS_UNNAMED;
+  GHashTable *stats;
+  GArray *states;
+
+  if (!g_getenv ("FP_DEBUG_SSM_STATS"))
+    return NULL;
+
+  stats = g_object_get_data (G_OBJECT (machine->dev), FPI_SSM_STATS_KEY);
+  if (!stats)
+    {
+      stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify) g_array_unref);
+      g_object_set_data_full (G_OBJECT (machine->dev), FPI_SSM_STATS_KEY,
+                              stats, (GDestroyNotify) g_hash_table_destroy);
+    }
+
+  states = g_hash_table_lookup (stats, name);
+  if (!states)
+    {
+      states = g_array_new (FALSE, TRUE, sizeof (FpiSsmStateStats));
+      g_hash_table_insert (stats, g_strdup (name), states);
+    }
+
+  if (states->len < (guint) machine->nr_states)
+    g_array_set_size (states, machine->nr_states);
+
+  return g_array_ref (states);
+}
+
+/* Account the time spent in the current state, must be called before
+ * leaving it.
+ */
+static void
+fpi_ssm_stats_leave_state (FpiSsm *machine)
+{
+  FpiSsmStateStats *stats;
+  gint64 elapsed;
+  guint bucket;
+
+  if (!machine->stats || machine->cur_state >= machine->nr_states)
+    return;
+
+  elapsed = g_get_monotonic_time () - machine->state_start;
+  bucket = g_bit_storage (MIN (elapsed, G_MAXUINT32)) - 1;
+
+  stats = &g_array_index (machine->stats, FpiSsmStateStats, machine->cur_state);
+  stats->visits++;
+  stats->total_time += elapsed;
+  stats->max_time = MAX (stats->max_time, elapsed);
+  stats->histogram[MIN (bucket, FPI_SSM_STATS_BUCKETS - 1)]++;
+}
+
 /* Invoke the state handler */
 static void
 __ssm_call_handler (FpiSsm *machine)
 {
   fp_dbg ("[%s] %s entering state %d", fp_device_get_driver (machine->dev),
           machine->name, machine->cur_state);
+  if (machine->stats)
+    machine->state_start = g_get_monotonic_time ();
   machine->handler (machine, machine->dev);
 }
 
@@ -318,6 +390,8 @@ fpi_ssm_start (FpiSsm *ssm, FpiSsmCompletedCallback callback)
   ssm->cur_state = 0;
   ssm->completed = FALSE;
   ssm->error = NULL;
+  if (!ssm->stats)
+    ssm->stats = fpi_ssm_stats_lookup (ssm);
   __ssm_call_handler (ssm);
 }
 
@@ -375,6 +449,7 @@ fpi_ssm_mark_completed (FpiSsm *machine)
   BUG_ON (machine->timeout != NULL);
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_stats_leave_state (machine);
 
   machine->completed = TRUE;
 
@@ -477,6 +552,7 @@ fpi_ssm_next_state (FpiSsm *machine)
   BUG_ON (machine->timeout != NULL);
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_stats_leave_state (machine);
 
   machine->cur_state++;
   if (machine->cur_state == machine->nr_states)
@@ -558,6 +634,7 @@ fpi_ssm_jump_to_state (FpiSsm *machine, int state)
   BUG_ON (machine->timeout != NULL);
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_stats_leave_state (machine);
 
   machine->cur_state = state;
   __ssm_call_handler (machine);
@@ -683,6 +760,94 @@ fpi_ssm_dup_error (FpiSsm *machine)
   return NULL;
 }
 
+/**
+ * fpi_ssm_get_state_stats:
+ * @dev: a #FpDevice
+ * @machine_name: the name of the state machines
+ * @state: the state
+ *
+ * Returns the timing statistics of @state of all state machines of @dev
+ * named @machine_name. Statistics are only recorded when the
+ * `FP_DEBUG_SSM_STATS` environment variable is set.
+ *
+ * Returns: (transfer none) (nullable): the #FpiSsmStateStats or %NULL if
+ *   no machine with that name and state was run
+ */
+const FpiSsmStateStats *
+fpi_ssm_get_state_stats (FpDevice   *dev,
+                         const char *machine_name,
+                         int         state)
+{
+  GHashTable *stats;
+  GArray *states;
+
+  g_return_val_if_fail (FP_IS_DEVICE (dev), NULL);
+
+  stats = g_object_get_data (G_OBJECT (dev), FPI_SSM_STATS_KEY);
+  if (!stats)
+    return NULL;
+
+  states = g_hash_table_lookup (stats,
+                                machine_name ? machine_name : FPI_SSM_STATS_UNNAMED);
+  if (!states || state < 0 || (guint) state >= states->len)
+    return NULL;
+
+  return &g_array_index (states, FpiSsmStateStats, state);
+}
+
+/**
+ * fpi_ssm_dump_stats:
+ * @dev: a #FpDevice
+ *
+ * Logs the timing statistics of all states of all state machines of @dev,
+ * see fpi_ssm_get_state_stats().
+ */
+void
+fpi_ssm_dump_stats (FpDevice *dev)
+{
+  g_autoptr(GList) names = NULL;
+  GHashTable *stats;
+  GList *l;
+
+  g_return_if_fail (FP_IS_DEVICE (dev));
+
+  stats = g_object_get_data (G_OBJECT (dev), FPI_SSM_STATS_KEY);
+  if (!stats)
+    return;
+
+  names = g_list_sort (g_hash_table_get_keys (stats), (GCompareFunc) g_strcmp0);
+
+  for (l = names; l; l = l->next)
+    {
+      GArray *states = g_hash_table_lookup (stats, l->data);
+      guint state;
+
+      for (state = 0; state < states->len; state++)
+        {
+          FpiSsmStateStats *s = &g_array_index (states, FpiSsmStateStats, state);
+          g_autoptr(GString) histogram = g_string_new (NULL);
+          guint i;
+
+          if (s->visits == 0)
+            continue;
+
+          for (i = 0; i < FPI_SSM_STATS_BUCKETS - 1; i++)
+            if (s->histogram[i])
+              g_string_append_printf (histogram, " <%uus:%u",
+                                      1u << (i + 1), s->histogram[i]);
+          if (s->histogram[i])
+            g_string_append_printf (histogram, " >=%uus:%u",
+                                    1u << i, s->histogram[i]);
+
+          fp_info ("[%s] %s state %u: %u visits, mean %" G_GINT64_FORMAT
+                   "us, max %" G_GINT64_FORMAT "us,%s",
+                   fp_device_get_driver (dev), (const char *) l->data, state,
+                   s->visits, s->total_time / s->visits, s->max_time,
+                   histogram->str);
+        }
+    }
+}
+
 /**
  * fpi_ssm_usb_transfer_cb:
  * @transfer: a #FpiUsbTransfer
@@ -99,6 +99,38 @@ GError * fpi_ssm_get_error (FpiSsm *machine);
 GError * fpi_ssm_dup_error (FpiSsm *machine);
 int fpi_ssm_get_cur_state (FpiSsm *machine);
 
+/**
+ * FPI_SSM_STATS_BUCKETS:
+ *
+ * Number of buckets in the histogram of #FpiSsmStateStats.
+ */
+#define FPI_SSM_STATS_BUCKETS 24
+
+/**
+ * FpiSsmStateStats:
+ * @visits: Number of times the state was left
+ * @total_time: Total time spent in the state, in microseconds
+ * @max_time: Longest time spent in the state, in microseconds
+ * @histogram: Number of visits by duration; bucket `i` counts the visits
+ *   that took less than `2^(i+1)` but at least `2^i` microseconds, the
+ *   last bucket also counts all longer visits
+ *
+ * Timing of one state of all state machines of a device with the same name,
+ * see fpi_ssm_get_state_stats().
+ */
+typedef struct
+{
+  guint  visits;
+  gint64 total_time;
+  gint64 max_time;
+  guint  histogram[FPI_SSM_STATS_BUCKETS];
+} FpiSsmStateStats;
+
+const FpiSsmStateStats *fpi_ssm_get_state_stats (FpDevice   *dev,
+                                                 const char *machine_name,
+                                                 int         state);
+void fpi_ssm_dump_stats (FpDevice *dev);
+
 /* Callbacks to be used by the driver instead of implementing their own
  * logic.
  */
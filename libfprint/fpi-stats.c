@@ -0,0 +1,353 @@
+/*
+ * Pixel statistics helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "fpi-stats.h"
+
+/**
+ * SECTION: fpi-stats
+ * @title: Pixel statistics
+ * @short_description: Reductions over 8 bit pixel buffers
+ *
+ * Helpers to compute sums, histograms and differences of pixel buffers.
+ * Drivers use these to detect finger presence and empty frames, which
+ * happens continuously while a device is waiting for a finger.
+ *
+ * All results are accumulated in 64 bit, so they cannot overflow for any
+ * realistic buffer size. The inner loops accumulate in 32 bit blocks
+ * so that the compiler can vectorize them, and where supported an AVX2
+ * variant is selected at runtime.
+ */
+
+#if HAVE_TARGET_CLONES
+#define FPI_STATS_KERNEL __attribute__((target_clones ("avx2", "default")))
+#else
+#define FPI_STATS_KERNEL
+#endif
+
+/* Largest number of items whose values can be summed up in a guint32 */
+#define BLOCK_SUM        (G_MAXUINT32 / 255)
+#define BLOCK_SUM_SQ     (G_MAXUINT32 / (255 * 255))
+#define BLOCK_PAIR_SUM_SQ (G_MAXUINT32 / (510 * 510))
+
+/**
+ * fpi_stats_sum:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ *
+ * Returns: the sum of all values in @buf
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_sum (const guint8 *buf,
+               gsize         size)
+{
+  guint64 res = 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_SUM);
+      guint32 acc = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        acc += buf[i];
+
+      res += acc;
+      buf += n;
+      size -= n;
+    }
+
+  return res;
+}
+
+/**
+ * fpi_stats_sum_sq:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ *
+ * Returns: the sum of the squares of all values in @buf
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_sum_sq (const guint8 *buf,
+                  gsize         size)
+{
+  guint64 res = 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_SUM_SQ);
+      guint32 acc = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        acc += (guint32) buf[i] * buf[i];
+
+      res += acc;
+      buf += n;
+      size -= n;
+    }
+
+  return res;
+}
+
+/**
+ * fpi_stats_sum_nibbles:
+ * @buf: buffer holding two 4 bit pixels per byte
+ * @size: size of @buf
+ *
+ * Returns: the sum of all 4 bit values in @buf
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_sum_nibbles (const guint8 *buf,
+                       gsize         size)
+{
+  guint64 res = 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_SUM);
+      guint32 acc = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        acc += (buf[i] >> 4) + (buf[i] & 0x0f);
+
+      res += acc;
+      buf += n;
+      size -= n;
+    }
+
+  return res;
+}
+
+/**
+ * fpi_stats_histogram:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ * @hist: (out caller-allocates): the histogram
+ *
+ * Counts how often every value occurs in @buf.
+ */
+void
+fpi_stats_histogram (const guint8 *buf,
+                     gsize         size,
+                     guint32       hist[256])
+{
+  /* Interleaving several histograms avoids stalls on repeated values,
+   * which are common in mostly empty frames.
+   */
+  guint32 sub[4][256] = { { 0, } };
+  gsize i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+    {
+      sub[0][buf[i]]++;
+      sub[1][buf[i + 1]]++;
+      sub[2][buf[i + 2]]++;
+      sub[3][buf[i + 3]]++;
+    }
+  for (; i < size; i++)
+    sub[0][buf[i]]++;
+
+  for (i = 0; i < 256; i++)
+    hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+/**
+ * fpi_stats_histogram_nibbles:
+ * @buf: buffer holding two 4 bit pixels per byte
+ * @size: size of @buf
+ * @hist: (out caller-allocates): the histogram
+ *
+ * Counts how often every 4 bit value occurs in @buf.
+ */
+void
+fpi_stats_histogram_nibbles (const guint8 *buf,
+                             gsize         size,
+                             guint32       hist[16])
+{
+  guint32 bytes[256];
+  gint i;
+
+  fpi_stats_histogram (buf, size, bytes);
+
+  memset (hist, 0, 16 * sizeof (guint32));
+  for (i = 0; i < 256; i++)
+    {
+      hist[i >> 4] += bytes[i];
+      hist[i & 0x0f] += bytes[i];
+    }
+}
+
+/**
+ * fpi_stats_sad:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: size of the smallest buffer
+ *
+ * Returns: the sum of absolute differences between @buf1 and @buf2
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_sad (const guint8 *buf1,
+               const guint8 *buf2,
+               gsize         size)
+{
+  guint64 res = 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_SUM);
+      guint32 acc = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        acc += buf1[i] > buf2[i] ? buf1[i] - buf2[i] : buf2[i] - buf1[i];
+
+      res += acc;
+      buf1 += n;
+      buf2 += n;
+      size -= n;
+    }
+
+  return res;
+}
+
+/**
+ * fpi_stats_sq_diff:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: size of the smallest buffer
+ *
+ * Returns: the sum of squared differences between @buf1 and @buf2
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_sq_diff (const guint8 *buf1,
+                   const guint8 *buf2,
+                   gsize         size)
+{
+  guint64 res = 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_SUM_SQ);
+      guint32 acc = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        {
+          gint32 dev = (gint32) buf1[i] - (gint32) buf2[i];
+          acc += dev * dev;
+        }
+
+      res += acc;
+      buf1 += n;
+      buf2 += n;
+      size -= n;
+    }
+
+  return res;
+}
+
+/* Sum of squared deviations from the integer (truncated) mean, computed
+ * from the sum and the sum of squares so that only one pass is needed.
+ * The result is identical to subtracting the truncated mean first.
+ */
+static guint64
+sq_dev_from_sums (guint64 sum, guint64 sum_sq, gsize size)
+{
+  guint64 mean = sum / size;
+
+  return sum_sq + size * mean * mean - 2 * mean * sum;
+}
+
+/**
+ * fpi_stats_sq_dev:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ *
+ * Calculates the sum of squared deviations of the values in @buf from
+ * their mean, with the mean rounded down to an integer:
+ * |[<!-- -->
+ *    mean = sum (buf[0..size]) / size
+ *    sq_dev = sum ((buf[0..size] - mean) ^ 2)
+ * ]|
+ *
+ * Returns: the sum of squared deviations, or 0 if @size is 0
+ */
+guint64
+fpi_stats_sq_dev (const guint8 *buf,
+                  gsize         size)
+{
+  if (size == 0)
+    return 0;
+
+  return sq_dev_from_sums (fpi_stats_sum (buf, size),
+                           fpi_stats_sum_sq (buf, size),
+                           size);
+}
+
+/**
+ * fpi_stats_pair_sq_dev:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: size of the smallest buffer
+ *
+ * Same as fpi_stats_sq_dev() but for the sum of two buffers, which is
+ * usually two lines captured at the same time:
+ * |[<!-- -->
+ *    mean = sum (buf1[0..size] + buf2[0..size]) / size
+ *    sq_dev = sum ((buf1[0..size] + buf2[0..size] - mean) ^ 2)
+ * ]|
+ *
+ * Returns: the sum of squared deviations, or 0 if @size is 0
+ */
+FPI_STATS_KERNEL guint64
+fpi_stats_pair_sq_dev (const guint8 *buf1,
+                       const guint8 *buf2,
+                       gsize         size)
+{
+  guint64 sum = 0, sum_sq = 0;
+  gsize total = size;
+
+  if (size == 0)
+    return 0;
+
+  while (size > 0)
+    {
+      gsize n = MIN (size, BLOCK_PAIR_SUM_SQ);
+      guint32 acc = 0, acc_sq = 0;
+      gsize i;
+
+      for (i = 0; i < n; i++)
+        {
+          guint32 v = (guint32) buf1[i] + buf2[i];
+          acc += v;
+          acc_sq += v * v;
+        }
+
+      sum += acc;
+      sum_sq += acc_sq;
+      buf1 += n;
+      buf2 += n;
+      size -= n;
+    }
+
+  return sq_dev_from_sums (sum, sum_sq, total);
+}
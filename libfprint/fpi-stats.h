@@ -0,0 +1,48 @@
+/*
+ * Pixel statistics helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+guint64 fpi_stats_sum (const guint8 *buf,
+                       gsize         size);
+guint64 fpi_stats_sum_sq (const guint8 *buf,
+                          gsize         size);
+guint64 fpi_stats_sum_nibbles (const guint8 *buf,
+                               gsize         size);
+
+void fpi_stats_histogram (const guint8 *buf,
+                          gsize         size,
+                          guint32       hist[256]);
+void fpi_stats_histogram_nibbles (const guint8 *buf,
+                                  gsize         size,
+                                  guint32       hist[16]);
+
+guint64 fpi_stats_sad (const guint8 *buf1,
+                       const guint8 *buf2,
+                       gsize         size);
+guint64 fpi_stats_sq_diff (const guint8 *buf1,
+                           const guint8 *buf2,
+                           gsize         size);
+
+guint64 fpi_stats_sq_dev (const guint8 *buf,
+                          gsize         size);
+guint64 fpi_stats_pair_sq_dev (const guint8 *buf1,
+                               const guint8 *buf2,
+                               gsize         size);
@@ -17,6 +17,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <string.h>
+
 #include "fpi-usb-transfer.h"
 
 /**
@@ -30,11 +32,179 @@
  *
  * Drivers should use this API only rather than accessing the GUsbDevice
  * directly in most cases.
+ *
+ * Buffers allocated by the transfer helpers are recycled per device, so
+ * repeatedly polling a device does not allocate new memory. A driver that
+ * wants to keep the received data can take the buffer over using
+ * fpi_usb_transfer_steal_buffer() instead of copying it.
+ *
+ * Sensors that continuously stream data should use a #FpiUsbStream. It
+ * keeps several bulk transfers queued on an endpoint so that the host is
+ * always ready to receive data, and hands the completed transfers to the
+ * driver in order.
  */
 
 
 G_DEFINE_BOXED_TYPE (FpiUsbTransfer, fpi_usb_transfer, fpi_usb_transfer_ref, fpi_usb_transfer_unref)
 
+/* Buffers are pooled in power of two size classes from 64 bytes to 1 MiB,
+ * larger ones are allocated directly. Each buffer is preceded by a header
+ * that links it back to its pool, which stays alive until all of its
+ * buffers have been returned.
+ */
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 20
+#define BUFFER_POOL_N_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_MAX_FREE 8
+
+typedef struct _BufferHeader BufferHeader;
+
+typedef struct
+{
+  gint          ref_count;
+  GMutex        mutex;
+  gboolean      orphaned;
+  BufferHeader *free[BUFFER_POOL_N_CLASSES];
+  guint         n_free[BUFFER_POOL_N_CLASSES];
+} BufferPool;
+
+struct _BufferHeader
+{
+  BufferPool   *pool;
+  BufferHeader *next;
+  guint         size_class;
+};
+
+/* Keep the buffer itself aligned like a g_malloc() result */
+#define BUFFER_HEADER_SIZE ((sizeof (BufferHeader) + 15) & ~((gsize) 15))
+
+static GQuark
+buffer_pool_quark (void)
+{
+  return g_quark_from_static_string ("fpi-usb-buffer-pool");
+}
+
+static void
+buffer_pool_unref (BufferPool *pool)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&pool->ref_count))
+    return;
+
+  for (i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    {
+      while (pool->free[i])
+        {
+          BufferHeader *header = pool->free[i];
+
+          pool->free[i] = header->next;
+          g_free (header);
+        }
+    }
+
+  g_mutex_clear (&pool->mutex);
+  g_free (pool);
+}
+
+static void
+buffer_pool_orphan (gpointer data)
+{
+  BufferPool *pool = data;
+
+  /* The device is gone, buffers returned after this are freed directly */
+  g_mutex_lock (&pool->mutex);
+  pool->orphaned = TRUE;
+  g_mutex_unlock (&pool->mutex);
+
+  buffer_pool_unref (pool);
+}
+
+static void
+buffer_pool_free_buffer (gpointer data)
+{
+  BufferHeader *header = (BufferHeader *) ((guint8 *) data - BUFFER_HEADER_SIZE);
+  BufferPool *pool = header->pool;
+
+  g_mutex_lock (&pool->mutex);
+  if (!pool->orphaned && pool->n_free[header->size_class] < BUFFER_POOL_MAX_FREE)
+    {
+      header->next = pool->free[header->size_class];
+      pool->free[header->size_class] = header;
+      pool->n_free[header->size_class]++;
+      header = NULL;
+    }
+  g_mutex_unlock (&pool->mutex);
+
+  g_free (header);
+  buffer_pool_unref (pool);
+}
+
+static guint8 *
+buffer_pool_alloc (FpDevice       *device,
+                   gsize           length,
+                   GDestroyNotify *free_func)
+{
+  BufferPool *pool;
+  BufferHeader *header;
+  guint size_class = 0;
+
+  while (size_class < BUFFER_POOL_N_CLASSES &&
+         length > ((gsize) 1 << (size_class + BUFFER_POOL_MIN_SHIFT)))
+    size_class++;
+
+  if (size_class == BUFFER_POOL_N_CLASSES)
+    {
+      *free_func = g_free;
+      return g_malloc0 (length);
+    }
+
+  pool = g_object_get_qdata (G_OBJECT (device), buffer_pool_quark ());
+  if (!pool)
+    {
+      pool = g_new0 (BufferPool, 1);
+      pool->ref_count = 1;
+      g_mutex_init (&pool->mutex);
+      g_object_set_qdata_full (G_OBJECT (device), buffer_pool_quark (),
+                               pool, buffer_pool_orphan);
+    }
+
+  g_mutex_lock (&pool->mutex);
+  header = pool->free[size_class];
+  if (header)
+    {
+      pool->free[size_class] = header->next;
+      pool->n_free[size_class]--;
+    }
+  g_mutex_unlock (&pool->mutex);
+
+  if (!header)
+    {
+      header = g_malloc (BUFFER_HEADER_SIZE +
+                         ((gsize) 1 << (size_class + BUFFER_POOL_MIN_SHIFT)));
+      header->pool = pool;
+      header->size_class = size_class;
+    }
+
+  g_atomic_int_inc (&pool->ref_count);
+  header->next = NULL;
+
+  *free_func = buffer_pool_free_buffer;
+  return memset ((guint8 *) header + BUFFER_HEADER_SIZE, 0, length);
+}
+
+/* Allocates the buffer of a transfer that was filled without one */
+static void
+transfer_alloc_buffer (FpiUsbTransfer *transfer)
+{
+  g_assert (transfer->buffer == NULL);
+
+  transfer->buffer = buffer_pool_alloc (transfer->device,
+                                        transfer->length,
+                                        &transfer->free_buffer);
+  transfer->alloc_buffer = TRUE;
+}
+
 static void
 log_transfer (FpiUsbTransfer *transfer, gboolean submit, GError *error)
 {
@@ -176,11 +346,16 @@ fpi_usb_transfer_fill_bulk (FpiUsbTransfer *transfer,
                             guint8          endpoint,
                             gsize           length)
 {
+  GDestroyNotify free_func;
+  guint8 *buffer;
+
+  buffer = buffer_pool_alloc (transfer->device, length, &free_func);
   fpi_usb_transfer_fill_bulk_full (transfer,
                                    endpoint,
-                                   g_malloc0 (length),
+                                   buffer,
                                    length,
-                                   g_free);
+                                   free_func);
+  transfer->alloc_buffer = TRUE;
 }
 
 /**
@@ -246,8 +421,7 @@ fpi_usb_transfer_fill_control (FpiUsbTransfer       *transfer,
   transfer->idx = idx;
 
   transfer->length = length;
-  transfer->buffer = g_malloc0 (length);
-  transfer->free_buffer = g_free;
+  transfer_alloc_buffer (transfer);
 }
 
 /**
@@ -264,11 +438,16 @@ fpi_usb_transfer_fill_interrupt (FpiUsbTransfer *transfer,
                                  guint8          endpoint,
                                  gsize           length)
 {
+  GDestroyNotify free_func;
+  guint8 *buffer;
+
+  buffer = buffer_pool_alloc (transfer->device, length, &free_func);
   fpi_usb_transfer_fill_interrupt_full (transfer,
                                         endpoint,
-                                        g_malloc0 (length),
+                                        buffer,
                                         length,
-                                        g_free);
+                                        free_func);
+  transfer->alloc_buffer = TRUE;
 }
 
 /**
@@ -400,6 +579,13 @@ fpi_usb_transfer_submit (FpiUsbTransfer        *transfer,
   /* Recycling is allowed, but not two at the same time. */
   g_return_if_fail (transfer->callback == NULL);
 
+  /* The buffer may have been stolen from a recycled transfer */
+  if (!transfer->buffer)
+    {
+      g_return_if_fail (transfer->alloc_buffer);
+      transfer_alloc_buffer (transfer);
+    }
+
   transfer->callback = callback;
   transfer->user_data = user_data;
 
@@ -492,6 +678,12 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
   /* Recycling is allowed, but not two at the same time. */
   g_return_val_if_fail (transfer->callback == NULL, FALSE);
 
+  if (!transfer->buffer)
+    {
+      g_return_val_if_fail (transfer->alloc_buffer, FALSE);
+      transfer_alloc_buffer (transfer);
+    }
+
   log_transfer (transfer, TRUE, NULL);
 
   switch (transfer->type)
@@ -548,3 +740,383 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
 
   return res;
 }
+
+/**
+ * fpi_usb_transfer_steal_buffer:
+ * @transfer: The #FpiUsbTransfer
+ * @free_func: (out): Return location for the function to free the buffer
+ *
+ * Takes over the buffer of @transfer, so that the received data can be
+ * kept without copying it. The buffer has to be released using @free_func.
+ *
+ * This may be called from the transfer callback. If the buffer was
+ * allocated by the transfer itself, then a new buffer is allocated when
+ * the transfer is submitted again.
+ *
+ * Returns: (transfer full): The buffer of @transfer
+ */
+guint8 *
+fpi_usb_transfer_steal_buffer (FpiUsbTransfer *transfer,
+                               GDestroyNotify *free_func)
+{
+  guint8 *buffer;
+
+  g_return_val_if_fail (transfer, NULL);
+  g_return_val_if_fail (free_func, NULL);
+  g_return_val_if_fail (transfer->callback == NULL, NULL);
+
+  buffer = g_steal_pointer (&transfer->buffer);
+  *free_func = transfer->free_buffer;
+  transfer->free_buffer = NULL;
+
+  return buffer;
+}
+
+typedef struct
+{
+  FpiUsbStream   *stream;
+  FpiUsbTransfer *transfer;
+  GError         *error;
+  gboolean        completed;
+} FpiUsbStreamSlot;
+
+struct _FpiUsbStream
+{
+  FpDevice                   *device;
+
+  FpiUsbStreamSlot           *slots;
+  guint                       depth;
+  guint                       head;
+  guint                       in_flight;
+
+  guint                       timeout_ms;
+  GCancellable               *cancellable;
+  GCancellable               *parent_cancellable;
+  gulong                      cancelled_id;
+
+  gboolean                    running;
+  gboolean                    delivering;
+  gboolean                    free_pending;
+
+  FpiUsbStreamCallback        callback;
+  gpointer                    user_data;
+
+  FpiUsbStreamStoppedCallback stopped_callback;
+  gpointer                    stopped_data;
+};
+
+/**
+ * fpi_usb_stream_new:
+ * @device: The #FpDevice the stream is for
+ * @endpoint: The bulk endpoint to read from
+ * @length: The size of each transfer
+ * @depth: The number of transfers to keep queued
+ *
+ * Creates a new #FpiUsbStream with @depth transfers of @length bytes each.
+ * The transfer buffers are allocated once and reused for the lifetime
+ * of the stream.
+ *
+ * Returns: (transfer full): A newly created #FpiUsbStream
+ */
+FpiUsbStream *
+fpi_usb_stream_new (FpDevice *device,
+                    guint8    endpoint,
+                    gsize     length,
+                    guint     depth)
+{
+  FpiUsbStream *stream;
+  guint i;
+
+  g_return_val_if_fail (device != NULL, NULL);
+  g_return_val_if_fail (endpoint & FPI_USB_ENDPOINT_IN, NULL);
+  g_return_val_if_fail (depth > 0, NULL);
+
+  stream = g_new0 (FpiUsbStream, 1);
+  stream->device = device;
+  stream->depth = depth;
+  stream->slots = g_new0 (FpiUsbStreamSlot, depth);
+
+  for (i = 0; i < depth; i++)
+    {
+      stream->slots[i].stream = stream;
+      stream->slots[i].transfer = fpi_usb_transfer_new (device);
+      fpi_usb_transfer_fill_bulk (stream->slots[i].transfer, endpoint, length);
+    }
+
+  return stream;
+}
+
+static void
+fpi_usb_stream_destroy (FpiUsbStream *stream)
+{
+  guint i;
+
+  g_assert (stream->in_flight == 0);
+
+  for (i = 0; i < stream->depth; i++)
+    {
+      g_clear_error (&stream->slots[i].error);
+      fpi_usb_transfer_unref (stream->slots[i].transfer);
+    }
+
+  g_clear_object (&stream->cancellable);
+  g_free (stream->slots);
+  g_free (stream);
+}
+
+/**
+ * fpi_usb_stream_free:
+ * @stream: A #FpiUsbStream
+ *
+ * Frees @stream. A running stream is stopped first, and the memory is
+ * released once all of its transfers have been returned. No callbacks
+ * will be invoked after this function has been called.
+ */
+void
+fpi_usb_stream_free (FpiUsbStream *stream)
+{
+  if (!stream)
+    return;
+
+  stream->stopped_callback = NULL;
+  stream->stopped_data = NULL;
+
+  if (stream->running || stream->in_flight > 0)
+    {
+      stream->free_pending = TRUE;
+      fpi_usb_stream_stop (stream, NULL, NULL);
+      return;
+    }
+
+  fpi_usb_stream_destroy (stream);
+}
+
+static void
+stream_parent_cancelled (GCancellable *cancellable,
+                         FpiUsbStream *stream)
+{
+  g_cancellable_cancel (stream->cancellable);
+}
+
+static void
+stream_maybe_stopped (FpiUsbStream *stream)
+{
+  FpiUsbStreamStoppedCallback callback;
+  gpointer data;
+
+  if (stream->running || stream->delivering || stream->in_flight > 0)
+    return;
+
+  if (stream->parent_cancellable)
+    {
+      g_cancellable_disconnect (stream->parent_cancellable,
+                                stream->cancelled_id);
+      stream->cancelled_id = 0;
+      g_clear_object (&stream->parent_cancellable);
+    }
+
+  if (stream->free_pending)
+    {
+      fpi_usb_stream_destroy (stream);
+      return;
+    }
+
+  callback = stream->stopped_callback;
+  data = stream->stopped_data;
+  stream->stopped_callback = NULL;
+  stream->stopped_data = NULL;
+
+  /* Must be the last access, the callback may restart or free the stream */
+  if (callback)
+    callback (stream, stream->device, data);
+}
+
+static void stream_transfer_cb (FpiUsbTransfer *transfer,
+                                FpDevice       *device,
+                                gpointer        user_data,
+                                GError         *error);
+
+static void
+stream_submit_slot (FpiUsbStream     *stream,
+                    FpiUsbStreamSlot *slot)
+{
+  slot->completed = FALSE;
+  stream->in_flight++;
+
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (slot->transfer),
+                           stream->timeout_ms,
+                           stream->cancellable,
+                           stream_transfer_cb,
+                           slot);
+}
+
+static void
+stream_deliver (FpiUsbStream *stream)
+{
+  FpiUsbStreamSlot *slot;
+
+  if (stream->delivering)
+    return;
+
+  stream->delivering = TRUE;
+
+  /* Transfers on one endpoint complete in order, but only hand them out
+   * in submission order to be sure. Each slot is resubmitted right after
+   * it has been handled, so it becomes the last one in the queue.
+   */
+  while (stream->running && stream->slots[stream->head].completed)
+    {
+      slot = &stream->slots[stream->head];
+      slot->completed = FALSE;
+      stream->head = (stream->head + 1) % stream->depth;
+
+      stream->callback (stream, slot->transfer, stream->user_data,
+                        g_steal_pointer (&slot->error));
+
+      if (stream->running)
+        stream_submit_slot (stream, slot);
+    }
+
+  stream->delivering = FALSE;
+
+  stream_maybe_stopped (stream);
+}
+
+static void
+stream_transfer_cb (FpiUsbTransfer *transfer,
+                    FpDevice       *device,
+                    gpointer        user_data,
+                    GError         *error)
+{
+  FpiUsbStreamSlot *slot = user_data;
+  FpiUsbStream *stream = slot->stream;
+
+  g_assert (stream->in_flight > 0);
+  stream->in_flight--;
+
+  if (!stream->running)
+    {
+      /* Data and errors after stopping (usually cancellations) are dropped */
+      g_clear_error (&error);
+      stream_maybe_stopped (stream);
+      return;
+    }
+
+  slot->completed = TRUE;
+  slot->error = error;
+
+  stream_deliver (stream);
+}
+
+/**
+ * fpi_usb_stream_start:
+ * @stream: A #FpiUsbStream
+ * @timeout_ms: Timeout for each transfer in ms
+ * @cancellable: (nullable): Cancellable to use, e.g. fpi_device_get_cancellable()
+ * @callback: Callback for each completed transfer
+ * @user_data: Data to pass to @callback
+ *
+ * Submits all transfers of @stream. Every transfer that completes is passed
+ * to @callback and then resubmitted, until fpi_usb_stream_stop() is called.
+ * Note that this also happens for failed transfers, so @callback needs to
+ * stop the stream on errors it cannot recover from.
+ *
+ * Keep in mind that the timeout of a transfer starts when it is submitted,
+ * that is while the transfers before it are still being served.
+ *
+ * The stream must not be running, and all transfers of a previous run must
+ * have been returned (see fpi_usb_stream_stop()).
+ */
+void
+fpi_usb_stream_start (FpiUsbStream        *stream,
+                      guint                timeout_ms,
+                      GCancellable        *cancellable,
+                      FpiUsbStreamCallback callback,
+                      gpointer             user_data)
+{
+  guint i;
+
+  g_return_if_fail (stream);
+  g_return_if_fail (callback);
+  g_return_if_fail (!stream->running && stream->in_flight == 0);
+  g_return_if_fail (!stream->free_pending);
+
+  stream->running = TRUE;
+  stream->head = 0;
+  stream->timeout_ms = timeout_ms;
+  stream->callback = callback;
+  stream->user_data = user_data;
+
+  g_clear_object (&stream->cancellable);
+  stream->cancellable = g_cancellable_new ();
+
+  /* Cancelling the stream on the parent cancellable ensures that all
+   * transfers fail the same way if the parent is cancelled.
+   */
+  if (cancellable)
+    {
+      stream->parent_cancellable = g_object_ref (cancellable);
+      stream->cancelled_id = g_cancellable_connect (cancellable,
+                                                    G_CALLBACK (stream_parent_cancelled),
+                                                    stream, NULL);
+    }
+
+  for (i = 0; i < stream->depth; i++)
+    stream_submit_slot (stream, &stream->slots[i]);
+}
+
+/**
+ * fpi_usb_stream_stop:
+ * @stream: A #FpiUsbStream
+ * @callback: (nullable): Callback once all transfers have been returned
+ * @user_data: Data to pass to @callback
+ *
+ * Stops @stream and cancels all queued transfers. No further transfers
+ * will be passed to the #FpiUsbStreamCallback, this is also true if the
+ * function is called from within it.
+ *
+ * @callback is invoked once no transfer is in flight anymore, which
+ * happens right away if the stream is not running. Calling this function
+ * again before that replaces the callback.
+ */
+void
+fpi_usb_stream_stop (FpiUsbStream               *stream,
+                     FpiUsbStreamStoppedCallback callback,
+                     gpointer                    user_data)
+{
+  guint i;
+
+  g_return_if_fail (stream);
+
+  stream->stopped_callback = callback;
+  stream->stopped_data = user_data;
+
+  if (stream->running)
+    {
+      stream->running = FALSE;
+
+      for (i = 0; i < stream->depth; i++)
+        {
+          stream->slots[i].completed = FALSE;
+          g_clear_error (&stream->slots[i].error);
+        }
+
+      g_cancellable_cancel (stream->cancellable);
+    }
+
+  stream_maybe_stopped (stream);
+}
+
+/**
+ * fpi_usb_stream_is_running:
+ * @stream: A #FpiUsbStream
+ *
+ * Returns: %TRUE if @stream has been started and not been stopped yet
+ */
+gboolean
+fpi_usb_stream_is_running (FpiUsbStream *stream)
+{
+  g_return_val_if_fail (stream, FALSE);
+
+  return stream->running;
+}
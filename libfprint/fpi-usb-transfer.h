@@ -38,6 +38,42 @@ typedef void (*FpiUsbTransferCallback)(FpiUsbTransfer *transfer,
                                        gpointer        user_data,
                                        GError         *error);
 
+/**
+ * FpiUsbStream:
+ *
+ * An opaque structure keeping several bulk transfers queued on one endpoint.
+ */
+typedef struct _FpiUsbStream FpiUsbStream;
+
+/**
+ * FpiUsbStreamCallback:
+ * @stream: The #FpiUsbStream
+ * @transfer: The completed #FpiUsbTransfer
+ * @user_data: User data passed to fpi_usb_stream_start()
+ * @error: (transfer full): The #GError or %NULL
+ *
+ * Called for every completed transfer of a running stream, in the order in
+ * which the transfers were submitted. The data in @transfer is only valid
+ * during the callback, the transfer is resubmitted once it returns. Use
+ * fpi_usb_transfer_steal_buffer() to keep the data.
+ */
+typedef void (*FpiUsbStreamCallback)(FpiUsbStream   *stream,
+                                     FpiUsbTransfer *transfer,
+                                     gpointer        user_data,
+                                     GError         *error);
+
+/**
+ * FpiUsbStreamStoppedCallback:
+ * @stream: The #FpiUsbStream
+ * @dev: The #FpDevice the stream belongs to
+ * @user_data: User data passed to fpi_usb_stream_stop()
+ *
+ * Called once all transfers of a stopped stream have been returned.
+ */
+typedef void (*FpiUsbStreamStoppedCallback)(FpiUsbStream *stream,
+                                            FpDevice     *dev,
+                                            gpointer      user_data);
+
 /**
  * FpiTransferType:
  * @FP_TRANSFER_NONE: Type not set
@@ -95,6 +131,7 @@ struct _FpiUsbTransfer
 
   /* Flags */
   gboolean short_is_error;
+  gboolean alloc_buffer;
 
   /* Callbacks */
   gpointer               user_data;
@@ -153,6 +190,24 @@ gboolean           fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                                  guint           timeout_ms,
                                                  GError        **error);
 
+guint8            *fpi_usb_transfer_steal_buffer (FpiUsbTransfer *transfer,
+                                                  GDestroyNotify *free_func);
+
+FpiUsbStream      *fpi_usb_stream_new (FpDevice *device,
+                                       guint8    endpoint,
+                                       gsize     length,
+                                       guint     depth);
+void               fpi_usb_stream_free (FpiUsbStream *stream);
+
+void               fpi_usb_stream_start (FpiUsbStream        *stream,
+                                         guint                timeout_ms,
+                                         GCancellable        *cancellable,
+                                         FpiUsbStreamCallback callback,
+                                         gpointer             user_data);
+void               fpi_usb_stream_stop (FpiUsbStream               *stream,
+                                        FpiUsbStreamStoppedCallback callback,
+                                        gpointer                    user_data);
+gboolean           fpi_usb_stream_is_running (FpiUsbStream *stream);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbTransfer, fpi_usb_transfer_unref)
 
@@ -0,0 +1,596 @@
+/*
+ * Worker thread pool for CPU bound processing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "worker"
+
+#include <config.h>
+#include <errno.h>
+
+#include "fpi-log.h"
+#include "fpi-worker-pool.h"
+
+#if HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#if HAVE_SYS_GETTID
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * SECTION: fpi-worker-pool
+ * @title: Worker threads
+ * @short_description: Thread pool for image processing and matching
+ *
+ * Minutiae detection, matching and image assembly are CPU bound and must
+ * not block the main loop. They run on a pool of threads owned by
+ * libfprint rather than on the default GLib pool, so that the number of
+ * threads, their scheduling priority and CPU affinity can be configured,
+ * and the queue can be bounded.
+ *
+ * Most code should use the default pool returned by
+ * fpi_worker_pool_get_default(), which is configured through process wide
+ * functions like fp_context_set_worker_threads().
+ */
+
+struct _FpiWorkerPool
+{
+  GThreadPool *threads;
+
+  /* Protects everything below */
+  GMutex       mutex;
+
+  guint        max_threads;
+  /* Whether the threads may have a priority other than the inherited one */
+  gboolean     priority_changed;
+  gint         priority;
+  gint         inherited_priority;
+  guint64      cpu_mask;
+  guint        queue_limit;
+  /* Incremented whenever priority or affinity change */
+  guint        generation;
+
+  guint        queued;
+  guint64      n_jobs;
+  gint64       total_wait_time;
+  gint64       max_wait_time;
+};
+
+typedef struct
+{
+  gint      ref_count;
+
+  GFunc     func;
+  gpointer *items;
+  guint     n_items;
+  gpointer  user_data;
+
+  gint      next_item;
+
+  /* Helpers that start after the caller finished have nothing to do,
+   * so the caller only waits for the ones that are active.
+   */
+  GMutex    mutex;
+  GCond     cond;
+  gboolean  closed;
+  guint     active;
+} ParallelRun;
+
+typedef struct
+{
+  gint64          queued_time;
+
+  GTask          *task;
+  GTaskThreadFunc task_func;
+
+  ParallelRun    *run;
+} WorkerJob;
+
+/* The pool the current thread belongs to, and the configuration
+ * generation that was applied to it.
+ */
+static GPrivate current_pool = G_PRIVATE_INIT (NULL);
+static GPrivate current_generation = G_PRIVATE_INIT (NULL);
+
+static FpiWorkerPool *default_pool = NULL;
+
+static void
+worker_apply_config (FpiWorkerPool *self)
+{
+  guint generation;
+  gboolean priority_changed;
+  gint priority;
+  guint64 cpu_mask;
+
+  g_mutex_lock (&self->mutex);
+  generation = self->generation;
+  priority_changed = self->priority_changed;
+  priority = self->priority;
+  cpu_mask = self->cpu_mask;
+  g_mutex_unlock (&self->mutex);
+
+  if (GPOINTER_TO_UINT (g_private_get (&current_generation)) == generation)
+    return;
+  g_private_set (&current_generation, GUINT_TO_POINTER (generation));
+
+#if HAVE_SYS_GETTID
+  if (priority_changed &&
+      setpriority (PRIO_PROCESS, syscall (SYS_gettid), priority) != 0)
+    fp_warn ("Could not set worker thread priority to %d: %s",
+             priority, g_strerror (errno));
+#endif
+
+#if HAVE_SCHED_SETAFFINITY
+  {
+    cpu_set_t set;
+    gint i;
+
+    CPU_ZERO (&set);
+    for (i = 0; i < CPU_SETSIZE; i++)
+      if (cpu_mask == 0 || (i < 64 && (cpu_mask & (G_GUINT64_CONSTANT (1) << i))))
+        CPU_SET (i, &set);
+
+    if (sched_setaffinity (0, sizeof (set), &set) != 0)
+      fp_warn ("Could not set worker thread CPU affinity: %s",
+               g_strerror (errno));
+  }
+#endif
+}
+
+static void
+parallel_run_work (ParallelRun *run)
+{
+  guint i;
+
+  while ((i = g_atomic_int_add (&run->next_item, 1)) < run->n_items)
+    run->func (run->items[i], run->user_data);
+}
+
+static void
+parallel_run_unref (ParallelRun *run)
+{
+  if (!g_atomic_int_dec_and_test (&run->ref_count))
+    return;
+
+  g_mutex_clear (&run->mutex);
+  g_cond_clear (&run->cond);
+  g_free (run);
+}
+
+static void
+worker_func (gpointer data, gpointer user_data)
+{
+  FpiWorkerPool *self = user_data;
+  WorkerJob *job = data;
+  gint64 wait_time = g_get_monotonic_time () - job->queued_time;
+
+  g_mutex_lock (&self->mutex);
+  self->queued--;
+  self->n_jobs++;
+  self->total_wait_time += wait_time;
+  self->max_wait_time = MAX (self->max_wait_time, wait_time);
+  g_mutex_unlock (&self->mutex);
+
+  g_private_set (&current_pool, self);
+  worker_apply_config (self);
+
+  if (job->task)
+    {
+      if (!g_task_return_error_if_cancelled (job->task))
+        job->task_func (job->task,
+                        g_task_get_source_object (job->task),
+                        g_task_get_task_data (job->task),
+                        g_task_get_cancellable (job->task));
+      g_object_unref (job->task);
+    }
+  else
+    {
+      ParallelRun *run = job->run;
+      gboolean closed;
+
+      g_mutex_lock (&run->mutex);
+      closed = run->closed;
+      if (!closed)
+        run->active++;
+      g_mutex_unlock (&run->mutex);
+
+      if (!closed)
+        {
+          parallel_run_work (run);
+
+          g_mutex_lock (&run->mutex);
+          run->active--;
+          if (run->active == 0)
+            g_cond_signal (&run->cond);
+          g_mutex_unlock (&run->mutex);
+        }
+
+      parallel_run_unref (run);
+    }
+
+  g_free (job);
+}
+
+static void
+worker_pool_push (FpiWorkerPool *self, WorkerJob *job)
+{
+  job->queued_time = g_get_monotonic_time ();
+  g_thread_pool_push (self->threads, job, NULL);
+}
+
+/**
+ * fpi_worker_pool_new:
+ * @max_threads: Number of threads, or 0 for one per CPU
+ *
+ * Creates a new pool of worker threads.
+ *
+ * Returns: (transfer full): a new #FpiWorkerPool
+ */
+FpiWorkerPool *
+fpi_worker_pool_new (guint max_threads)
+{
+  FpiWorkerPool *self = g_new0 (FpiWorkerPool, 1);
+
+  if (max_threads == 0)
+    max_threads = g_get_num_processors ();
+
+  g_mutex_init (&self->mutex);
+  self->max_threads = max_threads;
+
+#if HAVE_SYS_GETTID
+  /* The nice value of the calling thread, which new threads inherit */
+  self->inherited_priority = getpriority (PRIO_PROCESS, 0);
+#endif
+  self->priority = self->inherited_priority;
+  self->threads = g_thread_pool_new (worker_func, self, max_threads, TRUE, NULL);
+
+  return self;
+}
+
+/**
+ * fpi_worker_pool_free:
+ * @pool: a #FpiWorkerPool
+ *
+ * Waits for all queued jobs to finish and frees @pool.
+ */
+void
+fpi_worker_pool_free (FpiWorkerPool *pool)
+{
+  g_return_if_fail (pool != default_pool);
+
+  g_thread_pool_free (pool->threads, FALSE, TRUE);
+  g_mutex_clear (&pool->mutex);
+  g_free (pool);
+}
+
+/**
+ * fpi_worker_pool_get_default:
+ *
+ * Gets the pool used for all processing in libfprint. It is shared
+ * between all #FpContext and #FpDevice instances of the process.
+ *
+ * Returns: (transfer none): the default #FpiWorkerPool
+ */
+FpiWorkerPool *
+fpi_worker_pool_get_default (void)
+{
+  if (g_once_init_enter (&default_pool))
+    g_once_init_leave (&default_pool, fpi_worker_pool_new (0));
+
+  return default_pool;
+}
+
+/**
+ * fpi_worker_pool_set_max_threads:
+ * @pool: a #FpiWorkerPool
+ * @max_threads: Number of threads, or 0 for one per CPU
+ *
+ * Sets the number of worker threads.
+ */
+void
+fpi_worker_pool_set_max_threads (FpiWorkerPool *pool,
+                                 guint          max_threads)
+{
+  if (max_threads == 0)
+    max_threads = g_get_num_processors ();
+
+  g_mutex_lock (&pool->mutex);
+  pool->max_threads = max_threads;
+  g_mutex_unlock (&pool->mutex);
+
+  g_thread_pool_set_max_threads (pool->threads, max_threads, NULL);
+}
+
+/**
+ * fpi_worker_pool_get_max_threads:
+ * @pool: a #FpiWorkerPool
+ *
+ * Returns: the number of worker threads
+ */
+guint
+fpi_worker_pool_get_max_threads (FpiWorkerPool *pool)
+{
+  guint res;
+
+  g_mutex_lock (&pool->mutex);
+  res = pool->max_threads;
+  g_mutex_unlock (&pool->mutex);
+
+  return res;
+}
+
+/**
+ * fpi_worker_pool_set_priority:
+ * @pool: a #FpiWorkerPool
+ * @priority: nice value for the worker threads
+ *
+ * Sets the scheduling priority of the worker threads. Until this is
+ * called the threads inherit the priority of the process. Lowering the
+ * nice value below that of the process usually requires privileges.
+ */
+void
+fpi_worker_pool_set_priority (FpiWorkerPool *pool,
+                              gint           priority)
+{
+  g_mutex_lock (&pool->mutex);
+  pool->priority_changed = TRUE;
+  pool->priority = CLAMP (priority, -20, 19);
+  pool->generation++;
+  g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * fpi_worker_pool_reset_priority:
+ * @pool: a #FpiWorkerPool
+ *
+ * Returns the worker threads to the priority they inherited from the
+ * thread that created @pool.
+ */
+void
+fpi_worker_pool_reset_priority (FpiWorkerPool *pool)
+{
+  g_mutex_lock (&pool->mutex);
+  if (pool->priority != pool->inherited_priority)
+    {
+      pool->priority = pool->inherited_priority;
+      pool->generation++;
+    }
+  g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * fpi_worker_pool_get_priority:
+ * @pool: a #FpiWorkerPool
+ *
+ * Returns: the configured nice value of the worker threads
+ */
+gint
+fpi_worker_pool_get_priority (FpiWorkerPool *pool)
+{
+  gint res;
+
+  g_mutex_lock (&pool->mutex);
+  res = pool->priority;
+  g_mutex_unlock (&pool->mutex);
+
+  return res;
+}
+
+/**
+ * fpi_worker_pool_set_cpu_mask:
+ * @pool: a #FpiWorkerPool
+ * @cpu_mask: bit mask of the first 64 CPUs, or 0 for all CPUs
+ *
+ * Restricts the worker threads to the CPUs in @cpu_mask.
+ */
+void
+fpi_worker_pool_set_cpu_mask (FpiWorkerPool *pool,
+                              guint64        cpu_mask)
+{
+  g_mutex_lock (&pool->mutex);
+  pool->cpu_mask = cpu_mask;
+  pool->generation++;
+  g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * fpi_worker_pool_get_cpu_mask:
+ * @pool: a #FpiWorkerPool
+ *
+ * Returns: the CPU mask of the worker threads, 0 if unrestricted
+ */
+guint64
+fpi_worker_pool_get_cpu_mask (FpiWorkerPool *pool)
+{
+  guint64 res;
+
+  g_mutex_lock (&pool->mutex);
+  res = pool->cpu_mask;
+  g_mutex_unlock (&pool->mutex);
+
+  return res;
+}
+
+/**
+ * fpi_worker_pool_set_queue_limit:
+ * @pool: a #FpiWorkerPool
+ * @queue_limit: maximum number of waiting jobs, or 0 for no limit
+ *
+ * Limits the number of jobs that may wait for a worker thread. Tasks
+ * started with fpi_worker_pool_run_task() while the queue is full fail
+ * with %G_IO_ERROR_BUSY.
+ */
+void
+fpi_worker_pool_set_queue_limit (FpiWorkerPool *pool,
+                                 guint          queue_limit)
+{
+  g_mutex_lock (&pool->mutex);
+  pool->queue_limit = queue_limit;
+  g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * fpi_worker_pool_get_queue_limit:
+ * @pool: a #FpiWorkerPool
+ *
+ * Returns: the maximum number of waiting jobs, 0 if unlimited
+ */
+guint
+fpi_worker_pool_get_queue_limit (FpiWorkerPool *pool)
+{
+  guint res;
+
+  g_mutex_lock (&pool->mutex);
+  res = pool->queue_limit;
+  g_mutex_unlock (&pool->mutex);
+
+  return res;
+}
+
+/**
+ * fpi_worker_pool_get_stats:
+ * @pool: a #FpiWorkerPool
+ * @stats: (out caller-allocates): the statistics
+ *
+ * Gets the current queue length and the time jobs had to wait for a
+ * worker thread.
+ */
+void
+fpi_worker_pool_get_stats (FpiWorkerPool      *pool,
+                           FpiWorkerPoolStats *stats)
+{
+  g_mutex_lock (&pool->mutex);
+  stats->queue_length = pool->queued;
+  stats->n_jobs = pool->n_jobs;
+  stats->total_wait_time = pool->total_wait_time;
+  stats->max_wait_time = pool->max_wait_time;
+  g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * fpi_worker_pool_run_task:
+ * @pool: a #FpiWorkerPool
+ * @task: a #GTask
+ * @task_func: a #GTaskThreadFunc
+ *
+ * Runs @task_func in one of the worker threads, this is the equivalent
+ * of g_task_run_in_thread(). As with that function, @task_func must
+ * return a result for @task.
+ *
+ * If @task is cancelled before a thread picks it up, @task_func is not
+ * called and @task returns %G_IO_ERROR_CANCELLED.
+ */
+void
+fpi_worker_pool_run_task (FpiWorkerPool  *pool,
+                          GTask          *task,
+                          GTaskThreadFunc task_func)
+{
+  WorkerJob *job;
+
+  g_mutex_lock (&pool->mutex);
+  if (pool->queue_limit > 0 && pool->queued >= pool->queue_limit)
+    {
+      g_mutex_unlock (&pool->mutex);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_BUSY,
+                               "Too many jobs waiting for a worker thread");
+      return;
+    }
+  pool->queued++;
+  g_mutex_unlock (&pool->mutex);
+
+  job = g_new0 (WorkerJob, 1);
+  job->task = g_object_ref (task);
+  job->task_func = task_func;
+
+  worker_pool_push (pool, job);
+}
+
+/**
+ * fpi_worker_pool_run_parallel:
+ * @pool: a #FpiWorkerPool
+ * @func: the function to call for every item
+ * @items: (array length=n_items): the items to process
+ * @n_items: the number of items
+ * @user_data: user data passed to @func
+ *
+ * Calls @func for every item in @items, spreading the calls over the
+ * worker threads and the calling thread, and waits until all of them
+ * have returned. The calls may happen in any order and concurrently.
+ *
+ * The queue limit is honoured by doing more of the work in the calling
+ * thread, so this never fails.
+ */
+void
+fpi_worker_pool_run_parallel (FpiWorkerPool *pool,
+                              GFunc          func,
+                              gpointer      *items,
+                              guint          n_items,
+                              gpointer       user_data)
+{
+  ParallelRun *run;
+  guint helpers = 0;
+  guint i;
+
+  if (n_items == 0)
+    return;
+
+  /* Blocking a worker on jobs queued behind it could dead lock */
+  if (g_private_get (&current_pool) != pool)
+    {
+      g_mutex_lock (&pool->mutex);
+      helpers = MIN (n_items - 1, pool->max_threads);
+      if (pool->queue_limit > 0)
+        {
+          if (pool->queued >= pool->queue_limit)
+            helpers = 0;
+          else
+            helpers = MIN (helpers, pool->queue_limit - pool->queued);
+        }
+      pool->queued += helpers;
+      g_mutex_unlock (&pool->mutex);
+    }
+
+  run = g_new0 (ParallelRun, 1);
+  run->ref_count = helpers + 1;
+  run->func = func;
+  run->items = items;
+  run->n_items = n_items;
+  run->user_data = user_data;
+  g_mutex_init (&run->mutex);
+  g_cond_init (&run->cond);
+
+  for (i = 0; i < helpers; i++)
+    {
+      WorkerJob *job = g_new0 (WorkerJob, 1);
+
+      job->run = run;
+      worker_pool_push (pool, job);
+    }
+
+  parallel_run_work (run);
+
+  g_mutex_lock (&run->mutex);
+  run->closed = TRUE;
+  while (run->active > 0)
+    g_cond_wait (&run->cond, &run->mutex);
+  g_mutex_unlock (&run->mutex);
+
+  parallel_run_unref (run);
+}
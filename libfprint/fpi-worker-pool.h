@@ -0,0 +1,78 @@
+/*
+ * Worker thread pool for CPU bound processing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/**
+ * FpiWorkerPool:
+ *
+ * An opaque structure representing a pool of worker threads.
+ */
+typedef struct _FpiWorkerPool FpiWorkerPool;
+
+/**
+ * FpiWorkerPoolStats:
+ * @queue_length: Number of jobs waiting for a worker thread
+ * @n_jobs: Number of jobs that have been started
+ * @total_wait_time: Sum of the time jobs spent in the queue, in microseconds
+ * @max_wait_time: Longest time a job spent in the queue, in microseconds
+ *
+ * Queue statistics of a #FpiWorkerPool.
+ */
+typedef struct
+{
+  guint   queue_length;
+  guint64 n_jobs;
+  gint64  total_wait_time;
+  gint64  max_wait_time;
+} FpiWorkerPoolStats;
+
+FpiWorkerPool *fpi_worker_pool_new (guint max_threads);
+void           fpi_worker_pool_free (FpiWorkerPool *pool);
+FpiWorkerPool *fpi_worker_pool_get_default (void);
+
+void    fpi_worker_pool_set_max_threads (FpiWorkerPool *pool,
+                                         guint          max_threads);
+guint   fpi_worker_pool_get_max_threads (FpiWorkerPool *pool);
+void    fpi_worker_pool_set_priority (FpiWorkerPool *pool,
+                                      gint           priority);
+void    fpi_worker_pool_reset_priority (FpiWorkerPool *pool);
+gint    fpi_worker_pool_get_priority (FpiWorkerPool *pool);
+void    fpi_worker_pool_set_cpu_mask (FpiWorkerPool *pool,
+                                      guint64        cpu_mask);
+guint64 fpi_worker_pool_get_cpu_mask (FpiWorkerPool *pool);
+void    fpi_worker_pool_set_queue_limit (FpiWorkerPool *pool,
+                                         guint          queue_limit);
+guint   fpi_worker_pool_get_queue_limit (FpiWorkerPool *pool);
+
+void fpi_worker_pool_get_stats (FpiWorkerPool      *pool,
+                                FpiWorkerPoolStats *stats);
+
+void fpi_worker_pool_run_task (FpiWorkerPool  *pool,
+                               GTask          *task,
+                               GTaskThreadFunc task_func);
+
+void fpi_worker_pool_run_parallel (FpiWorkerPool *pool,
+                                   GFunc          func,
+                                   gpointer      *items,
+                                   guint          n_items,
+                                   gpointer       user_data);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiWorkerPool, fpi_worker_pool_free)
@@ -785,7 +785,7 @@ extern int lfs_detect_minutiae_V2(MINUTIAE **,
                      int **, int **, int **, int **, int *, int *,
                      unsigned char **, int *, int *,
                      unsigned char *, const int, const int,
-                     const LFSPARMS *);
+                     unsigned char *, const LFSPARMS *);
 
 /* dft.c */
 extern int dft_dir_powers(double **, unsigned char *, const int,
@@ -809,7 +809,7 @@ extern void free_dir_powers(double **, const int);
 extern int get_minutiae(MINUTIAE **, int **, int **, int **,
                  int **, int **, int *, int *,
                  unsigned char **, int *, int *, int *,
-                 unsigned char *, const int, const int,
+                 unsigned char *, const int, const int, unsigned char *,
                  const int, const double, const LFSPARMS *);
 
 /* imgutil.c */
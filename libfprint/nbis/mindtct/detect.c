@@ -110,6 +110,10 @@ of the software.
       idata     - input 8-bit grayscale fingerprint image data
       iw        - width (in pixels) of the image
       ih        - height (in pixels) of the image
+      ipdata    - optional copy of idata that is already padded as
+                  required by get_max_padding_V2() using the pad value
+                  and scaled to 6 bits, or NULL; it is freed by this
+                  routine
       lfsparms  - parameters and thresholds for controlling LFS
 
    Output:
@@ -137,7 +141,7 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                         int *omw, int *omh,
                         unsigned char **obdata, int *obw, int *obh,
                         unsigned char *idata, const int iw, const int ih,
-                        const LFSPARMS *lfsparms)
+                        unsigned char *ipdata, const LFSPARMS *lfsparms)
 {
    unsigned char *pdata, *bdata;
    int pw, ph, bw, bh;
@@ -157,9 +161,11 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /******************/
 
    /* If LOG_REPORT defined, open log report file. */
-   if((ret = open_logfile()))
+   if((ret = open_logfile())){
       /* If system error, exit with error code. */
+      g_free(ipdata);
       return(ret);
+   }
 
    /* Determine the maximum amount of image padding required to support */
    /* LFS processes.                                                    */
@@ -170,6 +176,7 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* to angles in radians.                                     */
    if((ret = init_dir2rad(&dir2rad, lfsparms->num_directions))){
       /* Free memory allocated to this point. */
+      g_free(ipdata);
       return(ret);
    }
 
@@ -179,6 +186,7 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                         lfsparms->windowsize))){
       /* Free memory allocated to this point. */
       free_dir2rad(dir2rad);
+      g_free(ipdata);
       return(ret);
    }
 
@@ -191,11 +199,18 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       /* Free memory allocated to this point. */
       free_dir2rad(dir2rad);
       free_dftwaves(dftwaves);
+      g_free(ipdata);
       return(ret);
    }
 
+   /* Use the padded and scaled image prepared by the caller. */
+   if(ipdata){
+      pdata = ipdata;
+      pw = iw + (maxpad<<1);
+      ph = ih + (maxpad<<1);
+   }
    /* Pad input image based on max padding. */
-   if(maxpad > 0){   /* May not need to pad at all */
+   else if(maxpad > 0){   /* May not need to pad at all */
       if((ret = pad_uchar_image(&pdata, &pw, &ph, idata, iw, ih,
                              maxpad, lfsparms->pad_value))){
          /* Free memory allocated to this point. */
@@ -219,7 +234,8 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* could not get this work upon first attempt. Also, if not   */
    /* careful, I think accumulated power magnitudes may overflow */
    /* doubles.                                                   */
-   bits_8to6(pdata, pw, ph);
+   if(!ipdata)
+      bits_8to6(pdata, pw, ph);
 
    print2log("\nINITIALIZATION AND PADDING DONE\n");
 
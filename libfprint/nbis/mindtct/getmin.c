@@ -75,6 +75,8 @@ of the software.
       idata    - grayscale fingerprint image data
       iw       - width (in pixels) of the grayscale image
       ih       - height (in pixels) of the grayscale image
+      ipdata   - optional padded and scaled copy of idata, see
+                 lfs_detect_minutiae_V2(); it is freed by this routine
       id       - pixel depth (in bits) of the grayscale image
       ppmm     - the scan resolution (in pixels/mm) of the grayscale image
       lfsparms - parameters and thresholds for controlling LFS
@@ -102,6 +104,7 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                  int *omap_w, int *omap_h,
                  unsigned char **obdata, int *obw, int *obh, int *obd,
                  unsigned char *idata, const int iw, const int ih,
+                 unsigned char *ipdata,
                  const int id, const double ppmm, const LFSPARMS *lfsparms)
 {
    int ret;
@@ -116,6 +119,7 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
    if(id != 8){
       fprintf(stderr, "ERROR : get_minutiae : input image pixel ");
       fprintf(stderr, "depth = %d != 8.\n", id);
+      g_free(ipdata);
       return(-2);
    }
 
@@ -125,7 +129,7 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                                    &low_flow_map, &high_curve_map,
                                    &map_w, &map_h,
                                    &bdata, &bw, &bh,
-                                   idata, iw, ih, lfsparms))){
+                                   idata, iw, ih, ipdata, lfsparms))){
       return(ret);
    }
 
@@ -198,3 +198,6 @@ patch -p0 < fix-scan-build-reports.patch
 
 # Add pass to remove perimeter points
 patch -p0 < remove-perimeter-pts.patch
+
+# Allow passing an already padded and scaled image to mindtct
+patch -p0 < prepadded-input.patch
@@ -383,6 +383,67 @@ test_context_remove_device_active (void)
   fpt_teardown_virtual_device_environment ();
 }
 
+static void
+test_context_open_devices (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_device (FPT_VIRTUAL_DEVICE_IMAGE);
+  g_autoptr(GPtrArray) opened = NULL;
+  g_autoptr(GPtrArray) reopened = NULL;
+  g_autoptr(GError) error = NULL;
+
+  opened = fp_context_open_devices_sync (tctx->fp_context, NULL, 1, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (opened->len, ==, 1);
+  g_assert_true (g_ptr_array_index (opened, 0) == tctx->device);
+  g_assert_true (fp_device_is_open (tctx->device));
+
+  /* Open devices are skipped but still reported */
+  reopened = fp_context_open_devices_sync (tctx->fp_context, NULL, 0, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (reopened->len, ==, 1);
+}
+
+static void
+test_context_open_devices_cancelled (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_device (FPT_VIRTUAL_DEVICE_IMAGE);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GPtrArray) opened = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_cancellable_cancel (cancellable);
+  opened = fp_context_open_devices_sync (tctx->fp_context, NULL, 0, cancellable, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (opened);
+  g_assert_false (fp_device_is_open (tctx->device));
+}
+
+static void
+test_context_worker_settings (void)
+{
+  guint n_threads = fp_context_get_worker_threads ();
+  gint priority = fp_context_get_worker_priority ();
+
+  g_assert_cmpuint (n_threads, ==, g_get_num_processors ());
+  g_assert_cmpuint (fp_context_get_worker_queue_limit (), ==, 0);
+  g_assert_cmpuint (fp_context_get_worker_cpu_mask (), ==, 0);
+
+  fp_context_set_worker_threads (1);
+  g_assert_cmpuint (fp_context_get_worker_threads (), ==, 1);
+  fp_context_set_worker_threads (0);
+  g_assert_cmpuint (fp_context_get_worker_threads (), ==, n_threads);
+
+  fp_context_set_worker_queue_limit (4);
+  g_assert_cmpuint (fp_context_get_worker_queue_limit (), ==, 4);
+  fp_context_set_worker_queue_limit (0);
+
+  /* Raising the nice value never needs privileges */
+  fp_context_set_worker_priority (MIN (priority + 1, 19));
+  g_assert_cmpint (fp_context_get_worker_priority (), ==, MIN (priority + 1, 19));
+  fp_context_reset_worker_priority ();
+  g_assert_cmpint (fp_context_get_worker_priority (), ==, priority);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -397,6 +458,9 @@ main (int argc, char *argv[])
   g_test_add_func ("/context/remove-device-open", test_context_remove_device_open);
   g_test_add_func ("/context/remove-device-opening", test_context_remove_device_opening);
   g_test_add_func ("/context/remove-device-active", test_context_remove_device_active);
+  g_test_add_func ("/context/open-devices", test_context_open_devices);
+  g_test_add_func ("/context/open-devices/cancelled", test_context_open_devices_cancelled);
+  g_test_add_func ("/context/worker-settings", test_context_worker_settings);
 
   return g_test_run ();
 }
@@ -0,0 +1,224 @@
+/*
+ * FpGallery unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "test-utils.h"
+
+static GPtrArray *
+make_prints (guint n_prints)
+{
+  GPtrArray *prints = g_ptr_array_new_with_free_func (g_object_unref);
+  guint i;
+
+  for (i = 0; i < n_prints; i++)
+    g_ptr_array_add (prints,
+                     fpt_print_new_nbis (i % 2 ? "driver_a" : "driver_b",
+                                         FP_FINGER_FIRST + i % 10,
+                                         i % 3 ? "user" : NULL,
+                                         i));
+
+  return prints;
+}
+
+static gchar *
+gallery_tmp_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("libfprint-gallery-XXXXXX", &error);
+
+  g_assert_no_error (error);
+
+  return g_build_filename (tmpdir, "gallery", NULL);
+}
+
+static void
+remove_tmp_file (gchar *filename)
+{
+  g_autofree gchar *dirname = g_path_get_dirname (filename);
+
+  g_remove (filename);
+  g_rmdir (dirname);
+  g_free (filename);
+}
+
+static void
+test_gallery_roundtrip (void)
+{
+  g_autoptr(GPtrArray) prints = make_prints (50);
+  g_autoptr(FpGallery) gallery = NULL;
+  g_autoptr(GError) error = NULL;
+  gchar *filename = gallery_tmp_file ();
+  guint i;
+
+  g_assert_true (fp_gallery_write_file (filename, prints, &error));
+  g_assert_no_error (error);
+
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_no_error (error);
+  g_assert_true (FP_IS_GALLERY (gallery));
+
+  g_assert_cmpuint (fp_gallery_get_n_prints (gallery), ==, prints->len);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (gallery)), ==, prints->len);
+  g_assert_true (g_list_model_get_item_type (G_LIST_MODEL (gallery)) == FP_TYPE_PRINT);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *orig = g_ptr_array_index (prints, i);
+      g_autoptr(FpPrint) print = g_list_model_get_item (G_LIST_MODEL (gallery), i);
+
+      g_assert_true (FP_IS_PRINT (print));
+      g_assert_true (fp_print_equal (orig, print));
+      g_assert_cmpint (fp_print_get_finger (orig), ==, fp_print_get_finger (print));
+      g_assert_cmpstr (fp_print_get_username (orig), ==, fp_print_get_username (print));
+    }
+
+  g_assert_null (g_list_model_get_item (G_LIST_MODEL (gallery), prints->len));
+
+  remove_tmp_file (filename);
+}
+
+static void
+test_gallery_find (void)
+{
+  g_autoptr(GPtrArray) prints = make_prints (60);
+  g_autoptr(GPtrArray) found = NULL;
+  g_autoptr(FpGallery) gallery = NULL;
+  g_autoptr(GError) error = NULL;
+  gchar *filename = gallery_tmp_file ();
+  guint i;
+
+  g_assert_true (fp_gallery_write_file (filename, prints, &error));
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_no_error (error);
+
+  found = fp_gallery_find_prints (gallery, NULL, NULL, FP_FINGER_UNKNOWN, NULL);
+  g_assert_cmpuint (found->len, ==, prints->len);
+  g_clear_pointer (&found, g_ptr_array_unref);
+
+  found = fp_gallery_find_prints (gallery, "driver_a", NULL, FP_FINGER_UNKNOWN, NULL);
+  g_assert_cmpuint (found->len, ==, prints->len / 2);
+  for (i = 0; i < found->len; i++)
+    g_assert_cmpstr (fp_print_get_driver (g_ptr_array_index (found, i)), ==, "driver_a");
+  g_clear_pointer (&found, g_ptr_array_unref);
+
+  found = fp_gallery_find_prints (gallery, "driver_a", "0", FP_FINGER_LEFT_INDEX, "user");
+  g_assert_cmpuint (found->len, ==, 4);
+  for (i = 0; i < found->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (found, i);
+
+      g_assert_cmpint (fp_print_get_finger (print), ==, FP_FINGER_LEFT_INDEX);
+      g_assert_cmpstr (fp_print_get_username (print), ==, "user");
+    }
+  g_clear_pointer (&found, g_ptr_array_unref);
+
+  found = fp_gallery_find_prints (gallery, "unknown", NULL, FP_FINGER_UNKNOWN, NULL);
+  g_assert_cmpuint (found->len, ==, 0);
+
+  remove_tmp_file (filename);
+}
+
+static void
+test_gallery_invalid (void)
+{
+  g_autoptr(GPtrArray) prints = make_prints (4);
+  g_autoptr(FpGallery) gallery = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gchar *filename = gallery_tmp_file ();
+  gsize length;
+
+  g_assert_true (g_file_set_contents (filename, "not a gallery", -1, NULL));
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert_null (gallery);
+  g_clear_error (&error);
+
+  /* A gallery with a truncated index must be rejected */
+  g_assert_true (fp_gallery_write_file (filename, prints, &error));
+  g_assert_true (g_file_get_contents (filename, &contents, &length, NULL));
+  g_assert_true (g_file_set_contents (filename, contents, 64, NULL));
+
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert_null (gallery);
+
+  remove_tmp_file (filename);
+}
+
+#define ENTRY_OFFSET(i) (32 + (i) * 32 + 16)
+
+static void
+test_gallery_corrupt_entry (void)
+{
+  g_autoptr(GPtrArray) prints = make_prints (4);
+  g_autoptr(FpGallery) gallery = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gchar *filename = gallery_tmp_file ();
+  guint64 offset;
+  gsize length;
+
+  g_assert_true (fp_gallery_write_file (filename, prints, &error));
+  g_assert_true (g_file_get_contents (filename, &contents, &length, NULL));
+  memcpy (&offset, contents + ENTRY_OFFSET (2), sizeof (offset));
+  offset = GUINT64_FROM_LE (offset);
+
+  /* Changed print data fails the checksum of its entry */
+  contents[offset + 10] ^= 0xff;
+  g_assert_true (g_file_set_contents (filename, contents, length, NULL));
+
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert_null (gallery);
+  g_clear_error (&error);
+
+  contents[offset + 10] ^= 0xff;
+  g_assert_true (g_file_set_contents (filename, contents, length, NULL));
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (gallery)), ==, 4);
+  g_clear_object (&gallery);
+
+  /* An entry pointing outside of the file */
+  offset = GUINT64_TO_LE (length);
+  memcpy (contents + ENTRY_OFFSET (2), &offset, sizeof (offset));
+  g_assert_true (g_file_set_contents (filename, contents, length, NULL));
+
+  gallery = fp_gallery_new_from_file (filename, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert_null (gallery);
+
+  remove_tmp_file (filename);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/gallery/roundtrip", test_gallery_roundtrip);
+  g_test_add_func ("/gallery/find", test_gallery_find);
+  g_test_add_func ("/gallery/invalid", test_gallery_invalid);
+  g_test_add_func ("/gallery/corrupt-entry", test_gallery_corrupt_entry);
+
+  return g_test_run ();
+}
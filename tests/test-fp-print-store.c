@@ -0,0 +1,329 @@
+/*
+ * FpPrintStore unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "test-utils.h"
+
+typedef struct
+{
+  gchar *tmpdir;
+  gchar *filename;
+} StoreFixture;
+
+static void
+store_fixture_setup (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("libfprint-print-store-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->filename = g_build_filename (fixture->tmpdir, "prints", NULL);
+}
+
+static void
+store_fixture_teardown (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_remove (fixture->filename);
+  g_rmdir (fixture->tmpdir);
+  g_free (fixture->filename);
+  g_free (fixture->tmpdir);
+}
+
+static void
+assert_stored (FpPrintStore *store, const gchar *key, FpPrint *expected)
+{
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+
+  print = fp_print_store_load (store, key, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print, expected));
+}
+
+static void
+test_print_store_save_load (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) print_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_INDEX, "user", 2);
+  g_autoptr(FpPrint) print_c = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_RING, "user", 3);
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) keys = NULL;
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_print_store_save (store, "a", print_a, &error));
+  g_assert_true (fp_print_store_save (store, "b", print_b, &error));
+  g_assert_true (fp_print_store_save (store, "c", print_a, &error));
+  g_assert_true (fp_print_store_save (store, "c", print_c, &error));
+  g_assert_no_error (error);
+
+  assert_stored (store, "a", print_a);
+  assert_stored (store, "b", print_b);
+  assert_stored (store, "c", print_c);
+
+  g_assert_true (fp_print_store_delete (store, "b", &error));
+  g_assert_no_error (error);
+
+  print = fp_print_store_load (store, "b", &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (print);
+  g_clear_error (&error);
+
+  g_assert_false (fp_print_store_delete (store, "b", &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  /* A second instance cannot be opened at the same time */
+  g_assert_null (fp_print_store_new (fixture->filename, &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  /* Everything must be there again after reopening */
+  g_clear_object (&store);
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+
+  keys = fp_print_store_get_keys (store);
+  g_assert_cmpuint (g_strv_length (keys), ==, 2);
+  g_assert_true (g_strv_contains ((const gchar * const *) keys, "a"));
+  g_assert_true (g_strv_contains ((const gchar * const *) keys, "c"));
+
+  assert_stored (store, "a", print_a);
+  assert_stored (store, "c", print_c);
+}
+
+static void
+test_print_store_torn_write (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) print_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_INDEX, "user", 2);
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) keys = NULL;
+  gsize length;
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, "a", print_a, &error));
+  g_assert_true (fp_print_store_save (store, "b", print_b, &error));
+  g_clear_object (&store);
+
+  /* Simulate an interrupted write by cutting the last record short */
+  g_assert_true (g_file_get_contents (fixture->filename, &contents, &length, NULL));
+  g_assert_true (g_file_set_contents (fixture->filename, contents, length - 10, NULL));
+
+  g_test_expect_message ("libfprint-print-store", G_LOG_LEVEL_WARNING, "*Discarding*");
+  store = fp_print_store_new (fixture->filename, &error);
+  g_test_assert_expected_messages ();
+  g_assert_no_error (error);
+
+  keys = fp_print_store_get_keys (store);
+  g_assert_cmpuint (g_strv_length (keys), ==, 1);
+  g_assert_cmpstr (keys[0], ==, "a");
+  assert_stored (store, "a", print_a);
+
+  /* New records must follow the last good one */
+  g_assert_true (fp_print_store_save (store, "b", print_b, &error));
+  g_assert_no_error (error);
+  g_clear_object (&store);
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  assert_stored (store, "a", print_a);
+  assert_stored (store, "b", print_b);
+}
+
+static void
+test_print_store_zero_tail (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *padded = NULL;
+  gsize length;
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, "a", print_a, &error));
+  g_clear_object (&store);
+
+  /* Some file systems leave a zero filled tail after a crash */
+  g_assert_true (g_file_get_contents (fixture->filename, &contents, &length, NULL));
+  padded = g_malloc0 (length + 4096);
+  memcpy (padded, contents, length);
+  g_assert_true (g_file_set_contents (fixture->filename, padded, length + 4096, NULL));
+
+  g_test_expect_message ("libfprint-print-store", G_LOG_LEVEL_WARNING, "*Discarding*");
+  store = fp_print_store_new (fixture->filename, &error);
+  g_test_assert_expected_messages ();
+  g_assert_no_error (error);
+  assert_stored (store, "a", print_a);
+}
+
+static void
+test_print_store_corrupted (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) print_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_INDEX, "user", 2);
+  g_autoptr(FpPrint) print_c = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_RING, "user", 3);
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *corrupted = NULL;
+  const gchar *middle;
+  gsize length, corrupted_length;
+  gsize pos;
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, "key-first", print_a, &error));
+  g_assert_true (fp_print_store_save (store, "key-middle", print_b, &error));
+  g_assert_true (fp_print_store_save (store, "key-last", print_c, &error));
+  g_assert_no_error (error);
+  g_clear_object (&store);
+
+  /* Flip a byte of the print data in the middle record */
+  g_assert_true (g_file_get_contents (fixture->filename, &contents, &length, NULL));
+  middle = g_strstr_len (contents, length, "key-middle");
+  g_assert_nonnull (middle);
+  pos = middle - contents + strlen ("key-middle") + 10;
+  contents[pos] ^= 0x01;
+  g_assert_true (g_file_set_contents (fixture->filename, contents, length, NULL));
+
+  /* The file must not be truncated at the corrupted record */
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (store);
+  g_clear_error (&error);
+
+  g_assert_true (g_file_get_contents (fixture->filename, &corrupted, &corrupted_length, NULL));
+  g_assert_cmpmem (corrupted, corrupted_length, contents, length);
+
+  /* Once repaired, the later records are still there */
+  contents[pos] ^= 0x01;
+  g_assert_true (g_file_set_contents (fixture->filename, contents, length, NULL));
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  assert_stored (store, "key-first", print_a);
+  assert_stored (store, "key-middle", print_b);
+  assert_stored (store, "key-last", print_c);
+}
+
+typedef struct
+{
+  gboolean done;
+  GError  *error;
+} CompactResult;
+
+static void
+compact_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  CompactResult *result = user_data;
+
+  fp_print_store_compact_finish (FP_PRINT_STORE (source_object), res, &result->error);
+  result->done = TRUE;
+}
+
+static void
+test_print_store_compact (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) print_b = NULL;
+  g_autoptr(FpPrint) print_late = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_RING, "user", 3);
+  g_autoptr(GError) error = NULL;
+  CompactResult result = { 0, };
+  CompactResult pending = { 0, };
+  GStatBuf before, after;
+  guint i;
+
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_print_store_save (store, "a", print_a, &error));
+  for (i = 0; i < 50; i++)
+    {
+      g_clear_object (&print_b);
+      print_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_INDEX, "user", i);
+      g_assert_true (fp_print_store_save (store, "b", print_b, &error));
+    }
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_flush (store, &error));
+  g_assert_cmpint (g_stat (fixture->filename, &before), ==, 0);
+
+  fp_print_store_compact_async (store, NULL, compact_done_cb, &result);
+
+  /* Changes made while compacting must survive */
+  g_assert_true (fp_print_store_save (store, "late", print_late, &error));
+  g_assert_true (fp_print_store_delete (store, "a", &error));
+  g_assert_no_error (error);
+
+  /* Only one compaction can run at a time */
+  fp_print_store_compact_async (store, NULL, compact_done_cb, &pending);
+
+  while (!result.done || !pending.done)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_error (pending.error, G_IO_ERROR, G_IO_ERROR_PENDING);
+  g_assert_no_error (result.error);
+  g_clear_error (&pending.error);
+
+  g_assert_cmpint (g_stat (fixture->filename, &after), ==, 0);
+  g_assert_cmpint (after.st_size, <, before.st_size / 4);
+
+  assert_stored (store, "b", print_b);
+  assert_stored (store, "late", print_late);
+  g_assert_null (fp_print_store_load (store, "a", &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  g_clear_object (&store);
+  store = fp_print_store_new (fixture->filename, &error);
+  g_assert_no_error (error);
+  assert_stored (store, "b", print_b);
+  assert_stored (store, "late", print_late);
+  g_assert_null (fp_print_store_load (store, "a", &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/print-store/save-load", StoreFixture, NULL,
+              store_fixture_setup, test_print_store_save_load, store_fixture_teardown);
+  g_test_add ("/print-store/torn-write", StoreFixture, NULL,
+              store_fixture_setup, test_print_store_torn_write, store_fixture_teardown);
+  g_test_add ("/print-store/zero-tail", StoreFixture, NULL,
+              store_fixture_setup, test_print_store_zero_tail, store_fixture_teardown);
+  g_test_add ("/print-store/corrupted", StoreFixture, NULL,
+              store_fixture_setup, test_print_store_corrupted, store_fixture_teardown);
+  g_test_add ("/print-store/compact", StoreFixture, NULL,
+              store_fixture_setup, test_print_store_compact, store_fixture_teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,682 @@
+/*
+ * FpPrint unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+
+#include "fp-print-private.h"
+#include "test-utils.h"
+
+static GBytes *
+serialize_print (FpPrint *print)
+{
+  g_autoptr(GError) error = NULL;
+  guchar *data;
+  gsize length;
+
+  g_assert_true (fp_print_serialize (print, &data, &length, &error));
+  g_assert_no_error (error);
+
+  return g_bytes_new_take (data, length);
+}
+
+/* Builds a serialized NBIS print around @print_data, which is consumed if
+ * it is floating. @extensions is the optional a{sv} stored with it.
+ */
+static GByteArray *
+build_serialized_print (GVariant *print_data, GVariant *extensions)
+{
+  g_autoptr(GVariant) value = NULL;
+  GByteArray *buffer;
+
+  if (!extensions)
+    extensions = g_variant_new ("a{sv}", NULL);
+
+  value = g_variant_new ("(issbymsmsi@a{sv}v)",
+                         FPI_PRINT_NBIS, "driver", "0", FALSE,
+                         FP_FINGER_LEFT_THUMB, NULL, NULL, G_MININT32,
+                         extensions, print_data);
+  g_variant_ref_sink (value);
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (const guint8 *) "FP3", 3);
+  g_byte_array_append (buffer, g_variant_get_data (value), g_variant_get_size (value));
+
+  return buffer;
+}
+
+static void
+test_print_deserialize_bytes (void)
+{
+  g_autoptr(FpPrint) print = fpt_print_new_nbis ("driver", FP_FINGER_RIGHT_INDEX, "user", 5);
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(FpPrint) reloaded = NULL;
+  g_autoptr(GDate) date = g_date_new_dmy (5, G_DATE_MAY, 2021);
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GBytes) data2 = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *username = NULL;
+
+  fp_print_set_description (print, "description");
+  fp_print_set_enroll_date (print, date);
+  data = serialize_print (print);
+
+  loaded = fp_print_deserialize_bytes (data, &error);
+  g_assert_no_error (error);
+  g_assert_true (FP_IS_PRINT (loaded));
+
+  g_assert_cmpstr (fp_print_get_driver (loaded), ==, "driver");
+  g_assert_cmpstr (fp_print_get_device_id (loaded), ==, "0");
+  g_assert_cmpint (fp_print_get_finger (loaded), ==, FP_FINGER_RIGHT_INDEX);
+  g_assert_cmpstr (fp_print_get_description (loaded), ==, "description");
+  g_assert_cmpint (g_date_compare (fp_print_get_enroll_date (loaded), date), ==, 0);
+
+  g_object_get (loaded, "username", &username, NULL);
+  g_assert_cmpstr (username, ==, "user");
+
+  g_assert_true (fp_print_equal (print, loaded));
+
+  /* Serializing a lazily loaded print gives the same data again */
+  data2 = serialize_print (loaded);
+  g_assert_true (g_bytes_equal (data, data2));
+
+  reloaded = fp_print_deserialize_bytes (data2, &error);
+  g_assert_no_error (error);
+  fp_print_set_username (reloaded, "other");
+  g_assert_cmpstr (fp_print_get_username (reloaded), ==, "other");
+  g_assert_cmpint (fp_print_get_finger (reloaded), ==, FP_FINGER_RIGHT_INDEX);
+}
+
+static void
+test_print_deserialize_bytes_unaligned (void)
+{
+  g_autoptr(FpPrint) print = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 7);
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GBytes) data = serialize_print (print);
+  g_autoptr(GBytes) buffer = NULL;
+  g_autoptr(GBytes) slice = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 *padded;
+  gsize length;
+
+  /* The data needs to be copied if it is not aligned */
+  length = g_bytes_get_size (data);
+  padded = g_malloc (length + 1);
+  memcpy (padded + 1, g_bytes_get_data (data, NULL), length);
+  buffer = g_bytes_new_take (padded, length + 1);
+  slice = g_bytes_new_from_bytes (buffer, 1, length);
+
+  loaded = fp_print_deserialize_bytes (slice, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print, loaded));
+  g_assert_null (fp_print_get_username (loaded));
+}
+
+static void
+test_print_deserialize_bytes_invalid (void)
+{
+  g_autoptr(FpPrint) print = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 7);
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GByteArray) buffer = NULL;
+  g_autoptr(GBytes) garbage = g_bytes_new_static ("FP2 garbage", 11);
+  g_autoptr(GError) error = NULL;
+  const gint32 xcol[] = { 1, 2, 3 };
+  const gint32 ycol[] = { 1, 2 };
+  guchar *serialized;
+  gsize length;
+
+  g_assert_null (fp_print_deserialize_bytes (garbage, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  /* NBIS data with columns of different length */
+  buffer = build_serialized_print (g_variant_new ("(a(aiaiai))",
+                                                  g_variant_new_parsed ("[(%@ai, %@ai, %@ai)]",
+                                                                        g_variant_new_fixed_array (G_VARIANT_TYPE_INT32, xcol, 3, sizeof (gint32)),
+                                                                        g_variant_new_fixed_array (G_VARIANT_TYPE_INT32, ycol, 2, sizeof (gint32)),
+                                                                        g_variant_new_fixed_array (G_VARIANT_TYPE_INT32, xcol, 3, sizeof (gint32)))),
+                                   NULL);
+
+  /* The eager parser rejects it right away */
+  g_assert_null (fp_print_deserialize (buffer->data, buffer->len, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  /* The lazy one only once the print data is used */
+  data = g_bytes_new (buffer->data, buffer->len);
+  loaded = fp_print_deserialize_bytes (data, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fp_print_get_finger (loaded), ==, FP_FINGER_LEFT_THUMB);
+
+  g_assert_false (fp_print_serialize (loaded, &serialized, &length, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_false (fp_print_equal (print, loaded));
+}
+
+static void
+test_print_serialize_many (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+  gsize single_length = 0;
+  guint i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_autofree gchar *username = g_strdup_printf ("user-%u", i % 7);
+      FpPrint *print = fpt_print_new_nbis (i % 3 ? "driver_a" : "driver_b",
+                                           FP_FINGER_FIRST + i % 10,
+                                           i % 5 ? username : NULL,
+                                           i);
+      g_autofree guchar *single = NULL;
+      gsize len;
+
+      g_assert_true (fp_print_serialize (print, &single, &len, NULL));
+      single_length += len;
+      g_ptr_array_add (prints, print);
+    }
+
+  g_assert_true (fp_print_serialize_many (prints, FP_PRINT_SERIALIZE_NONE, &data, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, <, single_length);
+
+  loaded = fp_print_deserialize_many (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *orig = g_ptr_array_index (prints, i);
+      FpPrint *print = g_ptr_array_index (loaded, i);
+
+      g_assert_true (fp_print_equal (orig, print));
+      g_assert_cmpint (fp_print_get_finger (orig), ==, fp_print_get_finger (print));
+      g_assert_cmpstr (fp_print_get_username (orig), ==, fp_print_get_username (print));
+    }
+  g_clear_pointer (&loaded, g_ptr_array_unref);
+
+  /* Data without any payload is rejected */
+  g_assert_null (fp_print_deserialize_many (data, 3, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  g_ptr_array_set_size (prints, 0);
+  g_clear_pointer (&data, g_free);
+  g_assert_true (fp_print_serialize_many (prints, FP_PRINT_SERIALIZE_NONE, &data, &length, &error));
+  loaded = fp_print_deserialize_many (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, 0);
+}
+
+static FpiMatchResult
+match_print (FpPrint *template, FpPrint *probe)
+{
+  g_autoptr(GError) error = NULL;
+  FpiMatchResult result;
+
+  result = fpi_print_bz3_match (template, probe, 10, &error);
+  g_assert_no_error (error);
+
+  return result;
+}
+
+static GVariant *
+variant_from_serialized (const guchar *data, gsize length)
+{
+  g_autoptr(GBytes) bytes = g_bytes_new (data + 3, length - 3);
+
+  return g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("(issbymsmsia{sv}v)"),
+                                                       bytes, FALSE));
+}
+
+static GVariant *
+serialized_print_data (FpPrint *print, FpPrintSerializeFlags flags)
+{
+  g_autoptr(GVariant) value = NULL;
+  g_autoptr(GVariant) data_variant = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+
+  g_assert_true (fp_print_serialize_full (print, flags, &data, &length, &error));
+  g_assert_no_error (error);
+
+  value = variant_from_serialized (data, length);
+  data_variant = g_variant_get_child_value (value, 9);
+
+  return g_variant_get_variant (data_variant);
+}
+
+static void
+test_print_matcher_data (void)
+{
+  g_autoptr(FpPrint) print_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 11);
+  g_autoptr(FpPrint) print_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 23);
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(FpPrint) stale = NULL;
+  g_autoptr(GVariant) value_a = NULL;
+  g_autoptr(GVariant) extensions = NULL;
+  g_autoptr(GVariant) print_data_b = NULL;
+  g_autoptr(GByteArray) buffer = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *plain = NULL;
+  g_autofree guchar *data = NULL;
+  gsize plain_length, length;
+
+  g_assert_true (fp_print_serialize (print_a, &plain, &plain_length, &error));
+  g_assert_true (fp_print_serialize_full (print_a, FP_PRINT_SERIALIZE_MATCHER_DATA,
+                                          &data, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, >, plain_length);
+
+  /* Stored tables give the same results as computed ones */
+  loaded = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print_a, loaded));
+  g_assert_cmpint (match_print (loaded, print_a), ==, match_print (print_a, print_a));
+  g_assert_cmpint (match_print (loaded, print_a), ==, FPI_MATCH_SUCCESS);
+  g_assert_cmpint (match_print (loaded, print_b), ==, match_print (print_a, print_b));
+
+  /* Tables that do not belong to the minutiae are regenerated */
+  value_a = variant_from_serialized (data, length);
+  extensions = g_variant_get_child_value (value_a, 8);
+  print_data_b = serialized_print_data (print_b, FP_PRINT_SERIALIZE_NONE);
+  buffer = build_serialized_print (print_data_b, extensions);
+
+  stale = fp_print_deserialize (buffer->data, buffer->len, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print_b, stale));
+  g_assert_cmpint (match_print (stale, print_b), ==, FPI_MATCH_SUCCESS);
+  g_assert_cmpint (match_print (stale, print_a), ==, match_print (print_b, print_a));
+}
+
+static void
+test_print_compact (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(FpPrint) print = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 3);
+  g_autoptr(FpPrint) stage = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 4);
+  g_autoptr(FpPrint) empty = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 5);
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *plain = NULL;
+  g_autofree guchar *compact = NULL;
+  struct xyt_struct *xyt;
+  gsize plain_length, compact_length;
+  guint i;
+
+  /* Multiple stages, including extreme and unsorted values */
+  fpi_print_add_print (print, stage);
+  xyt = g_ptr_array_index (stage->prints, 0);
+  xyt->xcol[0] = G_MAXINT32;
+  xyt->xcol[1] = G_MININT32;
+  xyt->ycol[2] = G_MININT32;
+  xyt->thetacol[3] = G_MAXINT32;
+  fpi_print_add_print (print, stage);
+  memset (g_ptr_array_index (empty->prints, 0), 0, sizeof (struct xyt_struct));
+  fpi_print_add_print (print, empty);
+
+  g_assert_true (fp_print_serialize_full (print, FP_PRINT_SERIALIZE_COMPACT,
+                                          &compact, &compact_length, &error));
+  g_assert_no_error (error);
+  result = fp_print_deserialize (compact, compact_length, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print, result));
+  g_clear_pointer (&compact, g_free);
+
+  for (i = 0; i < 1000; i++)
+    g_ptr_array_add (prints, fpt_print_new_nbis ("driver", FP_FINGER_FIRST + i % 10, "user", i));
+
+  g_assert_true (fp_print_serialize_many (prints, FP_PRINT_SERIALIZE_NONE,
+                                          &plain, &plain_length, &error));
+  g_assert_true (fp_print_serialize_many (prints, FP_PRINT_SERIALIZE_COMPACT,
+                                          &compact, &compact_length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (compact_length * 3, <, plain_length);
+
+  loaded = fp_print_deserialize_many (compact, compact_length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+  for (i = 0; i < prints->len; i++)
+    g_assert_true (fp_print_equal (g_ptr_array_index (prints, i),
+                                   g_ptr_array_index (loaded, i)));
+}
+
+static void
+test_print_compact_invalid (void)
+{
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GByteArray) buffer = NULL;
+  g_autoptr(GError) error = NULL;
+  const guint8 truncated[] = { 10, 0x80 };
+
+  buffer = build_serialized_print (g_variant_new_parsed ("(byte 1, [%@ay])",
+                                                        g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                                   truncated, 2, 1)),
+                                   NULL);
+
+  print = fp_print_deserialize (buffer->data, buffer->len, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (print);
+}
+
+static void
+test_print_fixed_layout (void)
+{
+  g_autoptr(FpPrint) print = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 6);
+  g_autoptr(FpPrint) stage = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 7);
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GVariant) fallback = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GBytes) bytes2 = NULL;
+  g_autoptr(GError) error = NULL;
+  struct xyt_struct *xyt, *xyt2;
+  const guint8 *data;
+  guchar *serialized;
+  gsize length;
+
+  fpi_print_add_print (print, stage);
+  xyt = g_ptr_array_index (print->prints, 0);
+  xyt2 = g_ptr_array_index (print->prints, 1);
+  xyt->xcol[0] = G_MININT16;
+  xyt->thetacol[0] = -180;
+
+  /* The record is in little endian regardless of the machine */
+  record = serialized_print_data (print, FP_PRINT_SERIALIZE_FIXED_LAYOUT);
+  g_assert_true (g_variant_is_of_type (record, G_VARIANT_TYPE_BYTESTRING));
+  data = g_variant_get_fixed_array (record, &length, 1);
+  g_assert_cmpuint (length, ==, 8 + 2 * 4 + 6 * (xyt->nrows + xyt2->nrows));
+  g_assert_cmpmem (data, 8, "XYT\0\1\0\2\0", 8);
+  g_assert_cmpint (data[8] | data[9] << 8, ==, xyt->nrows);
+  g_assert_cmpint ((gint16) (data[12] | data[13] << 8), ==, G_MININT16);
+  g_assert_cmpint ((gint16) (data[14] | data[15] << 8), ==, xyt->ycol[0]);
+  g_assert_cmpint ((gint16) (data[16] | data[17] << 8), ==, -180);
+
+  g_assert_true (fp_print_serialize_full (print, FP_PRINT_SERIALIZE_FIXED_LAYOUT,
+                                          &serialized, &length, &error));
+  g_assert_no_error (error);
+  bytes = g_bytes_new_take (serialized, length);
+  result = fp_print_deserialize_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print, result));
+
+  g_assert_true (fp_print_serialize_full (result, FP_PRINT_SERIALIZE_FIXED_LAYOUT,
+                                          &serialized, &length, &error));
+  bytes2 = g_bytes_new_take (serialized, length);
+  g_assert_true (g_bytes_equal (bytes, bytes2));
+
+  /* Values that do not fit use the default encoding */
+  xyt2->ycol[1] = G_MAXINT16 + 1;
+  fallback = serialized_print_data (print, FP_PRINT_SERIALIZE_FIXED_LAYOUT);
+  g_assert_false (g_variant_is_of_type (fallback, G_VARIANT_TYPE_BYTESTRING));
+}
+
+static void
+test_print_fixed_layout_invalid (void)
+{
+  const guint8 records[][14] = {
+    /* Wrong magic */
+    { 'X', 'Y', 'Z', 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0 },
+    /* Unknown version */
+    { 'X', 'Y', 'T', 0, 2, 0, 1, 0, 1, 0, 0, 0, 0, 0 },
+    /* Truncated minutia */
+    { 'X', 'Y', 'T', 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0 },
+    /* Too many minutiae */
+    { 'X', 'Y', 'T', 0, 1, 0, 1, 0, 0xff, 0xff, 0, 0, 0, 0 },
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (records); i++)
+    {
+      g_autoptr(FpPrint) print = NULL;
+      g_autoptr(GByteArray) buffer = NULL;
+      g_autoptr(GError) error = NULL;
+
+      buffer = build_serialized_print (g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                  records[i], sizeof (records[i]), 1),
+                                       NULL);
+
+      print = fp_print_deserialize (buffer->data, buffer->len, &error);
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+      g_assert_null (print);
+    }
+}
+
+static FpPrint *
+raw_print_new (const gchar *driver, const gchar *id)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT,
+                                 "driver", driver,
+                                 "device-id", "0",
+                                 "fpi-type", FPI_PRINT_RAW,
+                                 "fpi-data", g_variant_new_string (id),
+                                 NULL);
+
+  return g_object_ref_sink (print);
+}
+
+static void
+test_print_hash (void)
+{
+  g_autoptr(GHashTable) set = NULL;
+  g_autoptr(FpPrint) nbis_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) nbis_b = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 2);
+  g_autoptr(FpPrint) nbis_copy = NULL;
+  g_autoptr(FpPrint) nbis_other_driver = fpt_print_new_nbis ("other", FP_FINGER_LEFT_THUMB, "user", 1);
+  g_autoptr(FpPrint) raw_a = raw_print_new ("driver", "a");
+  g_autoptr(FpPrint) raw_a2 = raw_print_new ("driver", "a");
+  g_autoptr(FpPrint) raw_b = raw_print_new ("driver", "b");
+  g_autoptr(FpPrint) stage = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, "user", 3);
+  g_autofree guchar *data = NULL;
+  guint hash;
+  gsize length;
+
+  /* Metadata does not affect the hash */
+  g_assert_true (fp_print_serialize (nbis_a, &data, &length, NULL));
+  nbis_copy = fp_print_deserialize (data, length, NULL);
+  fp_print_set_username (nbis_copy, "someone else");
+  g_assert_cmpuint (fp_print_hash (nbis_a), ==, fp_print_hash (nbis_copy));
+  g_assert_cmpuint (fp_print_hash (nbis_a), !=, fp_print_hash (nbis_b));
+  g_assert_cmpuint (fp_print_hash (nbis_a), !=, fp_print_hash (nbis_other_driver));
+
+  g_assert_cmpuint (fp_print_hash (raw_a), ==, fp_print_hash (raw_a2));
+  g_assert_cmpuint (fp_print_hash (raw_a), !=, fp_print_hash (raw_b));
+
+  set = g_hash_table_new ((GHashFunc) fp_print_hash, (GEqualFunc) fp_print_equal);
+  g_hash_table_add (set, nbis_a);
+  g_hash_table_add (set, nbis_b);
+  g_hash_table_add (set, raw_a);
+  g_assert_true (g_hash_table_contains (set, nbis_copy));
+  g_assert_true (g_hash_table_contains (set, raw_a2));
+  g_assert_false (g_hash_table_contains (set, raw_b));
+  g_assert_false (g_hash_table_contains (set, nbis_other_driver));
+  g_clear_pointer (&set, g_hash_table_unref);
+
+  /* Changing the print data updates the hash */
+  hash = fp_print_hash (nbis_a);
+  fpi_print_add_print (nbis_a, stage);
+  g_assert_cmpuint (fp_print_hash (nbis_a), !=, hash);
+  g_assert_false (fp_print_equal (nbis_a, nbis_copy));
+
+  hash = fp_print_hash (raw_a);
+  g_object_set (raw_a, "fpi-data", g_variant_new_string ("b"), NULL);
+  g_assert_cmpuint (fp_print_hash (raw_a), ==, fp_print_hash (raw_b));
+  g_assert_cmpuint (fp_print_hash (raw_a), !=, hash);
+}
+
+static void
+identify_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GAsyncResult **result = user_data;
+
+  *result = g_object_ref (res);
+}
+
+static gboolean
+identify (FpPrint *probe, GPtrArray *gallery, gint threshold, GCancellable *cancellable,
+          FpPrint **match, gint *score, GError **error)
+{
+  g_autoptr(GAsyncResult) res = NULL;
+
+  fp_print_identify_async (probe, gallery, threshold, cancellable, identify_done_cb, &res);
+  while (!res)
+    g_main_context_iteration (NULL, TRUE);
+
+  return fp_print_identify_finish (probe, res, match, score, error);
+}
+
+static void
+test_print_match (void)
+{
+  g_autoptr(GPtrArray) gallery = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 8);
+  g_autoptr(FpPrint) raw = raw_print_new ("driver", "a");
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GError) error = NULL;
+  gint self_score, score;
+  guint i;
+
+  /* A print always matches itself */
+  g_assert_true (fp_print_match (probe, probe, 0, &self_score, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (self_score, >=, 40);
+
+  g_assert_false (fp_print_match (probe, probe, self_score + 1, &score, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (score, ==, self_score);
+
+  g_assert_false (fp_print_match (raw, probe, 0, &score, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED);
+  g_clear_error (&error);
+
+  for (i = 0; i < 20; i++)
+    g_ptr_array_add (gallery, fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 20 + i));
+  g_ptr_array_insert (gallery, 10, g_object_ref (probe));
+
+  g_assert_true (identify (probe, gallery, 0, NULL, &match, &score, &error));
+  g_assert_no_error (error);
+  g_assert_true (match == probe);
+  g_assert_cmpint (score, ==, self_score);
+  g_clear_object (&match);
+
+  g_assert_true (identify (probe, gallery, G_MAXINT, NULL, &match, &score, &error));
+  g_assert_no_error (error);
+  g_assert_null (match);
+
+  g_cancellable_cancel (cancellable);
+  g_assert_false (identify (probe, gallery, 0, cancellable, &match, &score, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (match);
+}
+
+static FpPrint *
+enrolled_print_new (const guint *seeds, guint n_seeds)
+{
+  FpPrint *print = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, seeds[0]);
+  guint i;
+
+  for (i = 1; i < n_seeds; i++)
+    {
+      g_autoptr(FpPrint) stage = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, seeds[i]);
+
+      fpi_print_add_print (print, stage);
+    }
+
+  return print;
+}
+
+static void
+test_print_match_enrolled (void)
+{
+  const guint seeds_a[] = { 30, 31, 32 };
+  const guint seeds_b[] = { 40, 31, 41 };
+  const guint seeds_c[] = { 50, 51 };
+  g_autoptr(FpPrint) print_a = enrolled_print_new (seeds_a, G_N_ELEMENTS (seeds_a));
+  g_autoptr(FpPrint) print_b = enrolled_print_new (seeds_b, G_N_ELEMENTS (seeds_b));
+  g_autoptr(FpPrint) print_c = enrolled_print_new (seeds_c, G_N_ELEMENTS (seeds_c));
+  g_autoptr(FpPrint) shared = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, 31);
+  g_autoptr(GPtrArray) gallery = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(GError) error = NULL;
+  gint shared_score, score_b, score;
+  gint expected = 0;
+  guint i, j;
+
+  g_assert_true (fp_print_match (shared, shared, 0, &shared_score, &error));
+  g_assert_no_error (error);
+
+  /* The prints share one stage, which matches itself */
+  g_assert_true (fp_print_match (print_b, print_a, 0, &score_b, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (score_b, >=, shared_score);
+
+  /* Otherwise the score is the best of all pairs of stages */
+  for (i = 0; i < G_N_ELEMENTS (seeds_a); i++)
+    {
+      for (j = 0; j < G_N_ELEMENTS (seeds_c); j++)
+        {
+          g_autoptr(FpPrint) stage_a = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, seeds_a[i]);
+          g_autoptr(FpPrint) stage_c = fpt_print_new_nbis ("driver", FP_FINGER_LEFT_THUMB, NULL, seeds_c[j]);
+
+          fp_print_match (stage_c, stage_a, 0, &score, &error);
+          g_assert_no_error (error);
+          expected = MAX (expected, score);
+        }
+    }
+
+  fp_print_match (print_c, print_a, 0, &score, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (score, ==, expected);
+  g_assert_cmpint (score_b, >, expected);
+
+  /* Enrolled prints can also be identified */
+  g_ptr_array_add (gallery, g_object_ref (print_c));
+  g_ptr_array_add (gallery, g_object_ref (print_b));
+
+  g_assert_true (identify (print_a, gallery, 0, NULL, &match, &score, &error));
+  g_assert_no_error (error);
+  g_assert_true (match == print_b);
+  g_assert_cmpint (score, ==, score_b);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/print/deserialize-bytes", test_print_deserialize_bytes);
+  g_test_add_func ("/print/deserialize-bytes/unaligned", test_print_deserialize_bytes_unaligned);
+  g_test_add_func ("/print/deserialize-bytes/invalid", test_print_deserialize_bytes_invalid);
+  g_test_add_func ("/print/serialize-many", test_print_serialize_many);
+  g_test_add_func ("/print/matcher-data", test_print_matcher_data);
+  g_test_add_func ("/print/compact", test_print_compact);
+  g_test_add_func ("/print/compact/invalid", test_print_compact_invalid);
+  g_test_add_func ("/print/fixed-layout", test_print_fixed_layout);
+  g_test_add_func ("/print/fixed-layout/invalid", test_print_fixed_layout_invalid);
+  g_test_add_func ("/print/hash", test_print_hash);
+  g_test_add_func ("/print/match", test_print_match);
+  g_test_add_func ("/print/match/enrolled", test_print_match_enrolled);
+
+  return g_test_run ();
+}
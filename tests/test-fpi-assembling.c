@@ -20,6 +20,7 @@
 
 #include <glib.h>
 #include <cairo.h>
+#include <string.h>
 #include "fpi-assembling.h"
 #include "fpi-image.h"
 #include "test-config.h"
@@ -54,7 +55,8 @@ cairo_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
 }
 
 static void
-test_frame_assembling (void)
+check_frame_assembling (FpiFrameMotionEstimator estimator,
+                        guint                   frame_height)
 {
   g_autofree char *path = NULL;
   cairo_surface_t *img = NULL;
@@ -78,8 +80,9 @@ test_frame_assembling (void)
 
   ctx.get_pixel = cairo_get_pixel;
   ctx.frame_width = width;
-  ctx.frame_height = 20;
+  ctx.frame_height = frame_height;
   ctx.image_width = width;
+  ctx.motion_estimator = estimator;
 
   g_assert (height > ctx.frame_height);
 
@@ -126,12 +129,75 @@ test_frame_assembling (void)
   g_assert (1);
 }
 
+static void
+test_frame_assembling (void)
+{
+  check_frame_assembling (FPI_FRAME_MOTION_ESTIMATOR_EXHAUSTIVE, 20);
+}
+
+static void
+test_frame_assembling_projection (void)
+{
+  check_frame_assembling (FPI_FRAME_MOTION_ESTIMATOR_PROJECTION, 60);
+}
+
+static int
+cmp_int (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+static void
+median_filter_reference (int *data, int size, int filtersize)
+{
+  g_autofree int *result = g_new0 (int, size);
+  g_autofree int *sortbuf = g_new0 (int, filtersize);
+
+  for (int i = 0; i < size; i++)
+    {
+      int i1 = MAX (i - (filtersize - 1) / 2, 0);
+      int i2 = MIN (i + (filtersize - 1) / 2, size - 1);
+
+      memcpy (sortbuf, data + i1, (i2 - i1 + 1) * sizeof (int));
+      g_qsort_with_data (sortbuf, i2 - i1 + 1, sizeof (int), cmp_int, NULL);
+      result[i] = sortbuf[(i2 - i1 + 1) / 2];
+    }
+  memcpy (data, result, size * sizeof (int));
+}
+
+static void
+test_median_filter (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (0x5eed);
+
+  for (int run = 0; run < 1000; run++)
+    {
+      int size = g_rand_int_range (rand, 1, 200);
+      int filtersize = g_rand_int_range (rand, 1, 40);
+      /* Mostly small speed-like values, sometimes a wide range */
+      int range = (run % 4 == 0) ? 1000000 : g_rand_int_range (rand, 1, 16);
+      g_autofree int *expected = g_new (int, size);
+      g_autofree int *data = g_new (int, size);
+
+      for (int i = 0; i < size; i++)
+        expected[i] = data[i] = g_rand_int_range (rand, -range / 2, range);
+
+      median_filter_reference (expected, size, filtersize);
+      fpi_median_filter (data, size, filtersize);
+
+      for (int i = 0; i < size; i++)
+        g_assert_cmpint (data[i], ==, expected[i]);
+    }
+}
+
 int
 main (int argc, char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/assembling/frames", test_frame_assembling);
+  g_test_add_func ("/assembling/frames-projection", test_frame_assembling_projection);
+  g_test_add_func ("/assembling/median-filter", test_median_filter);
 
   return g_test_run ();
 }
@@ -1354,6 +1354,57 @@ test_driver_identify (void)
   g_assert (expected_matched == matched_print);
 }
 
+static void
+on_driver_identify_model (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GAsyncResult **result = user_data;
+
+  *result = g_object_ref (res);
+}
+
+static void
+test_driver_identify_model (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(FpPrint) matched_print = NULL;
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  g_autoptr(GPtrArray) prints = make_fake_prints_gallery (device, 500);
+  g_autoptr(GListStore) gallery = g_list_store_new (FP_TYPE_PRINT);
+  g_autoptr(GAsyncResult) res = NULL;
+  g_autoptr(MatchCbData) match_data = g_new0 (MatchCbData, 1);
+  FpDeviceClass *dev_class = FP_DEVICE_GET_CLASS (device);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  FpPrint *expected_matched;
+  guint i;
+
+  expected_matched = g_ptr_array_index (prints, g_random_int_range (0, 499));
+  fp_print_set_description (expected_matched, "fake-verified");
+  for (i = 0; i < prints->len; i++)
+    g_list_store_append (gallery, g_ptr_array_index (prints, i));
+
+  /* The driver gets all prints of the model */
+  match_data->gallery = prints;
+
+  fake_dev->ret_print = make_fake_print (device, NULL);
+  fp_device_identify_model (device, G_LIST_MODEL (gallery), NULL,
+                            test_driver_match_cb, match_data, NULL,
+                            on_driver_identify_model, &res);
+  while (!res)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (fp_device_identify_finish (device, res, &matched_print, &print, &error));
+  g_assert_no_error (error);
+
+  g_assert_true (match_data->called);
+  g_assert_true (match_data->match == matched_print);
+  g_assert_true (match_data->print == print);
+  g_assert (fake_dev->last_called_function == dev_class->identify);
+
+  g_assert (print != NULL && print == fake_dev->ret_print);
+  g_assert (expected_matched == matched_print);
+}
+
 static void
 test_driver_identify_fail (void)
 {
@@ -1486,6 +1537,65 @@ test_driver_identify_not_reported (void)
   g_test_assert_expected_messages ();
 }
 
+/* Reports a result for the first scan only */
+static void
+fake_device_identify_report_once (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  guint n_calls = GPOINTER_TO_UINT (fake_dev->user_data);
+
+  fake_dev->user_data = GUINT_TO_POINTER (n_calls + 1);
+
+  if (n_calls == 0)
+    fpi_device_identify_report (device, NULL, NULL, NULL);
+
+  fpi_device_identify_complete (device, NULL);
+}
+
+static void
+on_driver_identify_continuous (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GError **error = user_data;
+
+  g_assert_false (fp_device_identify_continuous_finish (FP_DEVICE (source_object), res, error));
+  g_assert_nonnull (*error);
+}
+
+static void
+test_driver_identify_continuous_not_reported (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(MatchCbData) match_data = g_new0 (MatchCbData, 1);
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(GPtrArray) prints = NULL;
+  g_autoptr(GError) error = NULL;
+  FpiDeviceFake *fake_dev;
+
+  dev_class->identify = fake_device_identify_report_once;
+  device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  fake_dev = FPI_DEVICE_FAKE (device);
+  prints = make_fake_prints_gallery (device, 5);
+
+  g_assert_true (fp_device_open_sync (device, NULL, NULL));
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                         "*reported successful identify complete*not report*result*");
+
+  fp_device_identify_continuous (device, prints, NULL,
+                                 test_driver_match_cb, match_data, NULL,
+                                 on_driver_identify_continuous, &error);
+
+  while (!error)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Restarted after the reported scan, but not after the second one */
+  g_assert_cmpuint (GPOINTER_TO_UINT (fake_dev->user_data), ==, 2);
+  g_assert_true (match_data->called);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL);
+
+  g_test_assert_expected_messages ();
+}
+
 static void
 fake_device_identify_complete_error (FpDevice *device)
 {
@@ -2301,6 +2411,58 @@ test_driver_add_timeout_func (FpDevice *device, gpointer user_data)
   fake_dev->last_called_function = test_driver_add_timeout_func;
 }
 
+static void
+test_driver_calibration (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpDevice) other = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(GVariant) data = NULL;
+
+  g_assert_null (fpi_device_get_calibration (device, G_VARIANT_TYPE ("(uu)")));
+
+  fpi_device_set_calibration (device, g_variant_new ("(uu)", 1, 2), 0);
+
+  /* Shared by all instances of the same physical device */
+  data = fpi_device_get_calibration (other, G_VARIANT_TYPE ("(uu)"));
+  g_assert_nonnull (data);
+  g_assert_cmpstr (g_variant_get_type_string (data), ==, "(uu)");
+  g_clear_pointer (&data, g_variant_unref);
+
+  /* Data of a different format is ignored */
+  g_assert_null (fpi_device_get_calibration (device, G_VARIANT_TYPE ("(u)")));
+
+  fpi_device_clear_calibration (other);
+  g_assert_null (fpi_device_get_calibration (device, G_VARIANT_TYPE ("(uu)")));
+}
+
+static void
+test_driver_calibration_invalidated (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fpi_device_set_calibration (device, g_variant_new ("u", 1), 0);
+
+  /* Errors that are not about the device state keep the data */
+  fake_dev->ret_error = fpi_device_error_new (FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert_false (fp_device_open_sync (device, NULL, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID);
+  g_assert (error == g_steal_pointer (&fake_dev->ret_error));
+  g_clear_error (&error);
+
+  data = fpi_device_get_calibration (device, G_VARIANT_TYPE_UINT32);
+  g_assert_nonnull (data);
+
+  fake_dev->ret_error = fpi_device_error_new (FP_DEVICE_ERROR_PROTO);
+  g_assert_false (fp_device_open_sync (device, NULL, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_PROTO);
+  g_assert (error == g_steal_pointer (&fake_dev->ret_error));
+
+  g_assert_null (fpi_device_get_calibration (device, G_VARIANT_TYPE_UINT32));
+}
+
 static void
 test_driver_add_timeout (void)
 {
@@ -2459,10 +2621,12 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/verify/not_reported", test_driver_verify_not_reported);
   g_test_add_func ("/driver/verify/complete_retry", test_driver_verify_complete_retry);
   g_test_add_func ("/driver/identify", test_driver_identify);
+  g_test_add_func ("/driver/identify/model", test_driver_identify_model);
   g_test_add_func ("/driver/identify/fail", test_driver_identify_fail);
   g_test_add_func ("/driver/identify/retry", test_driver_identify_retry);
   g_test_add_func ("/driver/identify/error", test_driver_identify_error);
   g_test_add_func ("/driver/identify/not_reported", test_driver_identify_not_reported);
+  g_test_add_func ("/driver/identify/continuous/not_reported", test_driver_identify_continuous_not_reported);
   g_test_add_func ("/driver/identify/complete_retry", test_driver_identify_complete_retry);
   g_test_add_func ("/driver/identify/report_no_cb", test_driver_identify_report_no_callback);
   g_test_add_func ("/driver/capture", test_driver_capture);
@@ -2487,6 +2651,9 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/action_error/all", test_driver_action_error_all);
   g_test_add_func ("/driver/action_error/fail", test_driver_action_error_fallback_all);
 
+  g_test_add_func ("/driver/calibration", test_driver_calibration);
+  g_test_add_func ("/driver/calibration/invalidated", test_driver_calibration_invalidated);
+
   g_test_add_func ("/driver/timeout", test_driver_add_timeout);
   g_test_add_func ("/driver/timeout/cancelled", test_driver_add_timeout_cancelled);
 
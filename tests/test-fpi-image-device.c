@@ -0,0 +1,188 @@
+/*
+ * FpImageDevice Unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <cairo.h>
+
+#include "test-config.h"
+#include "test-utils.h"
+#include "fpi-image.h"
+#include "fpi-image-device.h"
+#include "fpi-worker-pool.h"
+
+typedef struct
+{
+  GMutex   mutex;
+  GCond    cond;
+  gboolean started;
+  gboolean release;
+} BlockingData;
+
+static void
+blocking_thread_func (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  BlockingData *data = task_data;
+
+  g_mutex_lock (&data->mutex);
+  data->started = TRUE;
+  g_cond_broadcast (&data->cond);
+  while (!data->release)
+    g_cond_wait (&data->cond, &data->mutex);
+  g_mutex_unlock (&data->mutex);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+task_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GAsyncResult **result = user_data;
+
+  *result = g_object_ref (res);
+}
+
+/* Loads a print image the same way tests/virtual-image.py does */
+static FpImage *
+load_print_image (const char *name)
+{
+  g_autofree char *filename = g_strdup_printf ("%s.png", name);
+  g_autofree char *path = NULL;
+  cairo_surface_t *png;
+  FpImage *image;
+  guchar *data;
+  gint stride;
+  guint x, y;
+
+  path = g_build_filename (SOURCE_ROOT, "examples", "prints", filename, NULL);
+  png = cairo_image_surface_create_from_png (path);
+  g_assert_cmpint (cairo_surface_status (png), ==, CAIRO_STATUS_SUCCESS);
+  g_assert_cmpint (cairo_image_surface_get_format (png), ==, CAIRO_FORMAT_ARGB32);
+
+  image = fp_image_new (cairo_image_surface_get_width (png),
+                        cairo_image_surface_get_height (png));
+  data = cairo_image_surface_get_data (png);
+  stride = cairo_image_surface_get_stride (png);
+
+  /* The print is stored in the alpha channel */
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++)
+      image->data[x + y * image->width] = ((guint32 *) (data + y * stride))[x] >> 24;
+
+  cairo_surface_destroy (png);
+
+  return image;
+}
+
+static void
+wait_for_state (FpDevice *device, FpiImageDeviceState state)
+{
+  FpiImageDeviceState current;
+
+  while (TRUE)
+    {
+      g_object_get (device, "fpi-image-device-state", &current, NULL);
+      if (current == state)
+        return;
+
+      g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+test_image_device_match_queue_full (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_device (FPT_VIRTUAL_DEVICE_IMAGE);
+  FpiWorkerPool *pool = fpi_worker_pool_get_default ();
+  guint max_threads = fpi_worker_pool_get_max_threads (pool);
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GAsyncResult) identify_res = NULL;
+  g_autoptr(GAsyncResult) blocking_res = NULL;
+  g_autoptr(GAsyncResult) queued_res = NULL;
+  g_autoptr(GTask) blocking = NULL;
+  g_autoptr(GTask) queued = NULL;
+  g_autoptr(FpImage) image = NULL;
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(GError) error = NULL;
+  BlockingData data = { 0, };
+
+  g_mutex_init (&data.mutex);
+  g_cond_init (&data.cond);
+
+  fpi_worker_pool_set_max_threads (pool, 1);
+  fpi_worker_pool_set_queue_limit (pool, 1);
+
+  g_assert_true (fp_device_open_sync (tctx->device, NULL, NULL));
+
+  g_ptr_array_add (prints, fpt_print_new_nbis ("virtual_image", FP_FINGER_LEFT_THUMB, "user", 0));
+  fp_device_identify (tctx->device, prints, NULL, NULL, NULL, NULL,
+                      task_done_cb, &identify_res);
+  wait_for_state (tctx->device, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON);
+
+  image = load_print_image ("whorl");
+  fpi_image_device_report_finger_status (FP_IMAGE_DEVICE (tctx->device), TRUE);
+  fpi_image_device_image_captured (FP_IMAGE_DEVICE (tctx->device), image);
+  fpi_image_device_report_finger_status (FP_IMAGE_DEVICE (tctx->device), FALSE);
+
+  /* Minutiae detection is done once the thread picks up the next job */
+  blocking = g_task_new (NULL, NULL, task_done_cb, &blocking_res);
+  g_task_set_task_data (blocking, &data, NULL);
+  fpi_worker_pool_run_task (pool, blocking, blocking_thread_func);
+
+  g_mutex_lock (&data.mutex);
+  while (!data.started)
+    g_cond_wait (&data.cond, &data.mutex);
+  g_mutex_unlock (&data.mutex);
+
+  /* Fill the queue, so that the match job is rejected */
+  queued = g_task_new (NULL, NULL, task_done_cb, &queued_res);
+  g_task_set_task_data (queued, &data, NULL);
+  fpi_worker_pool_run_task (pool, queued, blocking_thread_func);
+
+  while (!identify_res)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (fp_device_identify_finish (tctx->device, identify_res, &match, NULL, &error));
+  g_assert_error (error, FP_DEVICE_RETRY, FP_DEVICE_RETRY_GENERAL);
+  g_assert_null (match);
+
+  g_mutex_lock (&data.mutex);
+  data.release = TRUE;
+  g_cond_broadcast (&data.cond);
+  g_mutex_unlock (&data.mutex);
+
+  while (!blocking_res || !queued_res)
+    g_main_context_iteration (NULL, TRUE);
+
+  fpi_worker_pool_set_queue_limit (pool, 0);
+  fpi_worker_pool_set_max_threads (pool, max_threads);
+  g_mutex_clear (&data.mutex);
+  g_cond_clear (&data.cond);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image-device/match/queue-full", test_image_device_match_queue_full);
+
+  return g_test_run ();
+}
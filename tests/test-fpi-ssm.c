@@ -1348,6 +1348,56 @@ test_ssm_subssm_start_with_delayed (void)
   g_assert_no_error (data->error);
 }
 
+static void
+test_ssm_stats (void)
+{
+  g_autoptr(FpiSsm) ssm = ssm_test_new_full (FPI_TEST_SSM_STATE_NUM, "FPI_TEST_SSM_STATS");
+  g_autoptr(FpiSsmTestData) data = fpi_ssm_test_data_ref (fpi_ssm_get_data (ssm));
+  const FpiSsmStateStats *stats;
+
+  g_assert_null (fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", 0));
+
+  g_setenv ("FP_DEBUG_SSM_STATS", "1", TRUE);
+  fpi_ssm_start (ssm, test_ssm_completed_callback);
+  g_unsetenv ("FP_DEBUG_SSM_STATS");
+
+  fpi_ssm_next_state (ssm);
+  fpi_ssm_jump_to_state (ssm, FPI_TEST_SSM_STATE_0);
+  fpi_ssm_next_state (ssm);
+  fpi_ssm_next_state_delayed (ssm, 10, NULL);
+
+  while (data->handler_state == FPI_TEST_SSM_STATE_1)
+    g_main_context_iteration (NULL, TRUE);
+
+  data->expected_last_state = FPI_TEST_SSM_STATE_2;
+  fpi_ssm_mark_completed (g_steal_pointer (&ssm));
+  g_assert_true (data->completed);
+
+  stats = fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", FPI_TEST_SSM_STATE_0);
+  g_assert_nonnull (stats);
+  g_assert_cmpuint (stats->visits, ==, 2);
+
+  stats = fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", FPI_TEST_SSM_STATE_1);
+  g_assert_nonnull (stats);
+  g_assert_cmpuint (stats->visits, ==, 2);
+  g_assert_cmpint (stats->max_time, >=, 10000);
+  g_assert_cmpint (stats->total_time, >=, stats->max_time);
+  g_assert_cmpuint (stats->histogram[g_bit_storage (stats->max_time) - 1], >=, 1);
+
+  stats = fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", FPI_TEST_SSM_STATE_2);
+  g_assert_nonnull (stats);
+  g_assert_cmpuint (stats->visits, ==, 1);
+
+  stats = fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", FPI_TEST_SSM_STATE_3);
+  g_assert_nonnull (stats);
+  g_assert_cmpuint (stats->visits, ==, 0);
+
+  g_assert_null (fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM_STATS", FPI_TEST_SSM_STATE_NUM));
+  g_assert_null (fpi_ssm_get_state_stats (fake_device, "FPI_TEST_SSM", 0));
+
+  fpi_ssm_dump_stats (fake_device);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1402,6 +1452,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/ssm/subssm/start/with_started", test_ssm_subssm_start_with_started);
   g_test_add_func ("/ssm/subssm/start/with_delayed", test_ssm_subssm_start_with_delayed);
   g_test_add_func ("/ssm/subssm/mark_failed", test_ssm_subssm_mark_failed);
+  g_test_add_func ("/ssm/stats", test_ssm_stats);
 
   return g_test_run ();
 }
@@ -0,0 +1,116 @@
+/*
+ * Pixel statistics unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "fpi-image.h"
+#include "fpi-stats.h"
+
+static guint8 *
+random_buffer (GRand *rand, gsize size)
+{
+  guint8 *buf = g_malloc (size);
+
+  for (gsize i = 0; i < size; i++)
+    buf[i] = g_rand_int_range (rand, 0, 256);
+
+  return buf;
+}
+
+static void
+test_stats_reductions (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (0x5eed);
+
+  for (int run = 0; run < 100; run++)
+    {
+      gsize size = g_rand_int_range (rand, 1, 5000);
+      g_autofree guint8 *buf1 = random_buffer (rand, size);
+      g_autofree guint8 *buf2 = random_buffer (rand, size);
+      guint64 sum = 0, sum_sq = 0, sum_nibbles = 0, sad = 0, sq_diff = 0;
+      guint64 pair_sum = 0, sq_dev = 0, pair_sq_dev = 0;
+      guint32 hist[256] = { 0, }, hist_nibbles[16] = { 0, };
+      guint32 res_hist[256], res_hist_nibbles[16];
+
+      for (gsize i = 0; i < size; i++)
+        {
+          gint64 diff = (gint64) buf1[i] - buf2[i];
+
+          sum += buf1[i];
+          sum_sq += buf1[i] * buf1[i];
+          sum_nibbles += (buf1[i] >> 4) + (buf1[i] & 0x0f);
+          sad += ABS (diff);
+          sq_diff += diff * diff;
+          pair_sum += buf1[i] + buf2[i];
+          hist[buf1[i]]++;
+          hist_nibbles[buf1[i] >> 4]++;
+          hist_nibbles[buf1[i] & 0x0f]++;
+        }
+
+      for (gsize i = 0; i < size; i++)
+        {
+          gint64 dev = (gint64) buf1[i] - (gint64) (sum / size);
+          gint64 pair_dev = (gint64) buf1[i] + buf2[i] - (gint64) (pair_sum / size);
+
+          sq_dev += dev * dev;
+          pair_sq_dev += pair_dev * pair_dev;
+        }
+
+      g_assert_cmpuint (fpi_stats_sum (buf1, size), ==, sum);
+      g_assert_cmpuint (fpi_stats_sum_sq (buf1, size), ==, sum_sq);
+      g_assert_cmpuint (fpi_stats_sum_nibbles (buf1, size), ==, sum_nibbles);
+      g_assert_cmpuint (fpi_stats_sad (buf1, buf2, size), ==, sad);
+      g_assert_cmpuint (fpi_stats_sq_diff (buf1, buf2, size), ==, sq_diff);
+      g_assert_cmpuint (fpi_stats_sq_dev (buf1, size), ==, sq_dev);
+      g_assert_cmpuint (fpi_stats_pair_sq_dev (buf1, buf2, size), ==, pair_sq_dev);
+
+      fpi_stats_histogram (buf1, size, res_hist);
+      g_assert_cmpmem (res_hist, sizeof (res_hist), hist, sizeof (hist));
+
+      fpi_stats_histogram_nibbles (buf1, size, res_hist_nibbles);
+      g_assert_cmpmem (res_hist_nibbles, sizeof (res_hist_nibbles),
+                       hist_nibbles, sizeof (hist_nibbles));
+    }
+}
+
+static void
+test_stats_no_overflow (void)
+{
+  /* Large enough to overflow 32 bit accumulators */
+  gsize size = 100000;
+  g_autofree guint8 *white = g_malloc (size);
+  g_autofree guint8 *black = g_malloc0 (size);
+
+  memset (white, 0xff, size);
+
+  g_assert_cmpuint (fpi_stats_sum_sq (white, size), ==, (guint64) size * 255 * 255);
+  g_assert_cmpuint (fpi_stats_sq_diff (white, black, size), ==, (guint64) size * 255 * 255);
+  g_assert_cmpint (fpi_mean_sq_diff_norm (white, black, size), ==, 255 * 255);
+  g_assert_cmpint (fpi_std_sq_dev (white, size), ==, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/stats/reductions", test_stats_reductions);
+  g_test_add_func ("/stats/no-overflow", test_stats_no_overflow);
+
+  return g_test_run ();
+}
@@ -0,0 +1,350 @@
+/*
+ * FpiUsbTransfer Unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <string.h>
+
+#include "fpi-usb-transfer.h"
+#include "test-device-fake.h"
+
+/* The device and the transfers on its bulk endpoint are emulated by
+ * umockdev, see usb-transfer/transfers.ioctl. Every transfer returns
+ * 64 bytes, the first of which is a running counter.
+ */
+#define TEST_USB_VID 0x138a
+#define TEST_USB_PID 0x0017
+#define TEST_EP_IN (0x02 | FPI_USB_ENDPOINT_IN)
+#define TEST_LENGTH 64
+#define TEST_TIMEOUT 5000
+
+static GUsbContext *usb_ctx = NULL;
+static GUsbDevice *usb_device = NULL;
+
+static FpDevice *
+fake_usb_device_new (void)
+{
+  FpDeviceClass *dev_class;
+  FpDevice *device;
+
+  if (!usb_device)
+    {
+      g_test_skip ("Needs to be run in umockdev");
+      return NULL;
+    }
+
+  dev_class = g_type_class_ref (FPI_TYPE_DEVICE_FAKE);
+  dev_class->type = FP_DEVICE_TYPE_USB;
+  device = g_object_new (FPI_TYPE_DEVICE_FAKE, "fpi-usb-device", usb_device, NULL);
+  g_type_class_unref (dev_class);
+
+  return device;
+}
+
+typedef struct
+{
+  guint    n_received;
+  guint8   last_value;
+  guint    stop_after;
+  gboolean stopped;
+} StreamData;
+
+static void
+stream_stopped_cb (FpiUsbStream *stream,
+                   FpDevice     *dev,
+                   gpointer      user_data)
+{
+  StreamData *data = user_data;
+
+  g_assert_false (fpi_usb_stream_is_running (stream));
+  g_assert_false (data->stopped);
+  data->stopped = TRUE;
+}
+
+static void
+stream_cb (FpiUsbStream   *stream,
+           FpiUsbTransfer *transfer,
+           gpointer        user_data,
+           GError         *error)
+{
+  StreamData *data = user_data;
+
+  g_assert_no_error (error);
+  g_assert_true (fpi_usb_stream_is_running (stream));
+  g_assert_cmpint (transfer->actual_length, ==, TEST_LENGTH);
+
+  /* The data needs to arrive in the order it was sent */
+  if (data->n_received > 0)
+    g_assert_cmpuint (transfer->buffer[0], ==, (guint8) (data->last_value + 1));
+
+  data->last_value = transfer->buffer[0];
+  data->n_received++;
+
+  if (data->n_received == data->stop_after)
+    fpi_usb_stream_stop (stream, stream_stopped_cb, data);
+}
+
+static void
+test_usb_stream_in_order (void)
+{
+  g_autoptr(FpDevice) device = fake_usb_device_new ();
+  FpiUsbStream *stream;
+  StreamData data = { 0, };
+
+  if (!device)
+    return;
+
+  stream = fpi_usb_stream_new (device, TEST_EP_IN, TEST_LENGTH, 4);
+  fpi_usb_stream_start (stream, TEST_TIMEOUT, NULL, stream_cb, &data);
+  g_assert_true (fpi_usb_stream_is_running (stream));
+
+  while (data.n_received < 10)
+    g_main_context_iteration (NULL, TRUE);
+
+  fpi_usb_stream_stop (stream, stream_stopped_cb, &data);
+  g_assert_false (fpi_usb_stream_is_running (stream));
+
+  while (!data.stopped)
+    g_main_context_iteration (NULL, TRUE);
+
+  fpi_usb_stream_free (stream);
+}
+
+static void
+test_usb_stream_stop_in_callback (void)
+{
+  g_autoptr(FpDevice) device = fake_usb_device_new ();
+  FpiUsbStream *stream;
+  StreamData data = { 0, };
+
+  if (!device)
+    return;
+
+  data.stop_after = 2;
+
+  stream = fpi_usb_stream_new (device, TEST_EP_IN, TEST_LENGTH, 4);
+  fpi_usb_stream_start (stream, TEST_TIMEOUT, NULL, stream_cb, &data);
+
+  while (!data.stopped)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Transfers that completed in the meantime are not passed on */
+  g_assert_cmpuint (data.n_received, ==, 2);
+
+  /* The stream can be started again once it has stopped */
+  data.n_received = 0;
+  data.stopped = FALSE;
+  fpi_usb_stream_start (stream, TEST_TIMEOUT, NULL, stream_cb, &data);
+
+  while (!data.stopped)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (data.n_received, ==, 2);
+
+  fpi_usb_stream_free (stream);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_usb_stream_free_in_flight (void)
+{
+  g_autoptr(FpDevice) device = fake_usb_device_new ();
+  FpiUsbStream *stream;
+  StreamData data = { 0, };
+  gboolean timed_out = FALSE;
+
+  if (!device)
+    return;
+
+  stream = fpi_usb_stream_new (device, TEST_EP_IN, TEST_LENGTH, 4);
+  fpi_usb_stream_start (stream, TEST_TIMEOUT, NULL, stream_cb, &data);
+
+  while (data.n_received < 1)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The stream is destroyed once the cancelled transfers have returned,
+   * neither callback may be called anymore.
+   */
+  fpi_usb_stream_free (stream);
+
+  g_timeout_add (500, timeout_cb, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (data.n_received, ==, 1);
+  g_assert_false (data.stopped);
+}
+
+static void
+transfer_done_cb (FpiUsbTransfer *transfer,
+                  FpDevice       *device,
+                  gpointer        user_data,
+                  GError         *error)
+{
+  gboolean *done = user_data;
+
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+static void
+run_transfer (FpiUsbTransfer *transfer)
+{
+  gboolean done = FALSE;
+
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (transfer), TEST_TIMEOUT, NULL,
+                           transfer_done_cb, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (transfer->actual_length, ==, TEST_LENGTH);
+}
+
+static void
+test_usb_transfer_buffer_reuse (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpDevice) other = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpiUsbTransfer) transfer = NULL;
+  guint8 *buffer;
+
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (transfer, TEST_EP_IN, 100);
+  buffer = transfer->buffer;
+  memset (buffer, 0xff, 100);
+  g_clear_pointer (&transfer, fpi_usb_transfer_unref);
+
+  /* A buffer of the same size class is handed out again, cleared */
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_interrupt (transfer, TEST_EP_IN, 120);
+  g_assert_true (transfer->buffer == buffer);
+  g_assert_cmpuint (transfer->buffer[0], ==, 0);
+  g_assert_cmpuint (transfer->buffer[119], ==, 0);
+  g_clear_pointer (&transfer, fpi_usb_transfer_unref);
+
+  /* Buffers of other devices are not shared */
+  transfer = fpi_usb_transfer_new (other);
+  fpi_usb_transfer_fill_bulk (transfer, TEST_EP_IN, 100);
+  g_assert_false (transfer->buffer == buffer);
+}
+
+static void
+test_usb_transfer_steal_resubmit (void)
+{
+  g_autoptr(FpDevice) device = fake_usb_device_new ();
+  g_autoptr(FpiUsbTransfer) transfer = NULL;
+  GDestroyNotify free_func = NULL;
+  guint8 *buffer;
+
+  if (!device)
+    return;
+
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (transfer, TEST_EP_IN, TEST_LENGTH);
+  run_transfer (transfer);
+
+  buffer = fpi_usb_transfer_steal_buffer (transfer, &free_func);
+  g_assert_nonnull (buffer);
+  g_assert_nonnull (free_func);
+  g_assert_null (transfer->buffer);
+
+  /* Submitting again allocates a new buffer for the transfer */
+  run_transfer (transfer);
+  g_assert_nonnull (transfer->buffer);
+  g_assert_false (transfer->buffer == buffer);
+  g_assert_cmpuint (transfer->buffer[0], ==, (guint8) (buffer[0] + 1));
+
+  free_func (buffer);
+}
+
+static void
+test_usb_transfer_orphaned_pool (void)
+{
+  FpDevice *device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpiUsbTransfer) transfer = NULL;
+  g_autoptr(FpiUsbTransfer) pending = NULL;
+  GDestroyNotify free_func = NULL;
+  guint8 *buffer;
+
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (transfer, TEST_EP_IN, TEST_LENGTH);
+  buffer = fpi_usb_transfer_steal_buffer (transfer, &free_func);
+  g_clear_pointer (&transfer, fpi_usb_transfer_unref);
+
+  pending = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_control (pending,
+                                 G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST,
+                                 G_USB_DEVICE_REQUEST_TYPE_VENDOR,
+                                 G_USB_DEVICE_RECIPIENT_DEVICE,
+                                 0, 0, 0, TEST_LENGTH);
+
+  /* The pool outlives the device until its last buffer is returned */
+  g_object_unref (device);
+
+  buffer[0] = 0xff;
+  free_func (buffer);
+  g_clear_pointer (&pending, fpi_usb_transfer_unref);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  if (g_getenv ("UMOCKDEV_DIR"))
+    {
+      usb_ctx = g_usb_context_new (&error);
+      g_assert_no_error (error);
+
+      g_usb_context_enumerate (usb_ctx);
+      usb_device = g_usb_context_find_by_vid_and_pid (usb_ctx, TEST_USB_VID,
+                                                      TEST_USB_PID, &error);
+      g_assert_no_error (error);
+
+      g_usb_device_open (usb_device, &error);
+      g_assert_no_error (error);
+    }
+
+  g_test_add_func ("/usb-stream/in-order", test_usb_stream_in_order);
+  g_test_add_func ("/usb-stream/stop-in-callback", test_usb_stream_stop_in_callback);
+  g_test_add_func ("/usb-stream/free-in-flight", test_usb_stream_free_in_flight);
+  g_test_add_func ("/usb-transfer/buffer-pool/reuse", test_usb_transfer_buffer_reuse);
+  g_test_add_func ("/usb-transfer/buffer-pool/orphaned", test_usb_transfer_orphaned_pool);
+  g_test_add_func ("/usb-transfer/steal-buffer/resubmit", test_usb_transfer_steal_resubmit);
+
+  ret = g_test_run ();
+
+  if (usb_device)
+    g_usb_device_close (usb_device, NULL);
+  g_clear_object (&usb_device);
+  g_clear_object (&usb_ctx);
+
+  return ret;
+}
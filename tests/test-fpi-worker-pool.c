@@ -0,0 +1,226 @@
+/*
+ * Worker thread pool unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gio/gio.h>
+#include "fpi-worker-pool.h"
+
+typedef struct
+{
+  GMutex   mutex;
+  GCond    cond;
+  gboolean started;
+  gboolean release;
+} BlockingData;
+
+static void
+square_thread_func (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  gssize value = GPOINTER_TO_INT (task_data);
+
+  g_task_return_int (task, value * value);
+}
+
+static void
+blocking_thread_func (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  BlockingData *data = task_data;
+
+  g_mutex_lock (&data->mutex);
+  data->started = TRUE;
+  g_cond_broadcast (&data->cond);
+  while (!data->release)
+    g_cond_wait (&data->cond, &data->mutex);
+  g_mutex_unlock (&data->mutex);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+task_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GTask **result = user_data;
+
+  *result = g_object_ref (G_TASK (res));
+}
+
+static void
+test_worker_pool_tasks (void)
+{
+  g_autoptr(FpiWorkerPool) pool = fpi_worker_pool_new (4);
+  GTask *results[32] = { NULL, };
+  FpiWorkerPoolStats stats;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (results); i++)
+    {
+      g_autoptr(GTask) task = g_task_new (NULL, NULL, task_done_cb, &results[i]);
+
+      g_task_set_task_data (task, GINT_TO_POINTER (i), NULL);
+      fpi_worker_pool_run_task (pool, task, square_thread_func);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (results); i++)
+    {
+      while (!results[i])
+        g_main_context_iteration (NULL, TRUE);
+
+      g_assert_cmpint (g_task_propagate_int (results[i], NULL), ==, i * i);
+      g_object_unref (results[i]);
+    }
+
+  fpi_worker_pool_get_stats (pool, &stats);
+  g_assert_cmpuint (stats.queue_length, ==, 0);
+  g_assert_cmpuint (stats.n_jobs, ==, G_N_ELEMENTS (results));
+  g_assert_cmpint (stats.max_wait_time, >=, 0);
+  g_assert_cmpint (stats.total_wait_time, >=, stats.max_wait_time);
+}
+
+static void
+test_worker_pool_cancelled (void)
+{
+  g_autoptr(FpiWorkerPool) pool = fpi_worker_pool_new (1);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) result = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_cancellable_cancel (cancellable);
+
+  task = g_task_new (NULL, cancellable, task_done_cb, &result);
+  fpi_worker_pool_run_task (pool, task, square_thread_func);
+
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (g_task_propagate_int (result, &error), ==, -1);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+}
+
+static void
+test_worker_pool_queue_limit (void)
+{
+  g_autoptr(FpiWorkerPool) pool = fpi_worker_pool_new (1);
+  g_autoptr(GTask) blocking = NULL;
+  g_autoptr(GTask) queued = NULL;
+  g_autoptr(GTask) rejected = NULL;
+  GTask *results[3] = { NULL, };
+  g_autoptr(GError) error = NULL;
+  BlockingData data = { 0, };
+  FpiWorkerPoolStats stats;
+  gint i;
+
+  g_mutex_init (&data.mutex);
+  g_cond_init (&data.cond);
+  fpi_worker_pool_set_queue_limit (pool, 1);
+
+  /* Occupy the only thread */
+  blocking = g_task_new (NULL, NULL, task_done_cb, &results[0]);
+  g_task_set_task_data (blocking, &data, NULL);
+  fpi_worker_pool_run_task (pool, blocking, blocking_thread_func);
+
+  g_mutex_lock (&data.mutex);
+  while (!data.started)
+    g_cond_wait (&data.cond, &data.mutex);
+  g_mutex_unlock (&data.mutex);
+
+  queued = g_task_new (NULL, NULL, task_done_cb, &results[1]);
+  g_task_set_task_data (queued, GINT_TO_POINTER (3), NULL);
+  fpi_worker_pool_run_task (pool, queued, square_thread_func);
+
+  fpi_worker_pool_get_stats (pool, &stats);
+  g_assert_cmpuint (stats.queue_length, ==, 1);
+
+  rejected = g_task_new (NULL, NULL, task_done_cb, &results[2]);
+  fpi_worker_pool_run_task (pool, rejected, square_thread_func);
+
+  g_mutex_lock (&data.mutex);
+  data.release = TRUE;
+  g_cond_broadcast (&data.cond);
+  g_mutex_unlock (&data.mutex);
+
+  for (i = 0; i < G_N_ELEMENTS (results); i++)
+    while (!results[i])
+      g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (results[0], NULL));
+  g_assert_cmpint (g_task_propagate_int (results[1], NULL), ==, 9);
+  g_assert_cmpint (g_task_propagate_int (results[2], &error), ==, -1);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_BUSY);
+
+  for (i = 0; i < G_N_ELEMENTS (results); i++)
+    g_object_unref (results[i]);
+
+  g_mutex_clear (&data.mutex);
+  g_cond_clear (&data.cond);
+}
+
+static void
+square_item (gpointer data, gpointer user_data)
+{
+  gint *value = data;
+
+  g_atomic_int_inc ((gint *) user_data);
+  *value = *value * *value;
+}
+
+static void
+test_worker_pool_parallel (void)
+{
+  g_autoptr(FpiWorkerPool) pool = fpi_worker_pool_new (4);
+  gint values[1000];
+  gpointer items[G_N_ELEMENTS (values)];
+  gint calls = 0;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (values); i++)
+    {
+      values[i] = i;
+      items[i] = &values[i];
+    }
+
+  fpi_worker_pool_run_parallel (pool, square_item, items, G_N_ELEMENTS (items), &calls);
+
+  g_assert_cmpint (calls, ==, G_N_ELEMENTS (values));
+  for (i = 0; i < G_N_ELEMENTS (values); i++)
+    g_assert_cmpint (values[i], ==, i * i);
+
+  /* The queue limit leaves more of the work to the calling thread */
+  fpi_worker_pool_set_queue_limit (pool, 1);
+  calls = 0;
+  fpi_worker_pool_run_parallel (pool, square_item, items, 10, &calls);
+  g_assert_cmpint (calls, ==, 10);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/worker-pool/tasks", test_worker_pool_tasks);
+  g_test_add_func ("/worker-pool/cancelled", test_worker_pool_cancelled);
+  g_test_add_func ("/worker-pool/queue-limit", test_worker_pool_queue_limit);
+  g_test_add_func ("/worker-pool/parallel", test_worker_pool_parallel);
+
+  return g_test_run ();
+}
@@ -20,6 +20,7 @@
 #include <libfprint/fprint.h>
 #include <glib/gstdio.h>
 
+#include "fp-print-private.h"
 #include "test-utils.h"
 
 struct
@@ -147,3 +148,36 @@ fpt_context_free (FptContext *tctx)
 
   fpt_teardown_virtual_device_environment ();
 }
+
+FpPrint *
+fpt_print_new_nbis (const gchar *driver,
+                    FpFinger     finger,
+                    const gchar *username,
+                    guint        seed)
+{
+  FpPrint *print;
+  struct xyt_struct *xyt;
+  gint i;
+
+  print = g_object_new (FP_TYPE_PRINT,
+                        "driver", driver,
+                        "device-id", "0",
+                        "finger", finger,
+                        "username", username,
+                        NULL);
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+
+  /* Synthetic minutiae, sorted by x and y like real ones */
+  xyt = g_new0 (struct xyt_struct, 1);
+  xyt->nrows = 20 + seed % 40;
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      xyt->xcol[i] = 10 + i * 7;
+      xyt->ycol[i] = (seed * 13 + i * 31) % 300;
+      xyt->thetacol[i] = (gint) ((seed * 7 + i * 23) % 360) - 179;
+    }
+  g_ptr_array_add (print->prints, xyt);
+
+  return print;
+}
@@ -41,4 +41,9 @@ FptContext * fpt_context_new_with_virtual_device (FptVirtualDeviceType devtype);
 
 void fpt_context_free (FptContext *test_context);
 
+FpPrint * fpt_print_new_nbis (const gchar *driver,
+                              FpFinger     finger,
+                              const gchar *username,
+                              guint        seed);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FptContext, fpt_context_free)
@@ -5,7 +5,7 @@ try:
     import gi
     import os
 
-    from gi.repository import GLib, Gio
+    from gi.repository import GLib, Gio, GObject
 
     import unittest
     import socket
@@ -250,6 +250,16 @@ class VirtualImage(unittest.TestCase):
         assert(self._verify_match)
         self.assertIsNotNone(self._verify_fp.props.image)
 
+        trace = self.dev.get_trace().unpack()
+        points = [p for p, t in trace]
+        self.assertEqual(points[0], FPrint.DeviceTracePoint.ACTION_START)
+        self.assertEqual(points[-1], FPrint.DeviceTracePoint.ACTION_COMPLETE)
+        self.assertLess(points.index(FPrint.DeviceTracePoint.CAPTURE_COMPLETE),
+                        points.index(FPrint.DeviceTracePoint.MATCH_START))
+        self.assertLess(points.index(FPrint.DeviceTracePoint.MATCH_END),
+                        points.index(FPrint.DeviceTracePoint.REPORT))
+        self.assertEqual([t for p, t in trace], sorted(t for p, t in trace))
+
         self._verify_match = None
         self._verify_fp = None
         self.dev.verify(fp_whorl, callback=verify_cb)
@@ -325,6 +335,166 @@ class VirtualImage(unittest.TestCase):
         assert(self._identify_error is not None)
         assert(self._identify_error.matches(FPrint.device_error_quark(), FPrint.DeviceError.GENERAL))
 
+    def test_identify_model(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        # Spread over several chunks, the match is in a later one
+        gallery = Gio.ListStore.new(FPrint.Print)
+        for i in range(150):
+            gallery.append(FPrint.Print.deserialize(fp_whorl.serialize()))
+        gallery.insert(100, fp_tented_arch)
+
+        def identify_cb(dev, res):
+            print('Identify finished')
+            try:
+                self._identify_match, self._identify_fp = self.dev.identify_finish(res)
+            except gi.repository.GLib.Error as e:
+                print(e)
+                self._identify_error = e
+
+        self._identify_fp = None
+        self.dev.identify_model(gallery, callback=identify_cb)
+        self.send_image('tented_arch')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is fp_tented_arch)
+
+        gallery.remove(100)
+        self._identify_fp = None
+        self.dev.identify_model(gallery, callback=identify_cb)
+        self.send_image('tented_arch')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is None)
+
+    def test_identify_model_hole(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        # A model that fails to load one of its entries
+        class HoleModel(GObject.Object, Gio.ListModel):
+            def __init__(self, prints, hole):
+                super().__init__()
+                self.prints = prints
+                self.hole = hole
+
+            def do_get_item_type(self):
+                return FPrint.Print.__gtype__
+
+            def do_get_n_items(self):
+                return len(self.prints)
+
+            def do_get_item(self, position):
+                if position == self.hole or position >= len(self.prints):
+                    return None
+                return self.prints[position]
+
+        prints = [FPrint.Print.deserialize(fp_whorl.serialize()) for i in range(10)]
+        prints.append(fp_tented_arch)
+        gallery = HoleModel(prints, 5)
+
+        def identify_cb(dev, res):
+            print('Identify finished')
+            try:
+                self._identify_match, self._identify_fp = self.dev.identify_finish(res)
+            except gi.repository.GLib.Error as e:
+                print(e)
+                self._identify_error = e
+
+        # The prints after the hole are still matched
+        self._identify_fp = None
+        self.dev.identify_model(gallery, callback=identify_cb)
+        self.send_image('tented_arch')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is fp_tented_arch)
+
+    def test_identify_continuous(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        def match_cb(dev, match, pnt, data, error):
+            self._matches.append((match, error))
+
+        def identify_cb(dev, res):
+            print('Continuous identify finished')
+            try:
+                dev.identify_continuous_finish(res)
+            except gi.repository.GLib.Error as e:
+                self._identify_error = e
+            self._identify_done = True
+
+        self._matches = []
+        self._identify_done = False
+        self._identify_error = None
+        cancel = Gio.Cancellable()
+        self.dev.identify_continuous([fp_whorl, fp_tented_arch], cancellable=cancel,
+                                     match_cb=match_cb, callback=identify_cb)
+
+        self.send_image('tented_arch')
+        while len(self._matches) < 1:
+            ctx.iteration(True)
+        assert(self._matches[0][0] is fp_tented_arch)
+
+        self.send_image('whorl')
+        while len(self._matches) < 2:
+            ctx.iteration(True)
+        assert(self._matches[1][0] is fp_whorl)
+
+        # A retry is reported but does not end the session
+        self.send_retry()
+        while len(self._matches) < 3:
+            ctx.iteration(True)
+        assert(self._matches[2][0] is None)
+        assert(self._matches[2][1].matches(FPrint.device_retry_quark(), FPrint.DeviceRetry.TOO_SHORT))
+
+        self.send_image('whorl')
+        while len(self._matches) < 4:
+            ctx.iteration(True)
+        assert(self._matches[3][0] is fp_whorl)
+        assert(not self._identify_done)
+
+        cancel.cancel()
+        while not self._identify_done:
+            ctx.iteration(True)
+        assert(self._identify_error.matches(Gio.io_error_quark(), Gio.IOErrorEnum.CANCELLED))
+
+    def test_identify_continuous_pipelined(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        def match_cb(dev, match, pnt, data, error):
+            self._matches.append(match)
+
+        def identify_cb(dev, res):
+            with self.assertRaises(GLib.GError) as cm:
+                dev.identify_continuous_finish(res)
+            assert cm.exception.matches(Gio.io_error_quark(), Gio.IOErrorEnum.CANCELLED)
+            self._identify_done = True
+
+        self._matches = []
+        self._identify_done = False
+        cancel = Gio.Cancellable()
+        self.dev.props.pipeline_depth = 3
+        self.dev.identify_continuous([fp_whorl, fp_tented_arch], cancellable=cancel,
+                                     match_cb=match_cb, callback=identify_cb)
+
+        # Send the scans without waiting for them to be processed
+        self.send_image('whorl', iterate=False)
+        self.send_image('tented_arch', iterate=False)
+        self.send_image('whorl', iterate=False)
+        while len(self._matches) < 3:
+            ctx.iteration(True)
+        assert(self._matches[0] is fp_whorl)
+        assert(self._matches[1] is fp_tented_arch)
+        assert(self._matches[2] is fp_whorl)
+
+        cancel.cancel()
+        while not self._identify_done:
+            ctx.iteration(True)
+        self.dev.props.pipeline_depth = 1
+
     def test_verify_serialized(self):
         done = False
 